@@ -20,4 +20,18 @@
 /* To select one of the supported displays please choose between: OLED_SMALL or OLED_BIG */
 #define OLED_SIZE	OLED_BIG
 
+/* Backup_Data() moves the files into the backup folder by renaming the directory entries (no data is copied).
+   Set this to false if the SD library of your ESP8266 core has no SD.rename(). Then the files are copied. */
+#define SD_HAS_RENAME	true
+
+/* Backup_Data() stores the counters of all cards in one snapshot file (true) or one file per card (false) */
+#define BACKUP_PACKED	true
+
+/* The buffer size for copying files in Backup_Data() when a file cannot be renamed (a multiple of the 512 byte sector) */
+#define BACKUP_COPY_SIZE	(512u)
+
+/* The WiFi transfer sends the SD card statistics after the counters (lines starting with "#SD,", see SDCard.h).
+   Set this to true only if the Android app ignores these lines. */
+#define EXPORT_SD_STATS	false
+
 #endif /* CONFIG_H_ */
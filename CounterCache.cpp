@@ -0,0 +1,306 @@
+/**************************************************************************
+    class CounterCache: A write-back cache of the coffee counters in RAM.
+**************************************************************************/
+
+#include "Config.h"
+#include "CounterCache.h"
+
+kCacheEntry CounterCache::mk_Entries[CACHE_SIZE];
+byte        CounterCache::mu8_Used        = 0;
+byte        CounterCache::mu8_Dirty       = 0;
+uint32_t    CounterCache::mu32_FirstDirty = 0;
+bool        CounterCache::mb_Flushing     = false;
+bool        CounterCache::mb_Error        = false;
+bool        CounterCache::mb_Idle         = false;
+uint32_t    CounterCache::mu32_IdleSince  = 0;
+uint64_t    CounterCache::mu64_Queue[CACHE_SIZE];
+byte        CounterCache::mu8_QueueHead   = 0;
+kCacheStats CounterCache::mk_Stats;
+
+// Increments the counter of the card in RAM. The counter is loaded from the SD card if it is not in the cache.
+// pu32_Count receives the new count.
+// returns false if the counter could not be loaded or a dirty entry could not be written to make room.
+// If HasError() is false after a failure the record on the SD card is corrupt.
+bool CounterCache::Increment(uint64_t u64_ID, uint32_t* pu32_Count)
+{
+    mk_Stats.u32_Taps ++;
+    int s32_Index = Find(u64_ID);
+    if (s32_Index < 0)
+    {
+        mk_Stats.u32_Misses ++;
+        s32_Index = Load(u64_ID);
+        if (s32_Index < 0)
+            return false;
+    }
+
+    kCacheEntry* pk_Entry = &mk_Entries[s32_Index];
+    pk_Entry->u32_Count ++;
+    pk_Entry->u32_LastUse = Utils::GetMillis();
+    if (pk_Entry->b_Dirty)
+    {
+        mk_Stats.u32_Coalesced ++;
+    }
+    else
+    {
+        if (mu8_Dirty == 0)
+            mu32_FirstDirty = pk_Entry->u32_LastUse;
+
+        // Append to the queue
+        pk_Entry->b_Dirty = true;
+        mu64_Queue[(mu8_QueueHead + mu8_Dirty) & (CACHE_SIZE - 1)] = u64_ID;
+        mu8_Dirty ++;
+        if (mu8_Dirty > mk_Stats.u8_MaxDepth)
+            mk_Stats.u8_MaxDepth = mu8_Dirty;
+    }
+    mk_Stats.u32_DepthSum += mu8_Dirty;
+
+    *pu32_Count = pk_Entry->u32_Count;
+    return true;
+}
+
+// Writes all dirty counters to the SD card, the oldest first.
+// returns false if a write has failed. This counter and all newer ones stay dirty.
+bool CounterCache::Flush(void)
+{
+    bool b_Success = true;
+    while (b_Success && mu8_Dirty > 0)
+    {
+        b_Success = WriteOldest();
+    }
+    mb_Flushing = false;
+    return b_Success;
+}
+
+// Executed by the scheduler every CACHE_TASK_INTERVAL.
+// Decides with the flush policy if the dirty counters must be written.
+// Then one counter is written per call, so the SD card never blocks the main loop for a long time.
+void CounterCache::FlushTask(void)
+{
+    if (mu8_Dirty == 0)
+    {
+        mb_Flushing = false;
+        return;
+    }
+
+    if (!mb_Flushing)
+    {
+        if (CACHE_FLUSH_COUNT > 0 && mu8_Dirty >= CACHE_FLUSH_COUNT)
+            mb_Flushing = true;
+
+        if (CACHE_FLUSH_INTERVAL > 0 && (Utils::GetMillis() - mu32_FirstDirty) >= CACHE_FLUSH_INTERVAL)
+            mb_Flushing = true;
+
+        // Nobody is waiting at the machine
+        if (CACHE_IDLE_DELAY > 0 && mb_Idle && (Utils::GetMillis() - mu32_IdleSince) >= CACHE_IDLE_DELAY)
+            mb_Flushing = true;
+
+        if (!mb_Flushing)
+            return;
+    }
+
+    // After an error try again after CACHE_FLUSH_INTERVAL
+    if (!WriteOldest())
+    {
+        mb_Flushing     = false;
+        mu32_FirstDirty = Utils::GetMillis();
+    }
+}
+
+// Called by the state machine after each poll of the RF field.
+// b_Idle = true: no card is in the RF field
+void CounterCache::SetIdle(bool b_Idle)
+{
+    if (b_Idle && !mb_Idle)
+        mu32_IdleSince = Utils::GetMillis();
+
+    mb_Idle = b_Idle;
+}
+
+// Removes all counters from the cache.
+// This must be called after the counter files have been modified directly (e.g. reset by Backup_Data).
+// Call Flush() before, otherwise the dirty counters are lost!
+void CounterCache::Invalidate(void)
+{
+    memset(mk_Entries, 0, sizeof(mk_Entries));
+    mu8_Used      = 0;
+    mu8_Dirty     = 0;
+    mu8_QueueHead = 0;
+    mb_Flushing   = false;
+    mb_Error      = false;
+}
+
+// returns true if the last write to the SD card has failed
+bool CounterCache::HasError(void)
+{
+    return mb_Error;
+}
+
+byte CounterCache::GetDirtyCount(void)
+{
+    return mu8_Dirty;
+}
+
+// Returns the dirty counter at position u8_Pos of the queue (0 = the oldest change)
+// returns false if there are not that many dirty counters
+bool CounterCache::GetDirty(byte u8_Pos, uint64_t* pu64_ID, uint32_t* pu32_Count)
+{
+    if (u8_Pos >= mu8_Dirty)
+        return false;
+
+    *pu64_ID    = mu64_Queue[(mu8_QueueHead + u8_Pos) & (CACHE_SIZE - 1)];
+    *pu32_Count = mk_Entries[Find(*pu64_ID)].u32_Count;
+    return true;
+}
+
+const kCacheStats* CounterCache::GetStats(void)
+{
+    return &mk_Stats;
+}
+
+#ifdef STD_PRINT_EN
+void CounterCache::PrintStats(void)
+{
+    char s8_Buf[120];
+    sprintf(s8_Buf, "Cache: taps= %u, coalesced= %u, misses= %u, writes= %u, errors= %u, max depth= %u, avg depth= %u.%02u\r\n",
+            (unsigned)mk_Stats.u32_Taps, (unsigned)mk_Stats.u32_Coalesced, (unsigned)mk_Stats.u32_Misses,
+            (unsigned)mk_Stats.u32_Writes, (unsigned)mk_Stats.u32_WriteErrors, (unsigned)mk_Stats.u8_MaxDepth,
+            (unsigned)(mk_Stats.u32_Taps ? mk_Stats.u32_DepthSum / mk_Stats.u32_Taps : 0),
+            (unsigned)(mk_Stats.u32_Taps ? (mk_Stats.u32_DepthSum * 100 / mk_Stats.u32_Taps) % 100 : 0));
+    Utils::Print(s8_Buf);
+    Utils::Print("Cache write: ");
+    Utils::PrintHistogram(&mk_Stats.k_WriteTime, LF);
+}
+#endif
+
+// ----------------------------------------------------------------------
+
+// Folds the UID to 32 bit and uses the upper bits of a multiplicative hash (Knuth) as start index
+byte CounterCache::Hash(uint64_t u64_ID)
+{
+    uint32_t u32_Key = (uint32_t)u64_ID ^ (uint32_t)(u64_ID >> 32);
+    return (byte)((u32_Key * 2654435761UL) >> 24) & (CACHE_SIZE - 1);
+}
+
+// returns the index of the card in the table or -1 if it is not cached
+int CounterCache::Find(uint64_t u64_ID)
+{
+    byte u8_Index = Hash(u64_ID);
+    for (byte i=0; i<CACHE_SIZE; i++)
+    {
+        kCacheEntry* pk_Entry = &mk_Entries[u8_Index];
+        if (!pk_Entry->b_Used)
+            return -1;
+
+        if (pk_Entry->u64_ID == u64_ID)
+            return u8_Index;
+
+        u8_Index = (u8_Index + 1) & (CACHE_SIZE - 1);
+    }
+    return -1;
+}
+
+// Reads the counter from the SD card and stores it in the cache
+// returns the index in the table or -1 on error
+int CounterCache::Load(uint64_t u64_ID)
+{
+    uint32_t u32_Count;
+    if (!Utils::ReadSDCounter(u64_ID, &u32_Count))
+        return -1; // corrupt record
+
+    if (!Evict())
+        return -1;
+
+    return Insert(u64_ID, u32_Count);
+}
+
+// The caller must assure that there is a free entry
+int CounterCache::Insert(uint64_t u64_ID, uint32_t u32_Count)
+{
+    byte u8_Index = Hash(u64_ID);
+    while (mk_Entries[u8_Index].b_Used)
+    {
+        u8_Index = (u8_Index + 1) & (CACHE_SIZE - 1);
+    }
+
+    kCacheEntry* pk_Entry = &mk_Entries[u8_Index];
+    pk_Entry->u64_ID      = u64_ID;
+    pk_Entry->u32_Count   = u32_Count;
+    pk_Entry->u32_LastUse = Utils::GetMillis();
+    pk_Entry->b_Used      = true;
+    pk_Entry->b_Dirty     = false;
+    mu8_Used ++;
+    return u8_Index;
+}
+
+// Makes room for a new entry if CACHE_MAX_USED entries are used.
+// The least recently used clean entry is removed. If all entries are dirty the oldest one is written first.
+// returns false if the dirty entry could not be written.
+bool CounterCache::Evict(void)
+{
+    if (mu8_Used < CACHE_MAX_USED)
+        return true;
+
+    if (mu8_Dirty == mu8_Used && !WriteOldest())
+        return false;
+
+    int      s32_Oldest = -1;
+    uint32_t u32_Now    = Utils::GetMillis();
+    for (byte i=0; i<CACHE_SIZE; i++)
+    {
+        kCacheEntry* pk_Entry = &mk_Entries[i];
+        if (!pk_Entry->b_Used || pk_Entry->b_Dirty)
+            continue;
+
+        // The subtraction handles the roll-over of GetMillis() correctly
+        if (s32_Oldest < 0 || (u32_Now - pk_Entry->u32_LastUse) > (u32_Now - mk_Entries[s32_Oldest].u32_LastUse))
+            s32_Oldest = i;
+    }
+
+    Remove(s32_Oldest);
+    return true;
+}
+
+// Deletes an entry with backward shift: All following entries of the probe sequence that would not be found anymore
+// are moved into the gap. This avoids tombstones which would make the probe sequences longer and longer.
+void CounterCache::Remove(int s32_Index)
+{
+    byte u8_Gap  = (byte)s32_Index;
+    byte u8_Next = (u8_Gap + 1) & (CACHE_SIZE - 1);
+    while (mk_Entries[u8_Next].b_Used)
+    {
+        // The distance of the entry from its home index must be at least the distance to the gap
+        byte u8_Home = Hash(mk_Entries[u8_Next].u64_ID);
+        if (((u8_Next - u8_Home) & (CACHE_SIZE - 1)) >= ((u8_Next - u8_Gap) & (CACHE_SIZE - 1)))
+        {
+            mk_Entries[u8_Gap] = mk_Entries[u8_Next];
+            u8_Gap = u8_Next;
+        }
+        u8_Next = (u8_Next + 1) & (CACHE_SIZE - 1);
+    }
+
+    memset(&mk_Entries[u8_Gap], 0, sizeof(kCacheEntry));
+    mu8_Used --;
+}
+
+// Writes the counter at the head of the queue and removes it from the queue.
+// returns false if the SD card could not be written. Then the counter stays at the head of the queue.
+bool CounterCache::WriteOldest(void)
+{
+    // A dirty entry is never removed from the table, so it is always found
+    kCacheEntry* pk_Entry = &mk_Entries[Find(mu64_Queue[mu8_QueueHead])];
+
+    uint32_t u32_Start = Utils::GetMicros();
+    mb_Error = !Utils::WriteSDCounter(pk_Entry->u64_ID, pk_Entry->u32_Count);
+    Utils::HistogramAdd(&mk_Stats.k_WriteTime, Utils::GetMicros() - u32_Start);
+    if (mb_Error)
+    {
+        mk_Stats.u32_WriteErrors ++;
+        return false;
+    }
+
+    mk_Stats.u32_Writes ++;
+    pk_Entry->b_Dirty = false;
+    mu8_QueueHead = (mu8_QueueHead + 1) & (CACHE_SIZE - 1);
+    mu8_Dirty --;
+    return true;
+}
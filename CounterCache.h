@@ -0,0 +1,107 @@
+/**************************************************************************
+    class CounterCache: A write-back cache of the coffee counters in RAM.
+
+    A tap increments the counter in RAM and the new value can be displayed immediately.
+    The dirty counters are written to the SD card later by FlushTask() (one counter per call)
+    or all at once by Flush().
+    The dirty counters form a FIFO queue (a ring buffer of UIDs), so the oldest change is written first.
+    A card is queued only once: more taps of a dirty card are coalesced into the same write.
+    FlushTask() drains the queue when the reader has been idle (no card in the RF field) for CACHE_IDLE_DELAY,
+    when the queue reaches the high-water mark CACHE_FLUSH_COUNT or when the oldest change is too old.
+    Only a tap of a card that is not cached has to read the SD card (to display the count).
+    The table has a fixed size and uses open addressing with linear probing.
+    The key is the 64 bit card UID. No 'new' operator is used.
+
+    Crash consistency:
+    - A counter is always written with a single write of a complete record. The SD card holds either the old or the new count.
+    - A dirty counter is never evicted. When all entries are dirty the oldest one is written first.
+    - A counter whose write failed stays dirty and is written again by the next flush.
+    - After a power failure the taps of the last CACHE_FLUSH_INTERVAL milliseconds (at most CACHE_FLUSH_COUNT taps) are lost.
+**************************************************************************/
+
+#ifndef COUNTERCACHE_H
+#define COUNTERCACHE_H
+
+#include "Utils.h"
+
+// The number of entries in the table. This must be a power of 2.
+#define CACHE_SIZE            (64u)
+// Not more entries than this are used, so the probe sequences stay short.
+// When a new card is inserted into a full table the least recently used clean entry is evicted.
+#define CACHE_MAX_USED        (CACHE_SIZE * 3 / 4)
+
+// ------------ Flush policy ------------
+// The dirty counters are written to the SD card when the oldest dirty counter is older than this (milliseconds, 0 = disabled)
+#define CACHE_FLUSH_INTERVAL  (5000u)
+// The high-water mark: The dirty counters are written to the SD card when there are that many dirty counters (0 = disabled)
+#define CACHE_FLUSH_COUNT     (8u)
+// The dirty counters are written to the SD card when no card has been in the RF field for this time (milliseconds, 0 = disabled)
+#define CACHE_IDLE_DELAY      (500u)
+// If true all dirty counters are written to the SD card when the state machine changes its state
+#define CACHE_FLUSH_ON_STATE  true
+// The interval in milliseconds in which FlushTask() must be executed by the scheduler
+#define CACHE_TASK_INTERVAL   (50u)
+
+// Statistics of the write-back queue
+struct kCacheStats
+{
+    uint32_t u32_Taps;         // calls of Increment()
+    uint32_t u32_Coalesced;    // taps of a card that was already dirty (no additional write)
+    uint32_t u32_Misses;       // taps that had to read the SD card
+    uint32_t u32_Writes;       // counters written to the SD card
+    uint32_t u32_WriteErrors;
+    uint32_t u32_DepthSum;     // sum of the queue depth after each tap (average = u32_DepthSum / u32_Taps)
+    byte     u8_MaxDepth;      // the highest number of dirty counters
+    kLatencyHistogram k_WriteTime; // duration of a counter write in microseconds
+};
+
+struct kCacheEntry
+{
+    uint64_t u64_ID;       // card UID
+    uint32_t u32_LastUse;  // tick of the last access (for eviction)
+    uint32_t u32_Count;    // number of coffees
+    bool      b_Used;
+    bool      b_Dirty;     // the count has not yet been written to the SD card
+};
+
+class CounterCache
+{
+public:
+    static bool Increment(uint64_t u64_ID, uint32_t* pu32_Count);
+    static bool Flush(void);
+    static void FlushTask(void);
+    static void Invalidate(void);
+    static void SetIdle(bool b_Idle);
+    static bool HasError(void);
+    static byte GetDirtyCount(void);
+    static bool GetDirty(byte u8_Pos, uint64_t* pu64_ID, uint32_t* pu32_Count);
+    static const kCacheStats* GetStats(void);
+#ifdef STD_PRINT_EN
+    static void PrintStats(void);
+#endif
+
+private:
+    static int  Find(uint64_t u64_ID);
+    static int  Insert(uint64_t u64_ID, uint32_t u32_Count);
+    static int  Load(uint64_t u64_ID);
+    static void Remove(int s32_Index);
+    static bool Evict(void);
+    static bool WriteOldest(void);
+    static byte Hash(uint64_t u64_ID);
+
+    static kCacheEntry mk_Entries[CACHE_SIZE];
+    static byte        mu8_Used;
+    static byte        mu8_Dirty;
+    static uint32_t    mu32_FirstDirty; // tick when the oldest dirty counter was modified
+    static bool        mb_Flushing;     // FlushTask() is writing the dirty counters
+    static bool        mb_Error;        // the last write to the SD card has failed
+    static bool        mb_Idle;         // no card is in the RF field
+    static uint32_t    mu32_IdleSince;  // tick when the RF field became empty
+
+    // The queue of dirty counters: mu8_Dirty UIDs starting at mu8_QueueHead
+    static uint64_t    mu64_Queue[CACHE_SIZE];
+    static byte        mu8_QueueHead;
+    static kCacheStats mk_Stats;
+};
+
+#endif // COUNTERCACHE_H
@@ -0,0 +1,662 @@
+/**************************************************************************
+    class CounterDB: All coffee counters in one binary file on the SD card.
+**************************************************************************/
+
+#include "Config.h"
+#include "CounterDB.h"
+#include "SDCard.h"
+
+CounterDB gi_CounterDB(COUNTER_DB_PATH);
+
+enum eSlotState
+{
+    SLOT_EMPTY,
+    SLOT_VALID,
+    SLOT_CORRUPT, // the CRC does not match
+};
+
+// The decoded content of a record
+struct kRecord
+{
+    uint64_t   u64_ID;
+    eSlotState e_State;      // SLOT_VALID if at least one slot is valid
+    uint32_t   u32_Count;    // the count of the newest valid slot
+    uint32_t   u32_Gen;      // the generation of the newest valid slot
+    byte       u8_Newest;    // 0 = slot A, 1 = slot B
+    eSlotState e_Slot[2];
+};
+
+// Calculates the CRC of a slot: UID + count + generation
+static uint32_t SlotCrc(const byte* u8_Record, const byte* u8_Slot)
+{
+    return Utils::CalcCrc32(u8_Record, 8, u8_Slot, 8);
+}
+
+// A random ID for a new database file. It is never 0, because the token 0 means that a client has not synced yet.
+static uint32_t NewDatabaseID(void)
+{
+    byte u8_Random[4];
+    Utils::GenerateRandom(u8_Random, sizeof(u8_Random));
+    uint32_t u32_ID = Utils::ReadLE32(u8_Random) ^ Utils::GetMicros();
+    return (u32_ID != 0) ? u32_ID : 1;
+}
+
+static eSlotState ParseSlot(const byte* u8_Record, const byte* u8_Slot)
+{
+    uint32_t u32_Crc = Utils::ReadLE32(u8_Slot + 8);
+    if (u32_Crc == 0 && Utils::ReadLE32(u8_Slot) == 0 && Utils::ReadLE32(u8_Slot + 4) == 0)
+        return SLOT_EMPTY;
+
+    return (u32_Crc == SlotCrc(u8_Record, u8_Slot)) ? SLOT_VALID : SLOT_CORRUPT;
+}
+
+// Decodes a record and selects the newest valid slot
+static void ParseRecord(const byte* u8_Record, kRecord* pk_Record)
+{
+    pk_Record->u64_ID    = Utils::ReadLE64(u8_Record);
+    pk_Record->e_Slot[0] = ParseSlot(u8_Record, u8_Record + 8);
+    pk_Record->e_Slot[1] = ParseSlot(u8_Record, u8_Record + 20);
+    pk_Record->u32_Count = 0;
+    pk_Record->u32_Gen   = 0;
+    pk_Record->u8_Newest = 0;
+
+    if (pk_Record->u64_ID == 0 && pk_Record->e_Slot[0] == SLOT_EMPTY && pk_Record->e_Slot[1] == SLOT_EMPTY)
+    {
+        pk_Record->e_State = SLOT_EMPTY;
+        return;
+    }
+
+    pk_Record->e_State = SLOT_CORRUPT;
+    for (byte S=0; S<2; S++)
+    {
+        const byte* u8_Slot = u8_Record + 8 + S * 12;
+        uint32_t u32_Gen = Utils::ReadLE32(u8_Slot + 4);
+        if (pk_Record->e_Slot[S] != SLOT_VALID || (pk_Record->e_State == SLOT_VALID && u32_Gen <= pk_Record->u32_Gen))
+            continue;
+
+        pk_Record->e_State   = SLOT_VALID;
+        pk_Record->u32_Count = Utils::ReadLE32(u8_Slot);
+        pk_Record->u32_Gen   = u32_Gen;
+        pk_Record->u8_Newest = S;
+    }
+
+    // The first write of a new card has been torn: The UID is there but no slot was ever completed.
+    // The tap was not confirmed, so the count is zero.
+    if (pk_Record->e_State == SLOT_CORRUPT && (pk_Record->e_Slot[0] == SLOT_EMPTY || pk_Record->e_Slot[1] == SLOT_EMPTY))
+    {
+        pk_Record->e_State   = SLOT_VALID;
+        pk_Record->u8_Newest = (pk_Record->e_Slot[0] == SLOT_EMPTY) ? 1 : 0;
+    }
+}
+
+CounterDB::CounterDB(const char* s8_Path)
+{
+    ms8_Path         = s8_Path;
+    mb_Open          = false;
+    mu32_Capacity    = 0;
+    mu32_Used        = 0;
+    mu32_Offset      = DB_HEADER_SIZE;
+    mu32_HeaderSeq   = 0;
+    mu32_ChangeSeq   = 0;
+    mu32_SeqLimit    = 0;
+    mu32_DatabaseID  = 0;
+    mu32_Sector      = 0xFFFFFFFF;
+    mb_IOError       = false;
+    mu32_Recover     = 0;
+    mu32_RecoverUsed = 0;
+    mu32_Corrupt     = 0;
+    mu32_DirtyCount  = 0;
+}
+
+// Opens the database. If the file does not exist it is created.
+// returns false if the file cannot be created or if it is not a valid database.
+// An invalid file is never overwritten.
+bool CounterDB::Open(void)
+{
+    if (mb_Open)
+        return true;
+
+    mu32_Sector = 0xFFFFFFFF;
+    if (!SDCard::Exists(ms8_Path))
+        return Create();
+
+    mi_File = SDCard::Open(ms8_Path, FILE_WRITE);
+    if (!mi_File)
+        return false;
+
+    if (!ReadHeader())
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("Error: The counter database has an invalid header\r\n");
+#endif
+        SDCard::Close(&mi_File);
+        return false;
+    }
+
+    mb_Open = true;
+
+    // All generations in the file are below the reserved change sequence
+    mu32_ChangeSeq = mu32_SeqLimit;
+
+    // Check all records in the background, this also rebuilds the dirty bitmap
+    mu32_Recover     = 0;
+    mu32_RecoverUsed = 0;
+    mu32_Corrupt     = 0;
+    mu32_DirtyCount  = 0;
+    memset(mu8_Dirty, 0, sizeof(mu8_Dirty));
+    return true;
+}
+
+// The database must be closed before the file is moved or deleted.
+// The next access opens it again (or creates a new one).
+void CounterDB::Close(void)
+{
+    if (!mb_Open)
+        return;
+
+    SDCard::Close(&mi_File);
+    mb_Open     = false;
+    mu32_Sector = 0xFFFFFFFF;
+}
+
+// Reads the count of a card. If the card is not stored the count is zero.
+// returns false if the SD card cannot be read or both slots of the card are corrupt
+bool CounterDB::Read(uint64_t u64_ID, uint32_t* pu32_Count)
+{
+    uint32_t u32_Record;
+    bool     b_Found;
+    if (!Find(u64_ID, &u32_Record, &b_Found))
+        return false;
+
+    *pu32_Count = 0;
+    if (!b_Found)
+        return true;
+
+    kRecord k_Record;
+    ParseRecord(mu8_Sector + (u32_Record % DB_RECORDS_PER_SECTOR) * DB_RECORD_SIZE, &k_Record);
+    *pu32_Count = k_Record.u32_Count;
+    return k_Record.e_State == SLOT_VALID;
+}
+
+// Stores the count of a card in the slot that does not hold the newest count.
+// A record with both slots corrupt is written completely new.
+// returns false if the SD card cannot be written or the database is full
+bool CounterDB::Write(uint64_t u64_ID, uint32_t u32_Count)
+{
+    uint32_t u32_Record;
+    bool     b_Found;
+    if (!Find(u64_ID, &u32_Record, &b_Found))
+        return false;
+
+    if (!b_Found && mu32_Used >= DB_MAX_USED(mu32_Capacity))
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("Error: The counter database is full\r\n");
+#endif
+        return false;
+    }
+
+    // Find() has loaded the sector of the record
+    byte*   u8_Record = mu8_Sector + (u32_Record % DB_RECORDS_PER_SECTOR) * DB_RECORD_SIZE;
+    kRecord k_Record;
+    ParseRecord(u8_Record, &k_Record);
+
+    // The next change sequence. Before the recovery has finished a record can still have a higher generation.
+    uint32_t u32_Gen = ((k_Record.e_State == SLOT_VALID && k_Record.u32_Gen > mu32_ChangeSeq) ? k_Record.u32_Gen : mu32_ChangeSeq) + 1;
+    if (!ReserveSeq(u32_Gen))
+        return false;
+
+    if (k_Record.e_State == SLOT_VALID)
+    {
+        // Only the older slot is written
+        byte* u8_Slot = u8_Record + 8 + (1 - k_Record.u8_Newest) * 12;
+        Utils::WriteLE32(u8_Slot,     u32_Count);
+        Utils::WriteLE32(u8_Slot + 4, u32_Gen);
+        Utils::WriteLE32(u8_Slot + 8, SlotCrc(u8_Record, u8_Slot));
+        if (!WriteRecord(u32_Record, u8_Slot - u8_Record, u8_Slot, 12))
+            return false;
+
+        mu32_ChangeSeq = u32_Gen;
+        SetDirty(u32_Record, u32_Count != 0);
+        return true;
+    }
+
+    // A new card or a corrupt record
+    memset(u8_Record, 0, DB_RECORD_SIZE);
+    Utils::WriteLE64(u8_Record,      u64_ID);
+    Utils::WriteLE32(u8_Record +  8, u32_Count);
+    Utils::WriteLE32(u8_Record + 12, u32_Gen);
+    Utils::WriteLE32(u8_Record + 16, SlotCrc(u8_Record, u8_Record + 8));
+    if (!WriteRecord(u32_Record, 0, u8_Record, DB_RECORD_SIZE))
+        return false;
+
+    mu32_ChangeSeq = u32_Gen;
+    SetDirty(u32_Record, u32_Count != 0);
+    if (b_Found)
+        return true;
+
+    // The recovery has already passed this record, so it must be counted here
+    if (u32_Record < mu32_Recover)
+        mu32_RecoverUsed ++;
+
+    mu32_Used ++;
+    return WriteHeader();
+}
+
+// Reads record u32_Slot (0 ... GetCapacity() - 1) for a sequential scan of all counters.
+// pu32_Seq (optional) receives the change sequence of the last change of the count.
+// returns false if the record is empty, has no coffees, is corrupt or cannot be read.
+bool CounterDB::ReadSlot(uint32_t u32_Slot, uint64_t* pu64_ID, uint32_t* pu32_Count, uint32_t* pu32_Seq)
+{
+    if (!Open() || u32_Slot >= mu32_Capacity || !LoadSector(u32_Slot / DB_RECORDS_PER_SECTOR))
+        return false;
+
+    kRecord k_Record;
+    ParseRecord(mu8_Sector + (u32_Slot % DB_RECORDS_PER_SECTOR) * DB_RECORD_SIZE, &k_Record);
+    *pu64_ID    = k_Record.u64_ID;
+    *pu32_Count = k_Record.u32_Count;
+    if (pu32_Seq)
+        *pu32_Seq = k_Record.u32_Gen;
+    return k_Record.e_State == SLOT_VALID && k_Record.u32_Count > 0;
+}
+
+// returns the number of cards in the database
+uint32_t CounterDB::GetUsed(void)
+{
+    if (!Open())
+        return 0;
+
+    return mu32_Used;
+}
+
+uint32_t CounterDB::GetCapacity(void)
+{
+    if (!Open())
+        return 0;
+
+    return mu32_Capacity;
+}
+
+// returns the number of records with both slots corrupt that the recovery has found so far
+uint32_t CounterDB::GetCorrupt(void)
+{
+    return mu32_Corrupt;
+}
+
+// returns the number of cards with a count that is not zero.
+// This is only complete after the recovery has finished (see FinishRecovery()).
+uint32_t CounterDB::GetDirtyCount(void)
+{
+    return mu32_DirtyCount;
+}
+
+// returns true if the last sector could not be read from the SD card.
+// Then a failed Read() means that the SD card is not available, otherwise the record is corrupt.
+bool CounterDB::HasIOError(void)
+{
+    return mb_IOError;
+}
+
+// returns the sync token for a WiFi client: database ID (high 32 bit) + change sequence of the last change.
+// The recovery must have finished (see FinishRecovery()), otherwise a record can have a higher generation.
+uint64_t CounterDB::GetSyncToken(void)
+{
+    if (!Open())
+        return 0;
+
+    return ((uint64_t)mu32_DatabaseID << 32) | mu32_ChangeSeq;
+}
+
+// returns the change sequence of a sync token. All cards with a higher generation have changed since the token.
+// returns 0 (all cards have changed) if the client has not synced yet or the token belongs to another database file.
+uint32_t CounterDB::GetTokenSeq(uint64_t u64_Token)
+{
+    if (!Open() || (uint32_t)(u64_Token >> 32) != mu32_DatabaseID || (uint32_t)u64_Token > mu32_ChangeSeq)
+        return 0;
+
+    return (uint32_t)u64_Token;
+}
+
+// Searches the next dirty record, starting at *pu32_Record.
+// returns false if there is no more dirty record
+bool CounterDB::NextDirty(uint32_t* pu32_Record)
+{
+    for (uint32_t R = *pu32_Record; R < mu32_Capacity; R++)
+    {
+        // Skip 8 clean records at once
+        if ((R & 7) == 0 && mu8_Dirty[R / 8] == 0)
+        {
+            R += 7;
+            continue;
+        }
+        if (mu8_Dirty[R / 8] & (1 << (R & 7)))
+        {
+            *pu32_Record = R;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Executes all remaining recovery steps at once. This is required before the dirty bitmap is used.
+// returns false if the SD card cannot be read or written
+bool CounterDB::FinishRecovery(void)
+{
+    if (!Open())
+        return false;
+
+    while (mu32_Recover < mu32_Capacity)
+    {
+        uint32_t u32_Recover = mu32_Recover;
+        if (!RecoveryStep() && mu32_Recover == u32_Recover)
+            return false;
+    }
+    return true;
+}
+
+// Checks the next sector of records. Must be called repeatedly after Open() until it returns true.
+// A torn slot is overwritten with the content of the valid slot, so that each card has two good copies again.
+// At the end the count of used records in the header is corrected (e.g. after a torn header write).
+// returns true when all records have been checked
+bool CounterDB::RecoveryStep(void)
+{
+    if (!mb_Open || mu32_Recover >= mu32_Capacity)
+        return true;
+
+    uint32_t u32_Sector = mu32_Recover / DB_RECORDS_PER_SECTOR;
+    if (!LoadSector(u32_Sector))
+        return false; // try again
+
+    // Counted only when the whole sector has been checked, a failed sector is checked again
+    uint32_t u32_Used    = 0;
+    uint32_t u32_Corrupt = 0;
+    for (byte R=0; R<DB_RECORDS_PER_SECTOR; R++)
+    {
+        uint32_t u32_Record = u32_Sector * DB_RECORDS_PER_SECTOR + R;
+        byte*    u8_Record  = mu8_Sector + R * DB_RECORD_SIZE;
+        kRecord  k_Record;
+        ParseRecord(u8_Record, &k_Record);
+
+        if (k_Record.e_State == SLOT_EMPTY)
+            continue;
+
+        u32_Used ++;
+        if (k_Record.e_State == SLOT_CORRUPT)
+        {
+            u32_Corrupt ++;
+            continue;
+        }
+
+        SetDirty(u32_Record, k_Record.u32_Count != 0);
+
+        // All generations are below the reserved change sequence, this only keeps the sequence monotonic in any case
+        if (k_Record.u32_Gen > mu32_ChangeSeq)
+            mu32_ChangeSeq = k_Record.u32_Gen;
+
+        byte u8_Other = 1 - k_Record.u8_Newest;
+        if (k_Record.e_Slot[u8_Other] == SLOT_CORRUPT)
+        {
+            byte* u8_Newest = u8_Record + 8 + k_Record.u8_Newest * 12;
+            byte* u8_Torn   = u8_Record + 8 + u8_Other * 12;
+            memcpy(u8_Torn, u8_Newest, 12);
+            if (!WriteRecord(u32_Record, u8_Torn - u8_Record, u8_Torn, 12))
+                return false;
+        }
+    }
+
+    mu32_RecoverUsed += u32_Used;
+    mu32_Corrupt     += u32_Corrupt;
+    mu32_Recover      = (u32_Sector + 1) * DB_RECORDS_PER_SECTOR;
+    if (mu32_Recover < mu32_Capacity)
+        return false;
+
+    if (mu32_RecoverUsed != mu32_Used)
+    {
+        mu32_Used = mu32_RecoverUsed;
+        WriteHeader();
+    }
+    return true;
+}
+
+// One-time migration of the old storage: Each card had its own file in the root folder which is named by Utils::Base36().
+// The counter of each file is stored in the database and then the file is deleted.
+// Running the migration again after a power failure is harmless because the counters are overwritten, not added.
+// Files with a corrupt counter are left in the root folder. They are moved into the next backup folder.
+// returns false if the database cannot be written.
+bool CounterDB::MigrateLegacy(File dir)
+{
+    File     entry;
+    uint64_t u64_ID;
+    uint16_t u16_Count;
+    char     s8_Name[13];
+
+    dir.rewindDirectory();
+    while (entry = SDCard::OpenNext(&dir), entry)
+    {
+        bool b_Legacy = !entry.isDirectory() && Utils::ParseBase36(entry.name(), &u64_ID);
+        if (b_Legacy)
+            strcpy(s8_Name, entry.name());
+        SDCard::Close(&entry);
+
+        if (!b_Legacy)
+            continue;
+
+        if (!Utils::GetSDCounterForCard(s8_Name, &u16_Count))
+        {
+#ifdef STD_PRINT_EN
+            Utils::Print("Corrupt counter file: ");
+            Utils::Print(s8_Name, LF);
+#endif
+            continue;
+        }
+
+        if (!Write(u64_ID, u16_Count))
+            return false;
+
+        SDCard::Remove(s8_Name);
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------
+
+// Creates a new file with all records empty
+bool CounterDB::Create(void)
+{
+    mi_File = SDCard::Open(ms8_Path, FILE_WRITE);
+    if (!mi_File)
+        return false;
+
+    mu32_Capacity  = DB_CAPACITY;
+    mu32_Used      = 0;
+    mu32_Offset    = DB_HEADER_SIZE;
+    mu32_HeaderSeq = 0;
+    mu32_ChangeSeq = 0;
+    mu32_SeqLimit  = 0;
+    mu32_DatabaseID = NewDatabaseID();
+    mu32_Recover   = DB_CAPACITY; // nothing to recover
+    mu32_Corrupt   = 0;
+    mu32_DirtyCount = 0;
+    memset(mu8_Dirty, 0, sizeof(mu8_Dirty));
+
+    // Write the empty records with whole sectors
+    memset(mu8_Sector, 0, DB_SECTOR_SIZE);
+    SDCard::Seek(&mi_File, 0);
+    for (uint32_t S=0; S < 1 + DB_CAPACITY / DB_RECORDS_PER_SECTOR; S++)
+    {
+        if (!SDCard::Write(&mi_File, mu8_Sector, DB_SECTOR_SIZE))
+        {
+            SDCard::Close(&mi_File);
+            SDCard::Remove(ms8_Path);
+            return false;
+        }
+    }
+
+    mb_Open = true;
+    if (!WriteHeader())
+    {
+        Close();
+        SDCard::Remove(ms8_Path);
+        return false;
+    }
+    return true;
+}
+
+// Reads both header copies and takes the valid one with the higher sequence number.
+bool CounterDB::ReadHeader(void)
+{
+    byte u8_Header[36];
+    bool b_Valid = false;
+    mu32_HeaderSeq  = 0;
+    mu32_SeqLimit   = 0;
+    mu32_DatabaseID = 0;
+
+    for (byte H=0; H<2; H++)
+    {
+        if (!SDCard::Seek(&mi_File, H * DB_HEADER_SLOT) || SDCard::Read(&mi_File, u8_Header, sizeof(u8_Header)) != sizeof(u8_Header))
+            return false;
+
+        uint16_t u16_Version = u8_Header[4] | (u8_Header[5] << 8);
+        uint32_t u32_Seq     = Utils::ReadLE32(u8_Header + 20);
+        if (Utils::ReadLE32(u8_Header) != DB_MAGIC || u16_Version != DB_VERSION ||
+            Utils::ReadLE32(u8_Header + 32) != Utils::CalcCrc32(u8_Header, 32) ||
+            (b_Valid && u32_Seq <= mu32_HeaderSeq))
+            continue;
+
+        b_Valid        = true;
+        mu32_Capacity  = Utils::ReadLE32(u8_Header +  8);
+        mu32_Used      = Utils::ReadLE32(u8_Header + 12);
+        mu32_Offset    = Utils::ReadLE32(u8_Header + 16);
+        mu32_HeaderSeq = u32_Seq;
+        mu32_SeqLimit   = Utils::ReadLE32(u8_Header + 24);
+        mu32_DatabaseID = Utils::ReadLE32(u8_Header + 28);
+        if ((u8_Header[6] | (u8_Header[7] << 8)) != DB_RECORD_SIZE)
+            return false;
+    }
+
+    if (!b_Valid)
+        return false;
+
+    // The capacity must be a power of 2 and the file must contain all records
+    return mu32_Capacity > 0 && mu32_Capacity <= DB_CAPACITY && (mu32_Capacity & (mu32_Capacity - 1)) == 0 &&
+           mi_File.size() >= mu32_Offset + mu32_Capacity * DB_RECORD_SIZE;
+}
+
+// Writes the header into the copy that does not hold the newest header
+bool CounterDB::WriteHeader(void)
+{
+    byte u8_Header[36];
+    Utils::WriteLE32(u8_Header,      DB_MAGIC);
+    u8_Header[4] = (byte)DB_VERSION;
+    u8_Header[5] = (byte)(DB_VERSION >> 8);
+    u8_Header[6] = (byte)DB_RECORD_SIZE;
+    u8_Header[7] = (byte)(DB_RECORD_SIZE >> 8);
+    Utils::WriteLE32(u8_Header +  8, mu32_Capacity);
+    Utils::WriteLE32(u8_Header + 12, mu32_Used);
+    Utils::WriteLE32(u8_Header + 16, mu32_Offset);
+    Utils::WriteLE32(u8_Header + 20, mu32_HeaderSeq + 1);
+    Utils::WriteLE32(u8_Header + 24, mu32_SeqLimit);
+    Utils::WriteLE32(u8_Header + 28, mu32_DatabaseID);
+    Utils::WriteLE32(u8_Header + 32, Utils::CalcCrc32(u8_Header, 32));
+
+    SDCard::Seek(&mi_File, ((mu32_HeaderSeq + 1) & 1) * DB_HEADER_SLOT);
+    bool b_Success = SDCard::Write(&mi_File, u8_Header, sizeof(u8_Header));
+    SDCard::Flush(&mi_File);
+    if (b_Success)
+        mu32_HeaderSeq ++;
+
+    return b_Success;
+}
+
+// Reserves the change sequence up to u32_Gen in the header (DB_SEQ_RESERVE values at once).
+// After a reset the sequence continues at the reserved value, so it is always higher than all generations in the file.
+bool CounterDB::ReserveSeq(uint32_t u32_Gen)
+{
+    if (u32_Gen <= mu32_SeqLimit)
+        return true;
+
+    uint32_t u32_Limit = mu32_SeqLimit;
+    mu32_SeqLimit = u32_Gen + DB_SEQ_RESERVE;
+    if (WriteHeader())
+        return true;
+
+    mu32_SeqLimit = u32_Limit;
+    return false;
+}
+
+// Writes u32_Length bytes at u32_Offset in a record. The data has already been modified in mu8_Sector.
+bool CounterDB::WriteRecord(uint32_t u32_Record, uint32_t u32_Offset, const byte* u8_Data, uint32_t u32_Length)
+{
+    SDCard::Seek(&mi_File, mu32_Offset + u32_Record * DB_RECORD_SIZE + u32_Offset);
+    bool b_Success = SDCard::Write(&mi_File, u8_Data, u32_Length);
+    SDCard::Flush(&mi_File);
+    if (!b_Success)
+        mu32_Sector = 0xFFFFFFFF; // the buffer does not match the file anymore
+
+    return b_Success;
+}
+
+// Searches the record of a card. If the card is not stored, u32_Record receives the empty record where it can be inserted.
+// The sector of the record is in mu8_Sector afterwards.
+// returns false if the SD card cannot be read
+bool CounterDB::Find(uint64_t u64_ID, uint32_t* pu32_Record, bool* pb_Found)
+{
+    if (!Open())
+        return false;
+
+    uint32_t u32_Record = Hash(u64_ID) & (mu32_Capacity - 1);
+    for (uint32_t i=0; i<mu32_Capacity; i++)
+    {
+        if (!LoadSector(u32_Record / DB_RECORDS_PER_SECTOR))
+            return false;
+
+        // A corrupt record with the same UID belongs to the card. Read() reports it, Write() repairs it.
+        kRecord k_Record;
+        ParseRecord(mu8_Sector + (u32_Record % DB_RECORDS_PER_SECTOR) * DB_RECORD_SIZE, &k_Record);
+        if (k_Record.e_State == SLOT_EMPTY || k_Record.u64_ID == u64_ID)
+        {
+            *pu32_Record = u32_Record;
+            *pb_Found    = (k_Record.e_State != SLOT_EMPTY);
+            return true;
+        }
+        u32_Record = (u32_Record + 1) & (mu32_Capacity - 1);
+    }
+
+    // Not possible because the database is never filled completely
+    return false;
+}
+
+// Reads a sector of the record area into mu8_Sector, if it is not already there
+bool CounterDB::LoadSector(uint32_t u32_Sector)
+{
+    if (mu32_Sector == u32_Sector)
+        return true;
+
+    mu32_Sector = 0xFFFFFFFF;
+    SDCard::Seek(&mi_File, mu32_Offset + u32_Sector * DB_SECTOR_SIZE);
+    mb_IOError = SDCard::Read(&mi_File, mu8_Sector, DB_SECTOR_SIZE) != DB_SECTOR_SIZE;
+    if (mb_IOError)
+        return false;
+
+    mu32_Sector = u32_Sector;
+    return true;
+}
+
+void CounterDB::SetDirty(uint32_t u32_Record, bool b_Dirty)
+{
+    byte u8_Mask = 1 << (u32_Record & 7);
+    if (b_Dirty == ((mu8_Dirty[u32_Record / 8] & u8_Mask) != 0))
+        return;
+
+    mu8_Dirty[u32_Record / 8] ^= u8_Mask;
+    if (b_Dirty) mu32_DirtyCount ++;
+    else         mu32_DirtyCount --;
+}
+
+// Folds the UID to 32 bit and spreads it with a multiplicative hash (Knuth)
+uint32_t CounterDB::Hash(uint64_t u64_ID)
+{
+    uint32_t u32_Key = (uint32_t)u64_ID ^ (uint32_t)(u64_ID >> 32);
+    u32_Key *= 2654435761UL;
+    return u32_Key ^ (u32_Key >> 16);
+}
@@ -0,0 +1,129 @@
+/**************************************************************************
+    class CounterDB: All coffee counters in one binary file on the SD card.
+
+    Before, each card had its own 8.3 file in the root folder. Each file occupied a whole FAT cluster
+    and SD.open() had to scan the directory linearly to find it.
+    Now the counters are stored in fixed size records in one file. The record of a card is found by hashing the UID
+    (open addressing with linear probing). 16 records share one sector, so a lookup costs normally one sector read.
+
+    File layout (all values little endian):
+    Sector 0:    two copies of the header at offset 0 and DB_HEADER_SLOT, the copy with the higher sequence number is valid
+                 magic "NFCD", version (16 bit), record size (16 bit), capacity (32 bit), used records (32 bit),
+                 offset of the first record (32 bit), sequence number (32 bit), change sequence reserved (32 bit),
+                 database ID (32 bit), CRC32 of the first 32 bytes
+    Records:     capacity records of DB_RECORD_SIZE bytes
+                 UID (64 bit), slot A, slot B
+                 each slot: count (32 bit), generation (32 bit), CRC32 over UID, count and generation
+                 A record that contains only zeroes is empty.
+
+    Change sequence:
+    The generation of a new slot is the next value of one change sequence for the whole file, so the newest
+    generation of a record tells when its count has changed last. A WiFi client gets the sync token
+    (database ID + change sequence) with each binary export and then receives only the cards that have changed since then.
+    The header reserves DB_SEQ_RESERVE values ahead, so the header is written only once every DB_SEQ_RESERVE changes
+    and the sequence continues above all generations after a reset.
+    The database ID is random. A token of another (new) database file is not valid.
+
+    Crash safety:
+    A new count is always written into the slot that does NOT hold the newest count, with the generation + 1.
+    If the write is torn, the CRC of this slot is wrong and the other slot still holds the last count.
+    The header is written alternately into its two copies in the same way.
+    At boot RecoveryStep() checks all records in the background (one sector per call) and repairs torn slots,
+    so the startup time does not depend on the number of cards.
+
+    Incremental backup:
+    A card is dirty if its count is not zero. Backup_Data() stores only the dirty cards and then resets their count to zero.
+    A bitmap of the dirty records is kept in RAM, so the backup does not have to read all records.
+    The bitmap is rebuilt by RecoveryStep() after Open(). Before the recovery has finished it is incomplete.
+
+    The file is created with all records at the first write and it is never resized.
+**************************************************************************/
+
+#ifndef COUNTERDB_H
+#define COUNTERDB_H
+
+#include "Utils.h"
+
+// The path of the counter database on the SD card
+#define COUNTER_DB_PATH   "/COUNTERS.DB"
+
+#define DB_MAGIC          (0x4443464Eu) // "NFCD"
+#define DB_VERSION        (1u)
+#define DB_SECTOR_SIZE    (512u)
+#define DB_HEADER_SIZE    DB_SECTOR_SIZE
+#define DB_HEADER_SLOT    (256u)
+#define DB_RECORD_SIZE    (32u)
+#define DB_RECORDS_PER_SECTOR  (DB_SECTOR_SIZE / DB_RECORD_SIZE)
+// The number of records in a new file (must be a power of 2). 8192 records = 256 kB.
+// A file with more records cannot be opened because the dirty bitmap has a fixed size.
+#define DB_CAPACITY       (8192u)
+// Not more records than this are used, so the probe sequences stay short (load factor 7/8)
+#define DB_MAX_USED(cap)  ((cap) / 8 * 7)
+
+// The number of change sequence values that are reserved with one header write
+#define DB_SEQ_RESERVE    (256u)
+
+// The interval in milliseconds in which RecoveryStep() is executed by the scheduler after boot
+#define DB_RECOVERY_INTERVAL   (20u)
+
+class CounterDB
+{
+public:
+    CounterDB(const char* s8_Path);
+    bool     Open(void);
+    void     Close(void);
+    bool     Read (uint64_t u64_ID, uint32_t* pu32_Count);
+    bool     Write(uint64_t u64_ID, uint32_t u32_Count);
+    bool     ReadSlot(uint32_t u32_Slot, uint64_t* pu64_ID, uint32_t* pu32_Count, uint32_t* pu32_Seq = NULL);
+    bool     MigrateLegacy(File dir);
+    bool     RecoveryStep(void);
+    bool     FinishRecovery(void);
+    bool     NextDirty(uint32_t* pu32_Record);
+    uint32_t GetUsed(void);
+    uint32_t GetCapacity(void);
+    uint32_t GetCorrupt(void);
+    uint32_t GetDirtyCount(void);
+    bool     HasIOError(void);
+    uint64_t GetSyncToken(void);
+    uint32_t GetTokenSeq(uint64_t u64_Token);
+
+private:
+    bool     Create(void);
+    bool     ReadHeader(void);
+    bool     WriteHeader(void);
+    bool     ReserveSeq(uint32_t u32_Gen);
+    bool     WriteRecord(uint32_t u32_Record, uint32_t u32_Offset, const byte* u8_Data, uint32_t u32_Length);
+    bool     Find(uint64_t u64_ID, uint32_t* pu32_Record, bool* pb_Found);
+    bool     LoadSector(uint32_t u32_Sector);
+    void     SetDirty(uint32_t u32_Record, bool b_Dirty);
+    uint32_t Hash(uint64_t u64_ID);
+
+    const char* ms8_Path;
+    File        mi_File;
+    bool        mb_Open;
+    uint32_t    mu32_Capacity;
+    uint32_t    mu32_Used;
+    uint32_t    mu32_Offset;    // file offset of the first record
+    uint32_t    mu32_HeaderSeq;
+    uint32_t    mu32_ChangeSeq; // the generation of the last change
+    uint32_t    mu32_SeqLimit;  // the change sequence is reserved in the header up to this value
+    uint32_t    mu32_DatabaseID;
+    uint32_t    mu32_Sector;    // the sector that is in mu8_Sector or 0xFFFFFFFF
+    bool        mb_IOError;     // the last sector could not be read
+
+    // The background recovery
+    uint32_t    mu32_Recover;   // the next record to be checked (mu32_Capacity = finished)
+    uint32_t    mu32_RecoverUsed;
+    uint32_t    mu32_Corrupt;   // records where both slots are corrupt
+
+    // One bit per record: the count is not zero (changed since the last backup)
+    uint32_t    mu32_DirtyCount;
+    byte        mu8_Dirty[DB_CAPACITY / 8];
+
+    // One sector is cached. A lookup and the sequential reads of ReadSlot() are served from this buffer.
+    byte        mu8_Sector[DB_SECTOR_SIZE];
+};
+
+extern CounterDB gi_CounterDB;
+
+#endif // COUNTERDB_H
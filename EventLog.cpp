@@ -0,0 +1,500 @@
+/**************************************************************************
+    class EventLog: An append-only log of all taps on the SD card.
+**************************************************************************/
+
+#include "Config.h"
+#include "EventLog.h"
+#include "SDCard.h"
+
+CounterDB EventLog::mi_Totals(LOG_TOTALS_PATH);
+byte      EventLog::mu8_Tail[LOG_SECTOR_SIZE];
+byte      EventLog::mu8_TailCount       = 0;
+bool      EventLog::mb_TailDirty        = false;
+uint32_t  EventLog::mu32_TailSegment    = 1;
+uint32_t  EventLog::mu32_TailSector     = 0;
+uint32_t  EventLog::mu32_FirstDirty     = 0;
+uint32_t  EventLog::mu32_NextSeq        = 1;
+bool      EventLog::mb_Ready            = false;
+uint32_t  EventLog::mu32_CompactSegment = 1;
+uint32_t  EventLog::mu32_CompactSector  = 0;
+uint32_t  EventLog::mu32_CompactSeq     = 0;
+uint32_t  EventLog::mu32_LastCompact    = 0;
+uint32_t  EventLog::mu32_JournalStep    = 0;
+bool      EventLog::mb_JournalPending   = false;
+byte      EventLog::mu8_JournalCount    = 0;
+uint64_t  EventLog::mu64_JournalID   [LOG_RECORDS_PER_SECTOR];
+uint32_t  EventLog::mu32_JournalTotal[LOG_RECORDS_PER_SECTOR];
+
+// Decodes a record. returns false if the record is empty or corrupt.
+static bool ParseRecord(const byte* u8_Record, uint64_t* pu64_ID, uint32_t* pu32_Seq)
+{
+    *pu64_ID  = Utils::ReadLE64(u8_Record);
+    *pu32_Seq = Utils::ReadLE32(u8_Record + 16);
+    return *pu64_ID != 0 && Utils::ReadLE32(u8_Record + 28) == Utils::CalcCrc32(u8_Record, 28);
+}
+
+// Converts a segment file name "XXXXXXXX.LOG" (hexadecimal) into the segment number
+// returns 0 if the name is not a segment
+static uint32_t ParseSegment(const char* s8_Name)
+{
+    char* s8_End;
+    if (strlen(s8_Name) != 12 || strcmp(s8_Name + 8, ".LOG") != 0)
+        return 0;
+
+    uint32_t u32_Segment = strtoul(s8_Name, &s8_End, 16);
+    return (s8_End == s8_Name + 8) ? u32_Segment : 0;
+}
+
+// Must be called once after the SD card has been initialized.
+// Finds the newest segment, loads its last sector and finishes an interrupted compaction step.
+// returns false if the SD card cannot be accessed.
+bool EventLog::Begin(void)
+{
+    mb_Ready = false;
+    if (!SDCard::Exists(LOG_FOLDER) && !SDCard::Mkdir(LOG_FOLDER))
+        return false;
+
+    File dir = SDCard::Open(LOG_FOLDER);
+    if (!dir)
+        return false;
+
+    File     entry;
+    uint32_t u32_First = 0xFFFFFFFF;
+    uint32_t u32_Last  = 0;
+    while (entry = SDCard::OpenNext(&dir), entry)
+    {
+        uint32_t u32_Segment = entry.isDirectory() ? 0 : ParseSegment(entry.name());
+        SDCard::Close(&entry);
+
+        if (u32_Segment == 0)
+            continue;
+        if (u32_Segment < u32_First) u32_First = u32_Segment;
+        if (u32_Segment > u32_Last)  u32_Last  = u32_Segment;
+    }
+    SDCard::Close(&dir);
+
+    if (u32_Last == 0)
+        u32_First = 1; // no segment yet
+
+    mu32_CompactSegment = u32_First;
+    mu32_CompactSector  = 0;
+    if (!LoadJournal())
+        return false;
+
+    if (mb_JournalPending && !ApplyJournal())
+        return false;
+
+    // Delete the segments that have been compacted completely before a power failure
+    char s8_Path[32];
+    for (uint32_t S = u32_First; S < mu32_CompactSegment && S <= u32_Last; S++)
+    {
+        GetSegmentPath(S, s8_Path);
+        SDCard::Remove(s8_Path);
+    }
+
+    mu32_TailSegment = max(u32_Last, mu32_CompactSegment);
+    if (!LoadTail())
+        return false;
+
+    mb_Ready = true;
+    return true;
+}
+
+// Appends a tap to the log. The record is written to the SD card when the sector is full, by Task() or by Flush().
+// u32_Flags: LOG_FLAG_REPLAYED, LOG_FLAG_DATE or 0
+// returns false if a full sector could not be written.
+bool EventLog::Append(uint64_t u64_ID, uint32_t u32_Flags, uint32_t u32_Data)
+{
+    if (!mb_Ready && !Begin())
+        return false;
+
+    // The last flush of a full sector has failed
+    if (mu8_TailCount >= LOG_RECORDS_PER_SECTOR && !Flush())
+        return false;
+
+    byte* u8_Record = mu8_Tail + mu8_TailCount * LOG_RECORD_SIZE;
+    Utils::WriteLE64(u8_Record,      u64_ID);
+    Utils::WriteLE64(u8_Record +  8, Utils::GetMillis64());
+    Utils::WriteLE32(u8_Record + 16, mu32_NextSeq);
+    Utils::WriteLE32(u8_Record + 20, u32_Flags);
+    Utils::WriteLE32(u8_Record + 24, u32_Data);
+    Utils::WriteLE32(u8_Record + 28, Utils::CalcCrc32(u8_Record, 28));
+    mu8_TailCount ++;
+    mu32_NextSeq  ++;
+
+    if (!mb_TailDirty)
+    {
+        mb_TailDirty    = true;
+        mu32_FirstDirty = Utils::GetMillis();
+    }
+
+    if (mu8_TailCount < LOG_RECORDS_PER_SECTOR)
+        return true;
+
+    return Flush();
+}
+
+// Writes the sector with the new records (one sector write).
+// returns false if the SD card cannot be written. The records stay in RAM.
+bool EventLog::Flush(void)
+{
+    if (!mb_TailDirty)
+        return true;
+
+    char s8_Path[32];
+    GetSegmentPath(mu32_TailSegment, s8_Path);
+    File logFile = SDCard::Open(s8_Path, FILE_WRITE);
+    if (!logFile)
+        return false;
+
+    bool b_Success = SDCard::Seek(&logFile, mu32_TailSector * LOG_SECTOR_SIZE) &&
+                     SDCard::Write(&logFile, mu8_Tail, LOG_SECTOR_SIZE);
+    SDCard::Close(&logFile);
+    if (!b_Success)
+        return false;
+
+    mb_TailDirty = false;
+    if (mu8_TailCount < LOG_RECORDS_PER_SECTOR)
+        return true;
+
+    // The sector is full, continue with the next one
+    memset(mu8_Tail, 0, LOG_SECTOR_SIZE);
+    mu8_TailCount = 0;
+    if (++mu32_TailSector >= LOG_SEGMENT_SECTORS)
+    {
+        mu32_TailSegment ++;
+        mu32_TailSector = 0;
+    }
+    return true;
+}
+
+// Called after the SD card has been mounted again.
+// Writes the records that are still in RAM. Begin() would discard them, so it is only executed if it has not succeeded before.
+bool EventLog::Resume(void)
+{
+    // The file of the totals has been opened on the old mount
+    mi_Totals.Close();
+
+    if (!mb_Ready)
+        return Begin();
+
+    return Flush();
+}
+
+// Executed by the scheduler every LOG_TASK_INTERVAL.
+// Writes the records after LOG_FLUSH_INTERVAL, otherwise executes a compaction step each LOG_COMPACT_INTERVAL.
+// After boot and after a remount the totals are recovered first (see CounterDB::RecoveryStep()).
+void EventLog::Task(void)
+{
+    if (!mb_Ready)
+        return;
+
+    uint32_t u32_Now = Utils::GetMillis();
+    if (mb_TailDirty && (u32_Now - mu32_FirstDirty) >= LOG_FLUSH_INTERVAL)
+    {
+        // After an error try again after LOG_FLUSH_INTERVAL
+        if (!Flush())
+            mu32_FirstDirty = u32_Now;
+        return;
+    }
+
+    if ((u32_Now - mu32_LastCompact) >= LOG_COMPACT_INTERVAL)
+    {
+        // The totals are checked and their torn slots repaired before the compaction adds to them.
+        // One sector per call, until the recovery has finished no compaction step is executed.
+        if (!mi_Totals.Open() || !mi_Totals.RecoveryStep())
+            return;
+
+        mu32_LastCompact = u32_Now;
+        CompactStep();
+    }
+}
+
+// Appends a date record. The time of day is not known, so the timestamps stay relative to power on.
+void EventLog::SetDate(uint16_t u16_Year, byte u8_Month, byte u8_Day)
+{
+    Append(LOG_DATE_ID, LOG_FLAG_DATE, (uint32_t)DaysFromCivil(u16_Year, u8_Month, u8_Day));
+}
+
+// returns the sequence number of the next tap
+uint32_t EventLog::GetNextSeq(void)
+{
+    return mu32_NextSeq;
+}
+
+// Compacts one sector of the oldest segment if there are more than LOG_KEEP_SEGMENTS segments.
+// returns false on error
+bool EventLog::CompactStep(void)
+{
+    if (!mb_Ready)
+        return false;
+
+    // A journal that could not be applied before
+    if (mb_JournalPending)
+        return ApplyJournal();
+
+    if (mu32_CompactSegment + LOG_KEEP_SEGMENTS > mu32_TailSegment)
+        return true; // nothing to compact
+
+    char s8_Path[32];
+    GetSegmentPath(mu32_CompactSegment, s8_Path);
+    File logFile = SDCard::Open(s8_Path);
+
+    // Collect the taps of one sector per card
+    mu8_JournalCount = 0;
+    uint32_t u32_Seq = mu32_CompactSeq;
+    if (logFile && SDCard::Seek(&logFile, mu32_CompactSector * LOG_SECTOR_SIZE))
+    {
+        for (byte R=0; R<LOG_RECORDS_PER_SECTOR; R++)
+        {
+            byte     u8_Record[LOG_RECORD_SIZE];
+            uint64_t u64_ID;
+            uint32_t u32_RecordSeq;
+            if (SDCard::Read(&logFile, u8_Record, LOG_RECORD_SIZE) != LOG_RECORD_SIZE)
+                break;
+            if (!ParseRecord(u8_Record, &u64_ID, &u32_RecordSeq))
+                continue;
+
+            if (u32_RecordSeq > u32_Seq)
+                u32_Seq = u32_RecordSeq;
+            if (Utils::ReadLE32(u8_Record + 20) & LOG_FLAG_DATE)
+                continue;
+
+            byte i = 0;
+            while (i < mu8_JournalCount && mu64_JournalID[i] != u64_ID)
+                i++;
+
+            if (i == mu8_JournalCount)
+            {
+                mu64_JournalID   [i] = u64_ID;
+                mu32_JournalTotal[i] = 0;
+                mu8_JournalCount ++;
+            }
+            mu32_JournalTotal[i] ++;
+        }
+    }
+    if (logFile)
+        SDCard::Close(&logFile);
+
+    // Convert the taps into the new totals
+    for (byte i=0; i<mu8_JournalCount; i++)
+    {
+        uint32_t u32_Total;
+        if (!mi_Totals.Read(mu64_JournalID[i], &u32_Total))
+        {
+#ifdef STD_PRINT_EN
+            Utils::Print("Error: Cannot read the event totals\r\n");
+#endif
+            return false;
+        }
+        mu32_JournalTotal[i] += u32_Total;
+    }
+
+    // Advance the cursor. The journal stores the new cursor together with the new totals.
+    uint32_t u32_OldSegment = mu32_CompactSegment;
+    uint32_t u32_OldSector  = mu32_CompactSector;
+    uint32_t u32_OldSeq     = mu32_CompactSeq;
+    mu32_CompactSeq = u32_Seq;
+    if (++mu32_CompactSector >= LOG_SEGMENT_SECTORS)
+    {
+        mu32_CompactSegment ++;
+        mu32_CompactSector = 0;
+    }
+
+    if (!WriteJournal(true))
+    {
+        mu32_CompactSegment = u32_OldSegment;
+        mu32_CompactSector  = u32_OldSector;
+        mu32_CompactSeq     = u32_OldSeq;
+        return false;
+    }
+
+    if (!ApplyJournal())
+        return false;
+
+    if (mu32_CompactSegment != u32_OldSegment)
+        SDCard::Remove(s8_Path);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------
+
+// Loads the last sector of the newest segment into RAM and continues the sequence numbers
+bool EventLog::LoadTail(void)
+{
+    char s8_Path[32];
+    memset(mu8_Tail, 0, LOG_SECTOR_SIZE);
+    mu8_TailCount   = 0;
+    mb_TailDirty    = false;
+    mu32_TailSector = 0;
+    mu32_NextSeq    = mu32_CompactSeq + 1;
+
+    GetSegmentPath(mu32_TailSegment, s8_Path);
+    File logFile = SDCard::Open(s8_Path);
+    if (!logFile)
+        return true; // not yet created
+
+    uint32_t u32_Sectors = logFile.size() / LOG_SECTOR_SIZE;
+    if (u32_Sectors == 0)
+    {
+        SDCard::Close(&logFile);
+        return true;
+    }
+
+    // The records of a torn sector write after the first invalid record are overwritten by the next records
+    mu32_TailSector = u32_Sectors - 1;
+    bool b_Success = SDCard::Seek(&logFile, mu32_TailSector * LOG_SECTOR_SIZE) &&
+                     SDCard::Read(&logFile, mu8_Tail, LOG_SECTOR_SIZE) == LOG_SECTOR_SIZE;
+
+    uint64_t u64_ID;
+    uint32_t u32_Seq;
+    while (b_Success && mu8_TailCount < LOG_RECORDS_PER_SECTOR && ParseRecord(mu8_Tail + mu8_TailCount * LOG_RECORD_SIZE, &u64_ID, &u32_Seq))
+    {
+        mu32_NextSeq = u32_Seq + 1;
+        mu8_TailCount ++;
+    }
+    memset(mu8_Tail + mu8_TailCount * LOG_RECORD_SIZE, 0, LOG_SECTOR_SIZE - mu8_TailCount * LOG_RECORD_SIZE);
+
+    // If the last sector has no valid record take the sequence number from the sector before
+    if (b_Success && mu8_TailCount == 0 && mu32_TailSector > 0)
+    {
+        byte u8_Record[LOG_RECORD_SIZE];
+        b_Success = SDCard::Seek(&logFile, mu32_TailSector * LOG_SECTOR_SIZE - LOG_RECORD_SIZE) &&
+                    SDCard::Read(&logFile, u8_Record, LOG_RECORD_SIZE) == LOG_RECORD_SIZE;
+        if (b_Success && ParseRecord(u8_Record, &u64_ID, &u32_Seq))
+            mu32_NextSeq = u32_Seq + 1;
+    }
+    SDCard::Close(&logFile);
+
+    if (mu8_TailCount == LOG_RECORDS_PER_SECTOR)
+    {
+        memset(mu8_Tail, 0, LOG_SECTOR_SIZE);
+        mu8_TailCount = 0;
+        if (++mu32_TailSector >= LOG_SEGMENT_SECTORS)
+        {
+            mu32_TailSegment ++;
+            mu32_TailSector = 0;
+        }
+    }
+    return b_Success;
+}
+
+// Loads the newest valid journal slot (compaction cursor and maybe a pending step)
+bool EventLog::LoadJournal(void)
+{
+    mb_JournalPending = false;
+    mu32_JournalStep  = 0;
+    if (!SDCard::Exists(LOG_JOURNAL_PATH))
+        return true;
+
+    File jnlFile = SDCard::Open(LOG_JOURNAL_PATH);
+    if (!jnlFile)
+        return false;
+
+    byte u8_Journal[28 + LOG_RECORDS_PER_SECTOR * 12 + 4];
+    for (byte J=0; J<2; J++)
+    {
+        if (!SDCard::Seek(&jnlFile, J * LOG_JOURNAL_SLOT) || SDCard::Read(&jnlFile, u8_Journal, sizeof(u8_Journal)) != sizeof(u8_Journal))
+            continue;
+
+        uint32_t u32_Step  = Utils::ReadLE32(u8_Journal + 4);
+        byte     u8_Count  = u8_Journal[24];
+        if (Utils::ReadLE32(u8_Journal) != LOG_JOURNAL_MAGIC || u8_Count > LOG_RECORDS_PER_SECTOR ||
+            Utils::ReadLE32(u8_Journal + sizeof(u8_Journal) - 4) != Utils::CalcCrc32(u8_Journal, sizeof(u8_Journal) - 4) ||
+            u32_Step <= mu32_JournalStep)
+            continue;
+
+        mu32_JournalStep    = u32_Step;
+        mb_JournalPending   = (u8_Journal[25] != 0);
+        mu32_CompactSegment = Utils::ReadLE32(u8_Journal +  8);
+        mu32_CompactSector  = Utils::ReadLE32(u8_Journal + 12);
+        mu32_CompactSeq     = Utils::ReadLE32(u8_Journal + 16);
+        mu8_JournalCount    = u8_Count;
+        for (byte i=0; i<u8_Count; i++)
+        {
+            mu64_JournalID   [i] = Utils::ReadLE64(u8_Journal + 28 + i * 12);
+            mu32_JournalTotal[i] = Utils::ReadLE32(u8_Journal + 28 + i * 12 + 8);
+        }
+    }
+    SDCard::Close(&jnlFile);
+    return true;
+}
+
+// Journal slot layout: magic, step, segment, sector, sequence number, reserved (32 bit each),
+// entry count (8 bit), pending flag (8 bit), 2 bytes reserved, LOG_RECORDS_PER_SECTOR x (UID 64 bit, total 32 bit), CRC32
+bool EventLog::WriteJournal(bool b_Pending)
+{
+    byte u8_Journal[28 + LOG_RECORDS_PER_SECTOR * 12 + 4];
+    memset(u8_Journal, 0, sizeof(u8_Journal));
+
+    uint32_t u32_Step = mu32_JournalStep + 1;
+    Utils::WriteLE32(u8_Journal,      LOG_JOURNAL_MAGIC);
+    Utils::WriteLE32(u8_Journal +  4, u32_Step);
+    Utils::WriteLE32(u8_Journal +  8, mu32_CompactSegment);
+    Utils::WriteLE32(u8_Journal + 12, mu32_CompactSector);
+    Utils::WriteLE32(u8_Journal + 16, mu32_CompactSeq);
+    u8_Journal[24] = mu8_JournalCount;
+    u8_Journal[25] = b_Pending ? 1 : 0;
+    for (byte i=0; i<mu8_JournalCount; i++)
+    {
+        Utils::WriteLE64(u8_Journal + 28 + i * 12,     mu64_JournalID[i]);
+        Utils::WriteLE32(u8_Journal + 28 + i * 12 + 8, mu32_JournalTotal[i]);
+    }
+    Utils::WriteLE32(u8_Journal + sizeof(u8_Journal) - 4, Utils::CalcCrc32(u8_Journal, sizeof(u8_Journal) - 4));
+
+    File jnlFile = SDCard::Open(LOG_JOURNAL_PATH, FILE_WRITE);
+    if (!jnlFile)
+        return false;
+
+    // A new file is filled with both (empty) slots first, because a file cannot be written behind its end
+    bool b_Success = true;
+    if (jnlFile.size() < 2 * LOG_JOURNAL_SLOT)
+    {
+        byte u8_Empty[LOG_RECORD_SIZE];
+        memset(u8_Empty, 0, sizeof(u8_Empty));
+        b_Success = SDCard::Seek(&jnlFile, 0);
+        for (uint32_t P=0; b_Success && P < 2 * LOG_JOURNAL_SLOT; P += sizeof(u8_Empty))
+        {
+            b_Success = SDCard::Write(&jnlFile, u8_Empty, sizeof(u8_Empty));
+        }
+    }
+
+    // The slot with the older step is overwritten
+    b_Success = b_Success && SDCard::Seek(&jnlFile, (u32_Step & 1) * LOG_JOURNAL_SLOT) &&
+                SDCard::Write(&jnlFile, u8_Journal, sizeof(u8_Journal));
+    SDCard::Close(&jnlFile);
+    if (!b_Success)
+        return false;
+
+    mu32_JournalStep  = u32_Step;
+    mb_JournalPending = b_Pending;
+    return true;
+}
+
+// Stores the totals of the journal in the database. Storing them twice does not change anything.
+bool EventLog::ApplyJournal(void)
+{
+    for (byte i=0; i<mu8_JournalCount; i++)
+    {
+        if (!mi_Totals.Write(mu64_JournalID[i], mu32_JournalTotal[i]))
+            return false;
+    }
+    return WriteJournal(false);
+}
+
+void EventLog::GetSegmentPath(uint32_t u32_Segment, char* s8_Path)
+{
+    sprintf(s8_Path, "%s/%08lX.LOG", LOG_FOLDER, (unsigned long)u32_Segment);
+}
+
+// returns the number of days since 1.1.1970 (proleptic Gregorian calendar, valid for all years after 0)
+int32_t EventLog::DaysFromCivil(int32_t s32_Year, uint32_t u32_Month, uint32_t u32_Day)
+{
+    s32_Year -= (u32_Month <= 2) ? 1 : 0;
+    int32_t  s32_Era = s32_Year / 400;
+    uint32_t u32_YearOfEra = (uint32_t)(s32_Year - s32_Era * 400);
+    uint32_t u32_DayOfYear = (153 * (u32_Month > 2 ? u32_Month - 3 : u32_Month + 9) + 2) / 5 + u32_Day - 1;
+    uint32_t u32_DayOfEra  = u32_YearOfEra * 365 + u32_YearOfEra / 4 - u32_YearOfEra / 100 + u32_DayOfYear;
+    return s32_Era * 146097 + (int32_t)u32_DayOfEra - 719468;
+}
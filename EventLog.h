@@ -0,0 +1,101 @@
+/**************************************************************************
+    class EventLog: An append-only log of all taps on the SD card.
+
+    The counters only tell how many coffees a card has taken, the log also tells when.
+    Each tap is stored as a record of LOG_RECORD_SIZE bytes (all values little endian):
+        UID (64 bit), timestamp in milliseconds (64 bit), sequence number (32 bit), flags (32 bit), data (32 bit), CRC32 of the first 28 bytes
+    The timestamp is Utils::GetMillis64(), the milliseconds since power on.
+    The Android app sends only the date with the secret key, not the time of day. SetDate() appends a date record
+    (UID LOG_DATE_ID, LOG_FLAG_DATE, data = days since 1.1.1970), the taps after it happened on that day or later.
+
+    The records are collected in RAM and written as one whole sector (LOG_RECORDS_PER_SECTOR records).
+    The sector that is not full yet is written again at the next flush. So a flush always costs one sector write,
+    no matter how many cards exist.
+
+    The log is split into segment files in the folder LOG_FOLDER ("00000001.LOG", "00000002.LOG", ...)
+    with LOG_SEGMENT_SECTORS sectors each. The last LOG_KEEP_SEGMENTS segments are kept with all details.
+    Older segments are compacted in the background: the taps are added to per card totals (a CounterDB) and
+    the segment file is deleted.
+    Each compaction step writes a journal with the new totals before they are stored in the database.
+    After a power failure the journal is applied again, so no tap is lost and no tap is counted twice.
+    The journal is written alternately into two slots, so a torn write never destroys the last valid journal.
+**************************************************************************/
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include "Utils.h"
+#include "CounterDB.h"
+
+#define LOG_FOLDER               "/EVENTS"
+#define LOG_JOURNAL_PATH         "/EVENTS/COMPACT.JNL"
+#define LOG_TOTALS_PATH          "/EVENTS/TOTALS.DB"
+
+#define LOG_JOURNAL_MAGIC        (0x4A43464Eu) // "NFCJ"
+#define LOG_JOURNAL_SLOT         (256u)
+
+#define LOG_RECORD_SIZE          (32u)
+#define LOG_SECTOR_SIZE          (512u)
+#define LOG_RECORDS_PER_SECTOR   (LOG_SECTOR_SIZE / LOG_RECORD_SIZE)
+// 64 sectors = 32 kB = 1024 taps per segment file
+#define LOG_SEGMENT_SECTORS      (64u)
+// The number of newest segments that are not compacted
+#define LOG_KEEP_SEGMENTS        (8u)
+
+// The records in RAM are written when the oldest one is older than this (milliseconds)
+#define LOG_FLUSH_INTERVAL       (5000u)
+// The interval in milliseconds in which Task() must be executed by the scheduler
+#define LOG_TASK_INTERVAL        (100u)
+// The interval in milliseconds between two compaction steps (one sector each)
+#define LOG_COMPACT_INTERVAL     (1000u)
+
+// Record flags (0x01 is not used)
+#define LOG_FLAG_REPLAYED        (0x02u) // the tap was counted while the SD card was missing, the timestamp is the time of the replay
+#define LOG_FLAG_DATE            (0x04u) // no tap: the date has been received at this time (see SetDate())
+
+// The UID of the date records (a card UID has max 7 bytes)
+#define LOG_DATE_ID              (0xFFFFFFFFFFFFFFFFull)
+
+class EventLog
+{
+public:
+    static bool Begin(void);
+    static bool Append(uint64_t u64_ID, uint32_t u32_Flags = 0, uint32_t u32_Data = 0);
+    static bool Flush(void);
+    static bool Resume(void);
+    static void Task(void);
+    static void SetDate(uint16_t u16_Year, byte u8_Month, byte u8_Day);
+    static bool CompactStep(void);
+    static uint32_t GetNextSeq(void);
+
+private:
+    static bool     LoadTail(void);
+    static bool     LoadJournal(void);
+    static bool     WriteJournal(bool b_Pending);
+    static bool     ApplyJournal(void);
+    static void     GetSegmentPath(uint32_t u32_Segment, char* s8_Path);
+    static int32_t  DaysFromCivil(int32_t s32_Year, uint32_t u32_Month, uint32_t u32_Day);
+
+    static CounterDB mi_Totals;
+    static byte      mu8_Tail[LOG_SECTOR_SIZE]; // the sector that is not yet full
+    static byte      mu8_TailCount;             // records in mu8_Tail
+    static bool      mb_TailDirty;              // mu8_Tail contains records that are not written yet
+    static uint32_t  mu32_TailSegment;
+    static uint32_t  mu32_TailSector;
+    static uint32_t  mu32_FirstDirty;           // tick when the oldest unwritten record was appended
+    static uint32_t  mu32_NextSeq;
+    static bool      mb_Ready;                  // Begin() was successful
+
+    // The compaction cursor and the journal of the current step
+    static uint32_t  mu32_CompactSegment;
+    static uint32_t  mu32_CompactSector;
+    static uint32_t  mu32_CompactSeq;           // the highest sequence number that has been compacted
+    static uint32_t  mu32_LastCompact;          // tick of the last compaction step
+    static uint32_t  mu32_JournalStep;          // incremented with each journal write, selects the journal slot
+    static bool      mb_JournalPending;         // the journal has not yet been applied to the totals
+    static byte      mu8_JournalCount;
+    static uint64_t  mu64_JournalID   [LOG_RECORDS_PER_SECTOR];
+    static uint32_t  mu32_JournalTotal[LOG_RECORDS_PER_SECTOR];
+};
+
+#endif // EVENTLOG_H
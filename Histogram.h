@@ -0,0 +1,26 @@
+/**************************************************************************
+    kLatencyHistogram: A fixed size logarithmic histogram of durations.
+    It is filled with Utils::HistogramAdd() and evaluated with Utils::HistogramPercentile().
+    This header has no dependencies so it can be used by the PN532 driver and by Utils.
+**************************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <Arduino.h>
+
+// The number of bins of a kLatencyHistogram.
+// Bin N counts durations below 2^(N + HISTOGRAM_SHIFT) microseconds (bin 0: < 32 us, bin 14: < 524 ms).
+// The last bin counts all longer durations.
+#define HISTOGRAM_BINS    (16u)
+#define HISTOGRAM_SHIFT   (5u)
+
+// A logarithmic histogram of durations with a fixed size (no allocation)
+struct kLatencyHistogram
+{
+    uint32_t u32_Bins[HISTOGRAM_BINS];
+    uint32_t u32_Samples;  // total number of durations added
+    uint32_t u32_Max;      // the longest duration in microseconds
+};
+
+#endif // HISTOGRAM_H
@@ -19,6 +19,12 @@
 
 #include "UserManager.h"
 #include "Utils.h"
+#include "Scheduler.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "EventLog.h"
+#include "TapBuffer.h"
+#include "SDCard.h"
 
 // This is the most important switch: It defines if you want to use Mifare Classic or Desfire EV1 cards.
 // If you set this define to false the users will only be identified by the UID of a Mifare Classic or Desfire card.
@@ -41,9 +47,23 @@
 // IMPORTANT: Before changing this compiler switch, please execute the RESTORE command on all personalized cards!
 #define USE_AES   false
 
+// If this switch is true the PN532 scans the RF field autonomously (InAutoPoll).
+// The host does not send a command each PN532_POLL_INTERVAL, it only checks if the PN532 has a result.
+// If it is false each poll sends an InListPassiveTarget command.
+#define USE_AUTOPOLL   true
+
+// The number of polls the PN532 does before it reports that no card was found
+// and the time between two polls in units of 150 ms. (2 * 150 ms = card removal is detected after 300 ms)
+#define AUTOPOLL_COUNT    2
+#define AUTOPOLL_PERIOD   1
+
 // This Arduino / Teensy pin is connected to the PN532 RSTPDN pin (reset the PN532)
 // When a communication error with the PN532 is detected the board is reset automatically.
 #define RESET_PIN         16
+// This pin is connected to the PN532 IRQ pin (response ready).
+// Set PN532_NO_IRQ if the IRQ line is not connected. Then the ready status is polled via SPI.
+// On the Wemos D1 mini the only free pin is RX (3) which can be used when STD_PRINT_EN is not defined.
+#define IRQ_PIN           PN532_NO_IRQ
 // The software SPI SCK  pin (Clock)
 #define SPI_CLK_PIN       14
 // The software SPI MISO pin (Master In, Slave Out)
@@ -58,9 +78,23 @@
 
 #define LED_OFF (0u)
 
+// The interval in milliseconds in which the RF field is checked for a new card.
+// This is the worst case latency until a card is detected.
+#define PN532_POLL_INTERVAL   (20u)
+// The interval in milliseconds between two frames of the coffee cup animation
+#define ANIMATION_INTERVAL    (100u)
+// The interval in milliseconds in which the LED flashes shortly while the reader works and no card is present
+#define HEARTBEAT_INTERVAL    (1000u)
+// While the SD card is missing it is mounted again after SD_REMOUNT_MIN milliseconds.
+// The interval is doubled after each failed attempt up to SD_REMOUNT_MAX.
+#define SD_REMOUNT_MIN        (1000u)
+#define SD_REMOUNT_MAX        (60000u)
+
 typedef enum {
 	CARD_READ,
 	UPLOAD_DATA,
+	UPLOAD_WAIT,      // wait for the WiFi client (also to resume an interrupted transfer)
+	UPLOAD_TRANSFER,  // send the counters to the WiFi client
 	BACKUP_DATA,
 	SDCARD_ERROR
 } SM_t;
@@ -78,6 +112,42 @@ bool		gb_InitSuccess  = false; // true if the PN532 has been initialized success
 SM_t		gSMCurrentState = CARD_READ;
 kUser		k_User;
 kCard		k_Card;
+bool		gb_FieldEmpty   = false; // true if no card was found in the RF field by the last poll
+
+// How often each tier of RecoverReader() has been executed and how often it was successful
+struct kRecoveryStats
+{
+    uint32_t u32_Resync;      // tier 1: abort the command and resynchronize the frame
+    uint32_t u32_ResyncOK;
+    uint32_t u32_SoftInit;    // tier 2: wake up and configure again without reset
+    uint32_t u32_SoftInitOK;
+    uint32_t u32_HardReset;   // tier 3: hardware reset (> 420 ms)
+    uint32_t u32_HardResetOK;
+};
+kRecoveryStats gk_Recovery;
+
+// Scheduler task handles
+byte		gu8_TaskStateMachine = SCHED_NO_TASK;
+byte		gu8_TaskAnimation    = SCHED_NO_TASK;
+byte		gu8_TaskLED          = SCHED_NO_TASK;
+byte		gu8_TaskFlush        = SCHED_NO_TASK;
+byte		gu8_TaskEventLog     = SCHED_NO_TASK;
+byte		gu8_TaskRecovery     = SCHED_NO_TASK;
+byte		gu8_TaskRemount      = SCHED_NO_TASK;
+byte		gu8_TaskTapBuffer    = SCHED_NO_TASK;
+
+uint32_t	gu32_RemountDelay = SD_REMOUNT_MIN; // milliseconds until the next attempt to mount the SD card
+bool		gb_SDErrorShown   = false;          // the SD error screen is displayed
+uint32_t	gu32_HeartbeatFrames = 0;           // animation frames since the last heartbeat flash
+
+// The LED pattern which is currently played by LEDTask()
+const uint16_t*	gpu16_LEDPattern = NULL;
+byte			gu8_LEDSteps     = 0;
+byte			gu8_LEDStep      = 0;
+uint16_t		gu16_FlashPattern[1];
+
+// The LED / buzzer pattern played after a coffee has been saved (on, off, on) in milliseconds
+const uint16_t	gu16_SavedPattern[] = { 150, 100, 150 };
 
 void SetLED(uint8_t e_LED)
 {
@@ -104,6 +174,31 @@ void SetLED(uint8_t e_LED)
 #endif
 }
 
+// Plays an LED pattern without blocking.
+// pu16_Pattern contains the durations in milliseconds, alternating LED on and LED off, starting with LED on.
+// A pattern that is still playing is replaced.
+void PlayLED(const uint16_t* pu16_Pattern, byte u8_Steps)
+{
+    gpu16_LEDPattern = pu16_Pattern;
+    gu8_LEDSteps     = u8_Steps;
+    gu8_LEDStep      = 0;
+    Scheduler::Start(gu8_TaskLED);
+}
+
+// Executed by the scheduler each time the current step of the LED pattern has elapsed
+void LEDTask(void)
+{
+    if (gu8_LEDStep >= gu8_LEDSteps)
+    {
+        SetLED(LOW);
+        return;
+    }
+
+    SetLED((gu8_LEDStep & 1) ? LOW : HIGH);
+    Scheduler::Start(gu8_TaskLED, gpu16_LEDPattern[gu8_LEDStep]);
+    gu8_LEDStep ++;
+}
+
 // If everything works correctly, the green LED will flash shortly (20 ms).
 // If the LED does not flash permanently this means that there is a severe error.
 // Additionally the LED will flash long (for 1 second) when the door is opened.
@@ -111,17 +206,131 @@ void SetLED(uint8_t e_LED)
 // The red LED shows a communication error with the PN532 (flash very slow),
 // or someone not authorized trying to open the door (flash for 1 second)
 // or on power failure the red LED flashes shortly.
+// This function does not block. The LED is switched off by LEDTask().
 void FlashLED(uint8_t e_LED, int s32_Interval)
 {
 #ifdef NO_BUZZER
-    SetLED(HIGH);
+    gu16_FlashPattern[0] = s32_Interval;
+    PlayLED(gu16_FlashPattern, 1);
 #endif
-    LongDelay(s32_Interval);
-#ifdef NO_BUZZER
-    SetLED(LOW);
+}
+
+// Switches the state machine to a new state and adapts the period of StateMachineTask()
+void SetState(SM_t e_State)
+{
+#if CACHE_FLUSH_ON_STATE
+    // Write all counters before a new state is entered. If this fails the SD card is not usable.
+    if (e_State != gSMCurrentState && (!CounterCache::Flush() || !EventLog::Flush()))
+        e_State = SDCARD_ERROR;
 #endif
+
+    if (e_State == SDCARD_ERROR && gSMCurrentState != SDCARD_ERROR)
+    {
+        // Count the coffees in the TapBuffer until SDRemountTask() has mounted the SD card again
+        TapBuffer::Capture();
+        Scheduler::Stop(gu8_TaskRecovery);
+        gu32_RemountDelay = SD_REMOUNT_MIN;
+        Scheduler::Start(gu8_TaskRemount, gu32_RemountDelay);
+    }
+
+    gSMCurrentState = e_State;
+    switch (e_State)
+    {
+        case CARD_READ:
+        case SDCARD_ERROR:
+            Scheduler::SetPeriod(gu8_TaskStateMachine, PN532_POLL_INTERVAL);
+            break;
+        default:
+            Scheduler::SetPeriod(gu8_TaskStateMachine, 1);
+            break;
+    }
+    // Execute the new state immediately
+    Scheduler::Start(gu8_TaskStateMachine);
 }
 
+// Checks the counter database after boot, one sector per call, and repairs torn records.
+// The task stops itself when all records have been checked.
+void DBRecoveryTask(void)
+{
+    if (!gi_CounterDB.RecoveryStep())
+        return;
+
+#ifdef STD_PRINT_EN
+    char Buf[80];
+    sprintf(Buf, "Counter database checked: %u cards, %u corrupt\r\n",
+            (unsigned)gi_CounterDB.GetUsed(), (unsigned)gi_CounterDB.GetCorrupt());
+    Utils::Print(Buf);
+#endif
+    Scheduler::Stop(gu8_TaskRecovery);
+}
+
+// Animates the coffee cup while no card is in the RF field.
+// While the SD card is missing the SD error screen is displayed instead.
+// Every HEARTBEAT_INTERVAL the LED flashes shortly unless a pattern is playing.
+void AnimationTask(void)
+{
+    if (gSMCurrentState == CARD_READ && gb_InitSuccess && gb_FieldEmpty)
+    {
+        OLEDScreen::ShowNFCRF();
+    }
+    else if (gSMCurrentState == SDCARD_ERROR && gb_FieldEmpty && !gb_SDErrorShown)
+    {
+        OLEDScreen::ShowSDError();
+        gb_SDErrorShown = true;
+    }
+
+    if ((gSMCurrentState == CARD_READ || gSMCurrentState == SDCARD_ERROR) && gb_FieldEmpty)
+    {
+        if (++gu32_HeartbeatFrames >= HEARTBEAT_INTERVAL / ANIMATION_INTERVAL && !Scheduler::IsActive(gu8_TaskLED))
+        {
+            // Flash the green LED shortly. On Power Failure flash the red LED shortly.
+            FlashLED(LED_BUILTIN, 100);
+            gu32_HeartbeatFrames = 0;
+        }
+    }
+}
+
+// Mounts the SD card, finishes the interrupted work of the last session
+// and writes the coffees that have been counted while the SD card was missing.
+// returns false if the SD card is not available
+bool MountSD(void)
+{
+    // The files that have been opened on the old mount are invalid
+    gi_CounterDB.Close();
+    SDCard::Close(&root);
+
+    if (!SDCard::Begin(SD_CHIP_SELECT))
+        return false;
+
+    root = SDCard::Open("/");
+
+    // Move the counters of the old one-file-per-card storage into the counter database,
+    // finish an interrupted compaction of the event log and an interrupted backup
+    return gi_CounterDB.MigrateLegacy(root) && EventLog::Resume() && Utils::FinishBackup() && TapBuffer::Replay();
+}
+
+// Executed by the scheduler while the SD card is missing (SDCARD_ERROR state).
+// The interval between two attempts is doubled each time up to SD_REMOUNT_MAX.
+void SDRemountTask(void)
+{
+    if (!MountSD())
+    {
+        gu32_RemountDelay *= 2;
+        if (gu32_RemountDelay > SD_REMOUNT_MAX)
+            gu32_RemountDelay = SD_REMOUNT_MAX;
+        Scheduler::Start(gu8_TaskRemount, gu32_RemountDelay);
+        return;
+    }
+
+#ifdef STD_PRINT_EN
+    Utils::Print("The SD card has been mounted again\r\n");
+#endif
+    OLEDScreen::ShowReady();
+    OLEDScreen::ShowNFCRF();
+    SetState(CARD_READ);
+    // The counter database has been opened again
+    Scheduler::Start(gu8_TaskRecovery);
+}
 
 // Reset the PN532 chip and initialize, set gb_InitSuccess = true on success
 void InitReader(bool b_ShowError)
@@ -179,6 +388,59 @@ void InitReader(bool b_ShowError)
 }
 
 
+// Configures the PN532 after a wake up without reading the firmware version again (the cached info is used)
+// returns true on success
+bool SoftInitReader(void)
+{
+    byte IC, VersionHi, VersionLo, Flags;
+    if (!gi_PN532.GetCachedFirmware(&IC, &VersionHi, &VersionLo, &Flags))
+        return false; // never initialized successfully -> a hard reset is required
+
+    gi_PN532.WakeUp();
+    return gi_PN532.SetPassiveActivationRetries() && gi_PN532.SamConfig();
+}
+
+// Recovers from a communication error with the PN532.
+// The tiers are tried from the fastest to the slowest until one succeeds:
+// 1.) Resync: abort the command, drain the pending frame, verify with GetFirmwareVersion (a few ms)
+// 2.) Soft init: wake up and send SetPassiveActivationRetries + SamConfig again (no reset)
+// 3.) Hard reset: InitReader() (RSTPDN low for 400 ms)
+void RecoverReader(void)
+{
+#ifdef STD_PRINT_EN
+    Utils::Print("Communication Error -> Recover PN532\r\n");
+#endif
+
+    gk_Recovery.u32_Resync ++;
+    if (gi_PN532.Resync())
+    {
+        gk_Recovery.u32_ResyncOK ++;
+    }
+    else
+    {
+        gk_Recovery.u32_SoftInit ++;
+        if (SoftInitReader())
+        {
+            gk_Recovery.u32_SoftInitOK ++;
+        }
+        else
+        {
+            gk_Recovery.u32_HardReset ++;
+            InitReader(true);
+            if (gb_InitSuccess) gk_Recovery.u32_HardResetOK ++;
+        }
+    }
+
+#ifdef STD_PRINT_EN
+    char Buf[100];
+    sprintf(Buf, "Recovery: resync %u/%u, soft init %u/%u, hard reset %u/%u\r\n",
+            (unsigned)gk_Recovery.u32_ResyncOK,    (unsigned)gk_Recovery.u32_Resync,
+            (unsigned)gk_Recovery.u32_SoftInitOK,  (unsigned)gk_Recovery.u32_SoftInit,
+            (unsigned)gk_Recovery.u32_HardResetOK, (unsigned)gk_Recovery.u32_HardReset);
+    Utils::Print(Buf);
+#endif
+}
+
 void setup()
 {
     gs8_CommandBuffer[0] = 0;
@@ -192,55 +454,109 @@ void setup()
 
     OLEDScreen::Initialize();
 
-    if (!SD.begin(SD_CHIP_SELECT)) {
+    gu8_TaskStateMachine = Scheduler::AddTask(StateMachineTask, PN532_POLL_INTERVAL, PN532_POLL_INTERVAL);
+    gu8_TaskAnimation    = Scheduler::AddTask(AnimationTask,    ANIMATION_INTERVAL);
+    gu8_TaskLED          = Scheduler::AddTask(LEDTask,          SCHED_ONE_SHOT);
+    gu8_TaskFlush        = Scheduler::AddTask(CounterCache::FlushTask, CACHE_TASK_INTERVAL);
+    gu8_TaskEventLog     = Scheduler::AddTask(EventLog::Task,       LOG_TASK_INTERVAL);
+    gu8_TaskRecovery     = Scheduler::AddTask(DBRecoveryTask,       DB_RECOVERY_INTERVAL);
+    gu8_TaskRemount      = Scheduler::AddTask(SDRemountTask,        SCHED_ONE_SHOT);
+    gu8_TaskTapBuffer    = Scheduler::AddTask(TapBuffer::Task,      TAPBUF_TASK_INTERVAL);
+
+    // The coffees that have been counted while the SD card was missing before the reset
+    TapBuffer::Begin();
+
+    if (!MountSD()) {
     	OLEDScreen::ShowSDError();
-    	gSMCurrentState = SDCARD_ERROR;
+    	gb_SDErrorShown = true;
+    	SetState(SDCARD_ERROR);
     } else {
 		OLEDScreen::ShowReady();
 		OLEDScreen::ShowNFCRF();
     }
 
-    root = SD.open("/");
-
-    gi_PN532.InitHardwareSPI(SPI_CS_PIN, RESET_PIN);
+    gi_PN532.InitHardwareSPI(SPI_CS_PIN, RESET_PIN, IRQ_PIN);
 
     Utils::SetPinMode(LED_BUILTIN,   OUTPUT);
 //    FlashLED(LED_BUILTIN, 500);
 
     InitReader(false);
+
+    Scheduler::Start(gu8_TaskStateMachine);
+    Scheduler::Start(gu8_TaskAnimation);
+    Scheduler::Start(gu8_TaskFlush);
+    Scheduler::Start(gu8_TaskEventLog);
+    Scheduler::Start(gu8_TaskTapBuffer);
+    if (gSMCurrentState != SDCARD_ERROR)
+        Scheduler::Start(gu8_TaskRecovery);
 }
 
 void loop()
+{
+    Scheduler::Run();
+}
+
+// Executed by the scheduler every PN532_POLL_INTERVAL in CARD_READ state, every millisecond in the other states.
+// The upload states poll the WiFi client in each tick and never block.
+void StateMachineTask(void)
 {
     	switch (gSMCurrentState) {
 			case CARD_READ:
+				if (CounterCache::HasError())
+				{
+					// A counter could not be written in the background
+					SetState(SDCARD_ERROR);
+					break;
+				}
 				SM_CardReading();
 				break;
 
 			case UPLOAD_DATA:
-		    	/* state machine wait for TCP clients */
 				OLEDScreen::ShowWiFi();
 				WLAN::Initialize();
 				FlashLED(LED_BUILTIN, 1000);
-				if(true == WLAN::StartTCP())
+				WLAN::BeginWait();
+				SetState(UPLOAD_WAIT);
+				break;
+
+			case UPLOAD_WAIT:
+		    	/* state machine wait for TCP clients */
+				switch (WLAN::PollClient())
 				{
-					OLEDScreen::ShowDT();
-					if(true == WLAN::StartTransffer())
-					{
-						gSMCurrentState = BACKUP_DATA;
-					}
-					else
-					{
-						gSMCurrentState = CARD_READ;
+					case WLAN_DONE:
+						OLEDScreen::ShowDT();
+						WLAN::BeginTransfer();
+						SetState(UPLOAD_TRANSFER);
+						break;
+					case WLAN_FAILED:
+						SetState(CARD_READ);
 						WLAN::ZeroInit();
-					}
+						OLEDScreen::ShowReady();
+						OLEDScreen::ShowNFCRF();
+						break;
+					default:
+						break;
 				}
-				else
+				break;
+
+			case UPLOAD_TRANSFER:
+				switch (WLAN::PollTransfer())
 				{
-					gSMCurrentState = CARD_READ;
-					WLAN::ZeroInit();
-					OLEDScreen::ShowReady();
-					OLEDScreen::ShowNFCRF();
+					case WLAN_DONE:
+						SetState(BACKUP_DATA);
+						break;
+					case WLAN_INTERRUPTED:
+						/* The access point stays on, so the client can connect again and resume the transfer */
+						OLEDScreen::ShowWiFi();
+						WLAN::BeginWait(true);
+						SetState(UPLOAD_WAIT);
+						break;
+					case WLAN_FAILED:
+						SetState(CARD_READ);
+						WLAN::ZeroInit();
+						break;
+					default:
+						break;
 				}
 				break;
 
@@ -251,20 +567,19 @@ void loop()
 				if(true == Utils::Backup_Data())
 				{
 #endif
-					gSMCurrentState = CARD_READ;
+					SetState(CARD_READ);
 #ifndef SKIP_BACKUP
 				}
 				else
 				{
-					gSMCurrentState = SDCARD_ERROR;
+					SetState(SDCARD_ERROR);
 				}
 #endif
 				break;
 
 			case SDCARD_ERROR:
-				/* wait for RESET */
-		    	OLEDScreen::ShowSDError();
-		    	FlashLED(LED_BUILTIN, 5000);
+				/* The coffees are counted in the TapBuffer until SDRemountTask() has mounted the SD card again */
+				SM_CardReading();
 				break;
 
 			default:
@@ -276,6 +591,9 @@ void loop()
 // CARD_READ handling function
 void SM_CardReading(void)
 {
+	bool b_FieldEmpty = gb_FieldEmpty;
+	gb_FieldEmpty = false;
+
 	if (!gb_InitSuccess)
 	{
 		InitReader(true); // flash red LED for 2.4 seconds
@@ -283,20 +601,24 @@ void SM_CardReading(void)
 	}
 	else if (!ReadCard(k_User.ID.u8, &k_Card))
 	{
-		if (k_Card.b_PN532_Error) // Another error from PN532 -> reset the chip
+		if (k_Card.b_PN532_Error) // Another error from PN532 -> recover, reset the chip only if required
 		{
 			//Utils::Print(" some error ");
-			InitReader(true); // flash red LED for 2.4 seconds
+			RecoverReader();
 		}
 	}
+	else if (k_Card.b_Pending)
+	{
+		// The PN532 is still polling - Nothing to do
+		gb_FieldEmpty = b_FieldEmpty;
+	}
 	else if (k_Card.u8_UidLength == 0)
 	{
 		// No card present in the RF field
 		gu64_LastID = 0;
+		gb_FieldEmpty = true;
 
-		// Flash the green LED shortly. On Power Failure flash the red LED shortly.
-		FlashLED(LED_BUILTIN, 100);
-		OLEDScreen::ShowNFCRF();
+		// The OLED animation and the LED heartbeat are done by AnimationTask()
 	}
 	else if (gu64_LastID == k_User.ID.u64)
 	{
@@ -307,7 +629,9 @@ void SM_CardReading(void)
 	{
 		/*0x000000BB36AB22ULL - MASTER key found*/
 		/*0x000000651B121CULL - ALT_MASTER key found*/
-		gSMCurrentState = UPLOAD_DATA;
+		/* The data cannot be uploaded while the SD card is missing */
+		if (gSMCurrentState == CARD_READ)
+			SetState(UPLOAD_DATA);
 	}
 	else
 	{
@@ -317,16 +641,21 @@ void SM_CardReading(void)
 		// A different card was found in the RF field
 		if(Utils::UpdateSDCardCounter(k_User.ID.u64, &k_Card, 0))
 		{
-			// Avoid that the card is read twice when the card remain in the RF field for a longer time.
-			gu64_LastID = k_User.ID.u64;
-			//FlashLED(LED_BUILTIN, 200);
+			PlayLED(gu16_SavedPattern, sizeof(gu16_SavedPattern) / sizeof(gu16_SavedPattern[0]));
 		}
-		else
+		// Avoid that the card is read twice when the card remain in the RF field for a longer time.
+		gu64_LastID = k_User.ID.u64;
+		gb_SDErrorShown = false;
+
+		if (TapBuffer::IsActive() && gSMCurrentState == CARD_READ)
 		{
-			// Error writing to SD Card - switch to SD Card error
-			gSMCurrentState = SDCARD_ERROR;
+			// The SD card has failed - count the coffees in the TapBuffer until it has been mounted again
+			SetState(SDCARD_ERROR);
 		}
 	}
+
+	// The dirty counters are written while nobody is at the machine
+	CounterCache::SetIdle(gb_FieldEmpty);
 }
 
 // Reads the card in the RF field.
@@ -334,27 +663,38 @@ void SM_CardReading(void)
 // ATTENTION: If no card is present, this function returns true. This is not an error. (check that pk_Card->u8_UidLength > 0)
 // pk_Card->u8_KeyVersion is > 0 if a random ID card did a valid authentication with SECRET_PICC_MASTER_KEY
 // pk_Card->b_PN532_Error is set true if the error comes from the PN532.
+// pk_Card->b_Pending is set true in auto poll mode if the PN532 has no result yet.
 bool ReadCard(byte u8_UID[8], kCard* pk_Card)
 {
     memset(pk_Card, 0, sizeof(kCard));
 
-    if (!gi_PN532.ReadPassiveTargetID(u8_UID, &pk_Card->u8_UidLength, &pk_Card->e_CardType))
+#if USE_AUTOPOLL
+    // The generic type finds all ISO14443A cards at 106 kbps (Desfire, Mifare Classic and Ultralight).
+    // The Mifare type alone would not report the Desfire cards.
+    static const byte u8_Types[] = { PN532_AUTOPOLL_GENERIC_106K };
+
+    if (!gi_PN532.IsAutoPolling())
+    {
+        if (!gi_PN532.StartAutoPoll(AUTOPOLL_COUNT, AUTOPOLL_PERIOD, u8_Types, sizeof(u8_Types)))
+        {
+            pk_Card->b_PN532_Error = true;
+            return false;
+        }
+    }
+
+    bool b_Done;
+    if (!gi_PN532.CheckAutoPoll(u8_UID, &pk_Card->u8_UidLength, &pk_Card->e_CardType, &b_Done))
     {
         pk_Card->b_PN532_Error = true;
         return false;
     }
-    return true;
-}
-
-void LongDelay(int s32_Interval)
-{
-	#define min(a,b) ((a)<(b)?(a):(b))
-
-    while(s32_Interval > 0)
+    pk_Card->b_Pending = !b_Done;
+#else
+    if (!gi_PN532.ReadPassiveTargetID(u8_UID, &pk_Card->u8_UidLength, &pk_Card->e_CardType))
     {
-        int s32_Delay = s32_Interval;
-        s32_Delay = min(100, s32_Interval);
-        Utils::DelayMilli(s32_Delay);
-        s32_Interval -= s32_Delay;
+        pk_Card->b_PN532_Error = true;
+        return false;
     }
+#endif
+    return true;
 }
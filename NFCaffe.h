@@ -12,9 +12,8 @@
 #include "Utils.h"
 
 void SM_CardReading(void);
-void LongDelay(int s32_Interval);
+void StateMachineTask(void);
+void PlayLED(const uint16_t* pu16_Pattern, byte u8_Steps);
 bool ReadCard(byte u8_UID[8], kCard* pk_Card);
-void GetSDCounterForCard(char* fileName, uint16_t * u16_noOfCoffees);
-void UpdateSDCardCounter(uint64_t u64_ID, kCard* pk_Card, uint64_t u64_StartTick);
 
 #endif /* NFCAFFE_H_ */
@@ -47,6 +47,8 @@
 #include "PN532.h"
 #include "Utils.h"
 
+volatile bool PN532::mb_IrqPending = false;
+
 /**************************************************************************
     Constructor
 **************************************************************************/
@@ -57,7 +59,23 @@ PN532::PN532()
     mu8_MosiPin    = 0;  
     mu8_SselPin    = 0;  
     mu8_ResetPin   = 0;
+    mu8_IrqPin     = PN532_NO_IRQ;
     mu8_DebugLevel = 0;
+    mu16_SelectDelay = PN532_SPI_SELECT_DELAY;
+    mu16_ByteDelay   = PN532_SPI_BYTE_DELAY;
+    mb_AutoPolling   = false;
+    mb_FirmwareValid = false;
+    memset(mu8_Firmware, 0, sizeof(mu8_Firmware));
+    mu8_LastCommand  = 0;
+    mb_WaitAck       = false;
+    mu8_QueueHead    = 0;
+    mu8_QueueCount   = 0;
+    me_AsyncState    = ASYNC_IDLE;
+    mu32_NextCheck   = 0;
+    mu32_Backoff     = PN532_READY_MIN_BACKOFF;
+    mb_SyncDone      = false;
+    mu8_SyncLen      = 0;
+    ClearReadyStats();
 }
 
 /**************************************************************************
@@ -101,14 +119,33 @@ PN532::PN532()
     Initializes for hardware SPI uage.
     param  sel       SPI chip select pin (CS/SSEL)
     param  reset     Location of the RSTPD_N pin
+    param  irq       Location of the IRQ pin (optional)
+                     If the IRQ line is connected the PN532 signals a ready response with a falling edge.
+                     This avoids polling the status byte via SPI.
 **************************************************************************/
-void PN532::InitHardwareSPI(byte u8_Sel, byte u8_Reset)
+void PN532::InitHardwareSPI(byte u8_Sel, byte u8_Reset, byte u8_Irq)
 {
 	mu8_SselPin  = u8_Sel;
 	mu8_ResetPin = u8_Reset;
+	mu8_IrqPin   = u8_Irq;
 
 	Utils::SetPinMode(mu8_ResetPin, OUTPUT);
 	Utils::SetPinMode(mu8_SselPin,  OUTPUT);
+
+	if (mu8_IrqPin != PN532_NO_IRQ)
+	{
+		Utils::SetPinMode(mu8_IrqPin, INPUT_PULLUP);
+		Utils::AttachInterrupt(mu8_IrqPin, IrqHandler, FALLING);
+	}
+}
+
+/**************************************************************************
+    Interrupt handler for the IRQ line.
+    The PN532 pulls IRQ low when a response (ACK or data) is ready to be read.
+**************************************************************************/
+void ICACHE_RAM_ATTR PN532::IrqHandler()
+{
+    mb_IrqPending = true;
 }
 
 /**************************************************************************
@@ -120,13 +157,25 @@ void PN532::begin()
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** begin()\r\n");
 #endif
 
+    // The reset aborts any command that the PN532 is executing
+    ClearQueue();
+
     Utils::WritePin(mu8_ResetPin, HIGH);
     Utils::DelayMilli(10);
     Utils::WritePin(mu8_ResetPin, LOW);
     Utils::DelayMilli(400);
     Utils::WritePin(mu8_ResetPin, HIGH);
     Utils::DelayMilli(10);  // Small delay required before taking other actions after reset. See datasheet section 12.23, page 209.
-  
+
+    WakeUp();
+}
+
+/**************************************************************************
+    Wake up the PN532 and start communication without a hardware reset.
+    Used by begin() and for a soft re-initialization after a communication error.
+**************************************************************************/
+void PN532::WakeUp()
+{
     #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
         #if USE_HARDWARE_SPI
@@ -162,6 +211,19 @@ void PN532::SetDebugLevel(byte level)
     mu8_DebugLevel = level;
 }
 
+/**************************************************************************
+    Sets the SPI timing profile.
+    u16_SelectDelay = microseconds to wait after pulling SSEL low
+    u16_ByteDelay   = microseconds to wait between two bytes of a frame.
+                      0 = transfer the whole frame in one burst (fastest)
+                      Use a value > 0 only for marginal wiring.
+**************************************************************************/
+void PN532::SetSpiTiming(uint16_t u16_SelectDelay, uint16_t u16_ByteDelay)
+{
+    mu16_SelectDelay = u16_SelectDelay;
+    mu16_ByteDelay   = u16_ByteDelay;
+}
+
 /**************************************************************************
     Gets the firmware version of the PN5xx chip
     returns:
@@ -178,10 +240,7 @@ bool PN532::GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo
 #endif
     
     mu8_PacketBuffer[0] = PN532_COMMAND_GETFIRMWAREVERSION;
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 1))
-        return 0;
-
-    byte len = ReadData(mu8_PacketBuffer, 13);
+    byte len = Transceive(1, 13);
     if (len != 6 || mu8_PacketBuffer[1] != PN532_COMMAND_GETFIRMWAREVERSION + 1)
     {
 #ifdef STD_PRINT_EN
@@ -194,6 +253,67 @@ bool PN532::GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo
     *pVersionHi = mu8_PacketBuffer[3];
     *pVersionLo = mu8_PacketBuffer[4];
     *pFlags     = mu8_PacketBuffer[5];    
+
+    // Cache the firmware info for a soft re-initialization (see GetCachedFirmware())
+    memcpy(mu8_Firmware, mu8_PacketBuffer + 2, 4);
+    mb_FirmwareValid = true;
+    return true;
+}
+
+/**************************************************************************
+    Returns the firmware info that has been read by the last successful GetFirmwareVersion()
+    without communicating with the PN532.
+    returns false if the firmware version has never been read.
+**************************************************************************/
+bool PN532::GetCachedFirmware(byte* pIcType, byte* pVersionHi, byte* pVersionLo, byte* pFlags)
+{
+    if (!mb_FirmwareValid)
+        return false;
+
+    *pIcType    = mu8_Firmware[0];
+    *pVersionHi = mu8_Firmware[1];
+    *pVersionLo = mu8_Firmware[2];
+    *pFlags     = mu8_Firmware[3];
+    return true;
+}
+
+/**************************************************************************
+    Fast recovery after a communication error without resetting the chip.
+    Sends an ACK frame which aborts the command that the PN532 is executing (chapter 6.2.1.3)
+    and discards a response that may still be pending.
+    Then the link is verified with GetFirmwareVersion(). If the firmware info is cached 
+    the answer must match the cached info.
+    returns true if the PN532 answers correctly.
+**************************************************************************/
+bool PN532::Resync()
+{
+#ifdef STD_PRINT_EN
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** Resync()\r\n");
+#endif
+
+    // The aborted commands are reported as failed
+    ClearQueue();
+
+    byte u8_Ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+    SendPacket(u8_Ack, sizeof(u8_Ack));
+
+    // Drain a frame that was already pending when the ACK arrived
+    byte u8_Drain[PN532_PACKBUFFSIZE];
+    for (byte i=0; i<3 && IsReady(); i++)
+    {
+        ReadPacket(u8_Drain, sizeof(u8_Drain));
+    }
+
+    byte u8_Cached[4];
+    bool b_Cached = GetCachedFirmware(&u8_Cached[0], &u8_Cached[1], &u8_Cached[2], &u8_Cached[3]);
+
+    byte IC, VersionHi, VersionLo, Flags;
+    if (!GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags))
+        return false;
+
+    if (b_Cached && (IC != u8_Cached[0] || VersionHi != u8_Cached[1] || VersionLo != u8_Cached[2]))
+        return false;
+
     return true;
 }
 
@@ -211,10 +331,7 @@ bool PN532::SamConfig(void)
     mu8_PacketBuffer[2] = 0x14; // timeout 50ms * 20 = 1 second
     mu8_PacketBuffer[3] = 0x01; // use IRQ pin!
   
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 4))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    byte len = Transceive(4, 9);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_SAMCONFIGURATION + 1)
     {
 #ifdef STD_PRINT_EN
@@ -240,10 +357,7 @@ bool PN532::SetPassiveActivationRetries()
     mu8_PacketBuffer[3] = 0x01; // MxRtyPSL (default = 0x01)
     mu8_PacketBuffer[4] = 3;    // one retry is enough for Mifare Classic but Desfire is slower (if you modify this, you must also modify PN532_TIMEOUT!)
     
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 5))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    byte len = Transceive(5, 9);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_RFCONFIGURATION + 1)
     {
 #ifdef STD_PRINT_EN
@@ -270,10 +384,7 @@ bool PN532::SwitchOffRfField()
     mu8_PacketBuffer[1] = 1; // Config item 1 (RF Field)
     mu8_PacketBuffer[2] = 0; // Field Off
     
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 3))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    byte len = Transceive(3, 9);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_RFCONFIGURATION + 1)
     {
 #ifdef STD_PRINT_EN
@@ -325,10 +436,7 @@ bool PN532::WriteGPIO(bool P30, bool P31, bool P33, bool P35)
     mu8_PacketBuffer[1] = PN532_GPIO_VALIDATIONBIT | pinState;  // P3 Pins
     mu8_PacketBuffer[2] = 0x00;                                 // P7 GPIO Pins (not used ... taken by SPI)
                     
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 3))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 9);
+    byte len = Transceive(3, 9);
     if (len != 2 || mu8_PacketBuffer[1] != PN532_COMMAND_WRITEGPIO + 1)
     {
 #ifdef STD_PRINT_EN
@@ -366,9 +474,6 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
     mu8_PacketBuffer[1] = 1;  // read data of 1 card (The PN532 can read max 2 targets at the same time)
     mu8_PacketBuffer[2] = CARD_TYPE_106KB_ISO14443A; // This function currently does not support other card types.
   
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 3))
-        return false; // Error (no valid ACK received or timeout)
-  
     /* 
     ISO14443A card response:
     mu8_PacketBuffer Description
@@ -384,13 +489,13 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
     nn               ATS Length     (Desfire only)
     nn..Length-1     ATS data bytes (Desfire only)
     */ 
-    byte len = ReadData(mu8_PacketBuffer, 28);
+    byte len = Transceive(3, 28);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INLISTPASSIVETARGET + 1)
     {
 #ifdef STD_PRINT_EN
         Utils::Print("ReadPassiveTargetID failed\r\n");
-        return false;
 #endif
+        return false;
     }   
 
     byte cardsFound = mu8_PacketBuffer[2]; 
@@ -404,8 +509,33 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
     if (cardsFound != 1)
         return true; // no card found -> this is not an error!
 
-    byte u8_IdLength = mu8_PacketBuffer[7];
-    if (u8_IdLength != 4 && u8_IdLength != 7)
+    return ParseTargetData(mu8_PacketBuffer + 3, len - 3, u8_UidBuffer, pu8_UidLength, pe_CardType);
+}
+
+/**************************************************************************
+    This function is private
+    Extracts the UID and the card type from the target data of an ISO14443A card.
+    The target data has the same layout in the response of InListPassiveTarget and InAutoPoll:
+    b0               Tag number (always 1)
+    b1,2             SENS_RES (ATQA = Answer to Request Type A)
+    b3               SEL_RES  (SAK  = Select Acknowledge)
+    b4               UID Length
+    b5..Length       UID (4 or 7 bytes)
+
+    returns true and *pu8_UidLength = 0 if the card is not supported (this is not an error)
+**************************************************************************/
+bool PN532::ParseTargetData(const byte* u8_Target, byte u8_TargetLen, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    if (u8_TargetLen < 5)
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("Target data too short\r\n");
+#endif
+        return false;
+    }
+
+    byte u8_IdLength = u8_Target[4];
+    if ((u8_IdLength != 4 && u8_IdLength != 7) || u8_TargetLen < 5 + u8_IdLength)
     {
 #ifdef STD_PRINT_EN
         Utils::Print("Card has unsupported UID length: ");
@@ -414,12 +544,12 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
         return true; // unsupported card found -> this is not an error!
     }   
 
-    memcpy(u8_UidBuffer, mu8_PacketBuffer + 8, u8_IdLength);    
+    memcpy(u8_UidBuffer, u8_Target + 5, u8_IdLength);    
     *pu8_UidLength = u8_IdLength;
 
     // See "Mifare Identification & Card Types.pdf" in the ZIP file
-    uint16_t u16_ATQA = ((uint16_t)mu8_PacketBuffer[4] << 8) | mu8_PacketBuffer[5];
-    byte     u8_SAK   = mu8_PacketBuffer[6];
+    uint16_t u16_ATQA = ((uint16_t)u8_Target[1] << 8) | u8_Target[2];
+    byte     u8_SAK   = u8_Target[3];
 
     if (u8_IdLength == 7 && u8_UidBuffer[0] != 0x80 && u16_ATQA == 0x0344 && u8_SAK == 0x20) *pe_CardType = CARD_Desfire;
     if (u8_IdLength == 4 && u8_UidBuffer[0] == 0x80 && u16_ATQA == 0x0304 && u8_SAK == 0x20) *pe_CardType = CARD_DesRandom;
@@ -451,6 +581,133 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
     return true;
 }
 
+/**************************************************************************
+    Starts the autonomous polling of the PN532 (InAutoPoll, chapter 7.3.13 in the manual).
+    The PN532 scans the RF field on its own and the host only talks to it when a target appears
+    or when all polls have been done without finding a target.
+    The command is queued in the asynchronous command engine, this function does not block.
+    Call CheckAutoPoll() periodically.
+
+    param u8_PollNr     Number of polling cycles (1...254), 0xFF = endless
+    param u8_Period     Time between two polls in units of 150 ms (1...15)
+    param u8_Types      The target types to poll for (e.g. PN532_AUTOPOLL_MIFARE)
+    param u8_TypeCount  Number of types (1...15)
+**************************************************************************/
+bool PN532::StartAutoPoll(byte u8_PollNr, byte u8_Period, const byte* u8_Types, byte u8_TypeCount)
+{
+#ifdef STD_PRINT_EN
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** StartAutoPoll()\r\n");
+#endif
+
+    if (mb_AutoPolling || u8_TypeCount < 1 || u8_TypeCount > 15)
+        return false;
+
+    byte u8_Cmd[3 + 15];
+    u8_Cmd[0] = PN532_COMMAND_INAUTOPOLL;
+    u8_Cmd[1] = u8_PollNr;
+    u8_Cmd[2] = u8_Period;
+    memcpy(u8_Cmd + 3, u8_Types, u8_TypeCount);
+
+    // The maximum time until the PN532 must respond
+    uint32_t u32_Timeout = PN532_WAIT_FOREVER;
+    if (u8_PollNr != 0xFF)
+        u32_Timeout = (uint32_t)u8_PollNr * u8_Period * u8_TypeCount * 150 + PN532_TIMEOUT;
+
+    memset(&mk_AutoPoll, 0, sizeof(mk_AutoPoll));
+    if (!Submit(u8_Cmd, 3 + u8_TypeCount, 40, AutoPollDone, this, u32_Timeout))
+        return false;
+
+    mb_AutoPolling = true;
+    return true;
+}
+
+/**************************************************************************
+    This function is private
+    Completion callback of the InAutoPoll command. Stores the result for CheckAutoPoll().
+
+    InAutoPoll response:
+    u8_Data          Description
+    -------------------------------------------------------
+    b0               D5 (always) (PN532_PN532TOHOST)
+    b1               61 (always) (PN532_COMMAND_INAUTOPOLL + 1)
+    b2               Amount of targets found
+    b3               Target type (e.g. PN532_AUTOPOLL_MIFARE)
+    b4               Length of the target data
+    b5..             Target data (see ParseTargetData())
+**************************************************************************/
+void PN532::AutoPollDone(void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len)
+{
+    PN532*       pi_This = (PN532*)p_Param;
+    kAutoPoll* pk_Result = &pi_This->mk_AutoPoll;
+
+    pk_Result->b_Done    = true;
+    pk_Result->b_Success = false;
+
+    if (!b_Success || u8_Len < 3 || u8_Data[1] != PN532_COMMAND_INAUTOPOLL + 1)
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("CheckAutoPoll failed\r\n");
+#endif
+        return;
+    }
+
+    pk_Result->b_Success = true;
+    if (u8_Data[2] < 1 || u8_Len < 5)
+        return; // no card found -> this is not an error!
+
+    byte u8_Type = u8_Data[3];
+    if (u8_Type != PN532_AUTOPOLL_GENERIC_106K && u8_Type != PN532_AUTOPOLL_MIFARE && u8_Type != PN532_AUTOPOLL_ISO14443_4A)
+        return; // unsupported card type -> this is not an error!
+
+    byte u8_TargetLen = u8_Data[4];
+    if (u8_TargetLen > u8_Len - 5)
+        u8_TargetLen = u8_Len - 5;
+
+    pk_Result->b_Success = pi_This->ParseTargetData(u8_Data + 5, u8_TargetLen, pk_Result->u8_Uid, &pk_Result->u8_UidLength, &pk_Result->e_CardType);
+}
+
+/**************************************************************************
+    Checks without blocking if the PN532 has finished the auto polling.
+
+    returns false on error (auto polling is stopped)
+    returns true and *pb_Done = false while the PN532 is still polling
+    returns true and *pb_Done = true when polling has finished. 
+        Then *pu8_UidLength = 0 if no card was found or *pu8_UidLength > 0 if a card has been read.
+        Call StartAutoPoll() again to continue polling.
+**************************************************************************/
+bool PN532::CheckAutoPoll(byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType, bool* pb_Done)
+{
+    *pb_Done       = false;
+    *pu8_UidLength = 0;
+    *pe_CardType   = CARD_Unknown;
+    memset(u8_UidBuffer, 0, 8);
+
+    if (!mb_AutoPolling)
+        return false;
+
+    Poll();
+    if (!mk_AutoPoll.b_Done)
+        return true; // still polling
+
+    mb_AutoPolling = false;
+    *pb_Done       = true;
+    if (!mk_AutoPoll.b_Success)
+        return false;
+
+    memcpy(u8_UidBuffer, mk_AutoPoll.u8_Uid, 8);
+    *pu8_UidLength = mk_AutoPoll.u8_UidLength;
+    *pe_CardType   = mk_AutoPoll.e_CardType;
+    return true;
+}
+
+/**************************************************************************
+    returns true while the PN532 is executing an InAutoPoll command
+**************************************************************************/
+bool PN532::IsAutoPolling()
+{
+    return mb_AutoPolling;
+}
+
 /**************************************************************************
     The goal of this command is to select the target. (Initialization, anti-collision loop and Selection)
     If the target is already selected, no action is performed and Status OK is returned. 
@@ -464,10 +721,7 @@ bool PN532::SelectCard()
     mu8_PacketBuffer[0] = PN532_COMMAND_INSELECT;
     mu8_PacketBuffer[1] = 1; // Target 1
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 10);
+    byte len = Transceive(2, 10);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INSELECT + 1)
     {
 #ifdef STD_PRINT_EN
@@ -497,10 +751,7 @@ bool PN532::DeselectCard()
     mu8_PacketBuffer[0] = PN532_COMMAND_INDESELECT;
     mu8_PacketBuffer[1] = 0; // Deselect all cards
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 10);
+    byte len = Transceive(2, 10);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INDESELECT + 1)
     {
 #ifdef STD_PRINT_EN
@@ -526,10 +777,7 @@ bool PN532::ReleaseCard()
     mu8_PacketBuffer[0] = PN532_COMMAND_INRELEASE;
     mu8_PacketBuffer[1] = 0; // Deselect all cards
 
-    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
-        return false;
-  
-    byte len = ReadData(mu8_PacketBuffer, 10);
+    byte len = Transceive(2, 10);
     if (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INRELEASE + 1)
     {
 #ifdef STD_PRINT_EN
@@ -701,6 +949,175 @@ bool PN532::CheckPN532Status(byte u8_Status)
     }
 }
 
+// ########################################################################
+// ####                  ASYNCHRONOUS COMMAND ENGINE                  #####
+// ########################################################################
+
+/**************************************************************************
+    Appends a command to the queue. It is executed by Poll() without blocking.
+    param  u8_Cmd       The command bytes (starting with PN532_COMMAND_XXX), they are copied.
+    param  u8_CmdLen    The command length (max PN532_MAX_CMD_LEN)
+    param  u8_RespLen   The number of bytes to read for the response (see ReadData())
+    param  pf_Callback  Called when the command has finished (may be NULL)
+                        The response is valid only during the callback.
+    param  p_Param      Passed to the callback
+    param  u32_Timeout  Milliseconds to wait for the response, 0 = PN532_TIMEOUT, PN532_WAIT_FOREVER = endless
+
+    returns false if the queue is full
+**************************************************************************/
+bool PN532::Submit(const byte* u8_Cmd, byte u8_CmdLen, byte u8_RespLen, PN532Callback pf_Callback, void* p_Param, uint32_t u32_Timeout)
+{
+    if (mu8_QueueCount >= PN532_QUEUE_SIZE || u8_CmdLen < 1 || u8_CmdLen > PN532_MAX_CMD_LEN)
+        return false;
+
+    kRequest* pk_Req = &mk_Queue[(mu8_QueueHead + mu8_QueueCount) % PN532_QUEUE_SIZE];
+    memcpy(pk_Req->u8_Cmd, u8_Cmd, u8_CmdLen);
+    pk_Req->u8_CmdLen   = u8_CmdLen;
+    pk_Req->u8_RespLen  = u8_RespLen;
+    pk_Req->u32_Timeout = (u32_Timeout == 0) ? PN532_TIMEOUT : u32_Timeout;
+    pk_Req->pf_Callback = pf_Callback;
+    pk_Req->p_Param     = p_Param;
+
+    mu8_QueueCount ++;
+    return true;
+}
+
+/**************************************************************************
+    Advances the command engine without blocking.
+    Sends the next queued command, checks if the ACK or the response is ready
+    and calls the completion callback.
+    This function must be called periodically while IsBusy() returns true.
+    returns true while commands are pending.
+**************************************************************************/
+bool PN532::Poll()
+{
+    while (mu8_QueueCount > 0)
+    {
+        kRequest* pk_Req = &mk_Queue[mu8_QueueHead];
+
+        if (me_AsyncState == ASYNC_IDLE)
+        {
+            WriteCommand(pk_Req->u8_Cmd, pk_Req->u8_CmdLen);
+            me_AsyncState = ASYNC_WAIT_ACK;
+            BeginReadyWait();
+        }
+
+        if (!CheckReady())
+        {
+            uint32_t u32_Timeout = (me_AsyncState == ASYNC_WAIT_ACK) ? PN532_TIMEOUT : pk_Req->u32_Timeout;
+            if (u32_Timeout == PN532_WAIT_FOREVER || Utils::GetMillis() - mu32_AsyncStart < u32_Timeout)
+                return true; // not yet ready
+
+            mb_WaitAck = (me_AsyncState == ASYNC_WAIT_ACK);
+            RecordReadyTime(0, false);
+            mb_WaitAck = false;
+#ifdef STD_PRINT_EN
+            Utils::Print("Poll() -> TIMEOUT\r\n");
+#endif
+            Complete(false, 0);
+            continue;
+        }
+
+        if (me_AsyncState == ASYNC_WAIT_ACK)
+        {
+            mb_WaitAck = true;
+            RecordReadyTime(Utils::GetMicros() - mu32_AsyncWaitFrom, true);
+            mb_WaitAck = false;
+
+            if (!ReadAck())
+            {
+                Complete(false, 0);
+                continue;
+            }
+            me_AsyncState = ASYNC_WAIT_RESPONSE;
+            BeginReadyWait();
+            continue; // the response may already be ready
+        }
+
+        // ASYNC_WAIT_RESPONSE
+        RecordReadyTime(Utils::GetMicros() - mu32_AsyncWaitFrom, true);
+        byte len = ReadData(mu8_PacketBuffer, pk_Req->u8_RespLen);
+        Complete(len > 0, len);
+    }
+    return false;
+}
+
+/**************************************************************************
+    returns true while commands are queued or executing
+**************************************************************************/
+bool PN532::IsBusy()
+{
+    return mu8_QueueCount > 0;
+}
+
+/**************************************************************************
+    This function is private
+    Removes the current command from the queue and calls its callback.
+    The callback may submit new commands.
+**************************************************************************/
+void PN532::Complete(bool b_Success, byte u8_Len)
+{
+    kRequest k_Req = mk_Queue[mu8_QueueHead];
+    mu8_QueueHead  = (mu8_QueueHead + 1) % PN532_QUEUE_SIZE;
+    mu8_QueueCount --;
+    me_AsyncState  = ASYNC_IDLE;
+
+    if (k_Req.pf_Callback)
+        k_Req.pf_Callback(k_Req.p_Param, b_Success, mu8_PacketBuffer, b_Success ? u8_Len : 0);
+}
+
+/**************************************************************************
+    This function is private
+    Aborts all queued commands (after a reset of the chip) and reports them as failed.
+**************************************************************************/
+void PN532::ClearQueue()
+{
+    while (mu8_QueueCount > 0)
+    {
+        Complete(false, 0);
+    }
+    mb_AutoPolling = false;
+}
+
+/**************************************************************************
+    This function is private
+    Synchronous wrapper around the command engine.
+    Sends the command in mu8_PacketBuffer and waits until the response has been 
+    written back to mu8_PacketBuffer. Commands that have been queued before are executed first.
+    param  cmdlen    The command length
+    param  resplen   The number of bytes to read for the response (see ReadData())
+    returns the length of the response or 0 on error
+**************************************************************************/
+byte PN532::Transceive(byte cmdlen, byte resplen)
+{
+    // Wait until there is a free entry in the queue
+    while (!Submit(mu8_PacketBuffer, cmdlen, resplen, TransceiveDone, this))
+    {
+        if (!Poll())
+            return 0; // queue is empty but Submit() failed -> invalid command length
+        SleepUntilCheck();
+    }
+
+    mb_SyncDone = false;
+    while (!mb_SyncDone)
+    {
+        Poll();
+        if (!mb_SyncDone) SleepUntilCheck();
+    }
+    return mu8_SyncLen;
+}
+
+/**************************************************************************
+    This function is private
+    Completion callback of Transceive(). The response is already in mu8_PacketBuffer.
+**************************************************************************/
+void PN532::TransceiveDone(void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len)
+{
+    PN532* pi_This = (PN532*)p_Param;
+    pi_This->mu8_SyncLen = b_Success ? u8_Len : 0;
+    pi_This->mb_SyncDone = true;
+}
+
 // ########################################################################
 // ####                      LOW LEVEL FUNCTIONS                      #####
 // ########################################################################
@@ -711,10 +1128,13 @@ bool PN532::CheckPN532Status(byte u8_Status)
 **************************************************************************/
 bool PN532::IsReady() 
 {
+    // The IRQ line is low as long as a response is pending
+    if (mu8_IrqPin != PN532_NO_IRQ)
+        return Utils::ReadPin(mu8_IrqPin) == LOW;
+
     #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2); // INDISPENSABLE!! Otherwise reads bullshit
+        SpiSelect(true);
 
         SpiWrite(PN532_SPI_STATUSREAD);
         byte u8_Ready = SpiRead();
@@ -745,38 +1165,159 @@ bool PN532::IsReady()
 }
 
 /**************************************************************************
-    Waits until the PN532 is ready.
+    This function is private
+    Starts to wait for the ACK or the response of the command that has just been sent.
+**************************************************************************/
+void PN532::BeginReadyWait()
+{
+    mu32_AsyncStart    = Utils::GetMillis();
+    mu32_AsyncWaitFrom = Utils::GetMicros();
+    mu32_NextCheck     = mu32_AsyncWaitFrom;
+    mu32_Backoff       = PN532_READY_MIN_BACKOFF;
+}
+
+/**************************************************************************
+    This function is private
+    Checks without blocking if the PN532 is ready with the ACK or the response.
+    In IRQ mode only the flag of the interrupt handler is checked, there is no SPI traffic.
+    In polling mode the status byte is read only when the backoff has elapsed.
+    The delay between two status reads starts with PN532_READY_MIN_BACKOFF microseconds
+    and grows geometrically, so a fast response is not rounded up to a fixed polling interval.
 **************************************************************************/
-bool PN532::WaitReady() 
+bool PN532::CheckReady()
 {
-    uint16_t timer = 0;
-    while (!IsReady()) 
+    if (mu8_IrqPin != PN532_NO_IRQ)
     {
-        if (timer >= PN532_TIMEOUT) 
-        {
-            //Utils::Print("WaitReady() -> TIMEOUT\r\n");
+        if (!mb_IrqPending)
             return false;
+
+        mb_IrqPending = false;
+        return true;
+    }
+
+    if ((int32_t)(Utils::GetMicros() - mu32_NextCheck) < 0)
+        return false; // the backoff has not yet elapsed
+
+    if (IsReady())
+        return true;
+
+    mu32_NextCheck = Utils::GetMicros() + mu32_Backoff;
+    mu32_Backoff  *= 2;
+    if (mu32_Backoff > PN532_READY_MAX_BACKOFF)
+        mu32_Backoff = PN532_READY_MAX_BACKOFF;
+    return false;
+}
+
+/**************************************************************************
+    This function is private
+    Called by Transceive() while Poll() waits for the PN532.
+    In polling mode it sleeps until the next status read is due, in IRQ mode it only yields.
+**************************************************************************/
+void PN532::SleepUntilCheck()
+{
+    if (mu8_IrqPin == PN532_NO_IRQ && me_AsyncState != ASYNC_IDLE)
+    {
+        int32_t s32_Wait = (int32_t)(mu32_NextCheck - Utils::GetMicros());
+        if (s32_Wait >= 1000)
+        {
+            Utils::DelayMilli(s32_Wait / 1000); // also services the WiFi stack
+            return;
         }
-        Utils::DelayMilli(10);
-        timer += 10;        
+        if (s32_Wait > 0)
+            Utils::DelayMicro(s32_Wait);
     }
-    return true;
+    Utils::Yield(); // service the WiFi stack and the watchdog
 }
 
 /**************************************************************************
-    Sends a command and waits a specified period for the ACK
-    param cmd       Pointer to the command buffer
-    param cmdlen    The size of the command in bytes
+    Adds the time that Poll() has waited to the statistics of the last command.
+    The ACK wait times of all commands are collected in one histogram.
+**************************************************************************/
+void PN532::RecordReadyTime(uint32_t u32_Micros, bool b_Ready)
+{
+    kReadyStats* pk_Stats = NULL;
+    if (mb_WaitAck)
+    {
+        pk_Stats = &mk_AckStats;
+    }
+    else
+    {
+        for (byte i=0; i<PN532_READY_STATS; i++)
+        {
+            kReadyStats* pk_Entry = &mk_ReadyStats[i];
+            if (pk_Entry->k_Histogram.u32_Samples > 0 || pk_Entry->u32_Timeouts > 0)
+            {
+                if (pk_Entry->u8_Command != mu8_LastCommand)
+                    continue;
+            }
+            else // free entry
+            {
+                pk_Entry->u8_Command = mu8_LastCommand;
+            }
+            pk_Stats = pk_Entry;
+            break;
+        }
+        if (!pk_Stats)
+            return; // all entries are used by other commands
+    }
+
+    if (b_Ready) Utils::HistogramAdd(&pk_Stats->k_Histogram, u32_Micros);
+    else         pk_Stats->u32_Timeouts ++;
+}
 
-    returns  true  if everything is OK, 
-             false if timeout occured before an ACK was recieved
+/**************************************************************************
+    returns the ready wait statistics of a command (PN532_COMMAND_XXX)
+    or NULL if the command has not been executed since ClearReadyStats()
 **************************************************************************/
-bool PN532::SendCommandCheckAck(byte *cmd, byte cmdlen) 
+const kReadyStats* PN532::GetReadyStats(byte u8_Command)
 {
-    WriteCommand(cmd, cmdlen);
-    return ReadAck();
+    for (byte i=0; i<PN532_READY_STATS; i++)
+    {
+        kReadyStats* pk_Entry = &mk_ReadyStats[i];
+        if (pk_Entry->u8_Command == u8_Command && (pk_Entry->k_Histogram.u32_Samples > 0 || pk_Entry->u32_Timeouts > 0))
+            return pk_Entry;
+    }
+    return NULL;
 }
 
+/**************************************************************************
+    returns the wait times for the ACK frame of all commands
+**************************************************************************/
+const kReadyStats* PN532::GetAckStats()
+{
+    return &mk_AckStats;
+}
+
+void PN532::ClearReadyStats()
+{
+    memset(&mk_AckStats,  0, sizeof(mk_AckStats));
+    memset(mk_ReadyStats, 0, sizeof(mk_ReadyStats));
+}
+
+#ifdef STD_PRINT_EN
+void PN532::PrintReadyStats()
+{
+    Utils::Print("ACK:  timeouts= ");
+    Utils::PrintDec(mk_AckStats.u32_Timeouts);
+    Utils::Print(", ");
+    Utils::PrintHistogram(&mk_AckStats.k_Histogram, LF);
+
+    for (byte i=0; i<PN532_READY_STATS; i++)
+    {
+        kReadyStats* pk_Entry = &mk_ReadyStats[i];
+        if (pk_Entry->k_Histogram.u32_Samples == 0 && pk_Entry->u32_Timeouts == 0)
+            continue;
+
+        Utils::Print("0x");
+        Utils::PrintHex8(pk_Entry->u8_Command);
+        Utils::Print(": timeouts= ");
+        Utils::PrintDec(pk_Entry->u32_Timeouts);
+        Utils::Print(", ");
+        Utils::PrintHistogram(&pk_Entry->k_Histogram, LF);
+    }
+}
+#endif
+
 /**************************************************************************
     Writes a command to the PN532, inserting the
     preamble and required frame details (checksum, len, etc.)
@@ -786,6 +1327,8 @@ bool PN532::SendCommandCheckAck(byte *cmd, byte cmdlen)
 **************************************************************************/
 void PN532::WriteCommand(byte* cmd, byte cmdlen)
 {
+    mu8_LastCommand = cmd[0];
+
     byte TxBuffer[PN532_PACKBUFFSIZE + 10];
     int P=0;
     TxBuffer[P++] = PN532_PREAMBLE;    // 00
@@ -825,20 +1368,18 @@ void PN532::WriteCommand(byte* cmd, byte cmdlen)
 **************************************************************************/
 void PN532::SendPacket(byte* buff, byte len)
 {
+    // An edge that arrives from now on belongs to the response of this packet
+    mb_IrqPending = false;
+
     #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2);  // INDISPENSABLE!!
+        SpiSelect();
 
 #ifdef STD_PRINT_EN
         if (mu8_DebugLevel > 2) Utils::Print("WriteCommand(): write DATAWRITE\r\n");
 #endif
         SpiWrite(PN532_SPI_DATAWRITE);
-
-        for (byte i=0; i<len; i++) 
-        {
-            SpiWrite(buff[i]);
-        }
+        SpiWriteBuf(buff, len);
 
         Utils::WritePin(mu8_SselPin, HIGH);
         Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
@@ -868,7 +1409,7 @@ bool PN532::ReadAck()
     // ATTENTION: Never read more than 6 bytes here!
     // The PN532 has a bug in SPI mode which results in the first byte of the response missing if more than 6 bytes are read here!
     if (!ReadPacket(ackbuff, sizeof(ackbuff)))
-        return false; // Timeout
+        return false;
 
 #ifdef STD_PRINT_EN
 if (mu8_DebugLevel > 2)
@@ -1016,27 +1557,19 @@ byte PN532::ReadData(byte* buff, byte len)
     Reads n bytes of data from the PN532 via SPI or I2C and does NOT check for valid data.
     param  buff      Pointer to the buffer where data will be written
     param  len       Number of bytes to read
+    The caller must have checked that the PN532 is ready.
 **************************************************************************/
 bool PN532::ReadPacket(byte* buff, byte len)
 { 
-    if (!WaitReady())
-        return false;
-        
     #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2); // INDISPENSABLE!! Otherwise reads bullshit
+        SpiSelect();
 
 #ifdef STD_PRINT_EN
         if (mu8_DebugLevel > 2)  Utils::Print("ReadPacket(): write DATAREAD\r\n");
 #endif
         SpiWrite(PN532_SPI_DATAREAD);
-    
-        for (byte i=0; i<len; i++) 
-        {
-            Utils::DelayMilli(1);
-            buff[i] = SpiRead();
-        }
+        SpiReadBuf(buff, len);
     
         Utils::WritePin(mu8_SselPin, HIGH);
         Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
@@ -1070,6 +1603,68 @@ bool PN532::ReadPacket(byte* buff, byte len)
     #endif
 }
 
+/**************************************************************************
+    Pulls SSEL low and waits the select delay of the timing profile.
+    A delay after SSEL is INDISPENSABLE!! Otherwise reads bullshit
+    b_StatusRead = true: the status byte is read, PN532_SPI_STATUS_DELAY is enough.
+**************************************************************************/
+void PN532::SpiSelect(bool b_StatusRead)
+{
+    Utils::WritePin(mu8_SselPin, LOW);
+
+    uint16_t u16_Delay = mu16_SelectDelay;
+    if (b_StatusRead && u16_Delay > PN532_SPI_STATUS_DELAY)
+        u16_Delay = PN532_SPI_STATUS_DELAY;
+
+    if (u16_Delay >= 1000)
+        Utils::DelayMilli(u16_Delay / 1000);
+    Utils::DelayMicro(u16_Delay % 1000);
+}
+
+/**************************************************************************
+    SPI write n bytes.
+    In hardware SPI mode without byte delay the whole buffer is sent in one burst.
+**************************************************************************/
+void PN532::SpiWriteBuf(const byte* buff, byte len)
+{
+    #if USE_HARDWARE_SPI
+    if (mu16_ByteDelay == 0)
+    {
+        SpiClass::WriteBytes(buff, len);
+        return;
+    }
+    #endif
+
+    for (byte i=0; i<len; i++) 
+    {
+        if (i > 0) Utils::DelayMicro(mu16_ByteDelay);
+        SpiWrite(buff[i]);
+    }
+}
+
+/**************************************************************************
+    SPI read n bytes.
+    In hardware SPI mode without byte delay the whole buffer is read in one burst.
+**************************************************************************/
+void PN532::SpiReadBuf(byte* buff, byte len)
+{
+    #if USE_HARDWARE_SPI
+    if (mu16_ByteDelay == 0)
+    {
+        // The PN532 ignores MOSI while sending the response, but clock out zeroes like SpiRead() does.
+        memset(buff, 0, len);
+        SpiClass::TransferBytes(buff, buff, len);
+        return;
+    }
+    #endif
+
+    for (byte i=0; i<len; i++) 
+    {
+        Utils::DelayMicro(mu16_ByteDelay);
+        buff[i] = SpiRead();
+    }
+}
+
 /**************************************************************************
     SPI write one byte
 **************************************************************************/
@@ -3,6 +3,7 @@
 #define ADAFRUIT_PN532_H
 
 #include <Arduino.h>
+#include "Histogram.h"
 
 // This parameter may be used to slow down the software SPI bus speed.
 // This is required when there is a long cable between the PN532 and the Teensy.
@@ -17,10 +18,40 @@
 // This parameter is not used for software SPI mode.
 #define PN532_HARD_SPI_CLOCK  1000000
 
+// The default SPI timing profile (see PN532::SetSpiTiming())
+// The delay in microseconds after pulling SSEL low before the first byte is clocked.
+#define PN532_SPI_SELECT_DELAY  2000
+// The select delay in microseconds for the status byte that IsReady() reads while polling.
+// The PN532 is awake while it processes a command, so it does not need the long wake up delay.
+#define PN532_SPI_STATUS_DELAY  100
+// The delay in microseconds between two bytes of a frame.
+// 0 transfers the whole frame in one burst (hardware SPI only).
+// Increase this value only if you have marginal wiring (long cables) and see checksum errors.
+#define PN532_SPI_BYTE_DELAY    0
+
 // The maximum time to wait for an answer from the PN532
 // Do NOT use infinite timeouts like in Adafruit code!
 #define PN532_TIMEOUT  1000
 
+// Pass this as IRQ pin to InitHardwareSPI() if the IRQ line of the PN532 is not connected.
+// In this case the ready status is polled via SPI.
+#define PN532_NO_IRQ  (0xFF)
+
+// Without IRQ line Poll() reads the status byte with an adaptive backoff:
+// The first delay is PN532_READY_MIN_BACKOFF microseconds, then it doubles up to PN532_READY_MAX_BACKOFF.
+#define PN532_READY_MIN_BACKOFF  20
+#define PN532_READY_MAX_BACKOFF  5000
+
+// The number of different commands for which the ready wait times are recorded (see GetReadyStats())
+#define PN532_READY_STATS  8
+
+// The number of commands that can be queued in the asynchronous command engine (see Submit())
+#define PN532_QUEUE_SIZE   4
+// The maximum length of a command passed to Submit()
+#define PN532_MAX_CMD_LEN  20
+// Pass this timeout to Submit() to wait endlessly for the response (e.g. for endless InAutoPoll)
+#define PN532_WAIT_FOREVER  (0xFFFFFFFFUL)
+
 // The packet buffer is used for sending commands and for receiving responses from the PN532
 #define PN532_PACKBUFFSIZE   80
 
@@ -92,6 +123,11 @@
 #define CARD_TYPE_106KB_ISO14443B           (0x03) // card baudrate 106 kB
 #define CARD_TYPE_106KB_JEWEL               (0x04) // card baudrate 106 kB
 
+// Target types for InAutoPoll (PN532 manual chapter 7.3.13)
+#define PN532_AUTOPOLL_GENERIC_106K         (0x00) // Generic passive 106 kbps (ISO/IEC14443-4A, Mifare and DEP)
+#define PN532_AUTOPOLL_MIFARE               (0x10) // Mifare card
+#define PN532_AUTOPOLL_ISO14443_4A          (0x20) // Passive 106 kbps ISO/IEC14443-4A
+
 // Prefixes for NDEF Records (to identify record type), not used
 #define NDEF_URIPREFIX_NONE                 (0x00)
 #define NDEF_URIPREFIX_HTTP_WWWDOT          (0x01)
@@ -137,11 +173,25 @@ enum eCardType
     CARD_DesRandom = 3, // A Desfire card with 4 byte random UID  (bit 0 + 1)
 };
 
+// The time the PN532 needed to become ready with the response of a command
+struct kReadyStats
+{
+    byte              u8_Command;  // PN532_COMMAND_XXX
+    uint32_t          u32_Timeouts;
+    kLatencyHistogram k_Histogram; // microseconds
+};
+
+// Called by PN532::Poll() when a submitted command has finished.
+// b_Success = false on timeout or if no valid ACK / response has been received.
+// u8_Data   = the response (first byte is always 0xD5), valid only during the callback.
+typedef void (*PN532Callback)(void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len);
+
 typedef struct
 {
     byte     u8_UidLength;   // UID = 4 or 7 bytes
     byte     u8_KeyVersion;  // for Desfire random ID cards
     bool      b_PN532_Error; // true -> the error comes from the PN532, false -> crypto error
+    bool      b_Pending;     // true -> auto polling is still running, there is no result yet
     eCardType e_CardType;
 } kCard;
 
@@ -150,13 +200,17 @@ class PN532
  public:
     PN532();
     
-	void InitHardwareSPI(byte u8_Sel, byte u8_Reset);
+	void InitHardwareSPI(byte u8_Sel, byte u8_Reset, byte u8_Irq = PN532_NO_IRQ);
     
     // Generic PN532 functions
     void begin();  
+    void WakeUp();
+    bool Resync();
     void SetDebugLevel(byte level);
+    void SetSpiTiming(uint16_t u16_SelectDelay, uint16_t u16_ByteDelay);
     bool SamConfig();
     bool GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo, byte* pFlags);
+    bool GetCachedFirmware (byte* pIcType, byte* pVersionHi, byte* pVersionLo, byte* pFlags);
     bool WriteGPIO(bool P30, bool P31, bool P33, bool P35);
     bool SetPassiveActivationRetries();
     bool DeselectCard();
@@ -169,19 +223,44 @@ class PN532
     // ISO14443A functions
     bool ReadPassiveTargetID(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
 
+    // Asynchronous command engine
+    bool Submit(const byte* u8_Cmd, byte u8_CmdLen, byte u8_RespLen, PN532Callback pf_Callback, void* p_Param, uint32_t u32_Timeout = 0);
+    bool Poll();
+    bool IsBusy();
+
+    // Autonomous polling (the host only talks to the PN532 when a target appears)
+    bool StartAutoPoll(byte u8_PollNr, byte u8_Period, const byte* u8_Types, byte u8_TypeCount);
+    bool CheckAutoPoll(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType, bool* pb_Done);
+    bool IsAutoPolling();
+
+    // Ready wait statistics (to tune PN532_TIMEOUT and the retry counts)
+    const kReadyStats* GetReadyStats(byte u8_Command);
+    const kReadyStats* GetAckStats();
+    void ClearReadyStats();
+#ifdef STD_PRINT_EN
+    void PrintReadyStats();
+#endif
+
  protected:	
     // Low Level functions
     bool CheckPN532Status(byte u8_Status);
-    bool SendCommandCheckAck(byte *cmd, byte cmdlen);    
+    bool ParseTargetData(const byte* u8_Target, byte u8_TargetLen, byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+    byte Transceive  (byte cmdlen, byte resplen);
     byte ReadData    (byte* buff, byte len);
     bool ReadPacket  (byte* buff, byte len);
     void WriteCommand(byte* cmd,  byte cmdlen);
     void SendPacket  (byte* buff, byte len);
     bool IsReady();
-    bool WaitReady();
+    void BeginReadyWait();
+    bool CheckReady();
+    void SleepUntilCheck();
+    void RecordReadyTime(uint32_t u32_Micros, bool b_Ready);
     bool ReadAck();
     void SpiWrite(byte c);
     byte SpiRead(void);
+    void SpiWriteBuf(const byte* buff, byte len);
+    void SpiReadBuf(byte* buff, byte len);
+    void SpiSelect(bool b_StatusRead = false);
 
     byte mu8_DebugLevel;   // 0, 1, or 2
     byte mu8_PacketBuffer[PN532_PACKBUFFSIZE];
@@ -192,6 +271,64 @@ class PN532
     byte mu8_MosiPin;  
     byte mu8_SselPin;  
     byte mu8_ResetPin;
+    byte mu8_IrqPin;
+    uint16_t mu16_SelectDelay; // microseconds
+    uint16_t mu16_ByteDelay;   // microseconds
+    bool     mb_AutoPolling;
+    bool     mb_FirmwareValid;
+    byte     mu8_Firmware[4];      // IC, VersionHi, VersionLo, Flags
+    byte     mu8_LastCommand;      // the command that has been sent last
+    bool     mb_WaitAck;           // true while waiting for the ACK frame
+    kReadyStats mk_AckStats;
+    kReadyStats mk_ReadyStats[PN532_READY_STATS];
+
+    enum eAsyncState
+    {
+        ASYNC_IDLE,           // no command is executing
+        ASYNC_WAIT_ACK,       // the command has been sent, waiting for the ACK frame
+        ASYNC_WAIT_RESPONSE,  // the ACK has been received, waiting for the response
+    };
+
+    struct kRequest
+    {
+        byte          u8_Cmd[PN532_MAX_CMD_LEN];
+        byte          u8_CmdLen;
+        byte          u8_RespLen;
+        uint32_t      u32_Timeout;
+        PN532Callback pf_Callback;
+        void*         p_Param;
+    };
+
+    // The result of the last InAutoPoll command
+    struct kAutoPoll
+    {
+        bool      b_Done;
+        bool      b_Success;
+        byte      u8_Uid[8];
+        byte      u8_UidLength;
+        eCardType e_CardType;
+    };
+
+    kRequest    mk_Queue[PN532_QUEUE_SIZE];
+    byte        mu8_QueueHead;
+    byte        mu8_QueueCount;
+    eAsyncState me_AsyncState;
+    uint32_t    mu32_AsyncStart;     // milliseconds, for the timeout
+    uint32_t    mu32_AsyncWaitFrom;  // microseconds, for the ready statistics
+    uint32_t    mu32_NextCheck;      // microseconds, the next status read in polling mode
+    uint32_t    mu32_Backoff;        // microseconds, the delay after the next status read
+    bool        mb_SyncDone;
+    byte        mu8_SyncLen;
+    kAutoPoll   mk_AutoPoll;
+
+    void Complete(bool b_Success, byte u8_Len);
+    void ClearQueue();
+    static void TransceiveDone(void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len);
+    static void AutoPollDone  (void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len);
+
+    // Set by the interrupt handler on the falling edge of the IRQ line (response ready)
+    static volatile bool mb_IrqPending;
+    static void IrqHandler();
 };
 
 #endif
@@ -0,0 +1,199 @@
+/**************************************************************************
+    class SDCard: All accesses to the SD card with latency and error statistics.
+**************************************************************************/
+
+#include "Config.h"
+#include "SDCard.h"
+
+kSDStats          SDCard::mk_Stats[SD_OP_COUNT];
+kLatencyHistogram SDCard::mk_WindowWrites;
+kLatencyHistogram SDCard::mk_RecentWrites;
+
+static const char* s8_OperationNames[SD_OP_COUNT] =
+{
+    "begin", "open", "next", "read", "write", "seek", "flush", "close", "exists", "remove", "rename", "mkdir", "rmdir"
+};
+
+bool SDCard::Begin(byte u8_ChipSelect)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Success = SD.begin(u8_ChipSelect);
+    Record(SD_OP_BEGIN, u32_Start, b_Success, 0);
+    return b_Success;
+}
+
+// A file that does not exist counts as error
+File SDCard::Open(const char* s8_Path, byte u8_Mode)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    File i_File = SD.open(s8_Path, u8_Mode);
+    Record(SD_OP_OPEN, u32_Start, i_File, 0);
+    return i_File;
+}
+
+// The end of the directory is not an error
+File SDCard::OpenNext(File* pi_Dir, byte u8_Mode)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    File i_File = pi_Dir->openNextFile(u8_Mode);
+    Record(SD_OP_NEXT, u32_Start, true, 0);
+    return i_File;
+}
+
+// returns the number of bytes read or -1 on error. Less bytes at the end of the file are not an error.
+int SDCard::Read(File* pi_File, void* p_Buffer, uint32_t u32_Length)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    int s32_Read = pi_File->read(p_Buffer, u32_Length);
+    Record(SD_OP_READ, u32_Start, s32_Read >= 0, s32_Read > 0 ? s32_Read : 0);
+    return s32_Read;
+}
+
+// returns false if not all bytes have been written
+bool SDCard::Write(File* pi_File, const void* p_Buffer, uint32_t u32_Length)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    size_t u32_Written = pi_File->write((const uint8_t*)p_Buffer, u32_Length);
+    Record(SD_OP_WRITE, u32_Start, u32_Written == u32_Length, u32_Written);
+
+    Utils::HistogramAdd(&mk_WindowWrites, Utils::GetMicros() - u32_Start);
+    if (mk_WindowWrites.u32_Samples >= SD_WINDOW_WRITES)
+    {
+        mk_RecentWrites = mk_WindowWrites;
+        memset(&mk_WindowWrites, 0, sizeof(mk_WindowWrites));
+    }
+    return u32_Written == u32_Length;
+}
+
+bool SDCard::Seek(File* pi_File, uint32_t u32_Position)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Success = pi_File->seek(u32_Position);
+    Record(SD_OP_SEEK, u32_Start, b_Success, 0);
+    return b_Success;
+}
+
+void SDCard::Flush(File* pi_File)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    pi_File->flush();
+    Record(SD_OP_FLUSH, u32_Start, true, 0);
+}
+
+// Closing also writes the directory entry of a file that has been written
+void SDCard::Close(File* pi_File)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    pi_File->close();
+    Record(SD_OP_CLOSE, u32_Start, true, 0);
+}
+
+// A file that does not exist is not an error
+bool SDCard::Exists(const char* s8_Path)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Exists = SD.exists(s8_Path);
+    Record(SD_OP_EXISTS, u32_Start, true, 0);
+    return b_Exists;
+}
+
+bool SDCard::Remove(const char* s8_Path)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Success = SD.remove(s8_Path);
+    Record(SD_OP_REMOVE, u32_Start, b_Success, 0);
+    return b_Success;
+}
+
+bool SDCard::Rename(const char* s8_Source, const char* s8_Dest)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Success = SD.rename(s8_Source, s8_Dest);
+    Record(SD_OP_RENAME, u32_Start, b_Success, 0);
+    return b_Success;
+}
+
+bool SDCard::Mkdir(const char* s8_Path)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Success = SD.mkdir(s8_Path);
+    Record(SD_OP_MKDIR, u32_Start, b_Success, 0);
+    return b_Success;
+}
+
+bool SDCard::Rmdir(const char* s8_Path)
+{
+    uint32_t u32_Start = Utils::GetMicros();
+    bool b_Success = SD.rmdir(s8_Path);
+    Record(SD_OP_RMDIR, u32_Start, b_Success, 0);
+    return b_Success;
+}
+
+// ----------------------------------------------------------------------
+
+const kSDStats* SDCard::GetStats(byte u8_Operation)
+{
+    return &mk_Stats[u8_Operation];
+}
+
+// returns the write latency of the last SD_WINDOW_WRITES writes (empty until that many writes have been done)
+const kLatencyHistogram* SDCard::GetRecentWrites(void)
+{
+    return &mk_RecentWrites;
+}
+
+const char* SDCard::GetName(byte u8_Operation)
+{
+    return s8_OperationNames[u8_Operation];
+}
+
+// Writes one line without line feed: "name,calls,errors,bytes,p50,p90,p99,max" (durations in microseconds).
+// s8_Buf must have room for 100 characters.
+void SDCard::FormatStats(byte u8_Operation, char* s8_Buf)
+{
+    const kSDStats* pk_Stats = &mk_Stats[u8_Operation];
+    sprintf(s8_Buf, "%s,%u,%u,%u,%u,%u,%u,%u", s8_OperationNames[u8_Operation],
+            (unsigned)pk_Stats->k_Time.u32_Samples, (unsigned)pk_Stats->u32_Errors, (unsigned)pk_Stats->u32_Bytes,
+            (unsigned)Utils::HistogramPercentile(&pk_Stats->k_Time, 50),
+            (unsigned)Utils::HistogramPercentile(&pk_Stats->k_Time, 90),
+            (unsigned)Utils::HistogramPercentile(&pk_Stats->k_Time, 99),
+            (unsigned)pk_Stats->k_Time.u32_Max);
+}
+
+void SDCard::ClearStats(void)
+{
+    memset(mk_Stats, 0, sizeof(mk_Stats));
+    memset(&mk_WindowWrites, 0, sizeof(mk_WindowWrites));
+    memset(&mk_RecentWrites, 0, sizeof(mk_RecentWrites));
+}
+
+#ifdef STD_PRINT_EN
+void SDCard::PrintStats(void)
+{
+    char s8_Buf[100];
+    for (byte i=0; i<SD_OP_COUNT; i++)
+    {
+        const kSDStats* pk_Stats = &mk_Stats[i];
+        if (pk_Stats->k_Time.u32_Samples == 0)
+            continue;
+
+        sprintf(s8_Buf, "SD %-6s errors= %u, bytes= %u, ", s8_OperationNames[i],
+                (unsigned)pk_Stats->u32_Errors, (unsigned)pk_Stats->u32_Bytes);
+        Utils::Print(s8_Buf);
+        Utils::PrintHistogram(&pk_Stats->k_Time, LF);
+    }
+    Utils::Print("SD recent writes: ");
+    Utils::PrintHistogram(&mk_RecentWrites, LF);
+}
+#endif
+
+// ----------------------------------------------------------------------
+
+void SDCard::Record(byte u8_Operation, uint32_t u32_Start, bool b_Success, uint32_t u32_Bytes)
+{
+    kSDStats* pk_Stats = &mk_Stats[u8_Operation];
+    Utils::HistogramAdd(&pk_Stats->k_Time, Utils::GetMicros() - u32_Start);
+    pk_Stats->u32_Bytes += u32_Bytes;
+    if (!b_Success)
+        pk_Stats->u32_Errors ++;
+}
@@ -0,0 +1,81 @@
+/**************************************************************************
+    class SDCard: All accesses to the SD card with latency and error statistics.
+
+    Each SD operation (open, read, write, seek, close, remove, ...) is executed through this class.
+    For each operation a logarithmic histogram of the duration, the number of errors and the bytes moved are counted
+    in a fixed table in RAM (no allocation).
+    Additionally the writes are measured in windows of SD_WINDOW_WRITES writes. The p99 of the last complete window
+    shows a degrading SD card long before it fails (the lifetime histogram changes too slowly for that).
+
+    The statistics are printed on the serial port with PrintStats() and are sent with the WiFi transfer
+    if EXPORT_SD_STATS is true (see Config.h).
+**************************************************************************/
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+#include "Utils.h"
+
+// The number of writes in one window of the recent write latency
+#define SD_WINDOW_WRITES   (256u)
+
+enum eSDOperation
+{
+    SD_OP_BEGIN = 0,
+    SD_OP_OPEN,
+    SD_OP_NEXT,     // openNextFile() of a directory
+    SD_OP_READ,
+    SD_OP_WRITE,
+    SD_OP_SEEK,
+    SD_OP_FLUSH,
+    SD_OP_CLOSE,
+    SD_OP_EXISTS,
+    SD_OP_REMOVE,
+    SD_OP_RENAME,
+    SD_OP_MKDIR,
+    SD_OP_RMDIR,
+    SD_OP_COUNT
+};
+
+struct kSDStats
+{
+    uint32_t u32_Errors;
+    uint32_t u32_Bytes;            // bytes read or written
+    kLatencyHistogram k_Time;      // duration in microseconds, k_Time.u32_Samples = number of calls
+};
+
+class SDCard
+{
+public:
+    static bool Begin(byte u8_ChipSelect);
+    static File Open(const char* s8_Path, byte u8_Mode = FILE_READ);
+    static File OpenNext(File* pi_Dir, byte u8_Mode = FILE_READ);
+    static int  Read (File* pi_File, void* p_Buffer, uint32_t u32_Length);
+    static bool Write(File* pi_File, const void* p_Buffer, uint32_t u32_Length);
+    static bool Seek (File* pi_File, uint32_t u32_Position);
+    static void Flush(File* pi_File);
+    static void Close(File* pi_File);
+    static bool Exists(const char* s8_Path);
+    static bool Remove(const char* s8_Path);
+    static bool Rename(const char* s8_Source, const char* s8_Dest);
+    static bool Mkdir (const char* s8_Path);
+    static bool Rmdir (const char* s8_Path);
+
+    static const kSDStats*          GetStats(byte u8_Operation);
+    static const kLatencyHistogram* GetRecentWrites(void);
+    static const char*              GetName(byte u8_Operation);
+    static void FormatStats(byte u8_Operation, char* s8_Buf);
+    static void ClearStats(void);
+#ifdef STD_PRINT_EN
+    static void PrintStats(void);
+#endif
+
+private:
+    static void Record(byte u8_Operation, uint32_t u32_Start, bool b_Success, uint32_t u32_Bytes);
+
+    static kSDStats          mk_Stats[SD_OP_COUNT];
+    static kLatencyHistogram mk_WindowWrites; // the window that is filled now
+    static kLatencyHistogram mk_RecentWrites; // the last complete window
+};
+
+#endif // SDCARD_H
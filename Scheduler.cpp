@@ -0,0 +1,129 @@
+/**************************************************************************
+    class Scheduler: A small tick based cooperative scheduler.
+**************************************************************************/
+
+#include "Config.h"
+#include "Scheduler.h"
+
+kTask Scheduler::mk_Tasks[SCHED_MAX_TASKS];
+byte  Scheduler::mu8_TaskCount = 0;
+
+// Registers a new task. The task is not active until Start() is called.
+// u32_Period   = milliseconds between two executions or SCHED_ONE_SHOT
+// u32_Deadline = maximum lateness in milliseconds that is tolerated before a deadline miss is counted (0 = none)
+// returns the task handle or SCHED_NO_TASK if the table is full
+byte Scheduler::AddTask(TaskFunc pf_Task, uint32_t u32_Period, uint32_t u32_Deadline)
+{
+    if (mu8_TaskCount >= SCHED_MAX_TASKS)
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("Error: The task table is full\r\n");
+#endif
+        return SCHED_NO_TASK;
+    }
+
+    kTask* pk_Task = &mk_Tasks[mu8_TaskCount];
+    memset(pk_Task, 0, sizeof(kTask));
+    pk_Task->pf_Task      = pf_Task;
+    pk_Task->u32_Period   = u32_Period;
+    pk_Task->u32_Deadline = u32_Deadline;
+    return mu8_TaskCount++;
+}
+
+// Activates a task. It will be executed the first time after u32_Delay milliseconds.
+// Calling Start() on an active task re-arms it.
+void Scheduler::Start(byte u8_Task, uint32_t u32_Delay)
+{
+    if (u8_Task >= mu8_TaskCount)
+        return;
+
+    mk_Tasks[u8_Task].u32_Due  = Utils::GetMillis() + u32_Delay;
+    mk_Tasks[u8_Task].b_Active = true;
+}
+
+void Scheduler::Stop(byte u8_Task)
+{
+    if (u8_Task >= mu8_TaskCount)
+        return;
+
+    mk_Tasks[u8_Task].b_Active = false;
+}
+
+// The new period is used after the next execution of the task
+void Scheduler::SetPeriod(byte u8_Task, uint32_t u32_Period)
+{
+    if (u8_Task >= mu8_TaskCount)
+        return;
+
+    mk_Tasks[u8_Task].u32_Period = u32_Period;
+}
+
+bool Scheduler::IsActive(byte u8_Task)
+{
+    if (u8_Task >= mu8_TaskCount)
+        return false;
+
+    return mk_Tasks[u8_Task].b_Active;
+}
+
+const kTask* Scheduler::GetTask(byte u8_Task)
+{
+    if (u8_Task >= mu8_TaskCount)
+        return NULL;
+
+    return &mk_Tasks[u8_Task];
+}
+
+// Executes all tasks which are due. This function never blocks (as long as the tasks do not block).
+// It must be called from loop() as often as possible.
+void Scheduler::Run(void)
+{
+    for (byte T=0; T<mu8_TaskCount; T++)
+    {
+        kTask* pk_Task = &mk_Tasks[T];
+        if (!pk_Task->b_Active)
+            continue;
+
+        // The cast to a signed value handles the roll-over of GetMillis() correctly
+        uint32_t u32_Now  = Utils::GetMillis();
+        int32_t  s32_Late = (int32_t)(u32_Now - pk_Task->u32_Due);
+        if (s32_Late < 0)
+            continue; // not yet due
+
+        if ((uint32_t)s32_Late > pk_Task->u32_MaxLate)
+            pk_Task->u32_MaxLate = s32_Late;
+
+        if (pk_Task->u32_Deadline > 0 && (uint32_t)s32_Late > pk_Task->u32_Deadline)
+            pk_Task->u32_Missed ++;
+
+        if (pk_Task->u32_Period == SCHED_ONE_SHOT)
+        {
+            pk_Task->b_Active = false;
+        }
+        else
+        {
+            pk_Task->u32_Due += pk_Task->u32_Period;
+
+            // If the task is far behind (e.g. after a long SD operation) do not execute it several times in a row.
+            if ((int32_t)(u32_Now - pk_Task->u32_Due) >= 0)
+                pk_Task->u32_Due = u32_Now + pk_Task->u32_Period;
+        }
+
+        // The task may call Start() / Stop() / SetPeriod() on itself
+        pk_Task->pf_Task();
+    }
+}
+
+#ifdef STD_PRINT_EN
+void Scheduler::PrintStats(void)
+{
+    char s8_Buf[80];
+    for (byte T=0; T<mu8_TaskCount; T++)
+    {
+        kTask* pk_Task = &mk_Tasks[T];
+        sprintf(s8_Buf, "Task %d: period= %u ms, max late= %u ms, missed deadlines= %u\r\n", T,
+                (unsigned)pk_Task->u32_Period, (unsigned)pk_Task->u32_MaxLate, (unsigned)pk_Task->u32_Missed);
+        Utils::Print(s8_Buf);
+    }
+}
+#endif
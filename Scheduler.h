@@ -0,0 +1,107 @@
+/**************************************************************************
+    class Scheduler: A small tick based cooperative scheduler.
+
+    All jobs of the main loop (PN532 polling, OLED animation, LED patterns, ...)
+    are registered as tasks which are executed by Scheduler::Run().
+    A task must NEVER block. Instead of calling DelayMilli() a task returns
+    and lets the scheduler call it again when its period has elapsed.
+    The task table is static. This avoids the 'new' operator which would lead to memory fragmentation.
+**************************************************************************/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "Utils.h"
+
+// The maximum number of tasks that can be registered with AddTask()
+#define SCHED_MAX_TASKS   (8u)
+
+// Returned by AddTask() if the task table is full
+#define SCHED_NO_TASK     (0xFFu)
+
+// A task with this period is executed only once after it has been started with Start()
+#define SCHED_ONE_SHOT    (0u)
+
+typedef void (*TaskFunc)(void);
+
+struct kTask
+{
+    TaskFunc pf_Task;
+    uint32_t u32_Period;    // milliseconds between two executions, SCHED_ONE_SHOT = run once
+    uint32_t u32_Deadline;  // maximum allowed lateness in milliseconds, 0 = no deadline
+    uint32_t u32_Due;       // tick when the task has to run the next time
+    uint32_t u32_Missed;    // how often the deadline has been missed
+    uint32_t u32_MaxLate;   // the worst lateness that has been measured in milliseconds
+    bool      b_Active;
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// A non-blocking replacement for DelayMilli().
+// Start() the timer and check Expired() each time the task is executed.
+class SoftTimer
+{
+public:
+    inline SoftTimer()
+    {
+        mu32_Start    = 0;
+        mu32_Interval = 0;
+        mb_Running    = false;
+    }
+
+    inline void Start(uint32_t u32_Interval)
+    {
+        mu32_Start    = Utils::GetMillis();
+        mu32_Interval = u32_Interval;
+        mb_Running    = true;
+    }
+
+    inline void Stop()
+    {
+        mb_Running = false;
+    }
+
+    inline bool IsRunning()
+    {
+        return mb_Running;
+    }
+
+    // returns true once when the interval has elapsed, then the timer stops.
+    // The subtraction handles the roll-over of GetMillis() correctly.
+    bool Expired()
+    {
+        if (!mb_Running || (Utils::GetMillis() - mu32_Start) < mu32_Interval)
+            return false;
+
+        mb_Running = false;
+        return true;
+    }
+
+private:
+    uint32_t mu32_Start;
+    uint32_t mu32_Interval;
+    bool     mb_Running;
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+class Scheduler
+{
+public:
+    static byte AddTask(TaskFunc pf_Task, uint32_t u32_Period, uint32_t u32_Deadline = 0);
+    static void Start(byte u8_Task, uint32_t u32_Delay = 0);
+    static void Stop(byte u8_Task);
+    static void SetPeriod(byte u8_Task, uint32_t u32_Period);
+    static bool IsActive(byte u8_Task);
+    static void Run(void);
+    static const kTask* GetTask(byte u8_Task);
+#ifdef STD_PRINT_EN
+    static void PrintStats(void);
+#endif
+
+private:
+    static kTask  mk_Tasks[SCHED_MAX_TASKS];
+    static byte   mu8_TaskCount;
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,358 @@
+/**************************************************************************
+    class Snapshot: All counters of a backup packed into one file.
+**************************************************************************/
+
+#include "Config.h"
+#include "Snapshot.h"
+#include "SDCard.h"
+
+File     Snapshot::mi_Out;
+byte     Snapshot::mu8_Chunk[SNAP_SECTOR_SIZE];
+uint32_t Snapshot::mu32_ChunkPos = 0;
+uint32_t Snapshot::mu32_Crc      = 0;
+uint32_t Snapshot::mu32_SortUsed = 0;
+uint64_t Snapshot::mu64_SortID   [SNAP_SORT_SIZE];
+uint32_t Snapshot::mu32_SortCount[SNAP_SORT_SIZE];
+
+Snapshot::Snapshot()
+{
+    mu32_Count  = 0;
+    mu32_Next   = 0;
+    ms8_Date[0] = 0;
+}
+
+// Writes the dirty cards of the database into a new snapshot file. An existing file is replaced.
+// s8_Date = "YYYYMMDD"
+// The dirty bitmap of the database must be complete (see CounterDB::FinishRecovery()).
+// returns false if the SD card cannot be read or written
+bool Snapshot::Write(const char* s8_Path, const char* s8_Date, CounterDB* pi_DB)
+{
+    uint32_t u32_Total = 0;
+    uint64_t u64_Last  = 0; // a UID is never zero
+
+    // The first pass also counts the records for the header
+    Collect(pi_DB, u64_Last, &u32_Total);
+
+    if (SDCard::Exists(s8_Path) && !SDCard::Remove(s8_Path))
+        return false;
+
+    mi_Out = SDCard::Open(s8_Path, FILE_WRITE);
+    if (!mi_Out)
+        return false;
+
+    byte u8_Header[SNAP_HEADER_SIZE];
+    memset(u8_Header, 0, sizeof(u8_Header));
+    Utils::WriteLE32(u8_Header, SNAP_MAGIC);
+    u8_Header[4] = (byte)SNAP_VERSION;
+    u8_Header[6] = (byte)SNAP_RECORD_SIZE;
+    memcpy(u8_Header + 8, s8_Date, 8);
+    Utils::WriteLE32(u8_Header + 16, u32_Total);
+    Utils::WriteLE32(u8_Header + 28, Utils::CalcCrc32(u8_Header, 28));
+
+    mu32_ChunkPos = 0;
+    bool b_Success = Put(u8_Header, sizeof(u8_Header));
+
+    // The CRC of the trailer covers only the records
+    mu32_Crc = 0xFFFFFFFF;
+    uint32_t u32_Written = 0;
+    while (b_Success && mu32_SortUsed > 0)
+    {
+        // Heap sort: the max-heap becomes an ascending array
+        for (uint32_t u32_End = mu32_SortUsed - 1; u32_End > 0; u32_End--)
+        {
+            Swap(0, u32_End);
+            SiftDown(0, u32_End);
+        }
+
+        for (uint32_t i=0; i<mu32_SortUsed && b_Success; i++)
+        {
+            byte u8_Record[SNAP_RECORD_SIZE];
+            Utils::WriteLE64(u8_Record,     mu64_SortID[i]);
+            Utils::WriteLE32(u8_Record + 8, mu32_SortCount[i]);
+            mu32_Crc  = Utils::CalcCrc32(u8_Record, SNAP_RECORD_SIZE, mu32_Crc);
+            b_Success = Put(u8_Record, SNAP_RECORD_SIZE);
+        }
+
+        u32_Written += mu32_SortUsed;
+        u64_Last     = mu64_SortID[mu32_SortUsed - 1];
+        if (b_Success && u32_Written < u32_Total)
+            Collect(pi_DB, u64_Last, NULL);
+        else
+            mu32_SortUsed = 0;
+    }
+
+    // The trailer and the last partial sector
+    byte u8_Trailer[4];
+    Utils::WriteLE32(u8_Trailer, mu32_Crc);
+    if (b_Success)
+        b_Success = Put(u8_Trailer, sizeof(u8_Trailer)) && u32_Written == u32_Total;
+    if (b_Success && mu32_ChunkPos > 0)
+        b_Success = SDCard::Write(&mi_Out, mu8_Chunk, mu32_ChunkPos);
+
+    SDCard::Close(&mi_Out);
+    return b_Success;
+}
+
+// Opens a snapshot for reading and checks the header.
+// The records are not checked here, see Verify().
+bool Snapshot::Open(const char* s8_Path)
+{
+    byte u8_Header[SNAP_HEADER_SIZE];
+
+    Close();
+    mi_File = SDCard::Open(s8_Path);
+    if (!mi_File)
+        return false;
+
+    if (SDCard::Read(&mi_File, u8_Header, sizeof(u8_Header)) != sizeof(u8_Header) ||
+        Utils::ReadLE32(u8_Header) != SNAP_MAGIC || u8_Header[4] != SNAP_VERSION || u8_Header[6] != SNAP_RECORD_SIZE ||
+        Utils::ReadLE32(u8_Header + 28) != Utils::CalcCrc32(u8_Header, 28))
+    {
+        Close();
+        return false;
+    }
+
+    mu32_Count = Utils::ReadLE32(u8_Header + 16);
+    mu32_Next  = 0;
+    memcpy(ms8_Date, u8_Header + 8, 8);
+    ms8_Date[8] = 0;
+
+    // The file must contain all records and the trailer
+    if (mi_File.size() < SNAP_HEADER_SIZE + mu32_Count * SNAP_RECORD_SIZE + 4)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void Snapshot::Close(void)
+{
+    if (mi_File)
+        SDCard::Close(&mi_File);
+
+    mu32_Count = 0;
+    mu32_Next  = 0;
+}
+
+// Reads the records in ascending order of the UID.
+// returns false after the last record or if the SD card cannot be read
+bool Snapshot::Next(uint64_t* pu64_ID, uint32_t* pu32_Count)
+{
+    if (mu32_Next >= mu32_Count)
+        return false;
+
+    if (!ReadRecord(mu32_Next, pu64_ID, pu32_Count))
+        return false;
+
+    mu32_Next ++;
+    return true;
+}
+
+// Searches the count of a card with a binary search.
+// returns false if the card is not in the snapshot
+bool Snapshot::Find(uint64_t u64_ID, uint32_t* pu32_Count)
+{
+    uint32_t u32_Low  = 0;
+    uint32_t u32_High = mu32_Count;
+    while (u32_Low < u32_High)
+    {
+        uint32_t u32_Mid = (u32_Low + u32_High) / 2;
+        uint64_t u64_MidID;
+        if (!ReadRecord(u32_Mid, &u64_MidID, pu32_Count))
+            return false;
+
+        if (u64_MidID == u64_ID)
+            return true;
+
+        if (u64_MidID < u64_ID) u32_Low  = u32_Mid + 1;
+        else                    u32_High = u32_Mid;
+    }
+    return false;
+}
+
+// Reads all records and checks the CRC of the trailer and the order of the UIDs.
+// Next() starts again with the first record afterwards.
+bool Snapshot::Verify(void)
+{
+    uint32_t u32_Crc  = 0xFFFFFFFF;
+    uint64_t u64_Last = 0;
+    byte     u8_Record[SNAP_RECORD_SIZE];
+
+    if (!mi_File || !SDCard::Seek(&mi_File, SNAP_HEADER_SIZE))
+        return false;
+
+    for (uint32_t i=0; i<mu32_Count; i++)
+    {
+        if (SDCard::Read(&mi_File, u8_Record, SNAP_RECORD_SIZE) != SNAP_RECORD_SIZE)
+            return false;
+
+        uint64_t u64_ID = Utils::ReadLE64(u8_Record);
+        if (u64_ID <= u64_Last)
+            return false;
+
+        u64_Last = u64_ID;
+        u32_Crc  = Utils::CalcCrc32(u8_Record, SNAP_RECORD_SIZE, u32_Crc);
+    }
+
+    mu32_Next = 0;
+    return SDCard::Read(&mi_File, u8_Record, 4) == 4 && Utils::ReadLE32(u8_Record) == u32_Crc;
+}
+
+uint32_t Snapshot::GetCount(void)
+{
+    return mu32_Count;
+}
+
+// returns "YYYYMMDD"
+const char* Snapshot::GetDate(void)
+{
+    return ms8_Date;
+}
+
+// Compares two snapshots that have been opened. f_Diff is called for each card whose count is different.
+// Both files are read sequentially from the first record.
+// returns false if a snapshot cannot be read
+bool Snapshot::Diff(Snapshot* pi_Old, Snapshot* pi_New, SnapDiffFunc f_Diff)
+{
+    uint64_t u64_OldID = 0, u64_NewID = 0;
+    uint32_t u32_OldCount = 0, u32_NewCount = 0;
+
+    pi_Old->mu32_Next = 0;
+    pi_New->mu32_Next = 0;
+    bool b_Old = pi_Old->Next(&u64_OldID, &u32_OldCount);
+    bool b_New = pi_New->Next(&u64_NewID, &u32_NewCount);
+
+    while (b_Old || b_New)
+    {
+        if (b_Old && (!b_New || u64_OldID < u64_NewID))
+        {
+            f_Diff(u64_OldID, u32_OldCount, 0);
+            b_Old = pi_Old->Next(&u64_OldID, &u32_OldCount);
+        }
+        else if (b_New && (!b_Old || u64_NewID < u64_OldID))
+        {
+            f_Diff(u64_NewID, 0, u32_NewCount);
+            b_New = pi_New->Next(&u64_NewID, &u32_NewCount);
+        }
+        else
+        {
+            if (u32_OldCount != u32_NewCount)
+                f_Diff(u64_NewID, u32_OldCount, u32_NewCount);
+
+            b_Old = pi_Old->Next(&u64_OldID, &u32_OldCount);
+            b_New = pi_New->Next(&u64_NewID, &u32_NewCount);
+        }
+    }
+
+    // A read error stops Next() early
+    return pi_Old->mu32_Next == pi_Old->mu32_Count && pi_New->mu32_Next == pi_New->mu32_Count;
+}
+
+// ----------------------------------------------------------------------
+
+// Collects the SNAP_SORT_SIZE smallest UIDs above u64_Last from the dirty records into a max-heap.
+// pu32_Total receives the number of all dirty cards (may be NULL).
+// A record that cannot be read is skipped, Write() detects this by the number of records.
+void Snapshot::Collect(CounterDB* pi_DB, uint64_t u64_Last, uint32_t* pu32_Total)
+{
+    uint32_t u32_Record = 0;
+    uint32_t u32_Total  = 0;
+    mu32_SortUsed = 0;
+
+    while (pi_DB->NextDirty(&u32_Record))
+    {
+        uint64_t u64_ID;
+        uint32_t u32_Count;
+        if (pi_DB->ReadSlot(u32_Record, &u64_ID, &u32_Count))
+        {
+            u32_Total ++;
+            if (u64_ID > u64_Last)
+            {
+                if (mu32_SortUsed < SNAP_SORT_SIZE)
+                {
+                    // Insert at the end and move up
+                    uint32_t i = mu32_SortUsed ++;
+                    mu64_SortID   [i] = u64_ID;
+                    mu32_SortCount[i] = u32_Count;
+                    while (i > 0 && mu64_SortID[(i - 1) / 2] < mu64_SortID[i])
+                    {
+                        Swap(i, (i - 1) / 2);
+                        i = (i - 1) / 2;
+                    }
+                }
+                else if (u64_ID < mu64_SortID[0])
+                {
+                    // Replace the largest UID
+                    mu64_SortID   [0] = u64_ID;
+                    mu32_SortCount[0] = u32_Count;
+                    SiftDown(0, mu32_SortUsed);
+                }
+            }
+        }
+        u32_Record ++;
+    }
+
+    if (pu32_Total)
+        *pu32_Total = u32_Total;
+}
+
+void Snapshot::SiftDown(uint32_t u32_Root, uint32_t u32_Size)
+{
+    while (true)
+    {
+        uint32_t u32_Max   = u32_Root;
+        uint32_t u32_Left  = 2 * u32_Root + 1;
+        uint32_t u32_Right = u32_Left + 1;
+        if (u32_Left  < u32_Size && mu64_SortID[u32_Left]  > mu64_SortID[u32_Max]) u32_Max = u32_Left;
+        if (u32_Right < u32_Size && mu64_SortID[u32_Right] > mu64_SortID[u32_Max]) u32_Max = u32_Right;
+        if (u32_Max == u32_Root)
+            return;
+
+        Swap(u32_Root, u32_Max);
+        u32_Root = u32_Max;
+    }
+}
+
+void Snapshot::Swap(uint32_t a, uint32_t b)
+{
+    uint64_t u64_ID    = mu64_SortID[a];
+    uint32_t u32_Count = mu32_SortCount[a];
+    mu64_SortID   [a] = mu64_SortID[b];
+    mu32_SortCount[a] = mu32_SortCount[b];
+    mu64_SortID   [b] = u64_ID;
+    mu32_SortCount[b] = u32_Count;
+}
+
+// Appends data to the output. A full sector is written at once.
+bool Snapshot::Put(const byte* u8_Data, uint32_t u32_Length)
+{
+    while (u32_Length > 0)
+    {
+        uint32_t u32_Copy = min(u32_Length, SNAP_SECTOR_SIZE - mu32_ChunkPos);
+        memcpy(mu8_Chunk + mu32_ChunkPos, u8_Data, u32_Copy);
+        mu32_ChunkPos += u32_Copy;
+        u8_Data       += u32_Copy;
+        u32_Length    -= u32_Copy;
+
+        if (mu32_ChunkPos == SNAP_SECTOR_SIZE)
+        {
+            if (!SDCard::Write(&mi_Out, mu8_Chunk, SNAP_SECTOR_SIZE))
+                return false;
+            mu32_ChunkPos = 0;
+        }
+    }
+    return true;
+}
+
+bool Snapshot::ReadRecord(uint32_t u32_Index, uint64_t* pu64_ID, uint32_t* pu32_Count)
+{
+    byte u8_Record[SNAP_RECORD_SIZE];
+    if (!SDCard::Seek(&mi_File, SNAP_HEADER_SIZE + u32_Index * SNAP_RECORD_SIZE) ||
+        SDCard::Read(&mi_File, u8_Record, SNAP_RECORD_SIZE) != SNAP_RECORD_SIZE)
+        return false;
+
+    *pu64_ID    = Utils::ReadLE64(u8_Record);
+    *pu32_Count = Utils::ReadLE32(u8_Record + 8);
+    return true;
+}
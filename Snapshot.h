@@ -0,0 +1,75 @@
+/**************************************************************************
+    class Snapshot: All counters of a backup packed into one file.
+
+    Before, a backup folder contained one 4 byte file per card and each file occupied a whole FAT cluster.
+    A snapshot is one file with a sorted table (all values little endian):
+    Header:   magic "NFCS", version (16 bit), record size (16 bit), date "YYYYMMDD" (8 characters),
+              number of records (32 bit), reserved (8 bytes), CRC32 of the first 28 bytes
+    Records:  UID (64 bit), count (32 bit), sorted by UID in ascending order
+    Trailer:  CRC32 of all records
+
+    The file is written in full sectors (only the last one is partial).
+    The records are sorted with a fixed buffer of SNAP_SORT_SIZE entries: Each pass over the dirty records of
+    the counter database collects the next SNAP_SORT_SIZE UIDs, so normally one pass is enough.
+
+    Reading: Open() checks the header, Next() reads the records sequentially, Find() uses a binary search.
+    Diff() compares two snapshots in one sequential pass over both files.
+**************************************************************************/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "Utils.h"
+#include "CounterDB.h"
+
+// The name of the snapshot file in a backup folder
+#define SNAP_FILE_NAME     "SNAPSHOT.DAT"
+
+#define SNAP_MAGIC         (0x53434E4Eu) // "NFCS"
+#define SNAP_VERSION       (1u)
+#define SNAP_HEADER_SIZE   (32u)
+#define SNAP_RECORD_SIZE   (12u)
+#define SNAP_SECTOR_SIZE   (512u)
+// The number of records that are sorted in RAM in one pass (12 bytes each)
+#define SNAP_SORT_SIZE     (256u)
+
+// Called by Diff() for each card whose count is different. A card that is missing in a snapshot has the count zero.
+typedef void (*SnapDiffFunc)(uint64_t u64_ID, uint32_t u32_OldCount, uint32_t u32_NewCount);
+
+class Snapshot
+{
+public:
+    Snapshot();
+    static bool Write(const char* s8_Path, const char* s8_Date, CounterDB* pi_DB);
+    bool        Open(const char* s8_Path);
+    void        Close(void);
+    bool        Next(uint64_t* pu64_ID, uint32_t* pu32_Count);
+    bool        Find(uint64_t u64_ID, uint32_t* pu32_Count);
+    bool        Verify(void);
+    uint32_t    GetCount(void);
+    const char* GetDate(void);
+    static bool Diff(Snapshot* pi_Old, Snapshot* pi_New, SnapDiffFunc f_Diff);
+
+private:
+    static void     Collect(CounterDB* pi_DB, uint64_t u64_Last, uint32_t* pu32_Total);
+    static void     SiftDown(uint32_t u32_Root, uint32_t u32_Size);
+    static void     Swap(uint32_t a, uint32_t b);
+    static bool     Put(const byte* u8_Data, uint32_t u32_Length);
+    bool            ReadRecord(uint32_t u32_Index, uint64_t* pu64_ID, uint32_t* pu32_Count);
+
+    File        mi_File;
+    uint32_t    mu32_Count;     // the number of records
+    uint32_t    mu32_Next;      // the record that Next() returns
+    char        ms8_Date[9];
+
+    // The writer: only one snapshot is written at a time
+    static File     mi_Out;
+    static byte     mu8_Chunk[SNAP_SECTOR_SIZE];
+    static uint32_t mu32_ChunkPos;
+    static uint32_t mu32_Crc;
+    static uint32_t mu32_SortUsed;
+    static uint64_t mu64_SortID   [SNAP_SORT_SIZE];
+    static uint32_t mu32_SortCount[SNAP_SORT_SIZE];
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,283 @@
+/**************************************************************************
+    class TapBuffer: Counts the taps while the SD card is not available.
+**************************************************************************/
+
+#include "Config.h"
+#include "TapBuffer.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "EventLog.h"
+
+kTapEntry TapBuffer::mk_Entries[TAPBUF_SIZE];
+byte      TapBuffer::mu8_Count  = 0;
+bool      TapBuffer::mb_Active  = false;
+byte      TapBuffer::mu8_Uncommitted       = 0;
+uint32_t  TapBuffer::mu32_UncommittedSince = 0;
+
+// Loads the taps that have been buffered before a reset.
+// If there are any, the buffer is active until Replay() has written them to the SD card.
+void TapBuffer::Begin(void)
+{
+    EEPROM.begin(EEPROM_LENGTH);
+
+    byte u8_Header[TAPBUF_HEADER_SIZE];
+    for (uint32_t i=0; i<TAPBUF_HEADER_SIZE; i++)
+    {
+        u8_Header[i] = EEPROM.read(TAPBUF_EEPROM_OFFSET + i);
+    }
+
+    mu8_Count       = 0;
+    mu8_Uncommitted = 0;
+    if (UserManager::HasReservedUsers())
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("Error: Users are stored in the EEPROM of the tap buffer. Delete the users above 96 to use it.\r\n");
+#endif
+        return;
+    }
+
+    uint16_t u16_Count = Utils::ReadLE16(u8_Header + 4);
+    if (Utils::ReadLE32(u8_Header) != TAPBUF_MAGIC || u16_Count > TAPBUF_SIZE)
+        return; // never used
+
+    uint32_t u32_Crc = Utils::CalcCrc32(u8_Header, 12, 0xFFFFFFFF);
+    for (uint16_t E=0; E<u16_Count; E++)
+    {
+        byte u8_Entry[TAPBUF_ENTRY_SIZE];
+        for (uint32_t i=0; i<TAPBUF_ENTRY_SIZE; i++)
+        {
+            u8_Entry[i] = EEPROM.read(TAPBUF_EEPROM_OFFSET + TAPBUF_HEADER_SIZE + E * TAPBUF_ENTRY_SIZE + i);
+        }
+        u32_Crc = Utils::CalcCrc32(u8_Entry, TAPBUF_ENTRY_SIZE, u32_Crc);
+
+        mk_Entries[E].u64_ID     = Utils::ReadLE64(u8_Entry);
+        mk_Entries[E].u32_Count  = Utils::ReadLE32(u8_Entry + 8);
+        mk_Entries[E].u16_Events = Utils::ReadLE16(u8_Entry + 12);
+        mk_Entries[E].u16_Flags  = Utils::ReadLE16(u8_Entry + 14);
+    }
+
+    if (u32_Crc != Utils::ReadLE32(u8_Header + 12))
+    {
+#ifdef STD_PRINT_EN
+        Utils::Print("Error: The buffered taps in the EEPROM are corrupt\r\n");
+#endif
+        return;
+    }
+
+    mu8_Count = (byte)u16_Count;
+    mb_Active = mu8_Count > 0;
+#ifdef STD_PRINT_EN
+    char s8_Buf[80];
+    sprintf(s8_Buf, "%u cards have been counted while the SD card was missing\r\n", (unsigned)mu8_Count);
+    Utils::Print(s8_Buf);
+#endif
+}
+
+// The SD card has failed: Moves the dirty counters of the CounterCache into the buffer (as totals).
+// From now on all taps are counted in the buffer until Replay() has succeeded.
+void TapBuffer::Capture(void)
+{
+    uint64_t u64_ID;
+    uint32_t u32_Count;
+    for (byte P=0; CounterCache::GetDirty(P, &u64_ID, &u32_Count); P++)
+    {
+        int s32_Index = Find(u64_ID);
+        if (s32_Index < 0)
+        {
+            // TAPBUF_SIZE > CACHE_MAX_USED, so an empty buffer has room for all dirty counters
+            if (mu8_Count >= TAPBUF_SIZE)
+                break;
+            s32_Index = mu8_Count ++;
+            mk_Entries[s32_Index].u64_ID     = u64_ID;
+            mk_Entries[s32_Index].u16_Events = 0;
+        }
+        // The taps are already in the event log (in RAM)
+        mk_Entries[s32_Index].u32_Count = u32_Count;
+        mk_Entries[s32_Index].u16_Flags = TAPBUF_FLAG_TOTAL;
+    }
+
+    // The counters are now in the buffer. The cache is loaded again from the SD card after Replay().
+    CounterCache::Invalidate();
+    if (mu8_Count > 0)
+        Save(true);
+
+    mb_Active = true;
+}
+
+// Counts a tap while the SD card is not available.
+// pu32_Count receives the total count (pb_Total = true) or the taps since the SD card failed (pb_Total = false).
+// returns false if the buffer is full
+bool TapBuffer::Add(uint64_t u64_ID, uint32_t* pu32_Count, bool* pb_Total)
+{
+    int s32_Index = Find(u64_ID);
+    if (s32_Index < 0)
+    {
+        if (mu8_Count >= TAPBUF_SIZE)
+            return false;
+
+        s32_Index = mu8_Count ++;
+        memset(&mk_Entries[s32_Index], 0, sizeof(kTapEntry));
+        mk_Entries[s32_Index].u64_ID = u64_ID;
+    }
+
+    kTapEntry* pk_Entry = &mk_Entries[s32_Index];
+    if (pk_Entry->u16_Events == 0xFFFF)
+        return false;
+
+    pk_Entry->u32_Count  ++;
+    pk_Entry->u16_Events ++;
+
+    if (mu8_Uncommitted == 0)
+        mu32_UncommittedSince = Utils::GetMillis();
+    Save(++mu8_Uncommitted >= TAPBUF_COMMIT_TAPS);
+
+    *pu32_Count = pk_Entry->u32_Count;
+    *pb_Total   = (pk_Entry->u16_Flags & TAPBUF_FLAG_TOTAL) != 0;
+    return true;
+}
+
+// Writes the buffered counters into the counter database and the buffered taps into the event log.
+// The SD card must have been mounted and the event log must be ready.
+// returns false if the SD card has failed again. The taps that have not been written stay in the buffer.
+bool TapBuffer::Replay(void)
+{
+    if (mu8_Count == 0)
+    {
+        mb_Active = false;
+        return true;
+    }
+
+    // 1.) Convert the taps since the SD card failed into totals and store them in the EEPROM
+    bool b_Changed = false;
+    for (byte E=0; E<mu8_Count; E++)
+    {
+        kTapEntry* pk_Entry = &mk_Entries[E];
+        if (pk_Entry->u16_Flags & TAPBUF_FLAG_TOTAL)
+            continue;
+
+        uint32_t u32_Stored;
+        if (!gi_CounterDB.Read(pk_Entry->u64_ID, &u32_Stored))
+        {
+            if (gi_CounterDB.HasIOError())
+                return false;
+            u32_Stored = 0; // both slots are corrupt, the record is written new
+        }
+        pk_Entry->u32_Count += u32_Stored;
+        pk_Entry->u16_Flags |= TAPBUF_FLAG_TOTAL;
+        b_Changed = true;
+    }
+    if (b_Changed)
+        Save(true);
+
+    // 2.) Write the totals. This can be repeated.
+    for (byte E=0; E<mu8_Count; E++)
+    {
+        if (!gi_CounterDB.Write(mk_Entries[E].u64_ID, mk_Entries[E].u32_Count))
+            return false;
+    }
+
+    // 3.) The taps in the event log get the time of the replay
+    for (byte E=0; E<mu8_Count; E++)
+    {
+        kTapEntry* pk_Entry = &mk_Entries[E];
+        while (pk_Entry->u16_Events > 0)
+        {
+            if (!EventLog::Append(pk_Entry->u64_ID, LOG_FLAG_REPLAYED))
+            {
+                Save(true);
+                return false;
+            }
+            pk_Entry->u16_Events --;
+        }
+    }
+    if (!EventLog::Flush())
+    {
+        Save(true);
+        return false;
+    }
+
+#ifdef STD_PRINT_EN
+    char s8_Buf[80];
+    sprintf(s8_Buf, "Replayed the buffered taps of %u cards\r\n", (unsigned)mu8_Count);
+    Utils::Print(s8_Buf);
+#endif
+
+    mu8_Count = 0;
+    mb_Active = false;
+    Save(true);
+    return true;
+}
+
+// returns true while the taps are counted in the buffer
+bool TapBuffer::IsActive(void)
+{
+    return mb_Active;
+}
+
+// returns the number of cards in the buffer
+byte TapBuffer::GetCount(void)
+{
+    return mu8_Count;
+}
+
+// Executed by the scheduler every TAPBUF_TASK_INTERVAL.
+// Commits the taps that Add() has not committed yet when the oldest one is older than TAPBUF_COMMIT_DELAY.
+void TapBuffer::Task(void)
+{
+    if (mu8_Uncommitted > 0 && Utils::GetMillis() - mu32_UncommittedSince >= TAPBUF_COMMIT_DELAY)
+        Save(true);
+}
+
+// ----------------------------------------------------------------------
+
+// returns the index of the card in the buffer or -1
+int TapBuffer::Find(uint64_t u64_ID)
+{
+    for (byte E=0; E<mu8_Count; E++)
+    {
+        if (mk_Entries[E].u64_ID == u64_ID)
+            return E;
+    }
+    return -1;
+}
+
+// Mirrors the buffer to the EEPROM. EEPROM.write() only changes the RAM copy, commit() writes the flash sector.
+// b_Commit = false leaves the flash sector unchanged, the changes are lost on a reset.
+// The users of an older firmware are not overwritten, then the buffer is only kept in RAM.
+void TapBuffer::Save(bool b_Commit)
+{
+    if (b_Commit)
+        mu8_Uncommitted = 0;
+
+    if (UserManager::HasReservedUsers())
+        return;
+
+    byte u8_Header[TAPBUF_HEADER_SIZE];
+    memset(u8_Header, 0, sizeof(u8_Header));
+    Utils::WriteLE32(u8_Header,     TAPBUF_MAGIC);
+    Utils::WriteLE16(u8_Header + 4, mu8_Count);
+
+    uint32_t u32_Crc = Utils::CalcCrc32(u8_Header, 12, 0xFFFFFFFF);
+    for (byte E=0; E<mu8_Count; E++)
+    {
+        byte u8_Entry[TAPBUF_ENTRY_SIZE];
+        Utils::WriteLE64(u8_Entry,      mk_Entries[E].u64_ID);
+        Utils::WriteLE32(u8_Entry +  8, mk_Entries[E].u32_Count);
+        Utils::WriteLE16(u8_Entry + 12, mk_Entries[E].u16_Events);
+        Utils::WriteLE16(u8_Entry + 14, mk_Entries[E].u16_Flags);
+        u32_Crc = Utils::CalcCrc32(u8_Entry, TAPBUF_ENTRY_SIZE, u32_Crc);
+
+        for (uint32_t i=0; i<TAPBUF_ENTRY_SIZE; i++)
+        {
+            EEPROM.write(TAPBUF_EEPROM_OFFSET + TAPBUF_HEADER_SIZE + E * TAPBUF_ENTRY_SIZE + i, u8_Entry[i]);
+        }
+    }
+    Utils::WriteLE32(u8_Header + 12, u32_Crc);
+
+    for (uint32_t i=0; i<TAPBUF_HEADER_SIZE; i++)
+    {
+        EEPROM.write(TAPBUF_EEPROM_OFFSET + i, u8_Header[i]);
+    }
+    if (b_Commit)
+        EEPROM.commit();
+}
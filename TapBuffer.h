@@ -0,0 +1,79 @@
+/**************************************************************************
+    class TapBuffer: Counts the taps while the SD card is not available.
+
+    When the SD card fails (or is removed) the dirty counters of the CounterCache are moved into this buffer
+    and all following taps are counted here until the SD card has been mounted again.
+    Then Replay() writes the counters into the counter database and the taps into the event log.
+
+    The buffer is kept in RAM and mirrored to the last TAPBUF_EEPROM_SIZE bytes of the EEPROM,
+    so the taps also survive a power failure or a reset while the SD card is missing.
+    On the ESP8266 the EEPROM is emulated in a flash sector and EEPROM.commit() erases and rewrites the whole sector
+    including the users. A power failure during the commit can destroy the sector, so the taps are not committed
+    one by one: Add() commits every TAPBUF_COMMIT_TAPS taps and Task() commits the remaining taps after TAPBUF_COMMIT_DELAY.
+    A power failure loses at most the taps of the last TAPBUF_COMMIT_DELAY (less than TAPBUF_COMMIT_TAPS).
+    Capture() and Replay() commit immediately, because they move counters between the SD card and the buffer.
+    While an older firmware has stored users in these bytes (see UserManager::HasReservedUsers()) the users are kept
+    and the buffer is only kept in RAM.
+
+    EEPROM layout (all values little endian):
+    Header:   magic "NFCT", number of entries (16 bit), reserved (16 bit), reserved (32 bit), CRC32 of the header and all entries
+    Entries:  UID (64 bit), count (32 bit), taps not yet in the event log (16 bit), flags (16 bit)
+
+    An entry holds either the number of taps since the SD card failed (delta) or the total count of the card (TAPBUF_FLAG_TOTAL).
+    The counters taken from the CounterCache are totals. Replay() first converts all deltas into totals and stores them
+    in the EEPROM, so writing the totals can be repeated after a power failure without counting a tap twice.
+    Only the taps in the event log can be duplicated when the power fails during the replay.
+**************************************************************************/
+
+#ifndef TAPBUFFER_H
+#define TAPBUFFER_H
+
+#include "Utils.h"
+#include "UserManager.h"
+
+#define TAPBUF_HEADER_SIZE   (16u)
+#define TAPBUF_ENTRY_SIZE    (16u)
+// The number of cards that can be buffered (63). This must be more than CACHE_MAX_USED.
+#define TAPBUF_SIZE          ((TAPBUF_EEPROM_SIZE - TAPBUF_HEADER_SIZE) / TAPBUF_ENTRY_SIZE)
+
+// Add() commits the EEPROM after this number of taps
+#define TAPBUF_COMMIT_TAPS   (16u)
+// Task() commits the EEPROM when the oldest uncommitted tap is older than this (milliseconds)
+#define TAPBUF_COMMIT_DELAY  (60000u)
+// The interval in milliseconds in which Task() must be executed by the scheduler
+#define TAPBUF_TASK_INTERVAL (1000u)
+
+// Entry flags
+#define TAPBUF_FLAG_TOTAL    (0x01u) // u32_Count is the total count of the card, otherwise the taps since the SD card failed
+
+struct kTapEntry
+{
+    uint64_t u64_ID;
+    uint32_t u32_Count;
+    uint16_t u16_Events;   // taps that have not yet been written to the event log
+    uint16_t u16_Flags;
+};
+
+class TapBuffer
+{
+public:
+    static void Begin(void);
+    static void Capture(void);
+    static bool Add(uint64_t u64_ID, uint32_t* pu32_Count, bool* pb_Total);
+    static bool Replay(void);
+    static bool IsActive(void);
+    static byte GetCount(void);
+    static void Task(void);
+
+private:
+    static int  Find(uint64_t u64_ID);
+    static void Save(bool b_Commit);
+
+    static kTapEntry mk_Entries[TAPBUF_SIZE];
+    static byte      mu8_Count;
+    static bool      mb_Active;             // the SD card has failed, the taps are counted in this buffer
+    static byte      mu8_Uncommitted;       // taps that are only in the RAM copy of the EEPROM
+    static uint32_t  mu32_UncommittedSince; // the time of the oldest uncommitted tap
+};
+
+#endif // TAPBUFFER_H
@@ -16,6 +16,15 @@
 
 #define EEPROM_LENGTH (4096u)
 
+// The last bytes of the EEPROM are reserved for the TapBuffer (taps counted while the SD card is missing).
+// The users are stored in front of it (96 users).
+// An older firmware has stored up to 128 users in the whole EEPROM. As long as a user is stored in the reserved
+// bytes the users keep the whole EEPROM and the TapBuffer is only kept in RAM (see HasReservedUsers()).
+#define TAPBUF_EEPROM_SIZE    (1024u)
+#define TAPBUF_EEPROM_OFFSET  (EEPROM_LENGTH - TAPBUF_EEPROM_SIZE)
+#define USER_EEPROM_LENGTH    TAPBUF_EEPROM_OFFSET
+#define TAPBUF_MAGIC          (0x5443464Eu) // "NFCT", the first bytes of the TapBuffer in the EEPROM
+
 // Defines the maximum characters that can be stored for a user name + terminating zero character.
 // The smaller this value, the more users fit into the EEPROM.
 // The EEPROM is filled with kUser structures of which each one stores the username and 8 byte for the ID and 1 byte for the user flags.
@@ -61,11 +70,29 @@ class UserManager
 public:
     static void DeleteAllUsers()
     {
-        for (uint16_t i=0; i<EEPROM_LENGTH; i++)
+        uint32_t u32_Length = GetUserLength();
+        for (uint32_t i=0; i<u32_Length; i++)
         {
             EEPROM.write(i, 0);
         }
     }
+
+    // returns true if an older firmware has stored users in the bytes that are reserved for the TapBuffer.
+    // The users are stored without gaps, so the first reserved slot is occupied.
+    // The TapBuffer starts with TAPBUF_MAGIC, the erased flash of the ESP8266 is 0xFF.
+    static bool HasReservedUsers()
+    {
+        kUser k_User;
+        byte* pu8_Ptr = (byte*)&k_User;
+        for (uint32_t i=0; i<sizeof(k_User.ID); i++)
+        {
+            pu8_Ptr[i] = EEPROM.read(TAPBUF_EEPROM_OFFSET + i);
+        }
+
+        if (Utils::ReadLE32(k_User.ID.u8) == TAPBUF_MAGIC)
+            return false;
+        return k_User.ID.u64 != 0 && k_User.ID.u64 != 0xFFFFFFFFFFFFFFFFull;
+    }
     
     static bool FindUser(uint64_t u64_ID, kUser* pk_User)
     {
@@ -244,12 +271,18 @@ public:
     }
 
 private:
+    // returns the bytes of the EEPROM that store users
+    static uint32_t GetUserLength()
+    {
+        return HasReservedUsers() ? EEPROM_LENGTH : USER_EEPROM_LENGTH;
+    }
+
     // Writes one user to the EEPROM
     // returns false if index out of range
     static bool WriteUserAt(int s32_Index, kUser* pk_User)
     {
         uint32_t P = s32_Index * sizeof(kUser);
-        if (P + sizeof(kUser) > EEPROM_LENGTH)
+        if (P + sizeof(kUser) > GetUserLength())
             return false;
     
         byte* pu8_Ptr = (byte*)pk_User;
@@ -265,7 +298,7 @@ private:
     static bool ReadUserAt(int s32_Index, kUser* pk_User)
     {
         uint32_t P = s32_Index * sizeof(kUser);
-        if (P + sizeof(kUser) > EEPROM_LENGTH)
+        if (P + sizeof(kUser) > GetUserLength())
             return false;
     
         byte* pu8_Ptr = (byte*)pk_User;
@@ -282,7 +315,7 @@ private:
     static bool ShiftUsersUp(int U)
     {
         kUser k_User;
-        int s32_Last = (EEPROM_LENGTH / sizeof(kUser)) -1;
+        int s32_Last = (GetUserLength() / sizeof(kUser)) -1;
         if (!ReadUserAt(s32_Last, &k_User))
             return false; // this should never happen!
     
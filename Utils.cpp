@@ -7,6 +7,12 @@
 #include "PN532.h"
 #include "Utils.h"
 #include "UserManager.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "EventLog.h"
+#include "Snapshot.h"
+#include "TapBuffer.h"
+#include "SDCard.h"
 #include "Graphics.h"
 #include <Stream.h>
 #include <ESP8266WiFi.h>
@@ -135,196 +141,766 @@ void WLAN::Initialize(void)
     //Utils::Print("TCP Server Setup done", LF);
 }
 
-bool WLAN::StartTCP(void)
+// The time in milliseconds that the Android app has to connect
+#define TOTAL_CONNECTION_TIMEOUT (120000UL)
+// The time in milliseconds that the Android app has to connect again and resume an interrupted transfer
+#define RESUME_CONNECTION_TIMEOUT (30000UL)
+// The progress bar is redrawn at most every 200 ms (5 frames per second).
+// Each display() transfers the whole frame over I2C, this time is better spent in the WiFi stack.
+#define CONNECTION_REDRAW_INTERVAL (200UL)
+// The time in milliseconds that the client has to send the secret key
+#define SECRET_KEY_TIMEOUT (1000UL)
+
+// The steps of WLAN::PollTransfer()
+typedef enum {
+	XFER_KEY,       // wait for the secret key
+	XFER_REQUEST,   // wait for the export request of a new client
+	XFER_REQUEST_EXT, // wait for the sync token and the transfer ID of the request
+	XFER_FLUSH,     // write the counters of the latest taps into the database
+	XFER_RECOVER,   // complete the dirty bitmap (one sector per tick)
+	XFER_EXPORT     // WiFiExport::Step()
+} eTransferStep;
+
+byte     WLAN::mu8_Step      = XFER_KEY;
+uint32_t WLAN::mu32_Start    = 0;
+uint32_t WLAN::mu32_Timeout  = TOTAL_CONNECTION_TIMEOUT;
+uint32_t WLAN::mu32_LastDraw = 0;
+uint16_t WLAN::mu16_Version  = EXPORT_ASCII;
+uint64_t WLAN::mu64_Token    = 0;
+uint32_t WLAN::mu32_Resume   = 0;
+
+// Starts the wait for a client. PollClient() must be called in each tick.
+// b_Resume: the transfer has been interrupted (WLAN_INTERRUPTED), the client has RESUME_CONNECTION_TIMEOUT to resume it.
+void WLAN::BeginWait(bool b_Resume)
 {
-#define TOTAL_CONNECTION_TIMEOUT (0xCAFEUL)
-	uint32_t lTimeout = TOTAL_CONNECTION_TIMEOUT;
+	mu32_Start    = Utils::GetMillis();
+	mu32_Timeout  = b_Resume ? RESUME_CONNECTION_TIMEOUT : TOTAL_CONNECTION_TIMEOUT;
+	mu32_LastDraw = mu32_Start - CONNECTION_REDRAW_INTERVAL;
+}
 
-	while(lTimeout)
+// Checks if a client has connected. The timeout is wall clock time (independent of the display speed).
+// The progress bar shows the remaining time.
+// returns WLAN_FAILED if no client has connected within the timeout.
+// Then the interrupted transfer cannot be resumed anymore: The coffees counted after the wait must be sent in a new transfer.
+eWLANStatus WLAN::PollClient(void)
+{
+	if (server.hasClient())
 	{
-		if (server.hasClient())
-		{
-		    //Utils::Print("Client connected");
-		    break;
-		}
-		else
-		{
-			// No connection show progress bar
-			display.setColor(BLACK);
-			display.fillRect(13, 39, 102, 11);
-			display.setColor(WHITE);
-			display.drawProgressBar(14, 40, 100, 8, (lTimeout * 100 / TOTAL_CONNECTION_TIMEOUT));
-			display.display();
-			lTimeout--;
-		}
+	    //Utils::Print("Client connected");
+	    return (WLAN_DONE);
 	}
-	if(0 == lTimeout)
-		return(false);
-	else
-		return(true);
+
+	uint32_t u32_Now     = Utils::GetMillis();
+	uint32_t u32_Elapsed = u32_Now - mu32_Start;
+	if (u32_Elapsed >= mu32_Timeout)
+	{
+		WiFiExport::Cancel();
+		return (WLAN_FAILED);
+	}
+
+	if (u32_Now - mu32_LastDraw >= CONNECTION_REDRAW_INTERVAL)
+	{
+		// No connection show progress bar
+		display.setColor(BLACK);
+		display.fillRect(13, 39, 102, 11);
+		display.setColor(WHITE);
+		display.drawProgressBar(14, 40, 100, 8, ((mu32_Timeout - u32_Elapsed) * 100 / mu32_Timeout));
+		display.display();
+		mu32_LastDraw = u32_Now;
+	}
+	return (WLAN_BUSY);
 }
 
-bool WLAN::StartTransffer(void)
+// Accepts the client that PollClient() has found. PollTransfer() must be called in each tick.
+void WLAN::BeginTransfer(void)
 {
-	bool retVal = true;
+	if (serverClient) serverClient.stop();
+	serverClient = server.available();
+	//Utils::Print("New client\n");
+
+	mu8_Step     = XFER_KEY;
+	mu32_Start   = Utils::GetMillis();
+	mu16_Version = EXPORT_ASCII;
+	mu64_Token   = 0;
+	mu32_Resume  = 0;
+}
 
-	if (!serverClient || !serverClient.connected())
+// Executes the next step of the transfer: secret key, export request, flush and recovery of the database, export.
+// returns WLAN_DONE if the cards have been sent (and the backup may run),
+// WLAN_INTERRUPTED if the connection has been lost and the client can resume the transfer (wait with BeginWait(true)),
+// WLAN_FAILED if the transfer has failed or there is nothing to backup
+eWLANStatus WLAN::PollTransfer(void)
+{
+	uint32_t u32_Now = Utils::GetMillis();
+	switch (mu8_Step)
 	{
-		if (serverClient) serverClient.stop();
-		serverClient = server.available();
-		//Utils::Print("New client\n");
-
-		/* Wait for secret Key */
-		if(true == WLAN::ReadSecretKey(androidDate))
+		case XFER_KEY:
 		{
+			/* A secret key has to be passed and the current device date */
+			if (serverClient.available() < 8)
+			{
+				/* Timeout or wrong stream length */
+				if (!serverClient.connected() || u32_Now - mu32_Start >= SECRET_KEY_TIMEOUT)
+					return EndTransfer(WLAN_FAILED);
+				return (WLAN_BUSY);
+			}
+
+			uint8_t secretKey[8];
+			serverClient.read(secretKey, 8);
+			if (!CheckSecretKey(secretKey, androidDate))
+				return EndTransfer(WLAN_FAILED);
+
 			//Utils::Print(androidDate, LF);
-			root.rewindDirectory();
-			totFiles = Utils::getNumFiles(root);
-			if(0 != totFiles)
+			mu8_Step   = XFER_REQUEST;
+			mu32_Start = u32_Now;
+			return (WLAN_BUSY);
+		}
+
+		case XFER_REQUEST:
+		{
+			/* An old client sends nothing and gets the ASCII export */
+			if (serverClient.available() < 6)
 			{
-				root.rewindDirectory();
-				if(false == Utils::printDirectory(root, totFiles))
-				{
-					/* Transfer failure */
-					retVal = false;
-				}
+				if (u32_Now - mu32_Start >= EXPORT_REQUEST_TIMEOUT)
+					mu8_Step = XFER_FLUSH;
+				return (WLAN_BUSY);
 			}
-			else
+
+			uint8_t request[6];
+			serverClient.read(request, 6);
+			if (EXPORT_REQUEST_MAGIC != Utils::ReadLE32(request))
+			{
+				mu8_Step = XFER_FLUSH;
+				return (WLAN_BUSY);
+			}
+
+			/* The client supports this version or a newer one */
+			mu16_Version = Utils::ReadLE16(request + 4);
+			if (mu16_Version >= EXPORT_VERSION)
+				mu16_Version = EXPORT_VERSION;
+
+			mu8_Step = mu16_Version >= EXPORT_VERSION_SYNC ? XFER_REQUEST_EXT : XFER_FLUSH;
+			return (WLAN_BUSY);
+		}
+
+		case XFER_REQUEST_EXT:
+		{
+			/* From EXPORT_VERSION_SYNC on the sync token of the last transfer (64 bit)
+			   and from EXPORT_VERSION_ACK on the ID of the interrupted transfer to resume (32 bit) */
+			uint32_t u32_Length = mu16_Version >= EXPORT_VERSION_ACK ? 12 : 8;
+			if ((uint32_t)serverClient.available() < u32_Length)
 			{
-				/* There is nothing to backup */
-				retVal = false;
+				/* Without a complete request all cards are sent in a new transfer */
+				if (u32_Now - mu32_Start >= EXPORT_REQUEST_TIMEOUT)
+					mu8_Step = XFER_FLUSH;
+				return (WLAN_BUSY);
 			}
+
+			uint8_t request[12];
+			serverClient.read(request, u32_Length);
+			mu64_Token = Utils::ReadLE64(request);
+			if (u32_Length == 12)
+				mu32_Resume = Utils::ReadLE32(request + 8);
+
+			mu8_Step = XFER_FLUSH;
+			return (WLAN_BUSY);
 		}
-		else
+
+		case XFER_FLUSH:
+			/* The database must contain the counters of the latest taps */
+			if (false == CounterCache::Flush() || false == gi_CounterDB.Open())
+				return EndTransfer(WLAN_FAILED);
+
+			mu8_Step = XFER_RECOVER;
+			return (WLAN_BUSY);
+
+		case XFER_RECOVER:
+			/* The dirty bitmap must be complete, the recovery continues here if DBRecoveryTask() has not finished */
+			if (false == gi_CounterDB.RecoveryStep())
+			{
+				if (gi_CounterDB.HasIOError())
+					return EndTransfer(WLAN_FAILED);
+				return (WLAN_BUSY);
+			}
+
+			/* Only the cards that have been used since the last backup */
+			totFiles = gi_CounterDB.GetDirtyCount();
+			WiFiExport::Begin(totFiles, mu16_Version, mu64_Token, mu32_Resume);
+			mu8_Step = XFER_EXPORT;
+			return (WLAN_BUSY);
+
+		case XFER_EXPORT:
 		{
-			/* Wrong key or no key has been received */
-			retVal = false;
+			eWLANStatus e_Status = WiFiExport::Step();
+			if (WLAN_DONE == e_Status && 0 == totFiles)
+			{
+				/* There is nothing to backup. The binary export is also sent without cards,
+				   so the client knows that the transfer is complete. */
+				e_Status = WLAN_FAILED;
+			}
+			if (WLAN_BUSY == e_Status)
+				return (WLAN_BUSY);
+			return EndTransfer(e_Status);
 		}
-		if (serverClient) serverClient.stop();
+
+		default:
+			return EndTransfer(WLAN_FAILED);
 	}
-	return (retVal);
 }
 
-bool WLAN::ReadSecretKey(char RcvDate[9])
+// Closes the connection to the client at the end of the transfer.
+// A lost connection is reported as WLAN_INTERRUPTED while the client can resume the transfer. This also applies to
+// a failed attempt to resume it, so a client that loses the connection again during the key or the request can try again.
+// An error of the SD card ends the upload.
+eWLANStatus WLAN::EndTransfer(eWLANStatus e_Status)
 {
-	bool retVal = true;
-	uint8_t secretKey[8];
+#ifdef STD_PRINT_EN
+	if (mu8_Step == XFER_EXPORT)
+		SDCard::PrintStats();
+#endif
+	if (serverClient) serverClient.stop();
+	if (WLAN_FAILED == e_Status && mu8_Step != XFER_FLUSH && mu8_Step != XFER_RECOVER && WiFiExport::CanResume())
+		return (WLAN_INTERRUPTED);
+	return (e_Status);
+}
 
-	/* A secret key has to be passed and the current device date */
-	serverClient.setTimeout(1000);
-	if(8u != serverClient.readBytes(secretKey, 8))
+bool WLAN::CheckSecretKey(const uint8_t secretKey[8], char RcvDate[9])
+{
+	/* Check for valid key */
+	uint16_t chkSum1 = ((uint16_t)secretKey[0] << 8) | (uint16_t)secretKey[1];
+	uint16_t chkSum2 = ((uint16_t)secretKey[7] << 8) | (uint16_t)secretKey[6];
+	uint16_t year = ((uint16_t)secretKey[2] << 8) | (uint16_t)secretKey[3];
+	uint8_t month = secretKey[4];
+	uint8_t day = secretKey[5];
+	if((chkSum1 != chkSum2) || ((year + (uint16_t)month + (uint16_t)day) != chkSum1))
+		return (false);
+
+	/* correct key - setup return data */
+	//Utils::PrintHexBuf(secretKey, 8u, LF);
+    char lBuf[9];
+	sprintf(lBuf, "%04d%02d%02d", year, month, day);
+	memcpy(RcvDate, lBuf, 9u);
+	EventLog::SetDate(year, month, day);
+	return (true);
+}
+
+// ----------------------------------------------------------------------
+
+byte     ExportBuffer::mu8_Buffer[EXPORT_BUFFER_SIZE];
+uint32_t ExportBuffer::mu32_Used     = 0;
+uint32_t ExportBuffer::mu32_Crc      = 0xFFFFFFFF;
+uint32_t ExportBuffer::mu32_LastSent = 0;
+bool     ExportBuffer::mb_Error      = false;
+
+// Starts a new transfer to serverClient
+void ExportBuffer::Begin(void)
+{
+	mu32_Used     = 0;
+	mu32_Crc      = 0xFFFFFFFF;
+	mu32_LastSent = Utils::GetMillis();
+	mb_Error      = false;
+}
+
+// Starts the CRC32 of the data that is written from now on.
+// A resumed transfer continues with the CRC32 of the data that has been acknowledged.
+void ExportBuffer::ResetCrc(uint32_t u32_Crc)
+{
+	mu32_Crc = u32_Crc;
+}
+
+uint32_t ExportBuffer::GetCrc(void)
+{
+	return mu32_Crc;
+}
+
+// returns the number of bytes that Write() accepts
+uint32_t ExportBuffer::GetFree(void)
+{
+	return EXPORT_BUFFER_SIZE - mu32_Used;
+}
+
+// returns true if the client has accepted all data
+bool ExportBuffer::IsEmpty(void)
+{
+	return mu32_Used == 0;
+}
+
+// Appends data to the buffer. The caller checks GetFree() before.
+// returns false if the data does not fit or the transfer has failed
+bool ExportBuffer::Write(const byte* u8_Data, uint32_t u32_Length)
+{
+	if (mb_Error || u32_Length > GetFree())
+		return false;
+
+	mu32_Crc = Utils::CalcCrc32(u8_Data, u32_Length, mu32_Crc);
+	memcpy(mu8_Buffer + mu32_Used, u8_Data, u32_Length);
+	mu32_Used += u32_Length;
+	return true;
+}
+
+// Appends a line with "\r\n" (the same as println())
+bool ExportBuffer::Print(const char* s8_Line)
+{
+	uint32_t u32_Length = strlen(s8_Line);
+	if (u32_Length + 2 > GetFree())
+		return false;
+
+	Write((const byte*)s8_Line, u32_Length);
+	return Write((const byte*)LF, 2);
+}
+
+// Passes the buffer to the client. Only as many bytes are written as the client's send window has room for
+// (availableForWrite()), so write() never blocks and the rest stays in the buffer for the next tick.
+// If the window stays closed for EXPORT_WRITE_TIMEOUT the transfer fails.
+// returns false if the client does not accept the data
+bool ExportBuffer::Send(void)
+{
+	uint32_t u32_Now = Utils::GetMillis();
+	if (mb_Error || mu32_Used == 0)
 	{
-		/* Timeout or wrong stream length */
-		retVal = false;
+		mu32_LastSent = u32_Now;
+		return !mb_Error;
 	}
-	else
+
+	uint32_t u32_Window = serverClient.availableForWrite();
+	if (u32_Window > mu32_Used)
+		u32_Window = mu32_Used;
+
+	uint32_t u32_Written = 0;
+	if (u32_Window > 0)
+		u32_Written = serverClient.write(mu8_Buffer, u32_Window);
+
+	if (u32_Written > 0)
 	{
-		/* Check for valid key */
-		uint16_t chkSum1 = ((uint16_t)secretKey[0] << 8) | (uint16_t)secretKey[1];
-		uint16_t chkSum2 = ((uint16_t)secretKey[7] << 8) | (uint16_t)secretKey[6];
-		uint16_t year = ((uint16_t)secretKey[2] << 8) | (uint16_t)secretKey[3];
-		uint8_t month = secretKey[4];
-		uint8_t day = secretKey[5];
-		if((chkSum1 == chkSum2) && ((year + (uint16_t)month + (uint16_t)day) == chkSum1))
-		{
-			/* correct key - setup return data */
-			/* Stub */
-			//Utils::PrintHexBuf(secretKey, 8u, LF);
-		    char lBuf[9];
-			sprintf(lBuf, "%04d%02d%02d", year, month, day);
-			memcpy(RcvDate, lBuf, 9u);
-		}
-		else
-		{
-			retVal = false;
-		}
+		mu32_Used -= u32_Written;
+		memmove(mu8_Buffer, mu8_Buffer + u32_Written, mu32_Used);
+		mu32_LastSent = u32_Now;
 	}
-
-	return (retVal);
+	else if (!serverClient.connected() || u32_Now - mu32_LastSent >= EXPORT_WRITE_TIMEOUT)
+	{
+		mb_Error = true;
+	}
+	return !mb_Error;
 }
 
+// Incremental backup: Only the cards with a count that is not zero are stored in the folder "/YYYYMMDD.BKP",
+// with BACKUP_PACKED in one snapshot file (see Snapshot.h), otherwise each in a file in the format of the
+// old storage (see GetSDCounterForCard()).
+// Then the manifest is written and the counts of these cards are reset to zero.
+// A backup on the same day is stored in the next folder "/YYYYMMDD.BKQ" ... "/YYYYMMDD.BKZ".
+// Other files in the root folder (e.g. corrupt counter files of the old storage) are moved into the backup folder.
 bool Utils::Backup_Data(void)
 {
 	bool retVal = true;
-	bool skipFolderCreation = false;
 	File inputFile;
-    File outputFile;
 	File dir;
 	uint16_t fileIdx = 0;
+	uint32_t u32_Cards = 0;
 
-    uint8_t copyBuf[4];
-
+	char newFolderName[1+8+1+3+1];
+	char prevFolderName[8+1+3+1];
+	char lastFolderName[8+1+3+1];
 
-	char newFolderName[1+8+1+3];
-	sprintf(newFolderName, "/%s.BKP", androidDate);
+	/* Write the cached counters before the backup and find all dirty cards */
+	if(false == CounterCache::Flush() || false == gi_CounterDB.FinishRecovery())
+		return (false);
 
-	/*root.rewindDirectory();
-	dir = root;*/
+	Utils::FindBackups(lastFolderName, prevFolderName);
 
-	/* Create folder if not already exists */
-	if(!SD.exists(newFolderName))
+	/* Create a new folder, an existing folder contains an older backup */
+	for (char Ext = 'P'; ; Ext++)
 	{
-		if(SD.mkdir(newFolderName))
-		{
-			/* Folder creation was successful */
-		} else {
-			/* Error creating folder */
-			/* ToDo: Damn, move to SD error */
-			retVal = false;
-		}
+		if (Ext > 'Z')
+			return (false);
+
+		sprintf(newFolderName, "/%s.BK%c", androidDate, Ext);
+		if (!SDCard::Exists(newFolderName))
+			break;
 	}
-	if(true == retVal)
+	if (!SDCard::Mkdir(newFolderName))
+		return (false);
+
+	root.rewindDirectory();
+	totFiles = Utils::getNumFiles(root) + gi_CounterDB.GetDirtyCount();
+	root.rewindDirectory();
+	dir = root;
+
+	/* we need to move all other files from / to androidDate.bkp/allFiles */
+	while (inputFile = SDCard::OpenNext(&dir, FILE_READ), inputFile)
 	{
-		/* no error creating the folder or folder already there */
-		/* now, copy files */
-		root.rewindDirectory();
-		dir = root;
+	  if (!inputFile.isDirectory() && 0 != strcmp(inputFile.name(), COUNTER_DB_PATH + 1))
+	  {
+		  fileIdx++;
+		  OLEDScreen::ShowProgressBar(fileIdx, totFiles);
 
-		/* we need to copy from allFiles to androidDate.bkp/allFiles */
-		while (inputFile = dir.openNextFile(FILE_READ), inputFile)
-		{
-		  if (!inputFile.isDirectory())
+		  char fileName[8+1+3+1];
+		  char copyFileFullPath[1+8+1+3+1+8+1+3+1];
+		  strcpy(fileName, inputFile.name());
+		  sprintf(copyFileFullPath, "%s/%s", newFolderName, fileName);
+
+		  /* the file must be closed before it can be moved */
+		  SDCard::Close(&inputFile);
+		  if(!Utils::MoveFile(fileName, copyFileFullPath))
 		  {
-			  fileIdx++;
-			  OLEDScreen::ShowProgressBar(fileIdx, totFiles);
-			  //Utils::Print(inputFile.name(), LF);
-
-			  char copyFileFullPath[1+8+1+3+1+8+1+3+1];
-			  sprintf(copyFileFullPath, "%s/%s", newFolderName, inputFile.name());
-			  //Utils::Print(copyFileFullPath, 0);
-
-			  outputFile = SD.open(copyFileFullPath, FILE_WRITE);
-			  if(outputFile)
-			  {
-				  /* copy data */
-				  while (inputFile.available())
-				  {
-					  outputFile.write(inputFile.read());
-				  }
-				  //Utils::Print(".. saved. ", LF);
-				  outputFile.close();
-			  }
-
-			  /* delete original */
-			  if(!SD.remove(inputFile.name()))
-			  {
-				  /* Error deleting */
 #ifdef STD_PRINT_EN
-				  Utils::Print("error deleting: ", 0);
-				  Utils::Print(inputFile.name(), LF);
+			  Utils::Print("error moving: ", 0);
+			  Utils::Print(fileName, LF);
 #endif
-				  retVal = false;
-			  }
+			  retVal = false;
 		  }
-		  inputFile.close();
+		  continue;
+	  }
+	  SDCard::Close(&inputFile);
+	}
+
+	/* Store the dirty cards */
+#if BACKUP_PACKED
+	if (retVal)
+	{
+		char s8_Path[1+8+1+3+1+8+1+3+1];
+		sprintf(s8_Path, "%s/%s", newFolderName, SNAP_FILE_NAME);
+		retVal    = Snapshot::Write(s8_Path, androidDate, &gi_CounterDB);
+		u32_Cards = gi_CounterDB.GetDirtyCount();
+		OLEDScreen::ShowProgressBar(totFiles, totFiles);
+	}
+#else
+	uint32_t u32_Record = 0;
+	while (retVal && gi_CounterDB.NextDirty(&u32_Record))
+	{
+		uint64_t u64_ID;
+		uint32_t u32_Count;
+		if (gi_CounterDB.ReadSlot(u32_Record, &u64_ID, &u32_Count))
+		{
+			fileIdx++;
+			OLEDScreen::ShowProgressBar(fileIdx, totFiles);
+			retVal = Utils::WriteBackupCard(newFolderName, u64_ID, u32_Count);
+			u32_Cards ++;
 		}
+		u32_Record ++;
+	}
+#endif
+
+	/* The backup is complete when the manifest exists. Then the counters are reset. */
+	if (retVal)
+	{
+		const char* s8_Prev = (0 == strcmp(lastFolderName, newFolderName + 1)) ? prevFolderName : lastFolderName;
+		retVal = Utils::WriteManifest(newFolderName, s8_Prev, u32_Cards) &&
+		         Utils::ResetBackupCards(newFolderName, false);
 	}
-	/* create backup folder if no already existing */
-	/* move all files from / to androidDate.bkp */
-	/* return true if anything went well */
+
+	/* The counters in the cache do not match the database anymore */
+	CounterCache::Invalidate();
 	return (retVal);
 }
 
+// Must be called at boot: A backup that has been interrupted by a power failure is finished.
+// If the manifest has been written the counts are reset again (this can be repeated).
+// Otherwise the incomplete backup folder is deleted, the counts are still in the database.
+bool Utils::FinishBackup(void)
+{
+	char s8_Folder[1+8+1+3+1];
+	char s8_Last[8+1+3+1];
+	char s8_Prev[8+1+3+1];
+
+	Utils::FindBackups(s8_Last, s8_Prev);
+	if (s8_Last[0] == 0)
+		return true;
+
+	sprintf(s8_Folder, "/%s", s8_Last);
+	switch (Utils::ReadManifest(s8_Folder))
+	{
+		case MANIFEST_DONE:
+			return true;
+		case MANIFEST_MISSING:
+			return Utils::RemoveFolder(s8_Folder);
+		case MANIFEST_INVALID:
+		{
+			/* The manifest is written after all cards, so the backup is complete. It is written again. */
+			char s8_Path[1+8+1+3+1+8+1+3+1];
+			Snapshot i_Snapshot;
+			sprintf(s8_Path, "%s/%s", s8_Folder, SNAP_FILE_NAME);
+
+			File dir = SDCard::Open(s8_Folder);
+			uint32_t u32_Cards = Utils::getNumFiles(dir) - 1;
+			SDCard::Close(&dir);
+			if (i_Snapshot.Open(s8_Path))
+				u32_Cards = i_Snapshot.GetCount();
+			i_Snapshot.Close();
+
+			if (!Utils::WriteManifest(s8_Folder, s8_Prev, u32_Cards))
+				return false;
+			break;
+		}
+		default:
+			break;
+	}
+
+	bool b_Success = Utils::ResetBackupCards(s8_Folder, true);
+	CounterCache::Invalidate();
+	return b_Success;
+}
+
+// Finds the two newest backup folders ("YYYYMMDD.BK?") in the root folder.
+// An empty string is returned if there is no such folder.
+void Utils::FindBackups(char* s8_Last, char* s8_Prev)
+{
+	File entry;
+	s8_Last[0] = 0;
+	s8_Prev[0] = 0;
+
+	root.rewindDirectory();
+	while (entry = SDCard::OpenNext(&root), entry)
+	{
+		const char* s8_Name = entry.name();
+		if (entry.isDirectory() && strlen(s8_Name) == 12 && 0 == strncmp(s8_Name + 8, ".BK", 3))
+		{
+			if (strcmp(s8_Name, s8_Last) > 0)
+			{
+				strcpy(s8_Prev, s8_Last);
+				strcpy(s8_Last, s8_Name);
+			}
+			else if (strcmp(s8_Name, s8_Prev) > 0)
+			{
+				strcpy(s8_Prev, s8_Name);
+			}
+		}
+		SDCard::Close(&entry);
+	}
+	root.rewindDirectory();
+}
+
+// Writes the count of a card into a backup folder in the format of the old storage.
+// The old format has 16 bit. A higher count is stored as 0xFFFF.
+bool Utils::WriteBackupCard(const char* s8_Folder, uint64_t u64_ID, uint32_t u32_Count)
+{
+	char cardIDString[] = "00000000.000";
+	char copyFileFullPath[1+8+1+3+1+8+1+3+1];
+	Utils::Base36(u64_ID, cardIDString);
+	sprintf(copyFileFullPath, "%s/%s", s8_Folder, cardIDString);
+
+	/* A file which has been moved from the root folder is replaced */
+	if (SDCard::Exists(copyFileFullPath) && !SDCard::Remove(copyFileFullPath))
+		return false;
+
+	File dataFile = SDCard::Open(copyFileFullPath, FILE_WRITE);
+	if (!dataFile)
+		return false;
+
+	uint16_t noOfCoffees = (u32_Count > 0xFFFF) ? 0xFFFF : (uint16_t)u32_Count;
+	uint8_t  bufCoffee[4];
+	bufCoffee[0] = (uint8_t)(noOfCoffees >> 8);
+	bufCoffee[1] = (uint8_t)noOfCoffees;
+	bufCoffee[2] = (uint8_t)~bufCoffee[0];
+	bufCoffee[3] = (uint8_t)~bufCoffee[1];
+
+	bool b_Success = SDCard::Write(&dataFile, bufCoffee, 4u);
+	SDCard::Close(&dataFile);
+	return b_Success;
+}
+
+// The manifest of a backup folder (all values little endian):
+// magic "NFCB", version (16 bit), reserved (16 bit), number of cards (32 bit), name of this folder (12 characters),
+// name of the previous backup folder (12 characters, zero if none), CRC32 of the first 36 bytes.
+// When the counts have been reset, the magic "DONE" is appended.
+bool Utils::WriteManifest(const char* s8_Folder, const char* s8_Prev, uint32_t u32_Cards)
+{
+	char s8_Path[1+8+1+3+1+8+1+3+1];
+	byte u8_Manifest[BACKUP_MANIFEST_SIZE];
+	sprintf(s8_Path, "%s/%s", s8_Folder, BACKUP_MANIFEST);
+
+	memset(u8_Manifest, 0, sizeof(u8_Manifest));
+	Utils::WriteLE32(u8_Manifest, BACKUP_MAGIC);
+	u8_Manifest[4] = BACKUP_VERSION;
+	Utils::WriteLE32(u8_Manifest + 8, u32_Cards);
+	strncpy((char*)u8_Manifest + 12, s8_Folder + 1, 12);
+	strncpy((char*)u8_Manifest + 24, s8_Prev, 12);
+	Utils::WriteLE32(u8_Manifest + 36, Utils::CalcCrc32(u8_Manifest, 36));
+
+	File dataFile = SDCard::Open(s8_Path, FILE_WRITE);
+	if (!dataFile)
+		return false;
+
+	/* A corrupt manifest is overwritten */
+	SDCard::Seek(&dataFile, 0);
+	bool b_Success = SDCard::Write(&dataFile, u8_Manifest, sizeof(u8_Manifest));
+	SDCard::Close(&dataFile);
+	return b_Success;
+}
+
+// returns MANIFEST_MISSING, MANIFEST_INVALID, MANIFEST_PENDING (the counts must be reset) or MANIFEST_DONE
+byte Utils::ReadManifest(const char* s8_Folder)
+{
+	char s8_Path[1+8+1+3+1+8+1+3+1];
+	byte u8_Manifest[BACKUP_MANIFEST_SIZE + 4];
+	sprintf(s8_Path, "%s/%s", s8_Folder, BACKUP_MANIFEST);
+
+	File dataFile = SDCard::Open(s8_Path);
+	if (!dataFile)
+		return MANIFEST_MISSING;
+
+	int s32_Read = SDCard::Read(&dataFile, u8_Manifest, sizeof(u8_Manifest));
+	SDCard::Close(&dataFile);
+
+	if (s32_Read < (int)BACKUP_MANIFEST_SIZE || Utils::ReadLE32(u8_Manifest) != BACKUP_MAGIC ||
+	    Utils::ReadLE32(u8_Manifest + 36) != Utils::CalcCrc32(u8_Manifest, 36))
+		return MANIFEST_INVALID;
+
+	if (s32_Read == sizeof(u8_Manifest) && Utils::ReadLE32(u8_Manifest + BACKUP_MANIFEST_SIZE) == BACKUP_DONE_MAGIC)
+		return MANIFEST_DONE;
+
+	return MANIFEST_PENDING;
+}
+
+// Resets the counts of all cards in a backup folder to zero and marks the manifest as done.
+// b_Folder = false: The cards are taken from the dirty bitmap (directly after the backup).
+// b_Folder = true:  The cards are taken from the files in the folder (after a power failure).
+bool Utils::ResetBackupCards(const char* s8_Folder, bool b_Folder)
+{
+	uint64_t u64_ID;
+	uint32_t u32_Count;
+
+	if (b_Folder)
+	{
+		File dir = SDCard::Open(s8_Folder);
+		File entry;
+		if (!dir)
+			return false;
+
+		while (entry = SDCard::OpenNext(&dir), entry)
+		{
+			bool b_Snapshot = (0 == strcmp(entry.name(), SNAP_FILE_NAME));
+			bool b_Card     = !entry.isDirectory() && 0 != strcmp(entry.name(), BACKUP_MANIFEST) && !b_Snapshot &&
+			                  Utils::ParseBase36(entry.name(), &u64_ID);
+			SDCard::Close(&entry);
+
+			/* Cards which are not in the database (moved files) are not inserted */
+			if (b_Card && gi_CounterDB.Read(u64_ID, &u32_Count) && u32_Count != 0 && !gi_CounterDB.Write(u64_ID, 0))
+			{
+				SDCard::Close(&dir);
+				return false;
+			}
+
+			if (b_Snapshot)
+			{
+				char s8_Path[1+8+1+3+1+8+1+3+1];
+				Snapshot i_Snapshot;
+				sprintf(s8_Path, "%s/%s", s8_Folder, SNAP_FILE_NAME);
+				bool b_Success = i_Snapshot.Open(s8_Path);
+				while (b_Success && i_Snapshot.Next(&u64_ID, &u32_Count))
+				{
+					if (gi_CounterDB.Read(u64_ID, &u32_Count) && u32_Count != 0)
+						b_Success = gi_CounterDB.Write(u64_ID, 0);
+				}
+				i_Snapshot.Close();
+				if (!b_Success)
+				{
+					SDCard::Close(&dir);
+					return false;
+				}
+			}
+		}
+		SDCard::Close(&dir);
+	}
+	else
+	{
+		uint32_t u32_Record = 0;
+		while (gi_CounterDB.NextDirty(&u32_Record))
+		{
+			if (gi_CounterDB.ReadSlot(u32_Record, &u64_ID, &u32_Count) && !gi_CounterDB.Write(u64_ID, 0))
+				return false;
+			u32_Record ++;
+		}
+	}
+
+	char s8_Path[1+8+1+3+1+8+1+3+1];
+	sprintf(s8_Path, "%s/%s", s8_Folder, BACKUP_MANIFEST);
+	File dataFile = SDCard::Open(s8_Path, FILE_WRITE);
+	if (!dataFile)
+		return false;
+
+	byte u8_Done[4];
+	Utils::WriteLE32(u8_Done, BACKUP_DONE_MAGIC);
+	SDCard::Seek(&dataFile, BACKUP_MANIFEST_SIZE);
+	bool b_Success = SDCard::Write(&dataFile, u8_Done, 4u);
+	SDCard::Close(&dataFile);
+	return b_Success;
+}
+
+// Deletes a folder with all files in it
+bool Utils::RemoveFolder(const char* s8_Folder)
+{
+	char s8_Path[1+8+1+3+1+8+1+3+1];
+	File dir = SDCard::Open(s8_Folder);
+	File entry;
+	if (!dir)
+		return false;
+
+	while (entry = SDCard::OpenNext(&dir), entry)
+	{
+		sprintf(s8_Path, "%s/%s", s8_Folder, entry.name());
+		SDCard::Close(&entry);
+		SDCard::Remove(s8_Path);
+	}
+	SDCard::Close(&dir);
+	return SDCard::Rmdir(s8_Folder);
+}
+
+// Moves a file into another folder. A file with the same name in the destination folder is replaced.
+// The directory entry is renamed, so no data is copied. If this is not possible the file is copied and then deleted.
+// The source file is only deleted after the copy has been written completely.
+bool Utils::MoveFile(const char* s8_Source, const char* s8_Dest)
+{
+	if (SDCard::Exists(s8_Dest) && !SDCard::Remove(s8_Dest))
+		return false;
+
+#if SD_HAS_RENAME
+	if (SDCard::Rename(s8_Source, s8_Dest))
+		return true;
+#endif
+
+	if (!Utils::CopyFile(s8_Source, s8_Dest))
+	{
+		SDCard::Remove(s8_Dest);
+		return false;
+	}
+	return SDCard::Remove(s8_Source);
+}
+
+// Copies a file in blocks of BACKUP_COPY_SIZE bytes. The destination must not exist.
+bool Utils::CopyFile(const char* s8_Source, const char* s8_Dest)
+{
+	// uint32_t makes the buffer 4 byte aligned, so the SD library can transfer whole words
+	uint32_t u32_CopyBuf[BACKUP_COPY_SIZE / 4];
+	byte*    u8_CopyBuf = (byte*)u32_CopyBuf;
+
+	File inputFile = SDCard::Open(s8_Source, FILE_READ);
+	if (!inputFile)
+		return false;
+
+	File outputFile = SDCard::Open(s8_Dest, FILE_WRITE);
+	if (!outputFile)
+	{
+		SDCard::Close(&inputFile);
+		return false;
+	}
+
+	bool b_Success = true;
+	while (b_Success)
+	{
+		int s32_Read = SDCard::Read(&inputFile, u8_CopyBuf, BACKUP_COPY_SIZE);
+		if (s32_Read <= 0)
+		{
+			b_Success = (s32_Read == 0);
+			break;
+		}
+		b_Success = SDCard::Write(&outputFile, u8_CopyBuf, s32_Read);
+	}
+
+	SDCard::Close(&outputFile);
+	SDCard::Close(&inputFile);
+	return b_Success;
+}
+
 void Utils::Base36(uint64_t u64_ID, char *s8_LF)
 {
   unsigned char pos = 11;
@@ -337,6 +913,29 @@ void Utils::Base36(uint64_t u64_ID, char *s8_LF)
   }
 }
 
+// The reverse of Base36(): Converts a name "XXXXXXXX.XXX" back into the UID
+// returns false if the name is not a valid card name
+bool Utils::ParseBase36(const char* s8_Name, uint64_t* pu64_ID)
+{
+  if (strlen(s8_Name) != 12 || s8_Name[8] != '.')
+    return false;
+
+  uint64_t u64_ID = 0;
+  for (unsigned char pos = 0; pos < 12; pos++)
+  {
+    if (8 == pos) continue;
+
+    const char* s8_Digit = strchr(baseC, toupper(s8_Name[pos]));
+    if (s8_Digit == NULL || *s8_Digit == 0)
+      return false;
+
+    u64_ID = u64_ID * 36 + (s8_Digit - baseC);
+  }
+
+  *pu64_ID = u64_ID;
+  return (u64_ID != 0);
+}
+
 #ifdef STD_PRINT_EN
 
 void Utils::Print(const char* s8_Text, const char* s8_LF) //=NULL
@@ -400,6 +999,16 @@ void Utils::PrintInterval(uint64_t u64_Time, const char* s8_LF)
     Print(Buf, s8_LF);   
 }
 
+// Prints the number of samples, the maximum and the 50%, 90% and 99% percentiles of a histogram
+void Utils::PrintHistogram(const kLatencyHistogram* pk_Hist, const char* s8_LF)
+{
+    char Buf[100];
+    sprintf(Buf, "n= %u, p50< %u us, p90< %u us, p99< %u us, max= %u us", (unsigned)pk_Hist->u32_Samples,
+            (unsigned)HistogramPercentile(pk_Hist, 50), (unsigned)HistogramPercentile(pk_Hist, 90),
+            (unsigned)HistogramPercentile(pk_Hist, 99), (unsigned)pk_Hist->u32_Max);
+    Print(Buf, s8_LF);
+}
+
 #endif
 
 void Utils::GetHexBuf(const byte* u8_Data, const uint32_t u32_DataLen, String* retVal)
@@ -432,6 +1041,42 @@ uint64_t Utils::GetMillis64()
     return u64_Time;
 }
 
+// Adds a duration in microseconds to a logarithmic histogram
+void Utils::HistogramAdd(kLatencyHistogram* pk_Hist, uint32_t u32_Micros)
+{
+    byte u8_Bin = 0;
+    uint32_t u32_Limit = 1UL << HISTOGRAM_SHIFT;
+    while (u8_Bin < HISTOGRAM_BINS - 1 && u32_Micros >= u32_Limit)
+    {
+        u8_Bin ++;
+        u32_Limit <<= 1;
+    }
+
+    pk_Hist->u32_Bins[u8_Bin] ++;
+    pk_Hist->u32_Samples ++;
+    if (u32_Micros > pk_Hist->u32_Max)
+        pk_Hist->u32_Max = u32_Micros;
+}
+
+// returns the upper limit (in microseconds) of the bin that contains the given percentile.
+// For the last bin the maximum is returned.
+uint32_t Utils::HistogramPercentile(const kLatencyHistogram* pk_Hist, byte u8_Percent)
+{
+    if (pk_Hist->u32_Samples == 0)
+        return 0;
+
+    // The number of samples that must be below the returned value (rounded up)
+    uint32_t u32_Needed = (uint32_t)(((uint64_t)pk_Hist->u32_Samples * u8_Percent + 99) / 100);
+    uint32_t u32_Sum    = 0;
+    for (byte B=0; B<HISTOGRAM_BINS - 1; B++)
+    {
+        u32_Sum += pk_Hist->u32_Bins[B];
+        if (u32_Sum >= u32_Needed)
+            return 1UL << (B + HISTOGRAM_SHIFT);
+    }
+    return pk_Hist->u32_Max;
+}
+
 // Multi byte XOR operation In -> Out
 // If u8_Out and u8_In are the same buffer use the other function below.
 void Utils::XorDataBlock(byte* u8_Out, const byte* u8_In, const byte* u8_Xor, int s32_Length)
@@ -482,17 +1127,61 @@ void Utils::GenerateRandom(byte* u8_Random, int s32_Length)
     }
 }
 
+// ------------------------------------------------------------------------------------------
+// The CRC tables are calculated by the compiler (constexpr) and stored in flash (PROGMEM).
+// The generator functions are written for C++11 (a constexpr function may only contain a return statement).
+
+#define CRC16_POLY   (0x8408u)      // ITU-V.41 polynomial 0x1021, bit reversed
+#define CRC32_POLY   (0xEDB88320UL) // IEEE 802.3 polynomial 0x04C11DB7, bit reversed
+
+// Processes u8_Bits bits of a reflected CRC
+constexpr uint16_t Crc16Bits(uint16_t u16_Crc, byte u8_Bits)
+{
+    return u8_Bits == 0 ? u16_Crc : Crc16Bits((u16_Crc >> 1) ^ ((u16_Crc & 1) ? CRC16_POLY : 0), u8_Bits - 1);
+}
+constexpr uint32_t Crc32Bits(uint32_t u32_Crc, byte u8_Bits)
+{
+    return u8_Bits == 0 ? u32_Crc : Crc32Bits((u32_Crc >> 1) ^ ((u32_Crc & 1) ? CRC32_POLY : 0), u8_Bits - 1);
+}
+
+// Slice-by-8: Table T[0] is the classic byte table.
+// T[k][i] is the CRC of byte i followed by k zero bytes: T[k][i] = (T[k-1][i] >> 8) ^ T[0][T[k-1][i] & 0xFF]
+constexpr uint32_t Crc32Slice(byte k, uint32_t i)
+{
+    return k == 0 ? Crc32Bits(i, 8) : (Crc32Slice(k - 1, i) >> 8) ^ Crc32Bits(Crc32Slice(k - 1, i) & 0xFF, 8);
+}
+
+static_assert(Crc32Bits(1, 8) == 0x77073096UL, "CRC32 table generator is broken");
+static_assert(Crc16Bits(1, 8) == 0x1189u,      "CRC16 table generator is broken");
+
+// These macros expand to 256 table entries
+#define CRC_4(F, k, i)     F(k, i), F(k, i + 1), F(k, i + 2), F(k, i + 3)
+#define CRC_16(F, k, i)    CRC_4 (F, k, i), CRC_4 (F, k, i +  4), CRC_4 (F, k, i +  8), CRC_4 (F, k, i +  12)
+#define CRC_64(F, k, i)    CRC_16(F, k, i), CRC_16(F, k, i + 16), CRC_16(F, k, i + 32), CRC_16(F, k, i +  48)
+#define CRC_256(F, k)      CRC_64(F, k, 0), CRC_64(F, k,     64), CRC_64(F, k,    128), CRC_64(F, k,     192)
+
+#define CRC16_ENTRY(k, i)  Crc16Bits(i, 8)
+#define CRC32_ENTRY(k, i)  Crc32Slice(k, i)
+
+static const uint16_t gu16_Crc16Table[256] PROGMEM = { CRC_256(CRC16_ENTRY, 0) };
+
+static const uint32_t gu32_Crc32Table[8][256] PROGMEM = 
+{
+    { CRC_256(CRC32_ENTRY, 0) }, { CRC_256(CRC32_ENTRY, 1) }, { CRC_256(CRC32_ENTRY, 2) }, { CRC_256(CRC32_ENTRY, 3) },
+    { CRC_256(CRC32_ENTRY, 4) }, { CRC_256(CRC32_ENTRY, 5) }, { CRC_256(CRC32_ENTRY, 6) }, { CRC_256(CRC32_ENTRY, 7) },
+};
+
+#define CRC32_TABLE(k, i)  pgm_read_dword(&gu32_Crc32Table[k][i])
+
 // ITU-V.41 (ISO 14443A)
 // This CRC is used only for legacy authentication. (not implemented anymore)
+// Table driven: one table lookup per byte instead of the shift / xor sequence.
 uint16_t Utils::CalcCrc16(const byte* u8_Data, int s32_Length)
 {
     uint16_t u16_Crc = 0x6363;
     for (int i=0; i<s32_Length; i++)
     {
-        byte ch = u8_Data[i];
-        ch = ch ^ (byte)u16_Crc;
-        ch = ch ^ (ch << 4);
-        u16_Crc = (u16_Crc >> 8) ^ ((uint16_t)ch << 8) ^ ((uint16_t)ch << 3) ^ ((uint16_t)ch >> 4);
+        u16_Crc = (u16_Crc >> 8) ^ pgm_read_word(&gu16_Crc16Table[(u16_Crc ^ u8_Data[i]) & 0xFF]);
     }
     return u16_Crc;
 }
@@ -509,155 +1198,507 @@ uint32_t Utils::CalcCrc32(const byte* u8_Data1, int s32_Length1, // data to proc
     return u32_Crc;
 }
 
-// private
+// Continues a CRC over more data. A new CRC starts with 0xFFFFFFFF (see above).
+// Slice-by-8: processes 8 bytes with 8 table lookups, the remaining bytes with the byte table.
+// The bytes are assembled manually, so the buffer does not need to be aligned.
 uint32_t Utils::CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc)
 {
+    while (s32_Length >= 8)
+    {
+        uint32_t u32_One = u32_Crc ^ ((uint32_t)u8_Data[0]       | ((uint32_t)u8_Data[1] << 8) |
+                                      ((uint32_t)u8_Data[2] << 16) | ((uint32_t)u8_Data[3] << 24));
+        uint32_t u32_Two =            ((uint32_t)u8_Data[4]       | ((uint32_t)u8_Data[5] << 8) |
+                                      ((uint32_t)u8_Data[6] << 16) | ((uint32_t)u8_Data[7] << 24));
+
+        u32_Crc = CRC32_TABLE(7,  u32_One        & 0xFF) ^ CRC32_TABLE(6, (u32_One >>  8) & 0xFF) ^
+                  CRC32_TABLE(5, (u32_One >> 16) & 0xFF) ^ CRC32_TABLE(4,  u32_One >> 24)         ^
+                  CRC32_TABLE(3,  u32_Two        & 0xFF) ^ CRC32_TABLE(2, (u32_Two >>  8) & 0xFF) ^
+                  CRC32_TABLE(1, (u32_Two >> 16) & 0xFF) ^ CRC32_TABLE(0,  u32_Two >> 24);
+
+        u8_Data    += 8;
+        s32_Length -= 8;
+    }
+
     for (int i=0; i<s32_Length; i++)
     {
-        u32_Crc ^= u8_Data[i];
-        for (int b=0; b<8; b++)
-        {
-            bool b_Bit = (u32_Crc & 0x01) > 0;
-            u32_Crc >>= 1;
-            if (b_Bit) u32_Crc ^= 0xEDB88320;
-        }
+        u32_Crc = (u32_Crc >> 8) ^ CRC32_TABLE(0, (u32_Crc ^ u8_Data[i]) & 0xFF);
     }
     return u32_Crc;
 }
 
-void Utils::GetSDCounterForCard(char* fileName, uint16_t * u16_noOfCoffees)
+// Reads the counter from a card file of the old storage (one file per card, see CounterDB::MigrateLegacy())
+// The file is a sequence of 4 byte records: count (16 bit, big endian) and its inverse. Only the last record is valid.
+// Instead of reading all records, the last record is read directly at its offset.
+// If it is corrupt (e.g. torn by a power failure while it was appended) the record before is used.
+// returns false if no valid counter was found. A missing or empty file is a count of zero.
+bool Utils::GetSDCounterForCard(const char* fileName, uint16_t * u16_noOfCoffees)
 {
     File dataFile;
-    uint8_t bufCoffee[4] = {0,0,255,255};
+    uint8_t bufCoffee[4];
 
-	dataFile = SD.open(fileName);
-	if(dataFile) {
-    	while (dataFile.available()) {
-	    	dataFile.readBytes(&bufCoffee[0], 4u);
-	    }
-	    dataFile.close();
-	}
-	uint16_t noOfCoffees = (uint16_t)((uint16_t)bufCoffee[0] << 8 | (uint16_t)bufCoffee[1]);
-	uint16_t noOfCoffeesInv = (uint16_t)((uint16_t)bufCoffee[2] << 8 | (uint16_t)bufCoffee[3]);
+	*u16_noOfCoffees = 0;
+	dataFile = SDCard::Open(fileName);
+	if(!dataFile)
+		return true;
+
+	/* A torn record at the end is ignored. At most the last two records are read. */
+	uint32_t u32_Records = dataFile.size() / 4u;
+	bool b_Valid = (u32_Records == 0);
+
+	for (uint32_t R = u32_Records; R > 0 && R + 2 > u32_Records && !b_Valid; R--)
+	{
+		if (!SDCard::Seek(&dataFile, (R - 1) * 4u) || 4u != SDCard::Read(&dataFile, bufCoffee, 4u))
+			break;
 
-	if(noOfCoffees == (uint16_t)~noOfCoffeesInv) {
-		*u16_noOfCoffees = noOfCoffees;
-	} else {
-		*u16_noOfCoffees = 1337;
+		uint16_t noOfCoffees = (uint16_t)((uint16_t)bufCoffee[0] << 8 | (uint16_t)bufCoffee[1]);
+		uint16_t noOfCoffeesInv = (uint16_t)((uint16_t)bufCoffee[2] << 8 | (uint16_t)bufCoffee[3]);
+		if(noOfCoffees == (uint16_t)~noOfCoffeesInv)
+		{
+			*u16_noOfCoffees = noOfCoffees;
+			b_Valid = true;
+		}
 	}
+	SDCard::Close(&dataFile);
+	return b_Valid;
+}
+
+// Reads the counter of a card from the counter database.
+// If the card is not stored the counter is zero.
+// returns false if the SD card cannot be read or the record is corrupt
+bool Utils::ReadSDCounter(uint64_t u64_ID, uint32_t* pu32_Count)
+{
+	return gi_CounterDB.Read(u64_ID, pu32_Count);
 }
 
+// Writes the counter of a card to the counter database
+// returns false if the SD card could not be written
+bool Utils::WriteSDCounter(uint64_t u64_ID, uint32_t u32_Count)
+{
+	return gi_CounterDB.Write(u64_ID, u32_Count);
+}
+
+// Counts the coffee in the CounterCache and the EventLog and shows the new count immediately.
+// The counter is written to the SD card later by CounterCache::FlushTask().
+// When the SD card fails the coffee is counted in the TapBuffer until the SD card has been mounted again.
+// returns false if the coffee could not be counted (the TapBuffer is full)
 bool Utils::UpdateSDCardCounter(uint64_t u64_ID, kCard* pk_Card, uint64_t u64_StartTick)
 {
-    kUser k_User;
-    File dataFile;
     char cardIDString[] = "00000000.000";
-    uint8_t bufCoffee[4] = {0,0,255,255};
-    bool retResult = true;
+    char tmpBuf[16];
+    uint32_t noOfCoffees = 0;
 
     Utils::Base36(u64_ID, cardIDString);
     display.clear();
     display.setFont(ArialMT_Plain_10);
     display.drawString(64, 1, cardIDString);
-//    display.display();
-
-#if true
-	dataFile = SD.open(cardIDString);
-	if(dataFile) {
-    	while (dataFile.available()) {
-	    	dataFile.readBytes(&bufCoffee[0], 4u);
-	    }
-	    dataFile.close();
-	}
-	uint16_t noOfCoffees = (uint16_t)((uint16_t)bufCoffee[0] << 8 | (uint16_t)bufCoffee[1]);
-	uint16_t noOfCoffeesInv = (uint16_t)((uint16_t)bufCoffee[2] << 8 | (uint16_t)bufCoffee[3]);
-
-	String sCoffees = "000000";
-
-	if(noOfCoffees == (uint16_t)~noOfCoffeesInv) {
-		/* number of coffees is correct */
-		noOfCoffees++;
-		noOfCoffeesInv = (uint16_t)~noOfCoffees;
-		bufCoffee[0] = (uint8_t)((noOfCoffees >> 8) & 0xFFu);
-		bufCoffee[1] = (uint8_t)(noOfCoffees & 0xFFu);
-		bufCoffee[2] = (uint8_t)((noOfCoffeesInv >> 8) & 0xFFu);
-		bufCoffee[3] = (uint8_t)(noOfCoffeesInv & 0xFFu);
-
-	    char tmpBuf[16];
-	    sprintf(tmpBuf, "%d", noOfCoffees);
-
-	    display.setFont(ArialMT_Plain_24);
-		display.drawString(64, 15, tmpBuf);
-		display.display();
-	} else {
-		/* invalid number */
-		/* start from zero? */
-	}
 
-	dataFile = SD.open(cardIDString, FILE_WRITE);
-    display.setFont(ArialMT_Plain_10);
-	if (dataFile) {
-		dataFile.seek(0u);
-		dataFile.write(&bufCoffee[0], 4u);
-		dataFile.close();
+	if (!TapBuffer::IsActive()) {
+		bool b_Counted = CounterCache::Increment(u64_ID, &noOfCoffees);
+		if (b_Counted && EventLog::Append(u64_ID)) {
+		    sprintf(tmpBuf, "%u", noOfCoffees);
 
-		WritePin(LED_BUILTIN, HIGH);
+		    display.setFont(ArialMT_Plain_24);
+			display.drawString(64, 15, tmpBuf);
+		    display.setFont(ArialMT_Plain_10);
+			display.drawString(64, 40, "Saved!");
+			display.display();
+			return true;
+		}
 
-		display.drawString(64, 40, "Saved!");
-		display.display();
+		if (!b_Counted && !CounterCache::HasError() && !gi_CounterDB.HasIOError()) {
+			/* invalid number - the record is left unchanged */
+			display.drawString(64, 40, "INVALID!");
+			display.display();
+			return (true);
+		}
 
-		DelayMilli(150);
-		WritePin(LED_BUILTIN, LOW);
-		DelayMilli(100);
-		WritePin(LED_BUILTIN, HIGH);
-		DelayMilli(150);
-		WritePin(LED_BUILTIN, LOW);
+		/* The SD card has failed. The dirty counters (with this coffee if it is in the cache) are moved into the TapBuffer. */
+		TapBuffer::Capture();
+		if (b_Counted) {
+		    sprintf(tmpBuf, "%u", noOfCoffees);
+
+		    display.setFont(ArialMT_Plain_24);
+			display.drawString(64, 15, tmpBuf);
+		    display.setFont(ArialMT_Plain_10);
+			display.drawString(64, 40, "No SD card!");
+			display.display();
+			return true;
+		}
 	}
-	else {
-		retResult = false;
 
+	/* The SD card is missing: count the coffee in the TapBuffer (RAM + EEPROM) */
+	bool b_Total;
+	if (!TapBuffer::Add(u64_ID, &noOfCoffees, &b_Total)) {
 		display.drawString(64, 40, "ERROR!");
 		display.display();
+		return false;
 	}
-#endif
-	return (retResult);
+
+	/* If the count on the SD card is not known only the coffees since the SD card failed are shown */
+	sprintf(tmpBuf, b_Total ? "%u" : "+%u", noOfCoffees);
+
+	display.setFont(ArialMT_Plain_24);
+	display.drawString(64, 15, tmpBuf);
+	display.setFont(ArialMT_Plain_10);
+	display.drawString(64, 40, "No SD card!");
+	display.display();
+	return true;
 }
 
 
-uint16_t Utils::getNumFiles(File dir)
+// Sends the cards that have been used since the last backup in the binary format (all values little endian):
+// Header:   magic "NFCE", version (16 bit), record size (16 bit), number of cards (32 bit), CRC32 of the first 12 bytes
+//           from version 3 on: magic, version, record size, number of cards, transfer ID (32 bit),
+//           number of the first batch (16 bit), reserved (16 bit), CRC32 of the first 20 bytes
+// Batches:  number of records (16 bit), batch number (16 bit), records: UID (64 bit), count (32 bit)
+//           A batch with 0 records ends the list. One batch fits into one TCP segment.
+// Trailer:  version 1: number of records sent (32 bit), CRC32 of all batches
+//           version 2+: number of records sent (32 bit), new sync token (64 bit), CRC32 of all batches and the first 12 bytes
+// From version 2 on only the cards that have changed since the client's sync token are sent (see CounterDB.h).
+// The counts of the other cards have not changed since the client received them.
+// The number in the header is the number of cards used since the last backup. It can be higher than the records sent.
+// A transfer without a valid trailer is incomplete.
+//
+// From version 3 on the client acknowledges each batch with its batch number (16 bit) and the last (empty) batch
+// after it has checked the trailer. Only then the transfer is complete (and the backup may run).
+// Not more than EXPORT_ACK_WINDOW batches are sent ahead of the acknowledgements.
+// When the connection is lost, the client can resume the transfer with the transfer ID from the header
+// within RESUME_CONNECTION_TIMEOUT. Meanwhile no taps are counted, so the counters cannot change before the resume.
+// The device then continues behind the last acknowledged batch (the first batch in the header). The client drops
+// the batches it has received from there on. The CRC32 and the number of records in the trailer cover the whole transfer.
+// A transfer can only be resumed as long as no counter has changed, otherwise a new transfer is started.
+//
+// The ASCII export (EXPORT_ASCII) sends "NAME.EXT,count" for each card instead.
+// NAME.EXT is the UID in Base36 (this was the file name of the card in the old storage).
+// With EXPORT_SD_STATS the lines of the SD card statistics follow.
+
+// The steps of WiFiExport::Step()
+typedef enum {
+	STEP_HEADER,
+	STEP_RECORDS,   // one batch of dirty records per tick
+	STEP_TRAILER,
+	STEP_STATS,     // ASCII: the SD card statistics
+	STEP_FLUSH,     // wait until the client has accepted the buffer
+	STEP_WAIT_ACK   // wait until the client has acknowledged the last batch
+} eExportStep;
+
+byte            WiFiExport::mu8_Step     = STEP_HEADER;
+uint16_t        WiFiExport::mu16_Version = EXPORT_ASCII;
+uint16_t        WiFiExport::mu16_Count   = 0;
+uint32_t        WiFiExport::mu32_Since   = 0;
+kExportPos      WiFiExport::mk_Pos;
+uint16_t        WiFiExport::mu16_Batch   = 0;
+uint32_t        WiFiExport::mu32_InBatch = 0;
+bool            WiFiExport::mb_End       = false;
+byte            WiFiExport::mu8_Stat     = 0;
+uint32_t        WiFiExport::mu32_Percent = 0xFFFFFFFF;
+uint32_t        WiFiExport::mu32_LastAck = 0;
+byte            WiFiExport::mu8_Batch[EXPORT_BATCH_HEADER + EXPORT_BATCH_RECORDS * EXPORT_RECORD_SIZE];
+kExportTransfer WiFiExport::mk_Export;
+
+// Starts the export of u16_Count dirty cards. The dirty bitmap must be complete (see CounterDB::FinishRecovery()).
+// A transfer with EXPORT_VERSION_ACK continues behind the last acknowledged batch if u32_Resume is the ID of the
+// interrupted transfer and no counter has changed since.
+void WiFiExport::Begin(uint16_t u16_Count, uint16_t u16_Version, uint64_t u64_Token, uint32_t u32_Resume)
 {
-	File entry;
-	uint8_t fileCount = 0;
+	mu8_Step     = STEP_HEADER;
+	mu16_Version = u16_Version;
+	mu16_Count   = u16_Count;
+	mu32_InBatch = 0;
+	mb_End       = false;
+	mu8_Stat     = 0;
+	mu32_Percent = 0xFFFFFFFF;
+	mu32_LastAck = Utils::GetMillis();
+	memset(&mk_Pos, 0, sizeof(mk_Pos));
+	mu16_Batch   = 0;
+
+	ExportBuffer::Begin();
+	if (u16_Version == EXPORT_ASCII)
+		return;
+
+	/* A change during the transfer gets a higher sequence, so it is sent again with the next sync */
+	bool     b_Ack   = u16_Version >= EXPORT_VERSION_ACK;
+	uint64_t u64_New = gi_CounterDB.GetSyncToken();
+	mu32_Since = u16_Version >= EXPORT_VERSION_SYNC ? gi_CounterDB.GetTokenSeq(u64_Token) : 0;
+
+	if (!b_Ack || u32_Resume == 0 || u32_Resume != mk_Export.u32_ID ||
+	    u64_Token != mk_Export.u64_Token || u64_New != mk_Export.u64_New) {
+		memset(&mk_Export, 0, sizeof(mk_Export));
+		mk_Export.k_Acked.u32_Crc = 0xFFFFFFFF;
+		mk_Export.u64_Token       = u64_Token;
+		mk_Export.u64_New         = u64_New;
+		/* The start time identifies the transfer */
+		if (b_Ack)
+			mk_Export.u32_ID = Utils::GetMillis() + 1;
+	}
+	mk_Pos     = mk_Export.k_Acked;
+	mu16_Batch = mk_Export.u16_Acked;
+}
 
-	while (entry = dir.openNextFile(), entry)
+// Executes the next step of the export
+// returns WLAN_DONE when the client has received everything (from EXPORT_VERSION_ACK on: acknowledged),
+// WLAN_FAILED if the connection is lost or the client does not accept the data
+eWLANStatus WiFiExport::Step(void)
+{
+	if (!ExportBuffer::Send())
+		return (WLAN_FAILED);
+	if (mk_Export.u32_ID != 0 && !ReceiveAcks())
+		return (WLAN_FAILED);
+
+	switch (mu8_Step)
 	{
-	  if (!entry.isDirectory())
-	  {
-		fileCount++;
-	  }
-	  entry.close();
+		case STEP_HEADER:
+		{
+			mu8_Step = STEP_RECORDS;
+			if (mu16_Version == EXPORT_ASCII)
+				break;
+
+			byte     u8_Header[EXPORT_HEADER_SIZE_ACK];
+			bool     b_Ack      = mu16_Version >= EXPORT_VERSION_ACK;
+			uint32_t u32_Header = b_Ack ? EXPORT_HEADER_SIZE_ACK : EXPORT_HEADER_SIZE;
+			Utils::WriteLE32(u8_Header,      EXPORT_MAGIC);
+			Utils::WriteLE16(u8_Header +  4, mu16_Version);
+			Utils::WriteLE16(u8_Header +  6, EXPORT_RECORD_SIZE);
+			Utils::WriteLE32(u8_Header +  8, mu16_Count);
+			if (b_Ack) {
+				Utils::WriteLE32(u8_Header + 12, mk_Export.u32_ID);
+				Utils::WriteLE16(u8_Header + 16, mu16_Batch);
+				Utils::WriteLE16(u8_Header + 18, 0);
+			}
+			Utils::WriteLE32(u8_Header + u32_Header - 4, Utils::CalcCrc32(u8_Header, u32_Header - 4));
+			ExportBuffer::Write(u8_Header, u32_Header); // the buffer is empty
+			ExportBuffer::ResetCrc(mk_Pos.u32_Crc);
+			break;
+		}
+
+		case STEP_RECORDS:
+			if (mu16_Version == EXPORT_ASCII) {
+				ScanAscii();
+				break;
+			}
+
+			if (mu32_InBatch < EXPORT_BATCH_RECORDS && !mb_End)
+				ScanBinary();
+
+			/* A full batch or the last records. The empty batch that ends the list is sent in the next tick. */
+			if ((mu32_InBatch == EXPORT_BATCH_RECORDS || mb_End) && SendBatch()) {
+				if (mu32_InBatch == 0)
+					mu8_Step = STEP_TRAILER;
+				mu32_InBatch = 0;
+			}
+			break;
+
+		case STEP_TRAILER:
+		{
+			byte u8_Trailer[16];
+			uint32_t u32_Length = 4;
+			if (ExportBuffer::GetFree() < sizeof(u8_Trailer))
+				break;
+
+			uint32_t u32_Crc = ExportBuffer::GetCrc();
+			Utils::WriteLE32(u8_Trailer, mk_Pos.u32_Records);
+			if (mu16_Version >= EXPORT_VERSION_SYNC) {
+				Utils::WriteLE64(u8_Trailer + 4, mk_Export.u64_New);
+				u32_Length += 8;
+				/* From version 2 on the CRC32 also covers the first 12 bytes of the trailer */
+				u32_Crc = Utils::CalcCrc32(u8_Trailer, u32_Length, u32_Crc);
+			}
+			Utils::WriteLE32(u8_Trailer + u32_Length, u32_Crc);
+			ExportBuffer::Write(u8_Trailer, u32_Length + 4);
+			mu8_Step = STEP_FLUSH;
+			break;
+		}
+
+		case STEP_STATS:
+			SendStats();
+			break;
+
+		case STEP_FLUSH:
+			if (!ExportBuffer::IsEmpty())
+				break;
+			if (mk_Export.u32_ID == 0)
+				return (WLAN_DONE);
+
+			/* The client acknowledges the last batch after it has checked the trailer */
+			mu8_Step = STEP_WAIT_ACK;
+			break;
+
+		case STEP_WAIT_ACK:
+			if (mk_Export.u16_Acked != mu16_Batch)
+				break;
+
+			mk_Export.u32_ID = 0; // complete, there is nothing to resume
+			return (WLAN_DONE);
+
+		default:
+			return (WLAN_FAILED);
 	}
-	return(fileCount);
+	return (WLAN_BUSY);
 }
 
-bool Utils::printDirectory(File dir, uint16_t fileCount)
+// returns true if a transfer with acknowledgements has been interrupted and can be resumed by the client
+bool WiFiExport::CanResume(void)
 {
-	File entry;
-	uint16_t fileIdx = 0;
-	uint16_t Coffees = 0;
-    char lBuf[12+1+5];
+	return mk_Export.u32_ID != 0;
+}
 
+// Drops the interrupted transfer. The next client gets a new transfer.
+void WiFiExport::Cancel(void)
+{
+	mk_Export.u32_ID = 0;
+}
 
-	while(entry = dir.openNextFile(), entry) {
-		if (!entry.isDirectory()) {
-			//		skip DIRs
-			fileIdx++;
-			OLEDScreen::ShowProgressBar(fileIdx, fileCount);
-			Utils::GetSDCounterForCard(entry.name(), &Coffees);
-			sprintf(lBuf, "%s,%d", entry.name(), Coffees);
-			serverClient.println(lBuf);
+// Appends "NAME.EXT,count" for up to EXPORT_BATCH_RECORDS dirty cards, as long as the lines fit into the buffer
+void WiFiExport::ScanAscii(void)
+{
+	uint64_t u64_ID;
+	uint32_t u32_Coffees;
+    char lBuf[12+1+10+1];
+
+	for (uint32_t i = 0; i < EXPORT_BATCH_RECORDS && ExportBuffer::GetFree() >= sizeof(lBuf) + 1; i++) {
+		/* Only the records in the dirty bitmap are read, in the order of the file */
+		if (!gi_CounterDB.NextDirty(&mk_Pos.u32_Slot)) {
+			mu8_Step = EXPORT_SD_STATS ? STEP_STATS : STEP_FLUSH;
+			return;
 		}
-		entry.close();
+		uint32_t u32_Slot = mk_Pos.u32_Slot++;
+		ShowProgress();
+		if (!gi_CounterDB.ReadSlot(u32_Slot, &u64_ID, &u32_Coffees))
+			continue; // skip corrupt slots
+
+		char cardIDString[] = "00000000.000";
+		Utils::Base36(u64_ID, cardIDString);
+		sprintf(lBuf, "%s,%u", cardIDString, (unsigned)u32_Coffees);
+		ExportBuffer::Print(lBuf);
+	}
+}
+
+// Reads dirty records into mu8_Batch until the batch is full or EXPORT_BATCH_RECORDS dirty records have been read.
+// Only the cards that have changed since the client's sync token are added.
+void WiFiExport::ScanBinary(void)
+{
+	uint64_t u64_ID;
+	uint32_t u32_Coffees;
+	uint32_t u32_Seq;
+
+	for (uint32_t i = 0; i < EXPORT_BATCH_RECORDS && mu32_InBatch < EXPORT_BATCH_RECORDS; i++) {
+		if (!gi_CounterDB.NextDirty(&mk_Pos.u32_Slot)) {
+			mk_Pos.u32_Slot = gi_CounterDB.GetCapacity();
+			mb_End = true;
+			return;
+		}
+		uint32_t u32_Slot = mk_Pos.u32_Slot++;
+		ShowProgress();
+
+		if (!gi_CounterDB.ReadSlot(u32_Slot, &u64_ID, &u32_Coffees, &u32_Seq))
+			continue; // skip corrupt slots
+		if (u32_Seq <= mu32_Since)
+			continue; // the client has this count already
+
+		byte* u8_Record = mu8_Batch + EXPORT_BATCH_HEADER + mu32_InBatch * EXPORT_RECORD_SIZE;
+		Utils::WriteLE64(u8_Record,     u64_ID);
+		Utils::WriteLE32(u8_Record + 8, u32_Coffees);
+		mu32_InBatch++;
+		mk_Pos.u32_Records++;
+	}
+}
+
+// Appends the records in mu8_Batch as batch mu16_Batch.
+// With acknowledgements the position behind the batch is stored until the client has acknowledged it.
+// returns false if the batch does not fit into the buffer or EXPORT_ACK_WINDOW batches are in flight (try again)
+bool WiFiExport::SendBatch(void)
+{
+	uint32_t u32_Length = EXPORT_BATCH_HEADER + mu32_InBatch * EXPORT_RECORD_SIZE;
+	if (ExportBuffer::GetFree() < u32_Length)
+		return (false);
+
+	/* The next batch may only be sent when the oldest batch in flight has been acknowledged */
+	if (mk_Export.u32_ID != 0 && (uint16_t)(mu16_Batch - mk_Export.u16_Acked) >= EXPORT_ACK_WINDOW)
+		return (false);
+
+	Utils::WriteLE16(mu8_Batch,     mu32_InBatch);
+	Utils::WriteLE16(mu8_Batch + 2, mu16_Batch);
+	ExportBuffer::Write(mu8_Batch, u32_Length);
+
+	if (mk_Export.u32_ID != 0) {
+		kExportPos* pk_Sent = &mk_Export.k_Sent[mu16_Batch % EXPORT_ACK_WINDOW];
+		*pk_Sent = mk_Pos;
+		pk_Sent->u32_Crc = ExportBuffer::GetCrc();
 	}
+	mu16_Batch++;
 	return (true);
 }
+
+// Reads the acknowledgements that the client has sent. An acknowledgement also confirms all batches before.
+// returns false if the connection is lost or a batch is in flight for EXPORT_ACK_TIMEOUT without an acknowledgement
+bool WiFiExport::ReceiveAcks(void)
+{
+	uint32_t u32_Now = Utils::GetMillis();
+	while (serverClient.available() >= 2) {
+		byte u8_Ack[2];
+		serverClient.read(u8_Ack, 2);
+		uint16_t u16_Ack = Utils::ReadLE16(u8_Ack);
+
+		/* A repeated acknowledgement is ignored */
+		if (u16_Ack >= mk_Export.u16_Acked && u16_Ack < mu16_Batch) {
+			mk_Export.k_Acked   = mk_Export.k_Sent[u16_Ack % EXPORT_ACK_WINDOW];
+			mk_Export.u16_Acked = u16_Ack + 1;
+			mu32_LastAck = u32_Now;
+		}
+	}
+
+	if (mk_Export.u16_Acked == mu16_Batch) {
+		mu32_LastAck = u32_Now; // no batch in flight
+		return (true);
+	}
+	return serverClient.connected() && u32_Now - mu32_LastAck < EXPORT_ACK_TIMEOUT;
+}
+
+// Appends one line "#SD,operation,calls,errors,bytes,p50,p90,p99,max" for each SD operation (durations in microseconds)
+// and the line "#SD,recent-write,..." with the write latency of the last SD_WINDOW_WRITES writes.
+void WiFiExport::SendStats(void)
+{
+	char lBuf[4+100];
+	while (ExportBuffer::GetFree() >= sizeof(lBuf) + 2) {
+		if (mu8_Stat < SD_OP_COUNT) {
+			strcpy(lBuf, "#SD,");
+			SDCard::FormatStats(mu8_Stat, lBuf + 4);
+		} else {
+			const kLatencyHistogram* pk_Recent = SDCard::GetRecentWrites();
+			sprintf(lBuf, "#SD,recent-write,%u,0,0,%u,%u,%u,%u", (unsigned)pk_Recent->u32_Samples,
+			        (unsigned)Utils::HistogramPercentile(pk_Recent, 50), (unsigned)Utils::HistogramPercentile(pk_Recent, 90),
+			        (unsigned)Utils::HistogramPercentile(pk_Recent, 99), (unsigned)pk_Recent->u32_Max);
+		}
+		ExportBuffer::Print(lBuf);
+		if (++mu8_Stat > SD_OP_COUNT) {
+			mu8_Step = STEP_FLUSH;
+			return;
+		}
+	}
+}
+
+// The progress bar is only redrawn when it changes (each redraw sends the whole frame over I2C)
+void WiFiExport::ShowProgress(void)
+{
+	mk_Pos.u16_Scanned++;
+	if (mu32_Percent != (uint32_t)mk_Pos.u16_Scanned * 100 / mu16_Count) {
+		mu32_Percent = (uint32_t)mk_Pos.u16_Scanned * 100 / mu16_Count;
+		OLEDScreen::ShowProgressBar(mk_Pos.u16_Scanned, mu16_Count);
+	}
+}
+
+uint16_t Utils::getNumFiles(File dir)
+{
+	File entry;
+	uint16_t fileCount = 0;
+
+	while (entry = SDCard::OpenNext(&dir), entry)
+	{
+	  if (!entry.isDirectory())
+	  {
+		fileCount++;
+	  }
+	  SDCard::Close(&entry);
+	}
+	return(fileCount);
+}
@@ -3,6 +3,8 @@
 #define UTILS_H
 
 #include "Config.h"
+#include "PN532.h"
+#include "Histogram.h"
 
 #include <Arduino.h>
 #include <SD.h>
@@ -41,6 +43,19 @@
 #define OLED_SDA    D2
 #define OLED_ADDR   (0x3cu)
 
+// The manifest of a backup folder (see Utils::WriteManifest())
+#define BACKUP_MANIFEST       "MANIFEST.DAT"
+#define BACKUP_MAGIC          (0x4243464Eu) // "NFCB"
+#define BACKUP_DONE_MAGIC     (0x454E4F44u) // "DONE"
+#define BACKUP_VERSION        (1u)
+#define BACKUP_MANIFEST_SIZE  (40u)
+
+// Return values of Utils::ReadManifest()
+#define MANIFEST_MISSING      (0u)
+#define MANIFEST_INVALID      (1u)
+#define MANIFEST_PENDING      (2u)
+#define MANIFEST_DONE         (3u)
+
 //extern SSD1306 display;
 extern SH1106 display;
 
@@ -96,15 +111,146 @@ public:
 
 // -------------------------------------------------------------------------------------------------------------------
 
+// The result of the WiFi functions that are polled by the state machine
+typedef enum {
+	WLAN_BUSY,      // not finished, call again in the next tick
+	WLAN_DONE,
+	WLAN_FAILED,
+	WLAN_INTERRUPTED // the connection to the client is lost, the client may resume the transfer (see WiFiExport)
+} eWLANStatus;
+
+// The upload runs in the scheduler task of the state machine. No function blocks, each returns after one step.
 class WLAN
 {
 public:
 	static void ZeroInit(void);
 	static void Initialize(void);
-	static bool StartTCP(void);
-	static bool StartTransffer(void);
-	static bool ReadSecretKey(char RcvDate[9]);
+	static void BeginWait(bool b_Resume = false);
+	static eWLANStatus PollClient(void);
+	static void BeginTransfer(void);
+	static eWLANStatus PollTransfer(void);
+
+private:
+	static bool CheckSecretKey(const uint8_t secretKey[8], char RcvDate[9]);
+	static eWLANStatus EndTransfer(eWLANStatus e_Status);
+
+	static byte     mu8_Step;     // the step of PollTransfer()
+	static uint32_t mu32_Start;   // the start of the wait for the client or of the current step
+	static uint32_t mu32_Timeout; // the time that PollClient() waits for the client
+	static uint32_t mu32_LastDraw;
+	static uint16_t mu16_Version; // the export version requested by the client
+	static uint64_t mu64_Token;
+	static uint32_t mu32_Resume;
+};
+
+// -------------------------------------------------------------------------------------------------------------------
+
+// The export to the WiFi client is collected in a buffer of one TCP segment.
+// Before, each card was sent with its own println(). With Nagle's algorithm (setNoDelay(false)) the tiny segments
+// waited for the delayed ACK of the client.
+// EXPORT_BUFFER_SIZE should be the TCP_MSS of lwIP: 536 bytes (1460 with the "higher bandwidth" lwIP variant).
+#define EXPORT_BUFFER_SIZE     (536u)
+// The time in milliseconds that the client may not accept any data before the transfer is aborted
+#define EXPORT_WRITE_TIMEOUT   (5000u)
+
+// ------------ Binary export (see WiFiExport) ------------
+// After the secret key a new client sends the request "NFCX" + the highest export version that it supports (16 bit).
+// An old client sends nothing and gets the ASCII export "NAME.EXT,count" (EXPORT_ASCII).
+// From version 2 on the request is followed by the sync token (64 bit) of the last transfer or 0.
+// From version 3 on the token is followed by the transfer ID (32 bit) of an interrupted transfer or 0.
+#define EXPORT_REQUEST_MAGIC   (0x5843464Eu) // "NFCX"
+#define EXPORT_REQUEST_TIMEOUT (250u)        // milliseconds to wait for the request after the secret key
+#define EXPORT_ASCII           (0u)
+#define EXPORT_MAGIC           (0x4543464Eu) // "NFCE"
+#define EXPORT_VERSION         (3u)
+#define EXPORT_VERSION_SYNC    (2u)          // the first version with the sync token
+#define EXPORT_VERSION_ACK     (3u)          // the first version with acknowledgements
+#define EXPORT_HEADER_SIZE     (16u)
+#define EXPORT_HEADER_SIZE_ACK (24u)
+#define EXPORT_BATCH_HEADER    (4u)
+#define EXPORT_RECORD_SIZE     (12u)
+// One batch (header + records) fits into one TCP segment
+#define EXPORT_BATCH_RECORDS   ((EXPORT_BUFFER_SIZE - EXPORT_BATCH_HEADER) / EXPORT_RECORD_SIZE)
+// The number of batches that are sent before the oldest one must have been acknowledged
+#define EXPORT_ACK_WINDOW      (4u)
+// The time in milliseconds that the client may not acknowledge a batch before the transfer is interrupted
+#define EXPORT_ACK_TIMEOUT     (5000u)
+
+// The position in the binary export behind a batch
+struct kExportPos
+{
+	uint32_t u32_Slot;      // the next record of the database
+	uint32_t u32_Records;   // the records sent
+	uint32_t u32_Crc;       // the CRC32 of all batches
+	uint16_t u16_Scanned;   // the dirty records read (for the progress bar)
+};
+
+// The binary export with acknowledgements. It is kept after an interrupted transfer, so the client can resume it.
+struct kExportTransfer
+{
+	uint32_t   u32_ID;      // 0 = there is no transfer to resume
+	uint64_t   u64_Token;   // the sync token of the client
+	uint64_t   u64_New;     // the sync token of the database at the start
+	uint16_t   u16_Acked;   // the number of batches that have been acknowledged
+	kExportPos k_Acked;     // the position behind the last acknowledged batch
+	kExportPos k_Sent[EXPORT_ACK_WINDOW]; // the position behind each batch in flight
+};
+
+// Write() only appends to the buffer, Send() passes as much of it to the client as its send window accepts.
+class ExportBuffer
+{
+public:
+	static void Begin(void);
+	static uint32_t GetFree(void);
+	static bool IsEmpty(void);
+	static bool Write(const byte* u8_Data, uint32_t u32_Length);
+	static bool Print(const char* s8_Line);
+	static bool Send(void);
+	static void ResetCrc(uint32_t u32_Crc = 0xFFFFFFFF);
+	static uint32_t GetCrc(void);
+
+private:
+	static byte     mu8_Buffer[EXPORT_BUFFER_SIZE];
+	static uint32_t mu32_Used;
+	static uint32_t mu32_Crc;      // CRC32 of the data written since ResetCrc()
+	static uint32_t mu32_LastSent; // the last time the client has accepted data (or the buffer was empty)
+	static bool     mb_Error;      // the client has not accepted the data, the rest of the transfer is discarded
 };
+
+// Sends the cards that have been used since the last backup to serverClient, in the ASCII or the binary format.
+// Step() is called by WLAN::PollTransfer() in each tick. It reads at most EXPORT_BATCH_RECORDS cards and only
+// fills the free space of the ExportBuffer.
+class WiFiExport
+{
+public:
+	static void Begin(uint16_t u16_Count, uint16_t u16_Version, uint64_t u64_Token, uint32_t u32_Resume);
+	static eWLANStatus Step(void);
+	static bool CanResume(void);
+	static void Cancel(void);
+
+private:
+	static void ScanAscii(void);
+	static void ScanBinary(void);
+	static void SendStats(void);
+	static bool SendBatch(void);
+	static bool ReceiveAcks(void);
+	static void ShowProgress(void);
+
+	static byte       mu8_Step;
+	static uint16_t   mu16_Version;
+	static uint16_t   mu16_Count;    // the number of cards used since the last backup
+	static uint32_t   mu32_Since;    // the change sequence of the client's sync token
+	static kExportPos mk_Pos;        // the position behind the records in mu8_Batch
+	static uint16_t   mu16_Batch;    // the number of the next batch
+	static uint32_t   mu32_InBatch;  // the records in mu8_Batch
+	static bool       mb_End;        // all dirty records have been read
+	static byte       mu8_Stat;      // the next line of the SD statistics
+	static uint32_t   mu32_Percent;  // the progress bar that is displayed
+	static uint32_t   mu32_LastAck;  // the last acknowledgement (or the time when no batch was in flight)
+	static byte       mu8_Batch[EXPORT_BATCH_HEADER + EXPORT_BATCH_RECORDS * EXPORT_RECORD_SIZE];
+	static kExportTransfer mk_Export;
+};
+
 // -------------------------------------------------------------------------------------------------------------------
 
 // This class implements Hardware SPI (4 wire bus). It is not used for the DoorOpener sketch.
@@ -123,6 +269,17 @@ public:
 	{
 		return SPI.transfer(u8_Data);
 	}
+	// Write u32_Count bytes from u8_Out and at the same time receive u32_Count bytes into u8_In in one burst.
+	// u8_Out and u8_In may be the same buffer.
+	static inline void TransferBytes(const byte* u8_Out, byte* u8_In, uint32_t u32_Count)
+	{
+		SPI.transferBytes(u8_Out, u8_In, u32_Count);
+	}
+	// Write u32_Count bytes in one burst, the received bytes are discarded.
+	static inline void WriteBytes(const byte* u8_Out, uint32_t u32_Count)
+	{
+		SPI.writeBytes((uint8_t*)u8_Out, u32_Count);
+	}
 };
 
 // -------------------------------------------------------------------------------------------------------------------
@@ -138,6 +295,14 @@ public:
         return millis();
     }
 
+    // returns the current microsecond counter (rolls over after 71 minutes)
+	// When you compile the code for Linux, Windows or any other platform you must change this function.
+	// On Windows use QueryPerformanceCounter() here
+    static inline uint32_t GetMicros()
+    {
+        return micros();
+    }
+
 	// When you compile the code for Linux, Windows or any other platform you must change this function.
 	// Use Sleep() here.
     static inline void DelayMilli(int s32_MilliSeconds)
@@ -171,6 +336,21 @@ public:
         digitalWrite(u8_Pin, u8_Status);
     }
 
+	// Attaches an interrupt handler to a digital processor pin.
+    // u8_Mode = RISING, FALLING or CHANGE
+	// When you compile the code for Linux, Windows or any other platform you must change this function.
+    static inline void AttachInterrupt(byte u8_Pin, void (*pf_Handler)(void), int s32_Mode)
+    {
+        attachInterrupt(digitalPinToInterrupt(u8_Pin), pf_Handler, s32_Mode);
+    }
+
+	// Gives the ESP8266 the chance to service the WiFi stack and the watchdog while waiting.
+	// When you compile the code for Linux, Windows or any other platform you can leave this function empty.
+    static inline void Yield()
+    {
+        yield();
+    }
+
 	// reads the current state of a digital processor pin.
     // returns HIGH or LOW
     // When you compile the code for Linux, Windows or any other platform you must change this function.	
@@ -179,8 +359,42 @@ public:
         return digitalRead(u8_Pin);
     }
 
+    // Little endian conversion of binary records on the SD card. The buffers do not need to be aligned.
+    static inline uint16_t ReadLE16(const byte* u8_Data)
+    {
+        return (uint16_t)(u8_Data[0] | (u8_Data[1] << 8));
+    }
+    static inline void WriteLE16(byte* u8_Data, uint16_t u16_Value)
+    {
+        u8_Data[0] = (byte)u16_Value;
+        u8_Data[1] = (byte)(u16_Value >> 8);
+    }
+    static inline uint32_t ReadLE32(const byte* u8_Data)
+    {
+        return (uint32_t)u8_Data[0] | ((uint32_t)u8_Data[1] << 8) | ((uint32_t)u8_Data[2] << 16) | ((uint32_t)u8_Data[3] << 24);
+    }
+    static inline void WriteLE32(byte* u8_Data, uint32_t u32_Value)
+    {
+        u8_Data[0] = (byte)u32_Value;
+        u8_Data[1] = (byte)(u32_Value >> 8);
+        u8_Data[2] = (byte)(u32_Value >> 16);
+        u8_Data[3] = (byte)(u32_Value >> 24);
+    }
+    static inline uint64_t ReadLE64(const byte* u8_Data)
+    {
+        return (uint64_t)ReadLE32(u8_Data) | ((uint64_t)ReadLE32(u8_Data + 4) << 32);
+    }
+    static inline void WriteLE64(byte* u8_Data, uint64_t u64_Value)
+    {
+        WriteLE32(u8_Data,     (uint32_t)u64_Value);
+        WriteLE32(u8_Data + 4, (uint32_t)(u64_Value >> 32));
+    }
+
     static uint64_t GetMillis64();
+    static void     HistogramAdd(kLatencyHistogram* pk_Hist, uint32_t u32_Micros);
+    static uint32_t HistogramPercentile(const kLatencyHistogram* pk_Hist, byte u8_Percent);
     static void     Base36(uint64_t u64_ID, char *s8_LF);
+    static bool     ParseBase36(const char* s8_Name, uint64_t* pu64_ID);
 #ifdef STD_PRINT_EN
     static void     Print(const char*   s8_Text,  const char* s8_LF=NULL);
     static void     PrintDec  (int      s32_Data, const char* s8_LF=NULL);
@@ -189,6 +403,7 @@ public:
     static void     PrintHex32(uint32_t u32_Data, const char* s8_LF=NULL);
     static void     PrintHexBuf(const byte* u8_Data, const uint32_t u32_DataLen, const char* s8_LF=NULL, int s32_Brace1=-1, int S32_Brace2=-1);
     static void     PrintInterval(uint64_t u64_Time, const char* s8_LF=NULL);
+    static void     PrintHistogram(const kLatencyHistogram* pk_Hist, const char* s8_LF=NULL);
 #endif
     static void     GetHexBuf(const byte* u8_Data, const uint32_t u32_DataLen, String* retVal);
     static void     GenerateRandom(byte* u8_Random, int s32_Length);
@@ -198,13 +413,23 @@ public:
     static void     XorDataBlock(byte* u8_Data, const byte* u8_Xor, int s32_Length);
     static uint16_t CalcCrc16(const byte* u8_Data,  int s32_Length);
     static uint32_t CalcCrc32(const byte* u8_Data1, int s32_Length1, const byte* u8_Data2=NULL, int s32_Length2=0);
-    static void     GetSDCounterForCard(char* fileName, uint16_t * u16_noOfCoffees);
+    static uint32_t CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc);
+    static bool     GetSDCounterForCard(const char* fileName, uint16_t * u16_noOfCoffees);
+    static bool     ReadSDCounter(uint64_t u64_ID, uint32_t* pu32_Count);
+    static bool     WriteSDCounter(uint64_t u64_ID, uint32_t u32_Count);
     static bool     UpdateSDCardCounter(uint64_t u64_ID, kCard* pk_Card, uint64_t u64_StartTick);
     static uint16_t getNumFiles(File dir);
-    static bool     printDirectory(File dir, uint16_t fileCount);
 	static bool		Backup_Data(void);
+    static bool     FinishBackup(void);
+    static bool     MoveFile(const char* s8_Source, const char* s8_Dest);
+    static bool     CopyFile(const char* s8_Source, const char* s8_Dest);
 private:
-    static uint32_t CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc);
+    static void     FindBackups(char* s8_Last, char* s8_Prev);
+    static bool     WriteBackupCard(const char* s8_Folder, uint64_t u64_ID, uint32_t u32_Count);
+    static bool     WriteManifest(const char* s8_Folder, const char* s8_Prev, uint32_t u32_Cards);
+    static byte     ReadManifest(const char* s8_Folder);
+    static bool     ResetBackupCards(const char* s8_Folder, bool b_Folder);
+    static bool     RemoveFolder(const char* s8_Folder);
 };
 
 #endif // UTILS_H
@@ -0,0 +1,903 @@
+// The host implementation of the Arduino stubs for the tests in test/.
+// The SD card and the EEPROM are kept in RAM, a fake PN532 answers on the SPI bus,
+// a WiFi client connects on a loopback and the display only counts its frames.
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <strings.h>
+
+#include "HostStubs.h"
+#include <SD.h>
+#include <SPI.h>
+#include <EEPROM.h>
+#include <ESP8266WiFi.h>
+#include <SSD1306.h>
+#include <SH1106.h>
+
+// The macros of Arduino.h would break std::min() and std::max()
+#undef min
+#undef max
+
+// ------------ Clock ------------
+
+static uint64_t gu64_Micros = 0;
+
+static void UpdateIrq(void);
+
+static void AdvanceMicros(uint64_t u64_Micros)
+{
+    gu64_Micros += u64_Micros;
+    UpdateIrq();
+}
+
+unsigned long millis(void)                 { return (unsigned long)(gu64_Micros / 1000); }
+unsigned long micros(void)                 { return (unsigned long)gu64_Micros; }
+void delay(unsigned long u32_Milli)        { AdvanceMicros((uint64_t)u32_Milli * 1000); }
+void delayMicroseconds(unsigned int u32_Micro) { AdvanceMicros(u32_Micro); }
+void yield(void)                           { AdvanceMicros(10); }
+
+void FakeClock::Advance(uint32_t u32_Milli)
+{
+    AdvanceMicros((uint64_t)u32_Milli * 1000);
+}
+
+// ------------ Pins, PROGMEM, Serial ------------
+
+static bool IsIrqLow(uint8_t u8_Pin);
+static void AttachIrq(uint8_t u8_Pin, void (*pf_Handler)(void));
+
+void     pinMode(uint8_t, uint8_t)                    {}
+int      digitalRead(uint8_t u8_Pin)                  { return IsIrqLow(u8_Pin) ? LOW : HIGH; }
+int      digitalPinToInterrupt(int s32_Pin)           { return s32_Pin; }
+void     attachInterrupt(uint8_t u8_Pin, void (*pf_Handler)(void), int) { AttachIrq(u8_Pin, pf_Handler); }
+void     detachInterrupt(uint8_t u8_Pin)              { AttachIrq(u8_Pin, NULL); }
+uint32_t pgm_read_dword(const void* p_Address)        { uint32_t u32_Value; memcpy(&u32_Value, p_Address, 4); return u32_Value; }
+uint16_t pgm_read_word (const void* p_Address)        { uint16_t u16_Value; memcpy(&u16_Value, p_Address, 2); return u16_Value; }
+int      stricmp(const char* s8_A, const char* s8_B)  { return strcasecmp(s8_A, s8_B); } // UserManager.h
+
+size_t Print::write(const uint8_t* u8_Data, size_t u32_Length)
+{
+    for (size_t i=0; i<u32_Length; i++)
+        write(u8_Data[i]);
+    return u32_Length;
+}
+size_t Print::print(const char* s8_Text)   { return write((const uint8_t*)s8_Text, strlen(s8_Text)); }
+size_t Print::println(const char* s8_Text) { return print(s8_Text) + println(); }
+size_t Print::println(void)                { return print("\r\n"); }
+
+void   Stream::setTimeout(unsigned long) {}
+size_t Stream::readBytes(char* s8_Buffer, size_t u32_Length) { return readBytes((uint8_t*)s8_Buffer, u32_Length); }
+size_t Stream::readBytes(uint8_t* u8_Buffer, size_t u32_Length)
+{
+    size_t i = 0;
+    for (int s32_Char; i < u32_Length && (s32_Char = read()) >= 0; i++)
+        u8_Buffer[i] = (uint8_t)s32_Char;
+    return i;
+}
+
+HardwareSerial Serial;
+void   HardwareSerial::begin(unsigned long) {}
+int    HardwareSerial::available(void)      { return 0; }
+int    HardwareSerial::read(void)           { return -1; }
+int    HardwareSerial::peek(void)           { return -1; }
+void   HardwareSerial::flush(void)          {}
+size_t HardwareSerial::write(uint8_t u8_Data) { putchar(u8_Data); return 1; }
+
+String::String(const char*)   {}
+String::String(int)           {}
+String::String(unsigned char) {}
+String& String::operator+=(const String&) { return *this; }
+String& String::operator+=(char)          { return *this; }
+
+// ------------ SD card ------------
+
+struct kFakeNode
+{
+    bool              b_Directory;
+    std::vector<byte> u8_Data;
+};
+
+struct kFakeHandle
+{
+    std::string path;
+    kFakeNode*  pk_Node;
+    uint32_t    u32_Position;
+    std::string lastChild;  // openNextFile() continues behind this path
+    char        s8_Name[13];
+};
+
+// The nodes are never deleted, so a File that is still open after remove() does not crash
+static std::map<std::string, kFakeNode*> gi_Files;
+static bool     gb_Present      = true;
+static int32_t  gs32_Budget     = -1; // the bytes that are still written before the "power fails", -1 = unlimited
+static uint32_t gu32_Written    = 0;
+static uint32_t gu32_Read       = 0;
+static uint32_t gu32_Calls      = 0;  // read() and write() calls, each costs a command on the SD bus
+static uint32_t gu32_Opens      = 0;  // open() and openNextFile(), each searches the directory
+
+static std::string NormPath(const char* s8_Path)
+{
+    std::string path = (s8_Path[0] == '/') ? s8_Path : std::string("/") + s8_Path;
+    for (size_t i=0; i<path.size(); i++)
+        path[i] = (char)toupper(path[i]);
+    if (path.size() > 1 && path[path.size() - 1] == '/')
+        path.erase(path.size() - 1);
+    return path;
+}
+
+static File MakeFile(const std::string& path, kFakeNode* pk_Node, uint32_t u32_Position)
+{
+    gu32_Opens ++;
+    kFakeHandle* pk_Handle  = new kFakeHandle;
+    pk_Handle->path         = path;
+    pk_Handle->pk_Node      = pk_Node;
+    pk_Handle->u32_Position = u32_Position;
+    strncpy(pk_Handle->s8_Name, path.substr(path.rfind('/') + 1).c_str(), 12);
+    pk_Handle->s8_Name[12]  = 0;
+
+    File i_File;
+    i_File.mp_Handle = pk_Handle;
+    return i_File;
+}
+
+// Deletes all files. The card is inserted and writes do not fail.
+void FakeSD::Format(void)
+{
+    gi_Files.clear();
+    gi_Files["/"] = new kFakeNode();
+    gi_Files["/"]->b_Directory = true;
+    gb_Present   = true;
+    gs32_Budget  = -1;
+    gu32_Written = 0;
+    gu32_Read    = 0;
+    gu32_Calls   = 0;
+    gu32_Opens   = 0;
+}
+
+// A removed card fails all operations
+void FakeSD::SetPresent(bool b_Present)
+{
+    gb_Present = b_Present;
+}
+
+// Only s32_Bytes are still written, then the "power fails": the write that crosses the limit is torn
+// (only its first bytes are written) and all later writes write nothing. -1 = no limit.
+void FakeSD::SetWriteBudget(int32_t s32_Bytes)
+{
+    gs32_Budget = s32_Bytes;
+}
+
+// returns the bytes written since Format()
+uint32_t FakeSD::GetBytesWritten(void)
+{
+    return gu32_Written;
+}
+
+// returns the bytes read since Format()
+uint32_t FakeSD::GetBytesRead(void)
+{
+    return gu32_Read;
+}
+
+// returns the read() and write() calls since Format()
+uint32_t FakeSD::GetCalls(void)
+{
+    return gu32_Calls;
+}
+
+// returns the files opened since Format()
+uint32_t FakeSD::GetOpens(void)
+{
+    return gu32_Opens;
+}
+
+SDClass SD;
+
+bool SDClass::begin(uint8_t)
+{
+    if (gi_Files.empty())
+        FakeSD::Format();
+    return gb_Present;
+}
+
+File SDClass::open(const char* s8_Path, uint8_t u8_Mode)
+{
+    if (!gb_Present)
+        return File();
+
+    std::string path = NormPath(s8_Path);
+    if (gi_Files.find(path) == gi_Files.end())
+    {
+        std::string parent = path.substr(0, std::max<size_t>(path.rfind('/'), 1));
+        if (u8_Mode != FILE_WRITE || gi_Files.find(parent) == gi_Files.end())
+            return File();
+        gi_Files[path] = new kFakeNode();
+        gi_Files[path]->b_Directory = false;
+    }
+    kFakeNode* pk_Node = gi_Files[path];
+    // FILE_WRITE appends like the SD library
+    return MakeFile(path, pk_Node, u8_Mode == FILE_WRITE ? pk_Node->u8_Data.size() : 0);
+}
+
+bool SDClass::exists(const char* s8_Path)
+{
+    return gb_Present && gi_Files.find(NormPath(s8_Path)) != gi_Files.end();
+}
+
+bool SDClass::mkdir(const char* s8_Path)
+{
+    if (!gb_Present)
+        return false;
+    std::string path = NormPath(s8_Path);
+    if (gi_Files.find(path) == gi_Files.end())
+    {
+        gi_Files[path] = new kFakeNode();
+        gi_Files[path]->b_Directory = true;
+    }
+    return true;
+}
+
+bool SDClass::remove(const char* s8_Path)
+{
+    std::map<std::string, kFakeNode*>::iterator it = gi_Files.find(NormPath(s8_Path));
+    if (!gb_Present || it == gi_Files.end() || it->second->b_Directory)
+        return false;
+    gi_Files.erase(it);
+    return true;
+}
+
+bool SDClass::rmdir(const char* s8_Path)
+{
+    return gb_Present && gi_Files.erase(NormPath(s8_Path)) > 0;
+}
+
+bool SDClass::rename(const char* s8_Source, const char* s8_Dest)
+{
+    std::string source = NormPath(s8_Source);
+    std::string dest   = NormPath(s8_Dest);
+    if (!gb_Present || gi_Files.find(source) == gi_Files.end() || gi_Files.find(dest) != gi_Files.end())
+        return false;
+    gi_Files[dest] = gi_Files[source];
+    gi_Files.erase(source);
+    return true;
+}
+
+static kFakeHandle* Handle(File* pi_File)
+{
+    return (kFakeHandle*)pi_File->mp_Handle;
+}
+
+File::File(void)
+{
+    mp_Handle = NULL;
+}
+
+File::operator bool(void)
+{
+    return mp_Handle != NULL;
+}
+
+size_t File::write(uint8_t u8_Data)
+{
+    return write(&u8_Data, 1);
+}
+
+size_t File::write(const uint8_t* u8_Data, size_t u32_Length)
+{
+    kFakeHandle* pk_Handle = Handle(this);
+    if (!pk_Handle || !gb_Present)
+        return 0;
+
+    if (gs32_Budget >= 0 && u32_Length > (uint32_t)gs32_Budget)
+        u32_Length = gs32_Budget;
+    if (gs32_Budget >= 0)
+        gs32_Budget -= u32_Length;
+
+    std::vector<byte>& u8_File = pk_Handle->pk_Node->u8_Data;
+    if (u8_File.size() < pk_Handle->u32_Position + u32_Length)
+        u8_File.resize(pk_Handle->u32_Position + u32_Length);
+    if (u32_Length > 0)
+        memcpy(&u8_File[pk_Handle->u32_Position], u8_Data, u32_Length);
+
+    pk_Handle->u32_Position += u32_Length;
+    gu32_Written            += u32_Length;
+    gu32_Calls              ++;
+    return u32_Length;
+}
+
+int File::read(void)
+{
+    uint8_t u8_Data;
+    return read(&u8_Data, 1) == 1 ? u8_Data : -1;
+}
+
+int File::read(void* p_Buffer, uint16_t u16_Length)
+{
+    kFakeHandle* pk_Handle = Handle(this);
+    if (!pk_Handle || !gb_Present)
+        return -1;
+
+    std::vector<byte>& u8_File = pk_Handle->pk_Node->u8_Data;
+    uint32_t u32_Length = 0;
+    if (pk_Handle->u32_Position < u8_File.size())
+        u32_Length = std::min<uint32_t>(u16_Length, u8_File.size() - pk_Handle->u32_Position);
+    if (u32_Length > 0)
+        memcpy(p_Buffer, &u8_File[pk_Handle->u32_Position], u32_Length);
+
+    pk_Handle->u32_Position += u32_Length;
+    gu32_Read               += u32_Length;
+    gu32_Calls              ++;
+    return u32_Length;
+}
+
+int File::peek(void)
+{
+    std::vector<byte>& u8_File = Handle(this)->pk_Node->u8_Data;
+    return Handle(this)->u32_Position < u8_File.size() ? u8_File[Handle(this)->u32_Position] : -1;
+}
+
+int File::available(void)
+{
+    return size() - std::min(position(), size());
+}
+
+void File::flush(void)
+{
+}
+
+bool File::seek(uint32_t u32_Position)
+{
+    if (!mp_Handle || !gb_Present || u32_Position > size())
+        return false;
+    Handle(this)->u32_Position = u32_Position;
+    return true;
+}
+
+uint32_t File::position(void)
+{
+    return Handle(this)->u32_Position;
+}
+
+uint32_t File::size(void)
+{
+    return Handle(this)->pk_Node->u8_Data.size();
+}
+
+void File::close(void)
+{
+    delete Handle(this);
+    mp_Handle = NULL;
+}
+
+char* File::name(void)
+{
+    return Handle(this)->s8_Name;
+}
+
+bool File::isDirectory(void)
+{
+    return Handle(this)->pk_Node->b_Directory;
+}
+
+void File::rewindDirectory(void)
+{
+    Handle(this)->lastChild.clear();
+}
+
+// Returns the children in alphabetical order
+File File::openNextFile(uint8_t)
+{
+    kFakeHandle* pk_Dir = Handle(this);
+    std::string prefix = (pk_Dir->path == "/") ? "/" : pk_Dir->path + "/";
+
+    std::map<std::string, kFakeNode*>::iterator it = pk_Dir->lastChild.empty() ? gi_Files.begin() : gi_Files.upper_bound(pk_Dir->lastChild);
+    for (; gb_Present && it != gi_Files.end(); ++it)
+    {
+        const std::string& path = it->first;
+        if (path.size() <= prefix.size() || path.compare(0, prefix.size(), prefix) != 0 ||
+            path.find('/', prefix.size()) != std::string::npos)
+            continue;
+
+        pk_Dir->lastChild = path;
+        return MakeFile(path, it->second, 0);
+    }
+    return File();
+}
+
+// ------------ EEPROM ------------
+
+static byte     gu8_EEPROM[4096];  // the RAM copy
+static byte     gu8_Flash[4096];   // the flash sector
+static uint32_t gu32_Commits = 0;
+
+EEPROMClass EEPROM;
+void    EEPROMClass::begin(size_t)                            { memcpy(gu8_EEPROM, gu8_Flash, sizeof(gu8_EEPROM)); }
+uint8_t EEPROMClass::read(int s32_Address)                    { return gu8_EEPROM[s32_Address]; }
+void    EEPROMClass::write(int s32_Address, uint8_t u8_Data)  { gu8_EEPROM[s32_Address] = u8_Data; }
+
+bool EEPROMClass::commit(void)
+{
+    memcpy(gu8_Flash, gu8_EEPROM, sizeof(gu8_Flash));
+    gu32_Commits ++;
+    return true;
+}
+
+// An erased EEPROM of the ESP8266 (the flash sector) contains 0xFF
+void FakeEEPROM::Erase(void)
+{
+    memset(gu8_EEPROM, 0xFF, sizeof(gu8_EEPROM));
+    memset(gu8_Flash,  0xFF, sizeof(gu8_Flash));
+}
+
+// returns how often the flash sector has been erased and written
+uint32_t FakeEEPROM::GetCommits(void)
+{
+    return gu32_Commits;
+}
+
+// ------------ PN532 ------------
+
+enum eFakeFrame
+{
+    FRAME_NONE,      // the PN532 is idle
+    FRAME_ACK,       // a command has been received, the ACK follows
+    FRAME_RESPONSE,  // the ACK has been read, the response follows
+};
+
+static const uint8_t gu8_AckFrame[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+
+static uint8_t       gu8_SselPin       = 0xFF;
+static uint8_t       gu8_IrqPin        = 0xFF;
+static void        (*gpf_IrqHandler)(void) = NULL;
+static bool          gb_Selected       = false;
+static int           gs32_Op           = -1;    // the first byte after SSEL low, -1 = not yet received
+static std::vector<uint8_t> gu8_Written;        // the bytes after PN532_SPI_DATAWRITE
+static uint32_t      gu32_ReadPos      = 0;     // the position in the frame after PN532_SPI_DATAREAD
+static eFakeFrame    ge_Frame          = FRAME_NONE;
+static uint64_t      gu64_ReadyAt      = 0;     // microseconds, when the frame is ready
+static bool          gb_IrqFired       = false; // the falling edge of the current frame has been signaled
+static std::vector<uint8_t> gu8_Response;       // the response frame that follows the ACK
+static std::vector<uint8_t> gu8_Frame;          // the frame that the host reads (ACK or response)
+static uint32_t      gu32_AckMicros    = 200;
+static uint32_t      gu32_RespMicros   = 1000;
+static FakeResponder gpf_Responder     = NULL;
+static uint32_t      gu32_Glitches     = 0;
+static uint32_t      gu32_SpiCalls     = 0;
+static uint32_t      gu32_SpiBytes     = 0;
+static uint32_t      gu32_StatusReads  = 0;
+static uint32_t      gu32_Commands     = 0;
+static uint64_t      gu64_SelectAt     = 0;     // microseconds, SSEL low
+static uint32_t      gu32_ReadMicros   = 0;
+static uint8_t       gu8_Commands[64];
+
+static bool IsFrameReady(void)
+{
+    return ge_Frame != FRAME_NONE && gu64_Micros >= gu64_ReadyAt;
+}
+
+static bool IsIrqLow(uint8_t u8_Pin)
+{
+    return u8_Pin == gu8_IrqPin && IsFrameReady();
+}
+
+static void AttachIrq(uint8_t u8_Pin, void (*pf_Handler)(void))
+{
+    if (u8_Pin == gu8_IrqPin) gpf_IrqHandler = pf_Handler;
+}
+
+// Calls the interrupt handler when the IRQ line goes low
+static void UpdateIrq(void)
+{
+    if (gb_IrqFired || !IsFrameReady())
+        return;
+
+    gb_IrqFired = true;
+    if (gpf_IrqHandler) gpf_IrqHandler();
+}
+
+static void SetFrame(eFakeFrame e_Frame, uint32_t u32_Latency)
+{
+    ge_Frame     = e_Frame;
+    gu64_ReadyAt = gu64_Micros + u32_Latency;
+    gb_IrqFired  = false;
+}
+
+// The default responder: GetFirmwareVersion returns a PN532 V1.6, all other commands are echoed
+static uint8_t EchoCommand(const uint8_t* u8_Cmd, uint8_t u8_CmdLen, uint8_t* u8_Resp)
+{
+    if (u8_Cmd[0] == 0x02)
+    {
+        const uint8_t u8_Firmware[] = { 0x03, 0x32, 0x01, 0x06, 0x07 };
+        memcpy(u8_Resp, u8_Firmware, sizeof(u8_Firmware));
+        return sizeof(u8_Firmware);
+    }
+    u8_Resp[0] = u8_Cmd[0] + 1;
+    memcpy(u8_Resp + 1, u8_Cmd + 1, u8_CmdLen - 1);
+    return u8_CmdLen;
+}
+
+// A frame from the host: an ACK aborts the current command, a valid command is acknowledged
+static void ReceiveFrame(void)
+{
+    const std::vector<uint8_t>& u8_In = gu8_Written;
+    if (u8_In.size() == sizeof(gu8_AckFrame) && memcmp(u8_In.data(), gu8_AckFrame, sizeof(gu8_AckFrame)) == 0)
+    {
+        ge_Frame = FRAME_NONE;
+        return;
+    }
+
+    // 00 00 FF LEN LCS D4 CMD... DCS 00
+    if (u8_In.size() < 8 || u8_In[2] != 0xFF || (uint8_t)(u8_In[3] + u8_In[4]) != 0 || u8_In[5] != 0xD4 || u8_In.size() < u8_In[3] + 7u)
+        return; // the PN532 ignores an invalid frame
+
+    const uint8_t* u8_Cmd = u8_In.data() + 6;
+    uint8_t u8_CmdLen = u8_In[3] - 1;
+    if (gu32_Commands < sizeof(gu8_Commands)) gu8_Commands[gu32_Commands] = u8_Cmd[0];
+    gu32_Commands ++;
+
+    uint8_t u8_Data[256];
+    uint8_t u8_Len = (gpf_Responder ? gpf_Responder : EchoCommand)(u8_Cmd, u8_CmdLen, u8_Data);
+
+    gu8_Response.clear();
+    if (u8_Len > 0)
+    {
+        uint8_t u8_Sum = 0xD5;
+        gu8_Response.push_back(0x00);
+        gu8_Response.push_back(0x00);
+        gu8_Response.push_back(0xFF);
+        gu8_Response.push_back(u8_Len + 1);
+        gu8_Response.push_back(0x100 - (uint8_t)(u8_Len + 1));
+        gu8_Response.push_back(0xD5);
+        for (uint8_t i=0; i<u8_Len; i++)
+        {
+            gu8_Response.push_back(u8_Data[i]);
+            u8_Sum += u8_Data[i];
+        }
+        gu8_Response.push_back(0x100 - u8_Sum);
+        gu8_Response.push_back(0x00);
+    }
+    gu8_Frame.assign(gu8_AckFrame, gu8_AckFrame + sizeof(gu8_AckFrame));
+    SetFrame(FRAME_ACK, gu32_AckMicros);
+}
+
+// SSEL low starts a transfer, SSEL high ends it
+static void SelectPN532(bool b_Select)
+{
+    if (b_Select == gb_Selected)
+        return;
+
+    gb_Selected = b_Select;
+    if (b_Select)
+    {
+        gs32_Op = -1;
+        gu64_SelectAt = gu64_Micros;
+        gu8_Written.clear();
+        gu32_ReadPos = 0;
+        return;
+    }
+
+    if (gs32_Op == 0x01) // PN532_SPI_DATAWRITE
+    {
+        ReceiveFrame();
+    }
+    else if (gs32_Op == 0x03 && gu32_ReadPos > 0) // PN532_SPI_DATAREAD
+    {
+        gu32_ReadMicros = (uint32_t)(gu64_Micros - gu64_SelectAt);
+        if (gu32_Glitches > 0)
+            gu32_Glitches --;
+
+        if (ge_Frame == FRAME_ACK && !gu8_Response.empty())
+        {
+            gu8_Frame = gu8_Response;
+            SetFrame(FRAME_RESPONSE, gu32_RespMicros);
+        }
+        else ge_Frame = FRAME_NONE;
+    }
+    UpdateIrq();
+}
+
+// One byte on the bus: u8_Out from the host, returns the byte of the PN532
+static uint8_t ClockByte(uint8_t u8_Out)
+{
+    gu32_SpiBytes ++;
+    AdvanceMicros(8);
+    if (!gb_Selected)
+        return 0xFF;
+
+    if (gs32_Op < 0)
+    {
+        gs32_Op = u8_Out;
+        if (gs32_Op == 0x02) gu32_StatusReads ++; // PN532_SPI_STATUSREAD
+        return 0x00;
+    }
+
+    switch (gs32_Op)
+    {
+        case 0x01: // PN532_SPI_DATAWRITE
+            gu8_Written.push_back(u8_Out);
+            return 0x00;
+        case 0x02: // PN532_SPI_STATUSREAD
+            return IsFrameReady() ? 0x01 : 0x00;
+        case 0x03: // PN532_SPI_DATAREAD
+        {
+            if (!IsFrameReady())
+                return 0x00;
+
+            uint32_t u32_Pos = gu32_ReadPos ++;
+            if (u32_Pos >= gu8_Frame.size())
+                return 0x00;
+
+            uint8_t u8_In = gu8_Frame[u32_Pos];
+            if (gu32_Glitches > 0 && u32_Pos == 3)
+                u8_In ^= 0x5A; // a bit error in the length byte
+            return u8_In;
+        }
+        default:
+            return 0x00;
+    }
+}
+
+void digitalWrite(uint8_t u8_Pin, uint8_t u8_Status)
+{
+    if (u8_Pin == gu8_SselPin) SelectPN532(u8_Status == LOW);
+}
+
+void FakePN532::Connect(uint8_t u8_SselPin, uint8_t u8_IrqPin)
+{
+    gu8_SselPin    = u8_SselPin;
+    gu8_IrqPin     = u8_IrqPin;
+    gpf_IrqHandler = NULL;
+    gb_Selected    = false;
+    ge_Frame       = FRAME_NONE;
+    gu32_Glitches  = 0;
+}
+
+void FakePN532::SetLatency(uint32_t u32_AckMicros, uint32_t u32_RespMicros)
+{
+    gu32_AckMicros  = u32_AckMicros;
+    gu32_RespMicros = u32_RespMicros;
+}
+
+void FakePN532::SetResponder(FakeResponder pf_Responder)
+{
+    gpf_Responder = pf_Responder;
+}
+
+void FakePN532::SetGlitches(uint32_t u32_Frames)
+{
+    gu32_Glitches = u32_Frames;
+}
+
+void FakePN532::ClearCounters(void)
+{
+    gu32_SpiCalls    = 0;
+    gu32_SpiBytes    = 0;
+    gu32_StatusReads = 0;
+    gu32_Commands    = 0;
+}
+
+uint32_t FakePN532::GetSpiCalls(void)    { return gu32_SpiCalls; }
+uint32_t FakePN532::GetSpiBytes(void)    { return gu32_SpiBytes; }
+uint32_t FakePN532::GetStatusReads(void) { return gu32_StatusReads; }
+uint32_t FakePN532::GetCommands(void)    { return gu32_Commands; }
+uint32_t FakePN532::GetReadMicros(void)  { return gu32_ReadMicros; }
+uint8_t  FakePN532::GetCommand(uint32_t u32_Index)
+{
+    return (u32_Index < gu32_Commands && u32_Index < sizeof(gu8_Commands)) ? gu8_Commands[u32_Index] : 0;
+}
+
+// ------------ WiFi, SPI, display ------------
+
+ESP8266WiFiClass WiFi;
+bool ESP8266WiFiClass::disconnect(bool)                   { return true; }
+bool ESP8266WiFiClass::mode(int)                          { return true; }
+bool ESP8266WiFiClass::softAP(const char*, const char*)   { return true; }
+
+#define WIFI_WINDOW (2 * 536u)
+
+static std::deque<uint8_t> gi_ToDevice;        // sent by the client, not yet read by the device
+static std::deque<uint8_t> gi_ToClient;        // written by the device, not yet received by the client
+static uint32_t gu32_Connection  = 0;          // the current connection, 0 = no client has connected
+static uint64_t gu64_ConnectAt   = 0;          // the time in microseconds when the client connects
+static bool     gb_Accepted      = false;      // server.available() has returned the current connection
+static bool     gb_Open          = false;
+static uint32_t gu32_Window      = WIFI_WINDOW;
+static uint32_t gu32_Writes      = 0;
+static uint32_t gu32_BytesSent   = 0;
+
+// The previous connection is gone, its WiFiClient is not connected anymore
+void FakeWiFi::Connect(uint32_t u32_Delay)
+{
+    gi_ToDevice.clear();
+    gi_ToClient.clear();
+    gu32_Connection ++;
+    gu64_ConnectAt = gu64_Micros + (uint64_t)u32_Delay * 1000;
+    gb_Accepted    = false;
+    gb_Open        = true;
+}
+
+void FakeWiFi::Drop(void)
+{
+    gi_ToClient.clear();
+    gb_Open = false;
+}
+
+bool FakeWiFi::IsOpen(void)
+{
+    return gb_Open;
+}
+
+void FakeWiFi::SetWindow(uint32_t u32_Bytes)
+{
+    gu32_Window = u32_Bytes;
+}
+
+void FakeWiFi::Send(const uint8_t* u8_Data, uint32_t u32_Length)
+{
+    if (gb_Open)
+        gi_ToDevice.insert(gi_ToDevice.end(), u8_Data, u8_Data + u32_Length);
+}
+
+uint32_t FakeWiFi::Receive(uint8_t* u8_Buffer, uint32_t u32_Max)
+{
+    uint32_t u32_Length = std::min<uint32_t>(u32_Max, gi_ToClient.size());
+    std::copy(gi_ToClient.begin(), gi_ToClient.begin() + u32_Length, u8_Buffer);
+    gi_ToClient.erase(gi_ToClient.begin(), gi_ToClient.begin() + u32_Length);
+    return u32_Length;
+}
+
+void FakeWiFi::ClearCounters(void)
+{
+    gu32_Writes    = 0;
+    gu32_BytesSent = 0;
+}
+
+uint32_t FakeWiFi::GetWrites(void)    { return gu32_Writes; }
+uint32_t FakeWiFi::GetBytesSent(void) { return gu32_BytesSent; }
+
+WiFiClient::WiFiClient(uint32_t u32_Connection) : mu32_Connection(u32_Connection) {}
+
+bool WiFiClient::IsCurrent(void)
+{
+    return mu32_Connection != 0 && mu32_Connection == gu32_Connection;
+}
+
+size_t WiFiClient::write(uint8_t u8_Data)
+{
+    return write(&u8_Data, 1);
+}
+
+size_t WiFiClient::write(const uint8_t* u8_Data, size_t u32_Length)
+{
+    uint32_t u32_Written = std::min<uint32_t>(u32_Length, availableForWrite());
+    if (u32_Written == 0)
+        return 0;
+
+    gi_ToClient.insert(gi_ToClient.end(), u8_Data, u8_Data + u32_Written);
+    gu32_Writes ++;
+    gu32_BytesSent += u32_Written;
+    return u32_Written;
+}
+
+int WiFiClient::read(void)
+{
+    uint8_t u8_Data;
+    return read(&u8_Data, 1) == 1 ? u8_Data : -1;
+}
+
+// The bytes that have arrived before the connection was lost can still be read
+int WiFiClient::read(uint8_t* u8_Buffer, size_t u32_Length)
+{
+    if (!IsCurrent())
+        return 0;
+
+    u32_Length = std::min<size_t>(u32_Length, gi_ToDevice.size());
+    std::copy(gi_ToDevice.begin(), gi_ToDevice.begin() + u32_Length, u8_Buffer);
+    gi_ToDevice.erase(gi_ToDevice.begin(), gi_ToDevice.begin() + u32_Length);
+    return u32_Length;
+}
+
+int WiFiClient::peek(void)
+{
+    return IsCurrent() && !gi_ToDevice.empty() ? gi_ToDevice.front() : -1;
+}
+
+int WiFiClient::available(void)
+{
+    return IsCurrent() ? gi_ToDevice.size() : 0;
+}
+
+void WiFiClient::flush(void) {}
+
+void WiFiClient::stop(void)
+{
+    if (IsCurrent())
+        gb_Open = false;
+    mu32_Connection = 0;
+}
+
+uint8_t WiFiClient::connected(void)
+{
+    return IsCurrent() && gb_Open;
+}
+
+size_t WiFiClient::availableForWrite(void)
+{
+    if (!connected() || gi_ToClient.size() >= gu32_Window)
+        return 0;
+    return gu32_Window - gi_ToClient.size();
+}
+
+void WiFiClient::setNoDelay(bool) {}
+
+WiFiClient::operator bool(void)
+{
+    return mu32_Connection != 0;
+}
+
+WiFiServer::WiFiServer(uint16_t)        {}
+void       WiFiServer::begin(void)      {}
+void       WiFiServer::setNoDelay(bool) {}
+
+bool WiFiServer::hasClient(void)
+{
+    return gb_Open && !gb_Accepted && gu64_Micros >= gu64_ConnectAt;
+}
+
+WiFiClient WiFiServer::available(void)
+{
+    if (!hasClient())
+        return WiFiClient();
+    gb_Accepted = true;
+    return WiFiClient(gu32_Connection);
+}
+
+SPIClass SPI;
+SPISettings::SPISettings(uint32_t, uint8_t, uint8_t) {}
+void    SPIClass::begin(void)                                    {}
+void    SPIClass::beginTransaction(SPISettings)                  {}
+uint8_t SPIClass::transfer(uint8_t u8_Data)
+{
+    gu32_SpiCalls ++;
+    return ClockByte(u8_Data);
+}
+void SPIClass::transferBytes(const uint8_t* u8_Out, uint8_t* u8_In, uint32_t u32_Length)
+{
+    gu32_SpiCalls ++;
+    for (uint32_t i=0; i<u32_Length; i++)
+    {
+        uint8_t u8_Data = ClockByte(u8_Out ? u8_Out[i] : 0xFF);
+        if (u8_In) u8_In[i] = u8_Data;
+    }
+}
+void SPIClass::writeBytes(uint8_t* u8_Data, uint32_t u32_Length)
+{
+    gu32_SpiCalls ++;
+    for (uint32_t i=0; i<u32_Length; i++)
+        ClockByte(u8_Data[i]);
+}
+
+static uint32_t gu32_FrameMicros = 0;
+static uint32_t gu32_Frames      = 0;
+
+void     FakeDisplay::SetFrameTime(uint32_t u32_Micros) { gu32_FrameMicros = u32_Micros; }
+uint32_t FakeDisplay::GetFrames(void)                   { return gu32_Frames; }
+
+const char ArialMT_Plain_10[1] = { 0 };
+const char ArialMT_Plain_24[1] = { 0 };
+bool OLEDDisplay::init(void)                                { return true; }
+void OLEDDisplay::clear(void)                               {}
+void OLEDDisplay::display(void)                             { gu32_Frames ++; AdvanceMicros(gu32_FrameMicros); }
+void OLEDDisplay::setTextAlignment(int)                     {}
+void OLEDDisplay::setColor(OLEDDISPLAY_COLOR)               {}
+void OLEDDisplay::setFont(const char*)                      {}
+void OLEDDisplay::drawXbm(int, int, int, int, const char*)  {}
+void OLEDDisplay::fillRect(int, int, int, int)              {}
+void OLEDDisplay::drawProgressBar(int, int, int, int, int)  {}
+void OLEDDisplay::drawString(int, int, String)              {}
+void OLEDDisplay::drawString(int, int, const char*)         {}
+SSD1306::SSD1306(uint8_t, uint8_t, uint8_t) {}
+SH1106::SH1106(uint8_t, uint8_t, uint8_t)   {}
@@ -0,0 +1,85 @@
+// The host implementation of the Arduino stubs (see stubs/) and the control of the fakes for the tests.
+#ifndef HOST_STUBS_H
+#define HOST_STUBS_H
+
+#include <Arduino.h>
+
+// The SD card in RAM with fault injection
+class FakeSD
+{
+public:
+    static void     Format(void);
+    static void     SetPresent(bool b_Present);
+    static void     SetWriteBudget(int32_t s32_Bytes);
+    static uint32_t GetBytesWritten(void);
+    static uint32_t GetBytesRead(void);
+    static uint32_t GetCalls(void);
+    static uint32_t GetOpens(void);
+};
+
+// The clock that millis() and micros() return. delay() advances it.
+class FakeClock
+{
+public:
+    static void Advance(uint32_t u32_Milli);
+};
+
+// The 4 kB EEPROM of the ESP8266: EEPROM.write() changes a RAM copy, EEPROM.commit() writes it to the flash sector
+// and EEPROM.begin() loads the RAM copy from the flash sector (like after a reset).
+class FakeEEPROM
+{
+public:
+    static void     Erase(void);
+    static uint32_t GetCommits(void);
+};
+
+// Writes the response data of a command (the command code + 1 first, without 0xD5) and returns its length.
+// Returns 0 if the PN532 should not answer (the command does not finish).
+typedef uint8_t (*FakeResponder)(const uint8_t* u8_Cmd, uint8_t u8_CmdLen, uint8_t* u8_Resp);
+
+// The PN532 on the SPI bus: Each command frame is answered with an ACK and a response frame.
+// The IRQ line goes low when a frame is ready and the interrupt handler is called on the falling edge.
+// Each SPI byte takes 8 microseconds (1 MHz), yield() takes 10 microseconds.
+class FakePN532
+{
+public:
+    static void     Connect(uint8_t u8_SselPin, uint8_t u8_IrqPin);
+    static void     SetLatency(uint32_t u32_AckMicros, uint32_t u32_RespMicros);
+    static void     SetResponder(FakeResponder pf_Responder);  // NULL = echo the command
+    static void     SetGlitches(uint32_t u32_Frames);          // corrupts the next frames that the host reads
+    static void     ClearCounters(void);
+    static uint32_t GetSpiCalls(void);    // calls of transfer(), transferBytes() and writeBytes()
+    static uint32_t GetSpiBytes(void);
+    static uint32_t GetStatusReads(void);
+    static uint32_t GetCommands(void);
+    static uint32_t GetReadMicros(void);  // SSEL low to high of the last frame read
+    static uint8_t  GetCommand(uint32_t u32_Index); // the command codes in the order received (max 64)
+};
+
+// The TCP connection of the WiFi client (the Android app) on a loopback. The test plays the client: It connects,
+// sends the bytes that the device reads and receives the bytes that the device has written.
+// The send window is TCP_SND_BUF of lwIP (2 * 536 bytes): availableForWrite() returns the part of it that is not
+// taken by written bytes the client has not yet received. write() never blocks, it only takes what fits.
+class FakeWiFi
+{
+public:
+    static void     Connect(uint32_t u32_Delay = 0);    // hasClient() returns true after u32_Delay milliseconds
+    static void     Drop(void);                         // the connection is lost, the bytes in flight are discarded
+    static bool     IsOpen(void);                       // neither dropped nor closed by the device with stop()
+    static void     SetWindow(uint32_t u32_Bytes);
+    static void     Send(const uint8_t* u8_Data, uint32_t u32_Length);
+    static uint32_t Receive(uint8_t* u8_Buffer, uint32_t u32_Max);
+    static void     ClearCounters(void);
+    static uint32_t GetWrites(void);     // calls of write() that have taken data
+    static uint32_t GetBytesSent(void);  // bytes taken by write()
+};
+
+// The OLED display: display() transfers the frame over I2C. This takes 23 ms with 400 kHz on the ESP8266.
+class FakeDisplay
+{
+public:
+    static void     SetFrameTime(uint32_t u32_Micros); // the clock advances on each display(), default 0
+    static uint32_t GetFrames(void);
+};
+
+#endif
@@ -0,0 +1,33 @@
+// The checks of the host tests. Each test program prints the failed checks and returns their number.
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <chrono>
+
+static int gs32_Checks = 0;
+static int gs32_Failed = 0;
+
+#define CHECK(condition) \
+    do { \
+        gs32_Checks++; \
+        if (!(condition)) { \
+            gs32_Failed++; \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        } \
+    } while (0)
+
+// Prints the result, the return value of main()
+static inline int TestResult(const char* s8_Name)
+{
+    printf("%s: %d checks, %d failed\n", s8_Name, gs32_Checks, gs32_Failed);
+    return gs32_Failed;
+}
+
+// The time on the host in microseconds for the benchmarks (the fake clock of the ESP8266 does not advance)
+static inline double HostMicros(void)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
@@ -0,0 +1,199 @@
+// Benchmark of the backup on the fake SD card.
+// Backup_Data() moves the files in the root folder into the backup folder. Before, each file was copied byte by byte
+// and deleted. Now MoveFile() renames the directory entry and only falls back to a block copy (CopyFile()).
+// Since the backup stores only the dirty cards of the counter database, only leftover counter files of the old storage are moved.
+// A month of taps with a backup each evening: The bytes written by the backup depend on the cards tapped that day,
+// not on the number of users.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "SDCard.h"
+#include "Snapshot.h"
+#include "Utils.h"
+
+#define BACKUP_FOLDER  "/20261017.BKP"
+#define FILE_COFFEES   (50u)  // the records in each counter file of the old storage
+#define MONTH_USERS    (500u)
+#define MONTH_ACTIVE   (40u)  // the users who take a coffee on a working day
+
+extern char androidDate[9];
+
+enum eMoveMethod
+{
+    MOVE_BYTES,    // the loop of Backup_Data() before
+    MOVE_BLOCKS,   // CopyFile() if the SD library has no rename
+    MOVE_RENAME,   // MoveFile()
+};
+
+static const char* gs8_Methods[] = { "byte copy", "block copy", "rename" };
+
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F600ull + u32_Card * 7919;
+}
+
+// Creates u32_Files counter files of the old storage in the root folder
+static void CreateFiles(uint32_t u32_Files)
+{
+    for (uint32_t F=0; F<u32_Files; F++)
+    {
+        char s8_Name[] = "00000000.000";
+        Utils::Base36(CardID(F), s8_Name);
+        File i_File = SD.open(s8_Name, FILE_WRITE);
+        for (uint32_t R=1; R<=FILE_COFFEES; R++)
+        {
+            byte u8_Record[4] = { (byte)(R >> 8), (byte)R, (byte)(~R >> 8), (byte)~R };
+            i_File.write(u8_Record, 4);
+        }
+        i_File.close();
+    }
+}
+
+// The loop of Backup_Data() before: outputFile.write(inputFile.read()) for each byte
+static bool CopyBytes(const char* s8_Source, const char* s8_Dest)
+{
+    File inputFile  = SD.open(s8_Source, FILE_READ);
+    File outputFile = SD.open(s8_Dest, FILE_WRITE);
+    while (inputFile.available())
+        outputFile.write(inputFile.read());
+    outputFile.close();
+    inputFile.close();
+    return SD.remove(s8_Source);
+}
+
+static void MeasureBackup(uint32_t u32_Files, eMoveMethod e_Method)
+{
+    FakeSD::Format();
+    CHECK(SDCard::Begin(0));
+    CreateFiles(u32_Files);
+    CHECK(SDCard::Mkdir(BACKUP_FOLDER));
+
+    uint32_t u32_Calls   = FakeSD::GetCalls();
+    uint32_t u32_Written = FakeSD::GetBytesWritten();
+    double   d_Start     = HostMicros();
+    for (uint32_t F=0; F<u32_Files; F++)
+    {
+        char s8_Name[] = "00000000.000";
+        char s8_Dest[32];
+        Utils::Base36(CardID(F), s8_Name);
+        sprintf(s8_Dest, "%s/%s", BACKUP_FOLDER, s8_Name);
+        switch (e_Method)
+        {
+            case MOVE_BYTES:  CHECK(CopyBytes(s8_Name, s8_Dest)); break;
+            case MOVE_BLOCKS: CHECK(Utils::CopyFile(s8_Name, s8_Dest) && SDCard::Remove(s8_Name)); break;
+            case MOVE_RENAME: CHECK(Utils::MoveFile(s8_Name, s8_Dest)); break;
+        }
+    }
+    double d_Millis = (HostMicros() - d_Start) / 1000;
+    u32_Calls   = FakeSD::GetCalls() - u32_Calls;
+    u32_Written = FakeSD::GetBytesWritten() - u32_Written;
+
+    printf("%4u files, %-10s: %6u SD calls, %6u bytes written, %7.2f ms on the host\n", (unsigned)u32_Files,
+           gs8_Methods[e_Method], (unsigned)u32_Calls, (unsigned)u32_Written, d_Millis);
+
+    // All counters are in the backup folder and not in the root folder
+    for (uint32_t F=0; F<u32_Files; F++)
+    {
+        char s8_Name[] = "00000000.000";
+        char s8_Dest[32];
+        uint16_t u16_Count = 0;
+        Utils::Base36(CardID(F), s8_Name);
+        sprintf(s8_Dest, "%s/%s", BACKUP_FOLDER, s8_Name);
+        CHECK(!SDCard::Exists(s8_Name));
+        CHECK(Utils::GetSDCounterForCard(s8_Dest, &u16_Count) && u16_Count == FILE_COFFEES);
+    }
+
+    uint32_t u32_Bytes = u32_Files * FILE_COFFEES * 4;
+    if (e_Method == MOVE_RENAME) CHECK(u32_Calls == 0 && u32_Written == 0);
+    if (e_Method == MOVE_BLOCKS) CHECK(u32_Written == u32_Bytes && u32_Calls == u32_Files * 3); // read, write, read at the end
+    if (e_Method == MOVE_BYTES)  CHECK(u32_Written == u32_Bytes && u32_Calls == u32_Bytes * 2);
+}
+
+// The counts in the snapshot of a backup folder
+static void ReadSnapshot(const char* s8_Folder, uint32_t* pu32_Cards, uint32_t* pu32_Taps)
+{
+    char s8_Path[32];
+    sprintf(s8_Path, "/%s/%s", s8_Folder, SNAP_FILE_NAME);
+    Snapshot i_Snapshot;
+    CHECK(i_Snapshot.Open(s8_Path) && i_Snapshot.Verify());
+
+    uint64_t u64_ID;
+    uint32_t u32_Count;
+    *pu32_Cards = i_Snapshot.GetCount();
+    *pu32_Taps  = 0;
+    while (i_Snapshot.Next(&u64_ID, &u32_Count))
+        *pu32_Taps += u32_Count;
+    i_Snapshot.Close();
+}
+
+// Taps u32_Taps coffees of u32_Cards different users, then the backup of the day.
+// returns the bytes that the backup has written
+static uint32_t BackupDay(uint32_t u32_Day, uint32_t u32_Cards, uint32_t u32_Taps, uint32_t* pu32_Seed)
+{
+    uint32_t u32_First = *pu32_Seed % MONTH_USERS;
+    *pu32_Seed = *pu32_Seed * 1103515245 + 12345;
+    for (uint32_t T=0; T<u32_Taps; T++)
+    {
+        uint32_t u32_Count;
+        CHECK(CounterCache::Increment(CardID((u32_First + (T % u32_Cards) * 7) % MONTH_USERS), &u32_Count));
+    }
+    CHECK(CounterCache::Flush());
+
+    sprintf(androidDate, "202610%02u", (unsigned)u32_Day);
+    uint32_t u32_Written = FakeSD::GetBytesWritten();
+    CHECK(Utils::Backup_Data());
+    u32_Written = FakeSD::GetBytesWritten() - u32_Written;
+
+    // The backup holds the taps of the day, the counts in the database start again at zero
+    char s8_Folder[16];
+    uint32_t u32_Stored, u32_Sum;
+    sprintf(s8_Folder, "%s.BKP", androidDate);
+    ReadSnapshot(s8_Folder, &u32_Stored, &u32_Sum);
+    CHECK(u32_Stored == u32_Cards && u32_Sum == u32_Taps);
+    CHECK(gi_CounterDB.GetDirtyCount() == 0);
+    return u32_Written;
+}
+
+static void TestMonth(void)
+{
+    FakeSD::Format();
+    CHECK(SDCard::Begin(0));
+    SDCard::Close(&root);
+    root = SDCard::Open("/");
+    gi_CounterDB.Close();
+    CounterCache::Invalidate();
+
+    // Day 1: all users have taken a coffee, like the full backup before
+    uint32_t u32_Seed = 1;
+    uint32_t u32_Full = BackupDay(1, MONTH_USERS, MONTH_USERS, &u32_Seed);
+
+    uint32_t u32_Total = 0;
+    uint32_t u32_Max   = 0;
+    for (uint32_t D=2; D<=31; D++)
+    {
+        bool b_Weekend = (D % 7 == 3 || D % 7 == 4); // 3.10.2026 is a Saturday
+        uint32_t u32_Cards = b_Weekend ? 2 : MONTH_ACTIVE;
+        uint32_t u32_Bytes = BackupDay(D, u32_Cards, u32_Cards * 2, &u32_Seed);
+        u32_Total += u32_Bytes;
+        if (u32_Bytes > u32_Max) u32_Max = u32_Bytes;
+    }
+    printf("Month of %u users: full backup %u bytes, %u daily backups %u bytes (max %u per day), 30 full backups %u bytes\n",
+           (unsigned)MONTH_USERS, (unsigned)u32_Full, 30, (unsigned)u32_Total, (unsigned)u32_Max, (unsigned)u32_Full * 30);
+    CHECK(u32_Max * 5 < u32_Full);
+    gi_CounterDB.Close();
+}
+
+int main(void)
+{
+    const uint32_t u32_Files[] = { 100, 1000 };
+    for (int i=0; i<2; i++)
+    {
+        MeasureBackup(u32_Files[i], MOVE_BYTES);
+        MeasureBackup(u32_Files[i], MOVE_BLOCKS);
+        MeasureBackup(u32_Files[i], MOVE_RENAME);
+    }
+    TestMonth();
+    return TestResult("TestBackup");
+}
@@ -0,0 +1,285 @@
+// Test of the CounterCache: The taps are counted in RAM and written to the counter database on the fake SD card later.
+// When all entries are dirty a new card writes the oldest change first (FIFO), a clean entry is evicted instead.
+// The flush policy writes the dirty counters when nobody is at the machine.
+// The flush is torn at every byte offset: after the "reboot" each card has the old or the new count
+// and all counters that have been written before the power failure keep their new count.
+// Bursty traffic: the queue must not write the SD card while somebody is at the machine, unless it reaches the high-water mark.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "SDCard.h"
+
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F600ull + u32_Card * 7919;
+}
+
+// The count of the card in the counter database on the SD card
+static uint32_t StoredCount(uint32_t u32_Card)
+{
+    uint32_t u32_Count = 0xFFFFFFFF;
+    CHECK(gi_CounterDB.Read(CardID(u32_Card), &u32_Count));
+    return u32_Count;
+}
+
+// The reset: The cache in RAM is lost, the counter database is opened again
+static void Reboot(void)
+{
+    gi_CounterDB.Close();
+    CounterCache::Invalidate();
+    CHECK(SDCard::Begin(0));
+}
+
+static void Format(void)
+{
+    gi_CounterDB.Close();
+    FakeSD::Format();
+    Reboot();
+}
+
+static void Tap(uint32_t u32_Card, uint32_t u32_Expect)
+{
+    uint32_t u32_Count = 0;
+    CHECK(CounterCache::Increment(CardID(u32_Card), &u32_Count));
+    CHECK(u32_Count == u32_Expect);
+}
+
+// returns the card at position u8_Pos of the queue
+static uint32_t DirtyCard(byte u8_Pos)
+{
+    uint64_t u64_ID;
+    uint32_t u32_Count;
+    CHECK(CounterCache::GetDirty(u8_Pos, &u64_ID, &u32_Count));
+    return (uint32_t)((u64_ID - CardID(0)) / 7919);
+}
+
+// All CACHE_MAX_USED entries are dirty: Each new card writes the oldest change and takes its entry
+static void TestFullDirty(void)
+{
+    Format();
+    for (uint32_t C=0; C<CACHE_MAX_USED; C++)
+        Tap(C, 1);
+
+    // More taps of a dirty card are coalesced and do not change the order
+    Tap(0, 2);
+    CHECK(CounterCache::GetDirtyCount() == CACHE_MAX_USED);
+    CHECK(DirtyCard(0) == 0 && DirtyCard(CACHE_MAX_USED - 1) == CACHE_MAX_USED - 1);
+    for (uint32_t C=0; C<CACHE_MAX_USED; C++)
+        CHECK(StoredCount(C) == 0);
+
+    uint32_t u32_Writes = CounterCache::GetStats()->u32_Writes;
+    for (uint32_t N=0; N<4; N++)
+    {
+        Tap(CACHE_MAX_USED + N, 1);
+        CHECK(CounterCache::GetStats()->u32_Writes == u32_Writes + N + 1);
+        CHECK(CounterCache::GetDirtyCount() == CACHE_MAX_USED);
+
+        // The oldest change has been written, the newer ones are still in RAM
+        CHECK(StoredCount(N) == (N == 0 ? 2 : 1));
+        CHECK(StoredCount(N + 1) == 0);
+        CHECK(DirtyCard(0) == N + 1);
+        CHECK(DirtyCard(CACHE_MAX_USED - 1) == CACHE_MAX_USED + N);
+    }
+
+    // The written cards have been evicted and must be loaded from the SD card again
+    uint32_t u32_Misses = CounterCache::GetStats()->u32_Misses;
+    Tap(0, 3);
+    CHECK(CounterCache::GetStats()->u32_Misses == u32_Misses + 1);
+
+    // Flush() writes the queue in FIFO order
+    CHECK(CounterCache::Flush());
+    CHECK(CounterCache::GetDirtyCount() == 0);
+    CHECK(StoredCount(0) == 3);
+    for (uint32_t C=1; C<CACHE_MAX_USED + 4; C++)
+        CHECK(StoredCount(C) == 1);
+}
+
+// A clean entry is evicted (the least recently used one) before a dirty counter is written
+static void TestEvictClean(void)
+{
+    Format();
+    for (uint32_t C=0; C<CACHE_MAX_USED; C++)
+    {
+        Tap(C, 1);
+        FakeClock::Advance(1);
+    }
+    CHECK(CounterCache::Flush());
+
+    // Card 0 is used again, card 1 is the least recently used one now
+    Tap(0, 2);
+    uint32_t u32_Writes = CounterCache::GetStats()->u32_Writes;
+    Tap(CACHE_MAX_USED, 1);
+    CHECK(CounterCache::GetStats()->u32_Writes == u32_Writes);
+
+    uint32_t u32_Misses = CounterCache::GetStats()->u32_Misses;
+    Tap(2, 2);
+    CHECK(CounterCache::GetStats()->u32_Misses == u32_Misses);
+    Tap(1, 2);
+    CHECK(CounterCache::GetStats()->u32_Misses == u32_Misses + 1);
+}
+
+// The dirty counters are written one per FlushTask() after the RF field has been empty for CACHE_IDLE_DELAY
+static void TestFlushOnIdle(void)
+{
+    Format();
+    CounterCache::SetIdle(false);
+    Tap(1, 1);
+    Tap(2, 1);
+    Tap(3, 1);
+
+    // Somebody is at the machine
+    FakeClock::Advance(CACHE_IDLE_DELAY * 2);
+    CounterCache::FlushTask();
+    CHECK(CounterCache::GetDirtyCount() == 3);
+
+    CounterCache::SetIdle(true);
+    FakeClock::Advance(CACHE_IDLE_DELAY - 1);
+    CounterCache::FlushTask();
+    CHECK(CounterCache::GetDirtyCount() == 3);
+    CHECK(StoredCount(1) == 0);
+
+    FakeClock::Advance(1);
+    for (uint32_t C=1; C<=3; C++)
+    {
+        CounterCache::FlushTask();
+        CHECK(CounterCache::GetDirtyCount() == 3 - C);
+        CHECK(StoredCount(C) == 1);
+        if (C < 3) CHECK(StoredCount(C + 1) == 0);
+    }
+
+    // Nothing is written twice
+    uint32_t u32_Bytes = FakeSD::GetBytesWritten();
+    CounterCache::FlushTask();
+    CHECK(FakeSD::GetBytesWritten() == u32_Bytes);
+    CounterCache::SetIdle(false);
+}
+
+#define BURST_CARDS    (12u)
+#define BURST_IN_FIELD (800u) // the card stays this long in the RF field (milliseconds)
+
+// People tap one after another with u32_Gap milliseconds between two cards, some take a second coffee.
+// The main loop is simulated like the scheduler: StateMachineTask() sets the idle flag, FlushTask() runs every CACHE_TASK_INTERVAL.
+static void RunBurst(const char* s8_Name, uint32_t u32_Taps, uint32_t u32_Gap, uint32_t* pu32_Expect)
+{
+    kCacheStats k_Before = *CounterCache::GetStats();
+    uint32_t u32_BusyWrites = 0;
+    byte     u8_MaxDepth    = 0;
+    uint32_t u32_Period = BURST_IN_FIELD + u32_Gap;
+    uint32_t u32_Time   = 0;
+    for (uint32_t T=0; T<u32_Taps; u32_Time += CACHE_TASK_INTERVAL)
+    {
+        uint32_t u32_Phase = u32_Time % u32_Period;
+        bool b_InField = u32_Phase < BURST_IN_FIELD;
+        if (u32_Phase == 0)
+        {
+            uint32_t u32_Card = (T * 7 + T / 5) % BURST_CARDS;
+            Tap(u32_Card, ++pu32_Expect[u32_Card]);
+            T ++;
+        }
+        if (CounterCache::GetDirtyCount() > u8_MaxDepth)
+            u8_MaxDepth = CounterCache::GetDirtyCount();
+        CounterCache::SetIdle(!b_InField);
+
+        uint32_t u32_Writes = CounterCache::GetStats()->u32_Writes;
+        CounterCache::FlushTask();
+        if (b_InField && CounterCache::GetStats()->u32_Writes != u32_Writes)
+            u32_BusyWrites ++;
+        FakeClock::Advance(CACHE_TASK_INTERVAL);
+    }
+
+    const kCacheStats* pk_After = CounterCache::GetStats();
+    uint32_t u32_Writes = pk_After->u32_Writes - k_Before.u32_Writes;
+    printf("%-8s: %3u taps, %3u coalesced, %3u writes, %3u writes while a card is in the field, max depth %u, avg depth %.2f\n",
+           s8_Name, (unsigned)u32_Taps, (unsigned)(pk_After->u32_Coalesced - k_Before.u32_Coalesced), (unsigned)u32_Writes,
+           (unsigned)u32_BusyWrites, (unsigned)u8_MaxDepth,
+           (double)(pk_After->u32_DepthSum - k_Before.u32_DepthSum) / u32_Taps);
+
+    CHECK(u8_MaxDepth <= CACHE_FLUSH_COUNT);
+    CHECK(u32_Writes <= u32_Taps);
+    // With enough time between two people all writes are done while the field is empty
+    if (u32_Gap >= CACHE_IDLE_DELAY + BURST_CARDS * CACHE_TASK_INTERVAL)
+        CHECK(u32_BusyWrites == 0);
+}
+
+// A quiet hour, the morning rush and the queue after a meeting, then nobody is at the machine
+static void TestBurst(void)
+{
+    Format();
+    uint32_t u32_Expect[BURST_CARDS] = { 0 };
+    RunBurst("Quiet",    20, 30000, u32_Expect);
+    RunBurst("Rush",     60,  1200, u32_Expect);
+    RunBurst("Meeting", 100,   200, u32_Expect);
+
+    CounterCache::SetIdle(true);
+    for (uint32_t i=0; i<CACHE_IDLE_DELAY / CACHE_TASK_INTERVAL + CACHE_FLUSH_COUNT + 1; i++)
+    {
+        FakeClock::Advance(CACHE_TASK_INTERVAL);
+        CounterCache::FlushTask();
+    }
+    CHECK(CounterCache::GetDirtyCount() == 0);
+    for (uint32_t C=0; C<BURST_CARDS; C++)
+        CHECK(StoredCount(C) == u32_Expect[C]);
+    CounterCache::SetIdle(false);
+}
+
+// Flushes 8 dirty counters with s32_Budget bytes left before the power fails, boots again and checks all cards.
+// returns the bytes that the flush needs (with s32_Budget = -1)
+static uint32_t TearFlush(int32_t s32_Budget)
+{
+    Format();
+    for (uint32_t C=0; C<8; C++)
+        CHECK(gi_CounterDB.Write(CardID(C), 10 * C));
+    Reboot();
+    CHECK(gi_CounterDB.FinishRecovery());
+
+    // The queue holds the cards 7, 6 ... 0
+    for (uint32_t C=8; C>0; C--)
+        Tap(C - 1, 10 * (C - 1) + 1);
+
+    uint32_t u32_Before = FakeSD::GetBytesWritten();
+    FakeSD::SetWriteBudget(s32_Budget);
+    bool b_Flushed = CounterCache::Flush();
+    uint32_t u32_Bytes = FakeSD::GetBytesWritten() - u32_Before;
+    byte u8_Dirty = CounterCache::GetDirtyCount();
+    CHECK(b_Flushed == (u8_Dirty == 0));
+    CHECK(b_Flushed || CounterCache::HasError());
+    FakeSD::SetWriteBudget(-1);
+
+    // The counter that could not be written stays at the head of the queue
+    if (!b_Flushed)
+    {
+        uint64_t u64_ID;
+        uint32_t u32_Count;
+        CHECK(CounterCache::GetDirty(0, &u64_ID, &u32_Count));
+        CHECK(u32_Count % 10 == 1);
+    }
+
+    Reboot();
+    CHECK(gi_CounterDB.FinishRecovery());
+    for (uint32_t C=0; C<8; C++)
+    {
+        uint32_t u32_Count = StoredCount(C);
+        // The cards 7 ... u8_Dirty have been written before the power failure
+        bool b_Written = C >= u8_Dirty;
+        if (b_Written) CHECK(u32_Count == 10 * C + 1);
+        else           CHECK(u32_Count == 10 * C || u32_Count == 10 * C + 1);
+    }
+    return u32_Bytes;
+}
+
+int main(void)
+{
+    TestFullDirty();
+    TestEvictClean();
+    TestFlushOnIdle();
+    TestBurst();
+
+    uint32_t u32_Bytes = TearFlush(-1);
+    CHECK(u32_Bytes > 0);
+    for (uint32_t u32_Budget=0; u32_Budget<=u32_Bytes; u32_Budget++)
+        TearFlush(u32_Budget);
+    printf("%u byte offsets torn\n", (unsigned)u32_Bytes + 1);
+    return TestResult("TestCounterCache");
+}
@@ -0,0 +1,231 @@
+// Power failure test of CounterDB: The writes after boot are torn at every byte offset.
+// After the "reboot" each card must have its last count or (the card that was written when the power failed)
+// the new count. A write that has returned true must never be lost.
+// The lookup benchmark shows that a card costs about one sector read, no matter how many cards are stored.
+// A counter file of the old storage is read with one record read, no matter how many coffees it holds.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "CounterDB.h"
+#include "SDCard.h"
+
+#define TEST_PATH   "/TEST.DB"
+#define TEST_CARDS  (20u)
+
+struct kTestWrite
+{
+    uint32_t u32_Card;
+    uint32_t u32_Count;
+};
+
+// The first write after boot also reserves the change sequence in the header.
+// TEST_CARDS is a new card, so the whole record and the used count are written.
+static const kTestWrite gk_Writes[] = {
+    { 3, 100 }, { TEST_CARDS, 1 }, { 3, 101 }, { 7, 0 }, { TEST_CARDS, 2 }
+};
+#define TEST_WRITES  (sizeof(gk_Writes) / sizeof(gk_Writes[0]))
+
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F600ull + u32_Card * 7919;
+}
+
+// Creates the database with the cards 0 ... TEST_CARDS-1, card i has the count i + 1
+static void CreateDB(void)
+{
+    FakeSD::Format();
+    SDCard::Begin(0);
+
+    CounterDB i_DB(TEST_PATH);
+    for (uint32_t i=0; i<TEST_CARDS; i++)
+        i_DB.Write(CardID(i), i + 1);
+    i_DB.Close();
+}
+
+// Boots, writes gk_Writes with s32_Budget bytes left before the power fails, boots again and checks all cards.
+// returns the bytes that the writes need (with s32_Budget = -1)
+static uint32_t TearWrites(int32_t s32_Budget)
+{
+    CreateDB();
+
+    bool     b_Done[TEST_WRITES];
+    uint64_t u64_Token;
+    {
+        CounterDB i_DB(TEST_PATH);
+        CHECK(i_DB.Open() && i_DB.FinishRecovery());
+        u64_Token = i_DB.GetSyncToken();
+
+        FakeSD::SetWriteBudget(s32_Budget);
+        for (uint32_t W=0; W<TEST_WRITES; W++)
+            b_Done[W] = i_DB.Write(CardID(gk_Writes[W].u32_Card), gk_Writes[W].u32_Count);
+        i_DB.Close();
+    }
+    uint32_t u32_Bytes = FakeSD::GetBytesWritten();
+    FakeSD::SetWriteBudget(-1);
+
+    // The reboot
+    CounterDB i_DB(TEST_PATH);
+    CHECK(i_DB.Open() && i_DB.FinishRecovery());
+    CHECK(i_DB.GetCorrupt() == 0);
+    CHECK(i_DB.GetSyncToken() >= u64_Token);
+
+    for (uint32_t C=0; C<=TEST_CARDS; C++)
+    {
+        // The count before the power failure, and the count of the write that has been torn
+        uint32_t u32_Last = (C < TEST_CARDS) ? C + 1 : 0;
+        uint32_t u32_Torn = u32_Last;
+        bool     b_Torn   = false;
+        for (uint32_t W=0; W<TEST_WRITES && !b_Torn; W++)
+        {
+            if (gk_Writes[W].u32_Card != C)
+                continue;
+            if (b_Done[W])
+                u32_Last = gk_Writes[W].u32_Count;
+            else
+            {
+                u32_Torn = gk_Writes[W].u32_Count;
+                b_Torn   = true;
+            }
+        }
+        if (!b_Torn)
+            u32_Torn = u32_Last;
+
+        uint32_t u32_Count = 0xFFFFFFFF;
+        CHECK(i_DB.Read(CardID(C), &u32_Count));
+        if (u32_Count != u32_Last && u32_Count != u32_Torn)
+            printf("Budget %d: card %u has the count %u, expected %u or %u\n", (int)s32_Budget, (unsigned)C,
+                   (unsigned)u32_Count, (unsigned)u32_Last, (unsigned)u32_Torn);
+        CHECK(u32_Count == u32_Last || u32_Count == u32_Torn);
+    }
+
+    // The repaired database accepts new counts
+    uint32_t u32_Count = 0;
+    CHECK(i_DB.Write(CardID(5), 555));
+    CHECK(i_DB.Read(CardID(5), &u32_Count) && u32_Count == 555);
+    i_DB.Close();
+    return u32_Bytes;
+}
+
+// Stores u32_Cards cards and looks up each card and as many unknown cards.
+// returns the SD bytes read per lookup of a stored card
+static double MeasureLookup(uint32_t u32_Cards)
+{
+    FakeSD::Format();
+    SDCard::Begin(0);
+    CounterDB i_DB(TEST_PATH);
+    for (uint32_t C=0; C<u32_Cards; C++)
+        CHECK(i_DB.Write(CardID(C), C + 1));
+    i_DB.Close();
+    CHECK(i_DB.Open() && i_DB.FinishRecovery());
+    CHECK(i_DB.GetUsed() == u32_Cards);
+
+    // The cards tap in a different order than they have been stored
+    uint32_t u32_Read  = FakeSD::GetBytesRead();
+    double   d_Start   = HostMicros();
+    for (uint32_t i=0; i<u32_Cards; i++)
+    {
+        uint32_t C = (i * 7919) % u32_Cards;
+        uint32_t u32_Count = 0;
+        CHECK(i_DB.Read(CardID(C), &u32_Count) && u32_Count == C + 1);
+    }
+    double d_Hit   = (HostMicros() - d_Start) / u32_Cards;
+    double d_Bytes = (double)(FakeSD::GetBytesRead() - u32_Read) / u32_Cards;
+
+    // A new card must probe until it finds an empty record
+    u32_Read = FakeSD::GetBytesRead();
+    for (uint32_t C=0; C<u32_Cards; C++)
+    {
+        uint32_t u32_Count = 0xFFFFFFFF;
+        CHECK(i_DB.Read(CardID(C + 100000), &u32_Count) && u32_Count == 0);
+    }
+    double d_Miss = (double)(FakeSD::GetBytesRead() - u32_Read) / u32_Cards;
+    i_DB.Close();
+
+    // The one-file-per-card storage: SD.open() compared the 32 byte directory entries until it found the file
+    printf("%4u cards: %.2f sectors read per lookup (%.2f for a new card), %.2f us on the host, "
+           "before: %.1f directory sectors on average\n", (unsigned)u32_Cards, d_Bytes / DB_SECTOR_SIZE,
+           d_Miss / DB_SECTOR_SIZE, d_Hit, u32_Cards * 32.0 / 2 / DB_SECTOR_SIZE);
+    return d_Bytes;
+}
+
+// Writes a counter file of the old storage with u32_Records records (count big endian, inverse) and u32_Torn trailing bytes
+static void WriteLegacy(const char* s8_Name, uint32_t u32_Records, uint32_t u32_Torn)
+{
+    File i_File = SD.open(s8_Name, FILE_WRITE);
+    for (uint32_t R=1; R<=u32_Records; R++)
+    {
+        uint16_t u16_Count = (uint16_t)R;
+        byte u8_Record[4] = { (byte)(u16_Count >> 8), (byte)u16_Count, (byte)(~u16_Count >> 8), (byte)~u16_Count };
+        i_File.write(u8_Record, 4);
+    }
+    byte u8_Torn[3] = { 0xAA, 0xBB, 0xCC };
+    i_File.write(u8_Torn, u32_Torn);
+    i_File.close();
+}
+
+// Reads a counter file of the old storage with u32_Records records, returns the SD bytes read
+static uint32_t MeasureLegacy(uint32_t u32_Records)
+{
+    char s8_Name[] = "00000000.000";
+    Utils::Base36(CardID(u32_Records), s8_Name);
+    WriteLegacy(s8_Name, u32_Records, 2);
+
+    uint16_t u16_Count = 0;
+    uint32_t u32_Read  = FakeSD::GetBytesRead();
+    double   d_Start   = HostMicros();
+    for (int i=0; i<100; i++)
+        CHECK(Utils::GetSDCounterForCard(s8_Name, &u16_Count) && u16_Count == (uint16_t)u32_Records);
+    double   d_Micros  = (HostMicros() - d_Start) / 100;
+    uint32_t u32_Bytes = (FakeSD::GetBytesRead() - u32_Read) / 100;
+
+    // The loop before read all records
+    printf("%5u coffees: %u bytes read, %.2f us on the host, before: %u bytes read (the whole file)\n",
+           (unsigned)u32_Records, (unsigned)u32_Bytes, d_Micros, (unsigned)(u32_Records * 4 + 2));
+    return u32_Bytes;
+}
+
+static void TestLegacy(void)
+{
+    FakeSD::Format();
+    SDCard::Begin(0);
+
+    const uint32_t u32_Records[] = { 10, 100, 1000, 10000 };
+    for (int i=0; i<4; i++)
+        CHECK(MeasureLegacy(u32_Records[i]) == 4);
+
+    // The last record is corrupt: the record before is used
+    uint16_t u16_Count = 0;
+    WriteLegacy("/CORRUPT.TST", 5, 0);
+    File i_File = SD.open("/CORRUPT.TST", FILE_WRITE);
+    CHECK(i_File.seek(18));
+    i_File.write((uint8_t)0x00);
+    i_File.close();
+    CHECK(Utils::GetSDCounterForCard("/CORRUPT.TST", &u16_Count) && u16_Count == 4);
+
+    // A missing or empty file is zero
+    CHECK(Utils::GetSDCounterForCard("/MISSING.TST", &u16_Count) && u16_Count == 0);
+    WriteLegacy("/EMPTY.TST", 0, 0);
+    CHECK(Utils::GetSDCounterForCard("/EMPTY.TST", &u16_Count) && u16_Count == 0);
+}
+
+int main(void)
+{
+    // The bytes that the writes need after the database has been created
+    CreateDB();
+    uint32_t u32_Created = FakeSD::GetBytesWritten();
+    uint32_t u32_Bytes   = TearWrites(-1) - u32_Created;
+    CHECK(u32_Bytes > 0);
+
+    for (uint32_t u32_Budget=0; u32_Budget<=u32_Bytes; u32_Budget++)
+        TearWrites(u32_Budget);
+
+    printf("%u byte offsets torn\n", (unsigned)u32_Bytes + 1);
+
+    // The table has the load factor 61% with 5000 cards, the probe sequences stay in one sector
+    const uint32_t u32_Cards[] = { 50, 500, 5000 };
+    for (int i=0; i<3; i++)
+        CHECK(MeasureLookup(u32_Cards[i]) <= 1.25 * DB_SECTOR_SIZE);
+
+    TestLegacy();
+    return TestResult("TestCounterDB");
+}
@@ -0,0 +1,69 @@
+// The table driven CRC16 and the slice-by-8 CRC32 must be bit exact to the original shift / xor loops,
+// otherwise the PN532 frames and all CRCs on the SD card and in the EEPROM would not match anymore.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "Utils.h"
+
+// The original implementations (before the tables)
+static uint16_t RefCrc16(const byte* u8_Data, int s32_Length)
+{
+    uint16_t u16_Crc = 0x6363;
+    for (int i=0; i<s32_Length; i++)
+    {
+        byte ch = u8_Data[i];
+        ch = ch ^ (byte)u16_Crc;
+        ch = ch ^ (ch << 4);
+        u16_Crc = (u16_Crc >> 8) ^ ((uint16_t)ch << 8) ^ ((uint16_t)ch << 3) ^ ((uint16_t)ch >> 4);
+    }
+    return u16_Crc;
+}
+
+static uint32_t RefCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc)
+{
+    for (int i=0; i<s32_Length; i++)
+    {
+        u32_Crc ^= u8_Data[i];
+        for (int b=0; b<8; b++)
+        {
+            bool b_Bit = (u32_Crc & 0x01) > 0;
+            u32_Crc >>= 1;
+            if (b_Bit) u32_Crc ^= 0xEDB88320;
+        }
+    }
+    return u32_Crc;
+}
+
+int main(void)
+{
+    // The check values of the catalogue: CRC-16/ISO-IEC-14443-3-A and CRC-32 (ISO-HDLC) without the final XOR
+    const byte u8_Check[] = "123456789";
+    CHECK(Utils::CalcCrc16(u8_Check, 9) == 0xBF05);
+    CHECK(Utils::CalcCrc32(u8_Check, 9) == (uint32_t)~0xCBF43926UL);
+    CHECK(Utils::CalcCrc32(NULL, 0)     == 0xFFFFFFFF);
+
+    // All lengths around the 8 byte blocks at all alignments
+    byte u8_Data[300];
+    uint32_t u32_Random = 12345;
+    for (uint32_t i=0; i<sizeof(u8_Data); i++)
+    {
+        u32_Random = u32_Random * 1103515245 + 12345;
+        u8_Data[i] = (byte)(u32_Random >> 16);
+    }
+    for (int s32_Offset=0; s32_Offset<8; s32_Offset++)
+    {
+        for (int s32_Length=0; s32_Length<=256; s32_Length++)
+        {
+            const byte* u8_Start = u8_Data + s32_Offset;
+            CHECK(Utils::CalcCrc16(u8_Start, s32_Length) == RefCrc16(u8_Start, s32_Length));
+            CHECK(Utils::CalcCrc32(u8_Start, s32_Length) == RefCrc32(u8_Start, s32_Length, 0xFFFFFFFF));
+            CHECK(Utils::CalcCrc32(u8_Start, s32_Length, 0x12345678) == RefCrc32(u8_Start, s32_Length, 0x12345678));
+        }
+    }
+
+    // A CRC over two buffers is the same as over one buffer
+    for (int s32_Split=0; s32_Split<=40; s32_Split++)
+        CHECK(Utils::CalcCrc32(u8_Data, s32_Split, u8_Data + s32_Split, 40 - s32_Split) == Utils::CalcCrc32(u8_Data, 40));
+
+    return TestResult("TestCrc");
+}
@@ -0,0 +1,145 @@
+// Test and benchmark of the EventLog on the fake SD card.
+// An append must cost one sector write per LOG_RECORDS_PER_SECTOR taps, no matter how many cards exist.
+// The compaction must fold the old segments into the totals (without the date records) and delete them.
+// The times are measured on the host, the bytes are what the ESP8266 would write to the SD card.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "EventLog.h"
+#include "SDCard.h"
+
+// More than LOG_KEEP_SEGMENTS segments, so the first 4 are compacted
+#define TEST_SEGMENTS  (LOG_KEEP_SEGMENTS + 4)
+#define TEST_TAPS      (TEST_SEGMENTS * LOG_SEGMENT_SECTORS * LOG_RECORDS_PER_SECTOR)
+
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F600ull + u32_Card * 7919;
+}
+
+// Reads the record u32_Index of a segment
+static bool ReadRecord(uint32_t u32_Segment, uint32_t u32_Index, byte* u8_Record)
+{
+    char s8_Path[32];
+    sprintf(s8_Path, "%s/%08lX.LOG", LOG_FOLDER, (unsigned long)u32_Segment);
+    File logFile = SDCard::Open(s8_Path);
+    bool b_Success = logFile && SDCard::Seek(&logFile, u32_Index * LOG_RECORD_SIZE) &&
+                     SDCard::Read(&logFile, u8_Record, LOG_RECORD_SIZE) == LOG_RECORD_SIZE;
+    if (logFile) SDCard::Close(&logFile);
+    return b_Success;
+}
+
+static uint32_t CountSegments(void)
+{
+    uint32_t u32_Count = 0;
+    char s8_Path[32];
+    for (uint32_t S=1; S<=TEST_SEGMENTS + 1; S++)
+    {
+        sprintf(s8_Path, "%s/%08lX.LOG", LOG_FOLDER, (unsigned long)S);
+        if (SDCard::Exists(s8_Path)) u32_Count ++;
+    }
+    return u32_Count;
+}
+
+// Appends taps of u32_Cards different cards, returns the SD bytes written per tap
+static double MeasureAppend(uint32_t u32_Cards, uint32_t u32_Taps)
+{
+    uint32_t u32_Bytes = FakeSD::GetBytesWritten();
+    double   d_Start   = HostMicros();
+    for (uint32_t T=0; T<u32_Taps; T++)
+        CHECK(EventLog::Append(CardID((T * 7) % u32_Cards)));
+    double d_Micros = HostMicros() - d_Start;
+
+    // Only full sectors have been written
+    u32_Bytes = FakeSD::GetBytesWritten() - u32_Bytes;
+    CHECK(u32_Bytes == u32_Taps / LOG_RECORDS_PER_SECTOR * LOG_SECTOR_SIZE);
+    printf("%4u cards: %5u appends, %6u bytes written (%u per sector of taps), %.2f us per append on the host\n",
+           (unsigned)u32_Cards, (unsigned)u32_Taps, (unsigned)u32_Bytes, LOG_SECTOR_SIZE, d_Micros / u32_Taps);
+    return (double)u32_Bytes / u32_Taps;
+}
+
+int main(void)
+{
+    FakeSD::Format();
+    CHECK(SDCard::Begin(0));
+    CHECK(EventLog::Begin());
+
+    // The date record: the timestamps stay relative to power on
+    FakeClock::Advance(12345);
+    EventLog::SetDate(2026, 10, 17);
+    CHECK(EventLog::Flush());
+    byte u8_Record[LOG_RECORD_SIZE];
+    CHECK(ReadRecord(1, 0, u8_Record));
+    CHECK(Utils::ReadLE64(u8_Record)      == LOG_DATE_ID);
+    CHECK(Utils::ReadLE64(u8_Record +  8) == Utils::GetMillis64());
+    CHECK(Utils::ReadLE32(u8_Record + 20) == LOG_FLAG_DATE);
+    CHECK(Utils::ReadLE32(u8_Record + 24) == 20743); // days since 1.1.1970
+
+    // Fill the sector, so the appends below start at a sector boundary
+    for (uint32_t T=1; T<LOG_RECORDS_PER_SECTOR; T++)
+        CHECK(EventLog::Append(CardID(T)));
+
+    // The bytes per tap do not depend on the number of cards
+    uint32_t u32_Taps = LOG_RECORDS_PER_SECTOR;
+    const uint32_t u32_Cards[] = { 50, 500, 5000 };
+    double d_Bytes[3];
+    for (int i=0; i<3; i++)
+    {
+        uint32_t u32_Count = (i < 2) ? 1600 : 6400;
+        d_Bytes[i] = MeasureAppend(u32_Cards[i], u32_Count);
+        u32_Taps += u32_Count;
+    }
+    CHECK(d_Bytes[0] == d_Bytes[1] && d_Bytes[1] == d_Bytes[2]);
+    CHECK(d_Bytes[0] == LOG_RECORD_SIZE);
+
+    // Fill the segments, then compact in the background like the scheduler does
+    while (u32_Taps < TEST_TAPS)
+        CHECK(EventLog::Append(CardID((u32_Taps++ * 7) % 5000)));
+    CHECK(EventLog::Flush());
+    CHECK(CountSegments() >= TEST_SEGMENTS);
+
+    uint32_t u32_Bytes = FakeSD::GetBytesWritten();
+    uint32_t u32_Steps = 0;
+    double   d_Start   = HostMicros();
+    while (CountSegments() > LOG_KEEP_SEGMENTS && u32_Steps < 10000)
+    {
+        FakeClock::Advance(LOG_COMPACT_INTERVAL);
+        EventLog::Task();
+        u32_Steps ++;
+    }
+    double d_Micros = HostMicros() - d_Start;
+    u32_Bytes = FakeSD::GetBytesWritten() - u32_Bytes;
+    printf("Compaction of %u segments: %u steps, %u bytes written, %.1f us per step on the host\n",
+           (unsigned)(TEST_SEGMENTS - LOG_KEEP_SEGMENTS), (unsigned)u32_Steps, (unsigned)u32_Bytes, d_Micros / u32_Steps);
+    CHECK(CountSegments() == LOG_KEEP_SEGMENTS);
+
+    // The totals contain the taps of the compacted segments, the date record is not counted
+    uint32_t u32_Compacted = (TEST_SEGMENTS - LOG_KEEP_SEGMENTS) * LOG_SEGMENT_SECTORS * LOG_RECORDS_PER_SECTOR;
+    static uint32_t u32_Expect[5000];
+    memset(u32_Expect, 0, sizeof(u32_Expect));
+    for (uint32_t T=1; T<LOG_RECORDS_PER_SECTOR; T++)
+        u32_Expect[T] ++;
+    uint32_t u32_Index = LOG_RECORDS_PER_SECTOR;
+    for (int i=0; i<3; i++)
+    {
+        uint32_t u32_Count = (i < 2) ? 1600 : 6400;
+        for (uint32_t T=0; T<u32_Count; T++, u32_Index++)
+            if (u32_Index < u32_Compacted) u32_Expect[(T * 7) % u32_Cards[i]] ++;
+    }
+    for (; u32_Index < u32_Compacted; u32_Index++)
+        u32_Expect[(u32_Index * 7) % 5000] ++;
+
+    CounterDB i_Totals(LOG_TOTALS_PATH);
+    CHECK(i_Totals.Read(LOG_DATE_ID, &u32_Taps) && u32_Taps == 0);
+    uint32_t u32_Sum = 0;
+    for (uint32_t C=0; C<5000; C++)
+    {
+        uint32_t u32_Total = 0xFFFFFFFF;
+        CHECK(i_Totals.Read(CardID(C), &u32_Total));
+        CHECK(u32_Total == u32_Expect[C]);
+        u32_Sum += u32_Total;
+    }
+    CHECK(u32_Sum == u32_Compacted - 1);
+    i_Totals.Close();
+    return TestResult("TestEventLog");
+}
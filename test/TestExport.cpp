@@ -0,0 +1,148 @@
+// Benchmark of the export preparation with 1000 cards on the fake SD card.
+// Before the counter database the export scanned the root folder twice (getNumFiles() and printDirectory())
+// and opened each counter file again by name (three opens per card).
+// The counter database was first exported by reading all records, now only the records in the dirty bitmap are read.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "CounterDB.h"
+#include "SDCard.h"
+#include "Utils.h"
+
+#define TEST_CARDS    (1000u)
+#define CARD_COFFEES  (20u)
+
+struct kScanCost
+{
+    uint32_t u32_Cards;
+    uint32_t u32_Opens;
+    uint32_t u32_Read;
+    double   d_Millis;
+};
+
+// A 7 byte UID, the file names of the old storage hold 56 bit
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F6ull + u32_Card * 7919;
+}
+
+static void BeginScan(kScanCost* pk_Cost)
+{
+    pk_Cost->u32_Cards = 0;
+    pk_Cost->u32_Opens = FakeSD::GetOpens();
+    pk_Cost->u32_Read  = FakeSD::GetBytesRead();
+    pk_Cost->d_Millis  = HostMicros();
+}
+
+static void EndScan(kScanCost* pk_Cost, const char* s8_Name)
+{
+    pk_Cost->u32_Opens = FakeSD::GetOpens() - pk_Cost->u32_Opens;
+    pk_Cost->u32_Read  = FakeSD::GetBytesRead() - pk_Cost->u32_Read;
+    pk_Cost->d_Millis  = (HostMicros() - pk_Cost->d_Millis) / 1000;
+    printf("%-14s: %4u cards, %4u files opened, %7u bytes read, %6.2f ms on the host\n", s8_Name,
+           (unsigned)pk_Cost->u32_Cards, (unsigned)pk_Cost->u32_Opens, (unsigned)pk_Cost->u32_Read, pk_Cost->d_Millis);
+}
+
+// The counter files of the old storage in the root folder, each card has CARD_COFFEES records
+static void CreateFiles(void)
+{
+    for (uint32_t C=0; C<TEST_CARDS; C++)
+    {
+        char s8_Name[] = "00000000.000";
+        Utils::Base36(CardID(C), s8_Name);
+        File i_File = SD.open(s8_Name, FILE_WRITE);
+        for (uint32_t R=1; R<=CARD_COFFEES; R++)
+        {
+            byte u8_Record[4] = { (byte)(R >> 8), (byte)R, (byte)(~R >> 8), (byte)~R };
+            i_File.write(u8_Record, 4);
+        }
+        i_File.close();
+    }
+}
+
+// Like WLAN::StartTransffer() before the counter database: getNumFiles(), then printDirectory() opened
+// each entry and GetSDCounterForCard() opened the file again by name
+static void ScanRoot(kScanCost* pk_Cost)
+{
+    File dir = SD.open("/");
+    BeginScan(pk_Cost);
+    dir.rewindDirectory();
+    uint16_t u16_Files = Utils::getNumFiles(dir);
+    dir.rewindDirectory();
+
+    File entry;
+    while (entry = dir.openNextFile(), entry)
+    {
+        char s8_Name[13];
+        strcpy(s8_Name, entry.name());
+        entry.close();
+
+        uint16_t u16_Count = 0;
+        CHECK(Utils::GetSDCounterForCard(s8_Name, &u16_Count) && u16_Count == CARD_COFFEES);
+        pk_Cost->u32_Cards ++;
+    }
+    EndScan(pk_Cost, "root scans");
+    CHECK(u16_Files == TEST_CARDS);
+    dir.close();
+}
+
+// Like printDirectory() after the counter database was introduced: all records are read
+static void ScanAll(kScanCost* pk_Cost)
+{
+    BeginScan(pk_Cost);
+    for (uint32_t R=0; R<gi_CounterDB.GetCapacity(); R++)
+    {
+        uint64_t u64_ID;
+        uint32_t u32_Count;
+        if (gi_CounterDB.ReadSlot(R, &u64_ID, &u32_Count) && u64_ID != 0 && u32_Count != 0)
+            pk_Cost->u32_Cards ++;
+    }
+    EndScan(pk_Cost, "all records");
+}
+
+// Like WiFiExport::ScanBinary(): only the records in the dirty bitmap are read
+static void ScanDirty(kScanCost* pk_Cost)
+{
+    BeginScan(pk_Cost);
+    uint32_t u32_Record = 0;
+    while (gi_CounterDB.NextDirty(&u32_Record))
+    {
+        uint64_t u64_ID;
+        uint32_t u32_Count;
+        CHECK(gi_CounterDB.ReadSlot(u32_Record++, &u64_ID, &u32_Count) && u32_Count != 0);
+        pk_Cost->u32_Cards ++;
+    }
+    EndScan(pk_Cost, "dirty bitmap");
+}
+
+int main(void)
+{
+    FakeSD::Format();
+    CHECK(SDCard::Begin(0));
+    CreateFiles();
+
+    kScanCost k_Root, k_All, k_Dirty;
+    ScanRoot(&k_Root);
+    CHECK(k_Root.u32_Opens == 3 * TEST_CARDS);
+
+    // The boot migrates the files into the counter database
+    File root = SD.open("/");
+    CHECK(gi_CounterDB.MigrateLegacy(root) && gi_CounterDB.FinishRecovery());
+    root.close();
+    CHECK(gi_CounterDB.GetDirtyCount() == TEST_CARDS);
+
+    ScanAll(&k_All);
+    ScanDirty(&k_Dirty);
+    CHECK(k_All.u32_Cards == TEST_CARDS && k_Dirty.u32_Cards == TEST_CARDS);
+    CHECK(k_All.u32_Read == gi_CounterDB.GetCapacity() * DB_RECORD_SIZE);
+    CHECK(k_Dirty.u32_Read < k_All.u32_Read && k_Dirty.u32_Opens == 0);
+
+    // After a backup only the cards used since then are dirty
+    for (uint32_t C=50; C<TEST_CARDS; C++)
+        CHECK(gi_CounterDB.Write(CardID(C), 0));
+    ScanAll(&k_All);
+    ScanDirty(&k_Dirty);
+    CHECK(k_Dirty.u32_Cards == 50 && k_Dirty.u32_Read <= 50 * DB_SECTOR_SIZE);
+    gi_CounterDB.Close();
+    return TestResult("TestExport");
+}
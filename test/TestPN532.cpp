@@ -0,0 +1,494 @@
+// Test of the asynchronous PN532 command engine against the fake PN532 on the SPI bus (see HostStubs.cpp).
+// The queued commands must be sent and completed in the order of Submit(), also when a callback submits a command.
+// Without IRQ line the number of status reads must grow with the logarithm of the response time until the backoff
+// reaches PN532_READY_MAX_BACKOFF, not with one read per Poll().
+// With IRQ line Poll() must not touch the bus until the interrupt handler has seen the falling edge.
+// A frame is transferred in one burst without byte delay, the byte delay of SetSpiTiming() slows it down.
+// After bit errors on the bus the tiered recovery must use the fastest tier that works.
+// Auto polling must find a Desfire card and cost less SPI traffic and CPU time per idle second than InListPassiveTarget.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "PN532.h"
+#include "Utils.h"
+
+#define SSEL_PIN   0
+#define RESET_PIN  16
+#define IRQ_PIN    3
+
+// The auto polling parameters and the poll interval of NFCaffe.cpp
+#define AUTOPOLL_COUNT       2
+#define AUTOPOLL_PERIOD      1
+#define POLL_INTERVAL       20
+
+// The completed commands in the order of the callbacks
+struct kDone
+{
+    byte u8_Cmd;
+    bool b_Success;
+    byte u8_Data[PN532_MAX_CMD_LEN + 1];
+    byte u8_Len;
+};
+
+static PN532 gi_PN532;
+static PN532 gi_IrqPN532;
+static kDone gk_Done[16];
+static int   gs32_Done = 0;
+
+// A Desfire card with a 7 byte UID in the RF field
+static const byte gu8_CardUid[7] = { 0x04, 0x51, 0x2A, 0x6B, 0x3C, 0x80, 0x19 };
+static bool gb_CardPresent = true;
+
+// The target data of the card: Tg, ATQA, SAK, UID, ATS
+static uint8_t WriteTarget(uint8_t* u8_Data)
+{
+    const byte u8_Target[] = { 0x01, 0x03, 0x44, 0x20, 0x07 };
+    const byte u8_Ats[]    = { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 };
+    uint8_t u8_Len = 0;
+    memcpy(u8_Data + u8_Len, u8_Target,   sizeof(u8_Target));   u8_Len += sizeof(u8_Target);
+    memcpy(u8_Data + u8_Len, gu8_CardUid, sizeof(gu8_CardUid)); u8_Len += sizeof(gu8_CardUid);
+    memcpy(u8_Data + u8_Len, u8_Ats,      sizeof(u8_Ats));      u8_Len += sizeof(u8_Ats);
+    return u8_Len;
+}
+
+// InListPassiveTarget returns the card with its ATS (28 byte frame), GetFirmwareVersion a PN532 V1.6,
+// the other commands only return their code + 1 (like RFConfiguration and SAMConfiguration).
+// InAutoPoll finds the Desfire card only with the generic 106 kbps or the ISO14443-4A type, not with the Mifare type.
+// Without card it answers after all polls (count * period * 150 ms per type).
+static uint8_t CardResponder(const uint8_t* u8_Cmd, uint8_t u8_CmdLen, uint8_t* u8_Resp)
+{
+    if (u8_Cmd[0] == PN532_COMMAND_INAUTOPOLL)
+    {
+        uint8_t u8_Len = 0;
+        u8_Resp[u8_Len++] = PN532_COMMAND_INAUTOPOLL + 1;
+        for (uint8_t i=3; i<u8_CmdLen && gb_CardPresent; i++)
+        {
+            if (u8_Cmd[i] != PN532_AUTOPOLL_GENERIC_106K && u8_Cmd[i] != PN532_AUTOPOLL_ISO14443_4A)
+                continue;
+
+            FakePN532::SetLatency(200, 5000);
+            u8_Resp[u8_Len++] = 1;
+            u8_Resp[u8_Len++] = u8_Cmd[i];
+            u8_Resp[u8_Len]   = WriteTarget(u8_Resp + u8_Len + 1);
+            return u8_Len + 1 + u8_Resp[u8_Len];
+        }
+        FakePN532::SetLatency(200, (uint32_t)u8_Cmd[1] * u8_Cmd[2] * (u8_CmdLen - 3) * 150000);
+        u8_Resp[u8_Len++] = 0;
+        return u8_Len;
+    }
+    if (u8_Cmd[0] == PN532_COMMAND_GETFIRMWAREVERSION)
+    {
+        const byte u8_Firmware[] = { PN532_COMMAND_GETFIRMWAREVERSION + 1, 0x32, 0x01, 0x06, 0x07 };
+        memcpy(u8_Resp, u8_Firmware, sizeof(u8_Firmware));
+        return sizeof(u8_Firmware);
+    }
+    if (u8_Cmd[0] != PN532_COMMAND_INLISTPASSIVETARGET)
+    {
+        u8_Resp[0] = u8_Cmd[0] + 1;
+        return 1;
+    }
+
+    uint8_t u8_Len = 0;
+    u8_Resp[u8_Len++] = PN532_COMMAND_INLISTPASSIVETARGET + 1;
+    u8_Resp[u8_Len++] = gb_CardPresent ? 1 : 0;
+    if (!gb_CardPresent)
+        return u8_Len;
+
+    return u8_Len + WriteTarget(u8_Resp + u8_Len);
+}
+
+static void OnDone(void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len)
+{
+    kDone* pk_Done = &gk_Done[gs32_Done++];
+    pk_Done->u8_Cmd    = (byte)(uintptr_t)p_Param;
+    pk_Done->b_Success = b_Success;
+    pk_Done->u8_Len    = u8_Len;
+    memcpy(pk_Done->u8_Data, u8_Data, u8_Len);
+}
+
+// Submits a command from the callback of the first command
+static void OnDoneSubmit(void* p_Param, bool b_Success, const byte* u8_Data, byte u8_Len)
+{
+    OnDone(p_Param, b_Success, u8_Data, u8_Len);
+    const byte u8_Cmd[] = { 0x50, 0x99 };
+    CHECK(gi_PN532.Submit(u8_Cmd, sizeof(u8_Cmd), 20, OnDone, (void*)0x50));
+}
+
+// Calls Poll() each millisecond like the scheduler, returns the milliseconds until the queue is empty
+static uint32_t PollUntilIdle(PN532* pi_PN532)
+{
+    uint32_t u32_Start = Utils::GetMillis();
+    while (pi_PN532->Poll())
+    {
+        FakeClock::Advance(1);
+    }
+    return Utils::GetMillis() - u32_Start;
+}
+
+static void TestQueueOrder(void)
+{
+    FakePN532::Connect(SSEL_PIN, PN532_NO_IRQ);
+    FakePN532::SetLatency(200, 3000);
+    FakePN532::ClearCounters();
+    gi_PN532.InitHardwareSPI(SSEL_PIN, RESET_PIN);
+    gs32_Done = 0;
+
+    const byte u8_Cmds[PN532_QUEUE_SIZE][4] =
+    {
+        { 0x4A, 0x01, 0x00, 0x00 },
+        { 0x40, 0x01, 0x30, 0x04 },
+        { 0x32, 0x05, 0xFF, 0x01 },
+        { 0x12, 0x24, 0x00, 0x00 },
+    };
+    for (int i=0; i<PN532_QUEUE_SIZE; i++)
+    {
+        PN532Callback pf_Callback = (i == 0) ? OnDoneSubmit : OnDone;
+        CHECK(gi_PN532.Submit(u8_Cmds[i], 4, 20, pf_Callback, (void*)(uintptr_t)u8_Cmds[i][0]));
+    }
+    // The queue is full
+    CHECK(!gi_PN532.Submit(u8_Cmds[0], 4, 20, OnDone, NULL));
+    CHECK(gi_PN532.IsBusy());
+
+    PollUntilIdle(&gi_PN532);
+    CHECK(!gi_PN532.IsBusy());
+
+    // The command submitted by the first callback is executed after the queued commands
+    const byte u8_Order[] = { 0x4A, 0x40, 0x32, 0x12, 0x50 };
+    CHECK(gs32_Done == sizeof(u8_Order));
+    CHECK(FakePN532::GetCommands() == sizeof(u8_Order));
+    for (int i=0; i<gs32_Done && i<(int)sizeof(u8_Order); i++)
+    {
+        kDone* pk_Done = &gk_Done[i];
+        CHECK(FakePN532::GetCommand(i) == u8_Order[i]);
+        CHECK(pk_Done->u8_Cmd == u8_Order[i]);
+        CHECK(pk_Done->b_Success);
+        // The fake echoes the command: D5, command + 1, parameters
+        CHECK(pk_Done->u8_Data[0] == PN532_PN532TOHOST);
+        CHECK(pk_Done->u8_Data[1] == u8_Order[i] + 1);
+        if (i < PN532_QUEUE_SIZE)
+            CHECK(pk_Done->u8_Len == 5 && memcmp(pk_Done->u8_Data + 2, u8_Cmds[i] + 1, 3) == 0);
+    }
+
+    // A synchronous command waits for the queued command
+    gs32_Done = 0;
+    CHECK(gi_PN532.Submit(u8_Cmds[0], 4, 20, OnDone, (void*)0x4A));
+    byte IC, VersionHi, VersionLo, Flags;
+    CHECK(gi_PN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags));
+    CHECK(IC == 0x32 && VersionHi == 0x01 && VersionLo == 0x06);
+    CHECK(gs32_Done == 1 && gk_Done[0].b_Success);
+}
+
+// Measures the status reads and the time of a command that the PN532 answers after u32_Latency milliseconds.
+// b_Sync = true:  GetFirmwareVersion() (Transceive() sleeps between the status reads)
+// b_Sync = false: Submit() and Poll() each millisecond like the scheduler
+static void MeasureBackoff(uint32_t u32_Latency, bool b_Sync)
+{
+    FakePN532::SetLatency(200, u32_Latency * 1000);
+    FakePN532::ClearCounters();
+    uint32_t u32_Start = Utils::GetMicros();
+    if (b_Sync)
+    {
+        byte IC, VersionHi, VersionLo, Flags;
+        CHECK(gi_PN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags));
+    }
+    else
+    {
+        gs32_Done = 0;
+        const byte u8_Cmd[] = { 0x4A, 0x01, 0x00 };
+        CHECK(gi_PN532.Submit(u8_Cmd, sizeof(u8_Cmd), 20, OnDone, (void*)0x4A, PN532_WAIT_FOREVER));
+        PollUntilIdle(&gi_PN532);
+        CHECK(gs32_Done == 1 && gk_Done[0].b_Success);
+    }
+    uint32_t u32_Micros = Utils::GetMicros() - u32_Start;
+    uint32_t u32_Reads  = FakePN532::GetStatusReads();
+
+    // 8 doublings from 20 to 5000 µs, then one read each 5 ms (for ACK and response)
+    uint32_t u32_MaxReads = 2 * 9 + u32_Latency * 1000 / PN532_READY_MAX_BACKOFF;
+    CHECK(u32_Reads <= u32_MaxReads);
+    // The response is detected at most one backoff after it is ready (plus the frame transfers with the select delays)
+    CHECK(u32_Micros <= 200 + u32_Latency * 1000 + PN532_READY_MAX_BACKOFF + 3 * (PN532_SPI_SELECT_DELAY + 1000));
+    printf("%-11s response after %3u ms: %3u status reads, %4u SPI calls, done after %6u us\n", b_Sync ? "Transceive" : "Poll 1 ms",
+           (unsigned)u32_Latency, (unsigned)u32_Reads, (unsigned)FakePN532::GetSpiCalls(), (unsigned)u32_Micros);
+}
+
+static void TestBackoff(void)
+{
+    FakePN532::Connect(SSEL_PIN, PN532_NO_IRQ);
+    gi_PN532.InitHardwareSPI(SSEL_PIN, RESET_PIN);
+
+    const uint32_t u32_Latency[] = { 1, 10, 100, 300 };
+    for (uint32_t i=0; i<sizeof(u32_Latency) / sizeof(u32_Latency[0]); i++)
+    {
+        MeasureBackoff(u32_Latency[i], true);
+        MeasureBackoff(u32_Latency[i], false);
+    }
+}
+
+static void TestIrqRoundTrip(void)
+{
+    FakePN532::Connect(SSEL_PIN, IRQ_PIN);
+    FakePN532::SetLatency(200, 30000);
+    gi_IrqPN532.InitHardwareSPI(SSEL_PIN, RESET_PIN, IRQ_PIN);
+
+    // The first Poll() sends the command
+    FakePN532::ClearCounters();
+    gs32_Done = 0;
+    uint32_t u32_Start = Utils::GetMicros();
+    const byte u8_Cmd[] = { 0x4A, 0x01, 0x00 };
+    CHECK(gi_IrqPN532.Submit(u8_Cmd, sizeof(u8_Cmd), 20, OnDone, (void*)0x4A));
+    CHECK(gi_IrqPN532.Poll());
+    uint32_t u32_Calls = FakePN532::GetSpiCalls();
+    CHECK(FakePN532::GetCommands() == 1);
+
+    // No edge -> Poll() returns without SPI traffic
+    for (int i=0; i<20; i++)
+    {
+        CHECK(gi_IrqPN532.Poll());
+        Utils::DelayMicro(5);
+    }
+    CHECK(FakePN532::GetSpiCalls() == u32_Calls);
+
+    // The ACK edge: only the ACK is read, the response is not yet ready
+    Utils::DelayMicro(200);
+    CHECK(gi_IrqPN532.Poll());
+    CHECK(FakePN532::GetSpiCalls() > u32_Calls);
+    u32_Calls = FakePN532::GetSpiCalls();
+    for (int i=0; i<25; i++)
+    {
+        FakeClock::Advance(1);
+        CHECK(gi_IrqPN532.Poll());
+    }
+    CHECK(FakePN532::GetSpiCalls() == u32_Calls);
+    CHECK(gs32_Done == 0);
+
+    // The response edge
+    PollUntilIdle(&gi_IrqPN532);
+    uint32_t u32_Micros = Utils::GetMicros() - u32_Start;
+    CHECK(gs32_Done == 1 && gk_Done[0].b_Success && gk_Done[0].u8_Data[1] == 0x4B);
+    CHECK(FakePN532::GetStatusReads() == 0);
+    CHECK(u32_Micros <= 200 + 30000 + 1000 + 3 * (PN532_SPI_SELECT_DELAY + 1000));
+    printf("IRQ Poll 1 ms  response after  30 ms: %u status reads, %2u SPI calls, done after %6u us\n",
+           (unsigned)FakePN532::GetStatusReads(), (unsigned)FakePN532::GetSpiCalls(), (unsigned)u32_Micros);
+
+    // Transceive() reacts on the edge without a status read
+    FakePN532::ClearCounters();
+    u32_Start = Utils::GetMicros();
+    byte IC, VersionHi, VersionLo, Flags;
+    CHECK(gi_IrqPN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags));
+    u32_Micros = Utils::GetMicros() - u32_Start;
+    CHECK(FakePN532::GetStatusReads() == 0);
+    CHECK(u32_Micros <= 200 + 30000 + 100 + 3 * (PN532_SPI_SELECT_DELAY + 1000));
+    printf("IRQ Transceive response after  30 ms: %u status reads, %2u SPI calls, done after %6u us\n",
+           (unsigned)FakePN532::GetStatusReads(), (unsigned)FakePN532::GetSpiCalls(), (unsigned)u32_Micros);
+}
+
+// Reads the card with the SPI timing u16_ByteDelay and returns the time of the 28 byte response frame
+static uint32_t MeasureFrame(uint16_t u16_ByteDelay)
+{
+    gi_PN532.SetSpiTiming(PN532_SPI_SELECT_DELAY, u16_ByteDelay);
+    FakePN532::ClearCounters();
+
+    byte u8_Uid[8], u8_UidLength;
+    eCardType e_CardType;
+    CHECK(gi_PN532.ReadPassiveTargetID(u8_Uid, &u8_UidLength, &e_CardType));
+    CHECK(u8_UidLength == 7 && memcmp(u8_Uid, gu8_CardUid, 7) == 0 && e_CardType == CARD_Desfire);
+
+    uint32_t u32_Micros = FakePN532::GetReadMicros();
+    printf("Byte delay %4u us: %3u SPI calls, %3u bytes, response frame %5u us\n", (unsigned)u16_ByteDelay,
+           (unsigned)FakePN532::GetSpiCalls(), (unsigned)FakePN532::GetSpiBytes(), (unsigned)u32_Micros);
+    return u32_Micros;
+}
+
+static void TestBurst(void)
+{
+    FakePN532::Connect(SSEL_PIN, PN532_NO_IRQ);
+    FakePN532::SetLatency(200, 5000);
+    FakePN532::SetResponder(CardResponder);
+    gi_PN532.InitHardwareSPI(SSEL_PIN, RESET_PIN);
+
+    // The burst: one call for the command frame, the ACK and the response (plus the operation bytes)
+    uint32_t u32_Burst = MeasureFrame(0);
+    CHECK(FakePN532::GetSpiCalls() == 6 + 2 * FakePN532::GetStatusReads());
+    CHECK(u32_Burst <= PN532_SPI_SELECT_DELAY + 29 * 8);
+
+    // The profile for marginal wiring
+    uint32_t u32_Slow = MeasureFrame(10);
+    CHECK(u32_Slow >= u32_Burst + 28 * 10);
+
+    // A delay of 1 ms before each byte (the timing before the burst transfers)
+    uint32_t u32_Old = MeasureFrame(1000);
+    CHECK(u32_Old >= 28000);
+
+    gi_PN532.SetSpiTiming(PN532_SPI_SELECT_DELAY, PN532_SPI_BYTE_DELAY);
+    FakePN532::SetResponder(NULL);
+}
+
+// Recovers like RecoverReader() in NFCaffe.cpp, returns the tier that succeeded (1 = resync, 2 = soft init, 3 = hard reset)
+static int Recover(void)
+{
+    if (gi_PN532.Resync())
+        return 1;
+
+    byte IC, VersionHi, VersionLo, Flags;
+    if (gi_PN532.GetCachedFirmware(&IC, &VersionHi, &VersionLo, &Flags))
+    {
+        gi_PN532.WakeUp();
+        if (gi_PN532.SetPassiveActivationRetries() && gi_PN532.SamConfig())
+            return 2;
+    }
+
+    gi_PN532.begin();
+    if (gi_PN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags) &&
+        gi_PN532.SetPassiveActivationRetries() && gi_PN532.SamConfig())
+        return 3;
+    return 0;
+}
+
+// u32_Glitches frames are corrupted, the first one makes the card read fail.
+// Returns the outage from the failed card read until the card can be read again.
+static uint32_t MeasureRecovery(uint32_t u32_Glitches, int s32_Tier)
+{
+    byte u8_Uid[8], u8_UidLength;
+    eCardType e_CardType;
+    FakePN532::SetGlitches(u32_Glitches);
+    uint32_t u32_Start = Utils::GetMillis();
+    CHECK(!gi_PN532.ReadPassiveTargetID(u8_Uid, &u8_UidLength, &e_CardType));
+
+    int s32_Result = Recover();
+    CHECK(s32_Result == s32_Tier);
+    CHECK(gi_PN532.ReadPassiveTargetID(u8_Uid, &u8_UidLength, &e_CardType));
+    CHECK(u8_UidLength == 7 && memcmp(u8_Uid, gu8_CardUid, 7) == 0);
+
+    uint32_t u32_Outage = Utils::GetMillis() - u32_Start;
+    printf("%u corrupted frames: recovered by tier %d, outage %3u ms\n", (unsigned)u32_Glitches, s32_Result, (unsigned)u32_Outage);
+    return u32_Outage;
+}
+
+static void TestRecovery(void)
+{
+    FakePN532::Connect(SSEL_PIN, PN532_NO_IRQ);
+    FakePN532::SetLatency(200, 5000);
+    FakePN532::SetResponder(CardResponder);
+    gi_PN532.InitHardwareSPI(SSEL_PIN, RESET_PIN);
+    byte IC, VersionHi, VersionLo, Flags;
+    CHECK(gi_PN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags));
+
+    // The bit error in the ACK leaves the response pending: Resync() aborts it and the next command works
+    uint32_t u32_Resync = MeasureRecovery(1, 1);
+    // The GetFirmwareVersion() of Resync() also fails
+    uint32_t u32_Soft   = MeasureRecovery(2, 2);
+    // Also the SetPassiveActivationRetries() of the soft init fails, only the reset helps
+    uint32_t u32_Hard   = MeasureRecovery(3, 3);
+    CHECK(u32_Resync < 50);
+    CHECK(u32_Soft   < 100);
+    CHECK(u32_Hard   > 420);
+
+    // A response that is pending when Resync() starts is discarded, the queued commands fail
+    gs32_Done = 0;
+    const byte u8_Cmd[] = { 0x4A, 0x01, 0x00 };
+    CHECK(gi_PN532.Submit(u8_Cmd, sizeof(u8_Cmd), 28, OnDone, (void*)0x4A));
+    CHECK(gi_PN532.Submit(u8_Cmd, sizeof(u8_Cmd), 28, OnDone, (void*)0x4A));
+    CHECK(gi_PN532.Poll());
+    FakeClock::Advance(1);
+    CHECK(gi_PN532.Poll()); // the ACK has been read
+    CHECK(gi_PN532.Resync());
+    CHECK(!gi_PN532.IsBusy());
+    CHECK(gs32_Done == 2 && !gk_Done[0].b_Success && !gk_Done[1].b_Success);
+
+    FakePN532::SetResponder(NULL);
+}
+
+// Reads the card like ReadCard() in NFCaffe.cpp, *pb_Pending = true while the PN532 is still auto polling.
+// u8_TypeCount = 0 uses InListPassiveTarget.
+static bool ReadCard(const byte* u8_Types, byte u8_TypeCount, byte* u8_Uid, byte* pu8_UidLength, bool* pb_Pending)
+{
+    eCardType e_CardType;
+    *pb_Pending = false;
+    if (u8_TypeCount == 0)
+        return gi_PN532.ReadPassiveTargetID(u8_Uid, pu8_UidLength, &e_CardType);
+
+    if (!gi_PN532.IsAutoPolling() && !gi_PN532.StartAutoPoll(AUTOPOLL_COUNT, AUTOPOLL_PERIOD, u8_Types, u8_TypeCount))
+        return false;
+
+    bool b_Done;
+    if (!gi_PN532.CheckAutoPoll(u8_Uid, pu8_UidLength, &e_CardType, &b_Done))
+        return false;
+    *pb_Pending = !b_Done;
+    return true;
+}
+
+// Polls each POLL_INTERVAL for one second with an empty field.
+// Prints the SPI traffic and the time that ReadCard() blocks the main loop (select delays, transfers and waiting).
+static void MeasureIdleSecond(const byte* u8_Types, byte u8_TypeCount, uint32_t* pu32_Bytes, uint32_t* pu32_Busy)
+{
+    byte u8_Uid[8], u8_UidLength;
+    bool b_Pending;
+    *pu32_Busy = 0;
+    FakePN532::ClearCounters();
+    for (uint32_t T=0; T<1000; T+=POLL_INTERVAL)
+    {
+        uint32_t u32_Start = Utils::GetMicros();
+        CHECK(ReadCard(u8_Types, u8_TypeCount, u8_Uid, &u8_UidLength, &b_Pending));
+        CHECK(u8_UidLength == 0);
+        uint32_t u32_Busy = Utils::GetMicros() - u32_Start;
+        *pu32_Busy += u32_Busy;
+        if (u32_Busy < POLL_INTERVAL * 1000)
+            Utils::DelayMicro(POLL_INTERVAL * 1000 - u32_Busy);
+    }
+    *pu32_Bytes = FakePN532::GetSpiBytes();
+    printf("%-18s: %2u commands, %4u SPI bytes, %4u SPI calls, %3u status reads, blocked %6u us per idle second\n",
+           u8_TypeCount ? "InAutoPoll" : "InListPassiveTarget", (unsigned)FakePN532::GetCommands(), (unsigned)*pu32_Bytes,
+           (unsigned)FakePN532::GetSpiCalls(), (unsigned)FakePN532::GetStatusReads(), (unsigned)*pu32_Busy);
+}
+
+static void TestAutoPoll(void)
+{
+    FakePN532::Connect(SSEL_PIN, PN532_NO_IRQ);
+    FakePN532::SetResponder(CardResponder);
+    gi_PN532.InitHardwareSPI(SSEL_PIN, RESET_PIN);
+
+    // The empty field: InListPassiveTarget answers after its activation retries (assumed 10 ms)
+    const byte u8_Types[] = { PN532_AUTOPOLL_GENERIC_106K };
+    gb_CardPresent = false;
+    FakePN532::SetLatency(200, 10000);
+    uint32_t u32_ListBytes, u32_ListBusy, u32_AutoBytes, u32_AutoBusy;
+    MeasureIdleSecond(NULL, 0, &u32_ListBytes, &u32_ListBusy);
+    MeasureIdleSecond(u8_Types, sizeof(u8_Types), &u32_AutoBytes, &u32_AutoBusy);
+    CHECK(u32_AutoBytes * 4 < u32_ListBytes);
+    CHECK(u32_AutoBusy  * 4 < u32_ListBusy);
+
+    // The Desfire card is found with the generic type
+    byte u8_Uid[8], u8_UidLength = 0;
+    bool b_Pending = true;
+    gb_CardPresent = true;
+    for (int i=0; i<50 && (b_Pending || u8_UidLength == 0); i++)
+    {
+        CHECK(ReadCard(u8_Types, sizeof(u8_Types), u8_Uid, &u8_UidLength, &b_Pending));
+        FakeClock::Advance(POLL_INTERVAL);
+    }
+    CHECK(u8_UidLength == 7 && memcmp(u8_Uid, gu8_CardUid, 7) == 0);
+
+    // The Mifare type alone does not find it
+    const byte u8_Mifare[] = { PN532_AUTOPOLL_MIFARE };
+    b_Pending = true;
+    while (gi_PN532.IsAutoPolling()) gi_PN532.Poll();
+    for (int i=0; i<50 && b_Pending; i++)
+    {
+        CHECK(ReadCard(u8_Mifare, sizeof(u8_Mifare), u8_Uid, &u8_UidLength, &b_Pending));
+        FakeClock::Advance(POLL_INTERVAL);
+    }
+    CHECK(!b_Pending && u8_UidLength == 0);
+
+    FakePN532::SetResponder(NULL);
+}
+
+int main(void)
+{
+    TestQueueOrder();
+    TestBackoff();
+    TestIrqRoundTrip();
+    TestBurst();
+    TestRecovery();
+    TestAutoPoll();
+    return TestResult("TestPN532");
+}
@@ -0,0 +1,170 @@
+// Test of the cooperative scheduler: The latency from placing a card on the reader until it is detected.
+// The poll task reads the card each POLL_INTERVAL like SM_CardReading() in NFCaffe.cpp (without auto polling)
+// and the LED pattern after a tap is played by a one-shot task like PlayLED().
+// For comparison the blocking main loop before the scheduler is measured: FlashLED() waited 100 ms after each
+// empty poll and the LED blinked for 400 ms after a tap before the next poll.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "PN532.h"
+#include "Scheduler.h"
+#include "Utils.h"
+
+#define SSEL_PIN       0
+#define RESET_PIN      16
+#define POLL_INTERVAL  20   // PN532_POLL_INTERVAL in NFCaffe.cpp
+
+static PN532 gi_PN532;
+
+// The card is in the RF field from gu32_CardFrom until gu32_CardUntil (milliseconds)
+static uint32_t gu32_CardFrom  = 0xFFFFFFFF;
+static uint32_t gu32_CardUntil = 0xFFFFFFFF;
+static uint32_t gu32_CardUid   = 0;
+
+static byte     gu8_TaskPoll = SCHED_NO_TASK;
+static byte     gu8_TaskLED  = SCHED_NO_TASK;
+static uint32_t gu32_LastUid = 0;           // like gu64_LastID
+static uint32_t gu32_Detected[4];           // the time when each card has been detected
+static uint32_t gu32_Taps    = 0;
+static byte     gu8_LEDStep  = 0;
+
+static const uint16_t gu16_SavedPattern[] = { 150, 100, 150 };
+
+// InListPassiveTarget finds the card with a 4 byte UID while it is in the field
+static uint8_t CardResponder(const uint8_t* u8_Cmd, uint8_t u8_CmdLen, uint8_t* u8_Resp)
+{
+    uint8_t  u8_Len = 0;
+    uint32_t u32_Now = Utils::GetMillis();
+    u8_Resp[u8_Len++] = u8_Cmd[0] + 1;
+    if (u8_Cmd[0] != PN532_COMMAND_INLISTPASSIVETARGET)
+        return u8_Len;
+
+    bool b_Present = u32_Now >= gu32_CardFrom && u32_Now < gu32_CardUntil;
+    u8_Resp[u8_Len++] = b_Present ? 1 : 0;
+    if (!b_Present)
+        return u8_Len;
+
+    const byte u8_Target[] = { 0x01, 0x00, 0x04, 0x08, 0x04 }; // Mifare Classic
+    memcpy(u8_Resp + u8_Len, u8_Target, sizeof(u8_Target));
+    u8_Len += sizeof(u8_Target);
+    Utils::WriteLE32(u8_Resp + u8_Len, gu32_CardUid);
+    return u8_Len + 4;
+}
+
+// Reads the card, returns its UID or 0 if the field is empty
+static uint32_t ReadUid(void)
+{
+    byte u8_Uid[8], u8_UidLength;
+    eCardType e_CardType;
+    CHECK(gi_PN532.ReadPassiveTargetID(u8_Uid, &u8_UidLength, &e_CardType));
+    return (u8_UidLength == 4) ? Utils::ReadLE32(u8_Uid) : 0;
+}
+
+// Returns true when a new card has been detected
+static bool CountTap(uint32_t u32_Uid)
+{
+    if (u32_Uid == 0 || u32_Uid == gu32_LastUid)
+    {
+        gu32_LastUid = u32_Uid;
+        return false;
+    }
+    gu32_LastUid = u32_Uid;
+    gu32_Detected[gu32_Taps++ & 3] = Utils::GetMillis();
+    return true;
+}
+
+static void LEDTask(void)
+{
+    if (gu8_LEDStep >= sizeof(gu16_SavedPattern) / sizeof(gu16_SavedPattern[0]))
+        return;
+    Scheduler::Start(gu8_TaskLED, gu16_SavedPattern[gu8_LEDStep++]);
+}
+
+static void PollTask(void)
+{
+    if (CountTap(ReadUid()))
+    {
+        gu8_LEDStep = 0;
+        Scheduler::Start(gu8_TaskLED);
+    }
+}
+
+// The main loop before the scheduler
+static void BlockingLoop(void)
+{
+    uint32_t u32_Uid = ReadUid();
+    if (u32_Uid == 0)
+        Utils::DelayMilli(100); // FlashLED(LED_BUILTIN, 100)
+    else if (CountTap(u32_Uid))
+        Utils::DelayMilli(400); // the LED blinks in UpdateSDCardCounter()
+}
+
+// Runs the main loop for u32_Millis
+static void RunLoop(bool b_Scheduler, uint32_t u32_Millis)
+{
+    uint32_t u32_Start = Utils::GetMillis();
+    while (Utils::GetMillis() - u32_Start < u32_Millis)
+    {
+        if (b_Scheduler)
+        {
+            Scheduler::Run();
+            Utils::DelayMicro(50);
+        }
+        else BlockingLoop();
+    }
+}
+
+// Card 1 is placed u32_Offset ms after the start and removed after 150 ms, then card 2 is placed (the next person).
+// Returns the worse of the two detection latencies.
+static uint32_t MeasureLatency(bool b_Scheduler, uint32_t u32_Offset)
+{
+    uint32_t u32_Start = Utils::GetMillis();
+    gu32_Taps = 0;
+    gu32_CardUid   = 0x11111111 + u32_Offset;
+    gu32_CardFrom  = u32_Start + u32_Offset;
+    gu32_CardUntil = gu32_CardFrom + 150;
+    RunLoop(b_Scheduler, u32_Offset + 150);
+
+    uint32_t u32_First = gu32_Detected[0] - gu32_CardFrom;
+    gu32_CardUid   = 0x22222222 + u32_Offset;
+    gu32_CardFrom  = gu32_CardUntil;
+    gu32_CardUntil = gu32_CardFrom + 1000;
+    RunLoop(b_Scheduler, 1200);
+    CHECK(gu32_Taps == 2);
+
+    uint32_t u32_Second = gu32_Detected[1] - gu32_CardFrom;
+    return (u32_First > u32_Second) ? u32_First : u32_Second;
+}
+
+int main(void)
+{
+    FakePN532::Connect(SSEL_PIN, PN532_NO_IRQ);
+    FakePN532::SetLatency(200, 3000);
+    FakePN532::SetResponder(CardResponder);
+    gi_PN532.InitHardwareSPI(SSEL_PIN, RESET_PIN);
+
+    gu8_TaskPoll = Scheduler::AddTask(PollTask, POLL_INTERVAL, POLL_INTERVAL);
+    gu8_TaskLED  = Scheduler::AddTask(LEDTask,  SCHED_ONE_SHOT);
+    CHECK(gu8_TaskPoll != SCHED_NO_TASK && gu8_TaskLED != SCHED_NO_TASK);
+
+    uint32_t u32_Worst[2] = { 0, 0 };
+    for (int s32_Mode=0; s32_Mode<2; s32_Mode++)
+    {
+        bool b_Scheduler = (s32_Mode == 1);
+        if (b_Scheduler) Scheduler::Start(gu8_TaskPoll);
+
+        for (uint32_t u32_Offset=0; u32_Offset<130; u32_Offset+=3)
+        {
+            uint32_t u32_Latency = MeasureLatency(b_Scheduler, u32_Offset);
+            if (u32_Latency > u32_Worst[s32_Mode])
+                u32_Worst[s32_Mode] = u32_Latency;
+        }
+        printf("%-15s: worst case detection latency %3u ms\n", b_Scheduler ? "Scheduler" : "Blocking loop", (unsigned)u32_Worst[s32_Mode]);
+    }
+
+    // One poll interval plus the InListPassiveTarget command (three frames with a 2 ms select delay)
+    CHECK(u32_Worst[1] <= POLL_INTERVAL + 15);
+    CHECK(u32_Worst[0] >= 300);
+    CHECK(Scheduler::GetTask(gu8_TaskPoll)->u32_Missed == 0);
+    return TestResult("TestScheduler");
+}
@@ -0,0 +1,248 @@
+// Test of the TapBuffer: The SD card is removed, the taps are counted in the EEPROM, the device is reset
+// and the SD card is mounted again. The replay is torn at every byte offset, after the "reboot" the replay
+// is repeated and each card must have exactly its count (a tap in the event log may be duplicated).
+// The users of an older firmware in the reserved EEPROM must not be overwritten.
+// The flash sector of the EEPROM is only rewritten every TAPBUF_COMMIT_TAPS taps or after TAPBUF_COMMIT_DELAY.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "EventLog.h"
+#include "SDCard.h"
+#include "TapBuffer.h"
+#include "UserManager.h"
+
+#define TEST_CARDS  (6u)
+
+// The taps while the SD card works (card, taps) go into the CounterCache, the taps while it is missing into the TapBuffer.
+// Card TEST_CARDS is a new card.
+static const uint32_t gu32_CacheTaps [TEST_CARDS + 1] = { 2, 0, 1, 0, 3, 0, 0 };
+static const uint32_t gu32_BufferTaps[TEST_CARDS + 1] = { 1, 2, 0, 0, 4, 1, 3 };
+
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F600ull + u32_Card * 7919;
+}
+
+// The count before the SD card has been removed: card i has the count 10 * i + 1
+static uint32_t StoredCount(uint32_t u32_Card)
+{
+    return (u32_Card < TEST_CARDS) ? 10 * u32_Card + 1 : 0;
+}
+
+// Mounts the SD card like MountSD() in NFCaffe.cpp
+static bool Mount(void)
+{
+    gi_CounterDB.Close();
+    return SDCard::Begin(0) && EventLog::Resume() && TapBuffer::Replay();
+}
+
+// The reset: Only the EEPROM and the SD card survive
+static void Reboot(void)
+{
+    gi_CounterDB.Close();
+    CounterCache::Invalidate();
+    TapBuffer::Begin();
+    EventLog::Begin(); // fails while the SD card is missing
+}
+
+// Counts the taps, removes the SD card and counts more taps in the TapBuffer, then resets the device
+static void CountWithoutSD(void)
+{
+    gi_CounterDB.Close();
+    FakeSD::Format();
+    FakeEEPROM::Erase();
+    SDCard::Begin(0);
+    for (uint32_t C=0; C<TEST_CARDS; C++)
+        CHECK(gi_CounterDB.Write(CardID(C), StoredCount(C)));
+    Reboot();
+    CHECK(!TapBuffer::IsActive());
+
+    uint32_t u32_Count;
+    for (uint32_t C=0; C<=TEST_CARDS; C++)
+    {
+        for (uint32_t T=0; T<gu32_CacheTaps[C]; T++)
+            CHECK(CounterCache::Increment(CardID(C), &u32_Count));
+    }
+
+    // The SD card fails: The dirty counters are moved into the TapBuffer
+    FakeSD::SetPresent(false);
+    TapBuffer::Capture();
+    CHECK(TapBuffer::IsActive());
+
+    bool b_Total;
+    for (uint32_t C=0; C<=TEST_CARDS; C++)
+    {
+        for (uint32_t T=0; T<gu32_BufferTaps[C]; T++)
+            CHECK(TapBuffer::Add(CardID(C), &u32_Count, &b_Total));
+    }
+    CHECK(!Mount());
+
+    // The scheduler commits the taps, then the reset while the SD card is missing
+    FakeClock::Advance(TAPBUF_COMMIT_DELAY);
+    TapBuffer::Task();
+    Reboot();
+    CHECK(TapBuffer::IsActive());
+    FakeSD::SetPresent(true);
+}
+
+static void CheckCounts(void)
+{
+    for (uint32_t C=0; C<=TEST_CARDS; C++)
+    {
+        uint32_t u32_Expect = StoredCount(C) + gu32_CacheTaps[C] + gu32_BufferTaps[C];
+        uint32_t u32_Count  = 0xFFFFFFFF;
+        CHECK(gi_CounterDB.Read(CardID(C), &u32_Count));
+        if (u32_Count != u32_Expect)
+            printf("Card %u has the count %u, expected %u\n", (unsigned)C, (unsigned)u32_Count, (unsigned)u32_Expect);
+        CHECK(u32_Count == u32_Expect);
+    }
+}
+
+// Mounts the SD card with s32_Budget bytes left before the power fails, boots again, mounts and checks all cards.
+// returns the bytes that the replay needs (with s32_Budget = -1)
+static uint32_t TearReplay(int32_t s32_Budget)
+{
+    CountWithoutSD();
+
+    uint32_t u32_Before = FakeSD::GetBytesWritten();
+    FakeSD::SetWriteBudget(s32_Budget);
+    bool b_Mounted = Mount();
+    uint32_t u32_Bytes = FakeSD::GetBytesWritten() - u32_Before;
+    FakeSD::SetWriteBudget(-1);
+
+    if (!b_Mounted)
+    {
+        Reboot();
+        CHECK(Mount());
+    }
+    CHECK(!TapBuffer::IsActive());
+    CHECK(TapBuffer::GetCount() == 0);
+    CHECK(gi_CounterDB.FinishRecovery());
+    CheckCounts();
+
+    // After the next reset nothing is replayed twice
+    Reboot();
+    CHECK(!TapBuffer::IsActive());
+    CHECK(Mount());
+    CheckCounts();
+    return u32_Bytes;
+}
+
+// An older firmware has stored 128 users in the whole EEPROM
+static void TestReservedUsers(void)
+{
+    gi_CounterDB.Close();
+    FakeSD::Format();
+    FakeEEPROM::Erase();
+    UserManager::DeleteAllUsers();
+    CHECK(!UserManager::HasReservedUsers());
+
+    kUser k_User;
+    uint32_t u32_Users = EEPROM_LENGTH / sizeof(kUser);
+    for (uint32_t U=0; U<u32_Users; U++)
+    {
+        k_User.ID.u64 = CardID(U);
+        sprintf(k_User.s8_Name, "User %03u", (unsigned)U);
+        k_User.u8_Flags = DOOR_ONE;
+        byte* pu8_Ptr = (byte*)&k_User;
+        for (uint32_t i=0; i<sizeof(kUser); i++)
+            EEPROM.write(U * sizeof(kUser) + i, pu8_Ptr[i]);
+    }
+    EEPROM.commit();
+    CHECK(UserManager::HasReservedUsers());
+
+    // The buffer is only kept in RAM
+    Reboot();
+    FakeSD::SetPresent(false);
+    TapBuffer::Capture();
+    uint32_t u32_Count;
+    bool     b_Total;
+    CHECK(TapBuffer::Add(CardID(1), &u32_Count, &b_Total));
+    CHECK(TapBuffer::GetCount() == 1);
+
+    for (uint32_t U=0; U<u32_Users; U++)
+        CHECK(UserManager::FindUser(CardID(U), &k_User) && k_User.u8_Flags == DOOR_ONE);
+
+    // Without the users above 96 the TapBuffer stores in the EEPROM again
+    for (uint32_t U=USER_EEPROM_LENGTH / sizeof(kUser); U<u32_Users; U++)
+        CHECK(UserManager::DeleteUser(CardID(U), NULL));
+    CHECK(!UserManager::HasReservedUsers());
+    CHECK(UserManager::FindUser(CardID(95), &k_User));
+    CHECK(TapBuffer::Add(CardID(2), &u32_Count, &b_Total));
+    FakeClock::Advance(TAPBUF_COMMIT_DELAY);
+    TapBuffer::Task();
+
+    Reboot();
+    CHECK(TapBuffer::GetCount() == 2);
+    CHECK(UserManager::FindUser(CardID(0), &k_User));
+    FakeSD::SetPresent(true);
+}
+
+// Counts u32_Taps taps of one card, returns the number of commits
+static uint32_t AddTaps(uint32_t u32_Taps, uint32_t* pu32_Count)
+{
+    uint32_t u32_Commits = FakeEEPROM::GetCommits();
+    bool b_Total;
+    for (uint32_t T=0; T<u32_Taps; T++)
+        CHECK(TapBuffer::Add(CardID(0), pu32_Count, &b_Total));
+    return FakeEEPROM::GetCommits() - u32_Commits;
+}
+
+// The power fails while the SD card is missing: Only the committed taps survive
+static void TestCommits(void)
+{
+    gi_CounterDB.Close();
+    FakeSD::Format();
+    FakeEEPROM::Erase();
+    Reboot();
+    FakeSD::SetPresent(false);
+    TapBuffer::Capture();
+
+    uint32_t u32_Taps = 10 * TAPBUF_COMMIT_TAPS;
+    uint32_t u32_Count;
+    uint32_t u32_Commits = AddTaps(u32_Taps, &u32_Count);
+    printf("%u taps without SD card: %u EEPROM commits (one per tap before)\n", (unsigned)u32_Taps, (unsigned)u32_Commits);
+    CHECK(u32_Commits == u32_Taps / TAPBUF_COMMIT_TAPS);
+
+    // The uncommitted taps are lost
+    CHECK(AddTaps(TAPBUF_COMMIT_TAPS - 1, &u32_Count) == 0);
+    Reboot();
+    CHECK(AddTaps(1, &u32_Count) == 0);
+    CHECK(u32_Count == u32_Taps + 1);
+
+    // Task() commits the taps after TAPBUF_COMMIT_DELAY
+    u32_Commits = FakeEEPROM::GetCommits();
+    FakeClock::Advance(TAPBUF_COMMIT_DELAY - 1);
+    TapBuffer::Task();
+    CHECK(FakeEEPROM::GetCommits() == u32_Commits);
+    FakeClock::Advance(1);
+    TapBuffer::Task();
+    CHECK(FakeEEPROM::GetCommits() == u32_Commits + 1);
+    TapBuffer::Task();
+    CHECK(FakeEEPROM::GetCommits() == u32_Commits + 1);
+    Reboot();
+    CHECK(AddTaps(1, &u32_Count) == 0);
+    CHECK(u32_Count == u32_Taps + 2);
+
+    // The replay commits the empty buffer
+    FakeSD::SetPresent(true);
+    CHECK(Mount());
+    Reboot();
+    CHECK(!TapBuffer::IsActive());
+}
+
+int main(void)
+{
+    uint32_t u32_Bytes = TearReplay(-1);
+    CHECK(u32_Bytes > 0);
+
+    for (uint32_t u32_Budget=0; u32_Budget<=u32_Bytes; u32_Budget++)
+        TearReplay(u32_Budget);
+    printf("%u byte offsets torn\n", (unsigned)u32_Bytes + 1);
+
+    TestReservedUsers();
+    TestCommits();
+    return TestResult("TestTapBuffer");
+}
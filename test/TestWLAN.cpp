@@ -0,0 +1,813 @@
+// Test and benchmark of the WiFi upload with a loopback client (FakeWiFi), the test plays the Android app.
+// The wait for the client: StartTCP() before counted down 0xCAFE iterations and repainted the progress bar in each one,
+// so the timeout and the time until the client was noticed depended on the I2C speed of the display.
+// Now PollClient() is called once per tick of the state machine (1 ms) and redraws at most 5 times per second.
+// The export: printDirectory() before wrote each card with println() (two writes of a few bytes),
+// now the ExportBuffer passes segments of up to 536 bytes to write() as the send window allows.
+// The binary export: The test client checks the CRC32 of the header and of the trailer and compares the bytes on the
+// wire and the transfer time with the ASCII export.
+// Repeated syncs with the token of the last transfer (version 2) send only the cards that have changed since.
+// With acknowledgements (version 3): the window and the timeout of the acknowledgements, the resume with a matching
+// or a stale transfer ID and token, and a client that loses the connection at random points and resumes the transfer.
+
+#include "Test.h"
+#include "HostStubs.h"
+#include "CounterCache.h"
+#include "CounterDB.h"
+#include "SDCard.h"
+#include "Utils.h"
+#include <ESP8266WiFi.h>
+
+#define FRAME_MICROS        (23000u)   // SH1106: 1024 bytes over I2C with 400 kHz
+#define CLIENT_DELAY        (3000u)    // the app connects 3 seconds after the start of the wait
+#define CONNECTION_TIMEOUT  (120000u)  // TOTAL_CONNECTION_TIMEOUT in Utils.cpp
+#define KEY_TIMEOUT         (1000u)    // SECRET_KEY_TIMEOUT in Utils.cpp
+#define TEST_CARDS          (1000u)
+#define TEST_BATCHES        (64u)      // more than the batches of TEST_CARDS
+#define RECONNECT_DELAY     (500u)     // the app connects again 500 ms after the connection was lost
+#define DROP_BYTES          (4000u)    // the connection is lost after 1 to 4000 bytes (a third of the binary export)
+
+extern WiFiServer server;
+extern WiFiClient serverClient;
+extern char androidDate[9];
+
+// What the client has received in the current transfer
+static byte     gu8_Received[64 * 1024];
+static uint32_t gu32_Received = 0;
+static uint32_t gu32_FirstByte = 0; // the tick of the first byte
+
+// The binary export as the client parses it
+struct kClient
+{
+    uint16_t u16_Version;   // the version that the device sends
+    uint32_t u32_Pos;       // the bytes of gu8_Received that have been parsed
+    bool     b_Header;      // the header has been received
+    bool     b_Trailer;     // the empty batch has been received, the trailer follows
+    bool     b_Complete;    // the trailer has been received and is valid
+    bool     b_Error;       // wrong magic, batch number or CRC
+    uint32_t u32_Count;     // the number of cards in the header
+    uint32_t u32_ID;        // the transfer ID in the header (version 3)
+    uint16_t u16_First;     // the first batch in the header (version 3)
+    bool     b_HoldAcks;    // do not acknowledge the batches
+    bool     b_HoldLast;    // do not acknowledge the last batch
+    uint16_t u16_Batch;     // the number of the next batch
+    uint32_t u32_Records;
+    uint32_t u32_Crc;       // the CRC32 of the batches
+    uint64_t u64_Token;     // the new sync token in the trailer
+    uint32_t u32_BatchCrc[TEST_BATCHES];     // the CRC32 behind each batch (version 3)
+    uint32_t u32_BatchRecords[TEST_BATCHES]; // the records behind each batch (version 3)
+    uint32_t u32_Counts[TEST_CARDS]; // the counts received, 0 = not received
+};
+
+static uint64_t CardID(uint32_t u32_Card)
+{
+    return 0x04A1B2C3D4E5F6ull + u32_Card * 7919;
+}
+
+static uint32_t CardCount(uint32_t u32_Card)
+{
+    return u32_Card % 50 + 1;
+}
+
+// A new counter database with TEST_CARDS dirty cards
+static void CreateCards(void)
+{
+    gi_CounterDB.Close();
+    CounterCache::Invalidate();
+    SDCard::Remove(COUNTER_DB_PATH);
+    CHECK(gi_CounterDB.Open());
+    for (uint32_t C=0; C<TEST_CARDS; C++)
+        CHECK(gi_CounterDB.Write(CardID(C), CardCount(C)));
+    CHECK(gi_CounterDB.FinishRecovery() && gi_CounterDB.GetDirtyCount() == TEST_CARDS);
+}
+
+// The client receives what the device has sent
+static void Receive(uint32_t u32_Tick)
+{
+    uint32_t u32_Length = FakeWiFi::Receive(gu8_Received + gu32_Received, sizeof(gu8_Received) - gu32_Received);
+    if (u32_Length > 0 && gu32_Received == 0)
+        gu32_FirstByte = u32_Tick;
+    gu32_Received += u32_Length;
+}
+
+// The secret key that the app sends after the connect: checksum, year, month, day, checksum
+static void SendKey(uint16_t u16_Year, byte u8_Month, byte u8_Day, bool b_Valid = true)
+{
+    uint16_t u16_Sum = u16_Year + u8_Month + u8_Day + (b_Valid ? 0 : 1);
+    byte u8_Key[8] = { (byte)(u16_Sum >> 8), (byte)u16_Sum, (byte)(u16_Year >> 8), (byte)u16_Year,
+                       u8_Month, u8_Day, (byte)(u16_Year + u8_Month + u8_Day), (byte)((u16_Year + u8_Month + u8_Day) >> 8) };
+    FakeWiFi::Send(u8_Key, 8);
+}
+
+// The loop of WLAN::StartTCP() before
+static void WaitLoop(uint32_t* pu32_Latency, double* pd_Fps)
+{
+    uint32_t u32_Frames = FakeDisplay::GetFrames();
+    uint32_t u32_Start  = millis();
+    FakeWiFi::Connect(CLIENT_DELAY);
+
+    uint32_t lTimeout = 0xCAFE;
+    while (lTimeout && !server.hasClient())
+    {
+        display.setColor(BLACK);
+        display.fillRect(13, 39, 102, 11);
+        display.setColor(WHITE);
+        display.drawProgressBar(14, 40, 100, 8, (lTimeout * 100 / 0xCAFE));
+        display.display();
+        lTimeout--;
+    }
+    CHECK(lTimeout != 0);
+    *pu32_Latency = millis() - u32_Start - CLIENT_DELAY;
+    *pd_Fps       = (FakeDisplay::GetFrames() - u32_Frames) * 1000.0 / (millis() - u32_Start);
+}
+
+// PollClient() in each tick of the state machine
+static eWLANStatus WaitPolled(uint32_t* pu32_Elapsed, double* pd_Fps)
+{
+    uint32_t u32_Frames = FakeDisplay::GetFrames();
+    uint32_t u32_Start  = millis();
+    WLAN::BeginWait();
+
+    eWLANStatus e_Status;
+    while ((e_Status = WLAN::PollClient()) == WLAN_BUSY)
+        FakeClock::Advance(1);
+    *pu32_Elapsed = millis() - u32_Start;
+    *pd_Fps       = (FakeDisplay::GetFrames() - u32_Frames) * 1000.0 / *pu32_Elapsed;
+    return e_Status;
+}
+
+static bool ParseBinary(kClient* pk_Client);
+
+// Calls PollTransfer() in each tick until the transfer ends, the client receives everything after each tick
+// and parses the binary export (if pk_Client is not NULL).
+// returns the ticks
+static uint32_t RunTransfer(eWLANStatus* pe_Status, kClient* pk_Client = NULL)
+{
+    uint32_t u32_Ticks = 0;
+    while ((*pe_Status = WLAN::PollTransfer()) == WLAN_BUSY && u32_Ticks < CONNECTION_TIMEOUT)
+    {
+        Receive(u32_Ticks);
+        if (pk_Client) ParseBinary(pk_Client);
+        FakeClock::Advance(1);
+        u32_Ticks ++;
+    }
+    Receive(u32_Ticks);
+    if (pk_Client) ParseBinary(pk_Client);
+    return u32_Ticks;
+}
+
+// The app connects and sends the secret key and the export request (an old app sends nothing more)
+static void StartClient(uint16_t u16_Version = EXPORT_ASCII, uint64_t u64_Token = 0, uint32_t u32_Resume = 0)
+{
+    FakeWiFi::Connect();
+    WLAN::BeginWait();
+    CHECK(WLAN::PollClient() == WLAN_DONE);
+    WLAN::BeginTransfer();
+    SendKey(2026, 10, 17);
+    gu32_Received = 0;
+
+    if (u16_Version != EXPORT_ASCII)
+    {
+        byte u8_Request[6];
+        Utils::WriteLE32(u8_Request,     EXPORT_REQUEST_MAGIC);
+        Utils::WriteLE16(u8_Request + 4, u16_Version);
+        FakeWiFi::Send(u8_Request, 6);
+    }
+    if (u16_Version >= EXPORT_VERSION_SYNC)
+    {
+        byte u8_Token[8];
+        Utils::WriteLE64(u8_Token, u64_Token);
+        FakeWiFi::Send(u8_Token, 8);
+    }
+    if (u16_Version >= EXPORT_VERSION_ACK)
+    {
+        byte u8_Resume[4];
+        Utils::WriteLE32(u8_Resume, u32_Resume);
+        FakeWiFi::Send(u8_Resume, 4);
+    }
+}
+
+static void SendAck(uint16_t u16_Batch)
+{
+    byte u8_Ack[2];
+    Utils::WriteLE16(u8_Ack, u16_Batch);
+    FakeWiFi::Send(u8_Ack, 2);
+}
+
+static void BeginClient(kClient* pk_Client, uint16_t u16_Version)
+{
+    memset(pk_Client, 0, sizeof(kClient));
+    pk_Client->u16_Version = u16_Version;
+    pk_Client->u32_Crc     = 0xFFFFFFFF;
+}
+
+// The connection has been lost, the client parses the header of the next connection again
+static void ResumeClient(kClient* pk_Client)
+{
+    pk_Client->u32_Pos    = 0;
+    pk_Client->b_Header   = false;
+    pk_Client->b_Trailer  = false;
+    pk_Client->b_Complete = false;
+}
+
+// Parses the header, the batches and the trailer that have been received completely.
+// From version 3 on each batch is acknowledged, the last (empty) one after the trailer has been checked.
+// A resumed transfer continues behind the first batch in the header, a new transfer starts again.
+// returns false if the export is invalid
+static bool ParseBinary(kClient* pk_Client)
+{
+    while (!pk_Client->b_Error && !pk_Client->b_Complete)
+    {
+        const byte* u8_Data  = gu8_Received + pk_Client->u32_Pos;
+        uint32_t u32_Length  = gu32_Received - pk_Client->u32_Pos;
+        uint32_t u32_Parsed  = 0;
+        if (!pk_Client->b_Header)
+        {
+            bool     b_Ack      = pk_Client->u16_Version >= EXPORT_VERSION_ACK;
+            uint32_t u32_Header = b_Ack ? EXPORT_HEADER_SIZE_ACK : EXPORT_HEADER_SIZE;
+            if (u32_Length < u32_Header)
+                break;
+            pk_Client->b_Error = Utils::ReadLE32(u8_Data) != EXPORT_MAGIC ||
+                                 Utils::ReadLE16(u8_Data + 4) != pk_Client->u16_Version ||
+                                 Utils::ReadLE16(u8_Data + 6) != EXPORT_RECORD_SIZE ||
+                                 Utils::ReadLE32(u8_Data + u32_Header - 4) != Utils::CalcCrc32(u8_Data, u32_Header - 4);
+            pk_Client->u32_Count = Utils::ReadLE32(u8_Data + 8);
+            pk_Client->b_Header  = true;
+            u32_Parsed = u32_Header;
+            if (b_Ack)
+            {
+                uint32_t u32_ID    = Utils::ReadLE32(u8_Data + 12);
+                pk_Client->u16_First = Utils::ReadLE16(u8_Data + 16);
+                if (u32_ID != pk_Client->u32_ID)
+                    pk_Client->u16_Batch = 0; // a new transfer
+                pk_Client->b_Error |= u32_ID == 0 || pk_Client->u16_First > pk_Client->u16_Batch;
+                pk_Client->u32_ID    = u32_ID;
+                pk_Client->u16_Batch = pk_Client->u16_First;
+                pk_Client->u32_Crc     = pk_Client->u16_Batch ? pk_Client->u32_BatchCrc[pk_Client->u16_Batch - 1] : 0xFFFFFFFF;
+                pk_Client->u32_Records = pk_Client->u16_Batch ? pk_Client->u32_BatchRecords[pk_Client->u16_Batch - 1] : 0;
+            }
+        }
+        else if (!pk_Client->b_Trailer)
+        {
+            if (u32_Length < EXPORT_BATCH_HEADER)
+                break;
+            uint32_t u32_Records = Utils::ReadLE16(u8_Data);
+            uint32_t u32_Batch   = EXPORT_BATCH_HEADER + u32_Records * EXPORT_RECORD_SIZE;
+            if (u32_Length < u32_Batch)
+                break;
+            pk_Client->b_Error = u32_Records > EXPORT_BATCH_RECORDS || Utils::ReadLE16(u8_Data + 2) != pk_Client->u16_Batch;
+            for (uint32_t R=0; R<u32_Records && !pk_Client->b_Error; R++)
+            {
+                const byte* u8_Record = u8_Data + EXPORT_BATCH_HEADER + R * EXPORT_RECORD_SIZE;
+                uint32_t C = (uint32_t)((Utils::ReadLE64(u8_Record) - CardID(0)) / 7919);
+                pk_Client->b_Error = C >= TEST_CARDS || CardID(C) != Utils::ReadLE64(u8_Record);
+                if (!pk_Client->b_Error)
+                    pk_Client->u32_Counts[C] = Utils::ReadLE32(u8_Record + 8);
+            }
+            pk_Client->u32_Crc = Utils::CalcCrc32(u8_Data, u32_Batch, pk_Client->u32_Crc);
+            pk_Client->u32_Records += u32_Records;
+            if (pk_Client->u16_Batch < TEST_BATCHES)
+            {
+                pk_Client->u32_BatchCrc[pk_Client->u16_Batch]     = pk_Client->u32_Crc;
+                pk_Client->u32_BatchRecords[pk_Client->u16_Batch] = pk_Client->u32_Records;
+            }
+            if (pk_Client->u16_Version >= EXPORT_VERSION_ACK && u32_Records > 0 && !pk_Client->b_HoldAcks)
+                SendAck(pk_Client->u16_Batch);
+            pk_Client->u16_Batch ++;
+            pk_Client->b_Trailer = u32_Records == 0;
+            u32_Parsed = u32_Batch;
+        }
+        else
+        {
+            // From version 2 on the CRC32 also covers the record count and the new token
+            uint32_t u32_Trailer = pk_Client->u16_Version >= EXPORT_VERSION_SYNC ? 16 : 8;
+            if (u32_Length < u32_Trailer)
+                break;
+            uint32_t u32_Crc = pk_Client->u32_Crc;
+            if (u32_Trailer == 16)
+            {
+                u32_Crc = Utils::CalcCrc32(u8_Data, 12, u32_Crc);
+                pk_Client->u64_Token = Utils::ReadLE64(u8_Data + 4);
+            }
+            pk_Client->b_Error    = Utils::ReadLE32(u8_Data) != pk_Client->u32_Records ||
+                                    Utils::ReadLE32(u8_Data + u32_Trailer - 4) != u32_Crc;
+            pk_Client->b_Complete = !pk_Client->b_Error;
+            u32_Parsed = u32_Trailer;
+            if (pk_Client->u16_Version >= EXPORT_VERSION_ACK && pk_Client->b_Complete && !pk_Client->b_HoldAcks && !pk_Client->b_HoldLast)
+                SendAck(pk_Client->u16_Batch - 1);
+        }
+        pk_Client->u32_Pos += u32_Parsed;
+    }
+    return !pk_Client->b_Error;
+}
+
+// Checks the lines "NAME.EXT,count" of the ASCII export, returns the number of cards.
+// The cards come in the order of the database, each must have its count and come only once.
+static uint32_t ParseAscii(void)
+{
+    static char s8_Names[TEST_CARDS][13];
+    bool b_Seen[TEST_CARDS] = { false };
+    for (uint32_t C=0; C<TEST_CARDS; C++)
+    {
+        strcpy(s8_Names[C], "00000000.000");
+        Utils::Base36(CardID(C), s8_Names[C]);
+    }
+
+    uint32_t u32_Cards = 0;
+    char* s8_Line = (char*)gu8_Received;
+    gu8_Received[gu32_Received] = 0;
+    for (char* s8_End; (s8_End = strstr(s8_Line, "\r\n")) != NULL; s8_Line = s8_End + 2)
+    {
+        *s8_End = 0;
+        if (s8_Line[0] == '#')
+            continue; // SD statistics
+
+        uint32_t C = 0;
+        while (C < TEST_CARDS && (strncmp(s8_Line, s8_Names[C], 12) != 0 || s8_Line[12] != ','))
+            C++;
+        CHECK(C < TEST_CARDS);
+        if (C == TEST_CARDS)
+            return 0;
+        CHECK(!b_Seen[C] && (uint32_t)atoi(s8_Line + 13) == CardCount(C));
+        b_Seen[C] = true;
+        u32_Cards ++;
+    }
+    CHECK(*s8_Line == 0); // nothing after the last line
+    return u32_Cards;
+}
+
+static void TestAccept(void)
+{
+    uint32_t u32_Latency, u32_Elapsed;
+    double d_FpsLoop, d_FpsPolled;
+    FakeDisplay::SetFrameTime(FRAME_MICROS);
+
+    WaitLoop(&u32_Latency, &d_FpsLoop);
+    FakeWiFi::Drop();
+    printf("StartTCP() loop : client noticed after %2u ms, %5.1f redraws per second, timeout %u s\n",
+           (unsigned)u32_Latency, d_FpsLoop, (unsigned)(0xCAFE * (FRAME_MICROS / 1000) / 1000));
+    CHECK(u32_Latency < FRAME_MICROS / 1000);
+
+    FakeWiFi::Connect(CLIENT_DELAY);
+    CHECK(WaitPolled(&u32_Elapsed, &d_FpsPolled) == WLAN_DONE);
+    u32_Latency = u32_Elapsed - CLIENT_DELAY;
+    printf("PollClient()    : client noticed after %2u ms, %5.1f redraws per second, timeout %u s\n",
+           (unsigned)u32_Latency, d_FpsPolled, CONNECTION_TIMEOUT / 1000);
+    CHECK(u32_Latency <= FRAME_MICROS / 1000 + 1);
+    CHECK(d_FpsPolled <= 5.5 && d_FpsLoop > 40);
+
+    // The secret key arrives 100 ms after the accept, PollTransfer() does not wait for it
+    WLAN::BeginTransfer();
+    eWLANStatus e_Status = WLAN::PollTransfer();
+    CHECK(e_Status == WLAN_BUSY);
+    FakeClock::Advance(100);
+    CHECK(WLAN::PollTransfer() == WLAN_BUSY);
+    SendKey(2026, 10, 17);
+    CHECK(WLAN::PollTransfer() == WLAN_BUSY);
+    CHECK(strcmp(androidDate, "20261017") == 0);
+    FakeWiFi::Drop();
+    RunTransfer(&e_Status);
+    CHECK(e_Status == WLAN_FAILED);
+
+    // A wrong key closes the connection at once
+    FakeWiFi::Connect();
+    CHECK(WaitPolled(&u32_Elapsed, &d_FpsPolled) == WLAN_DONE && u32_Elapsed == 0);
+    WLAN::BeginTransfer();
+    SendKey(2026, 10, 18, false);
+    CHECK(WLAN::PollTransfer() == WLAN_FAILED);
+    CHECK(!FakeWiFi::IsOpen() && strcmp(androidDate, "20261017") == 0);
+
+    // Without a key the connection is closed after KEY_TIMEOUT
+    FakeWiFi::Connect();
+    CHECK(WaitPolled(&u32_Elapsed, &d_FpsPolled) == WLAN_DONE);
+    WLAN::BeginTransfer();
+    CHECK(RunTransfer(&e_Status) == KEY_TIMEOUT && e_Status == WLAN_FAILED);
+    CHECK(!FakeWiFi::IsOpen());
+
+    // Nobody connects: the timeout is wall clock time, independent of the frame time
+    CHECK(WaitPolled(&u32_Elapsed, &d_FpsPolled) == WLAN_FAILED);
+    CHECK(u32_Elapsed >= CONNECTION_TIMEOUT && u32_Elapsed <= CONNECTION_TIMEOUT + FRAME_MICROS / 1000);
+    FakeDisplay::SetFrameTime(0);
+}
+
+// The loop of printDirectory() before: println() for each card
+static void ExportPrintln(void)
+{
+    for (uint32_t u32_Slot = 0; gi_CounterDB.NextDirty(&u32_Slot); u32_Slot++)
+    {
+        uint64_t u64_ID;
+        uint32_t u32_Coffees;
+        char lBuf[12+1+10+1];
+        CHECK(gi_CounterDB.ReadSlot(u32_Slot, &u64_ID, &u32_Coffees));
+
+        char cardIDString[] = "00000000.000";
+        Utils::Base36(u64_ID, cardIDString);
+        sprintf(lBuf, "%s,%u", cardIDString, (unsigned)u32_Coffees);
+        serverClient.println(lBuf);
+    }
+}
+
+static void TestThroughput(void)
+{
+    CreateCards();
+
+    // println() for each card, the window is large enough for the whole export
+    FakeWiFi::SetWindow(sizeof(gu8_Received));
+    StartClient();
+    FakeWiFi::ClearCounters();
+    ExportPrintln();
+    Receive(0);
+    serverClient.stop();
+    uint32_t u32_Writes = FakeWiFi::GetWrites();
+    uint32_t u32_Bytes  = FakeWiFi::GetBytesSent();
+    CHECK(ParseAscii() == TEST_CARDS && u32_Writes == 2 * TEST_CARDS);
+    printf("println()    : %4u cards, %6u bytes in %4u writes, %5.1f bytes per write\n",
+           TEST_CARDS, (unsigned)u32_Bytes, (unsigned)u32_Writes, (double)u32_Bytes / u32_Writes);
+
+    // The ExportBuffer with the send window of lwIP, the client reads after each tick
+    FakeWiFi::SetWindow(2 * EXPORT_BUFFER_SIZE);
+    StartClient();
+    FakeWiFi::ClearCounters();
+    eWLANStatus e_Status;
+    uint32_t u32_Ticks = RunTransfer(&e_Status) - gu32_FirstByte;
+    CHECK(e_Status == WLAN_DONE && !FakeWiFi::IsOpen());
+    CHECK(ParseAscii() == TEST_CARDS && FakeWiFi::GetBytesSent() == u32_Bytes);
+    u32_Writes = FakeWiFi::GetWrites();
+    printf("ExportBuffer : %4u cards, %6u bytes in %4u writes, %5.1f bytes per write, %u ticks (%.0f cards per second)\n",
+           TEST_CARDS, (unsigned)u32_Bytes, (unsigned)u32_Writes, (double)u32_Bytes / u32_Writes,
+           (unsigned)u32_Ticks, TEST_CARDS * 1000.0 / u32_Ticks);
+    CHECK(u32_Writes <= u32_Bytes / EXPORT_BUFFER_SIZE + 2);
+
+    // A slow client: the window only takes 100 bytes per tick, write() never blocks
+    FakeWiFi::SetWindow(100);
+    StartClient();
+    RunTransfer(&e_Status);
+    CHECK(e_Status == WLAN_DONE && ParseAscii() == TEST_CARDS);
+
+    // The client stops reading: the transfer fails after EXPORT_WRITE_TIMEOUT
+    FakeWiFi::SetWindow(2 * EXPORT_BUFFER_SIZE);
+    StartClient();
+    uint32_t u32_Stalled = 0;
+    while ((e_Status = WLAN::PollTransfer()) == WLAN_BUSY && u32_Stalled < CONNECTION_TIMEOUT)
+    {
+        FakeClock::Advance(1);
+        if (gu32_Received < 3 * EXPORT_BUFFER_SIZE)
+            Receive(0);
+        else
+            u32_Stalled ++;
+    }
+    CHECK(e_Status == WLAN_FAILED && u32_Stalled >= EXPORT_WRITE_TIMEOUT && u32_Stalled < EXPORT_WRITE_TIMEOUT + 10);
+    CHECK(!FakeWiFi::IsOpen());
+}
+
+// The card counts that the client has received are those in the database
+static uint32_t CheckCounts(const kClient* pk_Client)
+{
+    uint32_t u32_Cards = 0;
+    for (uint32_t C=0; C<TEST_CARDS; C++)
+    {
+        uint32_t u32_Count = 0;
+        CHECK(gi_CounterDB.Read(CardID(C), &u32_Count) && u32_Count == pk_Client->u32_Counts[C]);
+        if (pk_Client->u32_Counts[C] != 0) u32_Cards ++;
+    }
+    return u32_Cards;
+}
+
+// Sends the request, returns the ticks from the first byte to the end
+static uint32_t RunBinary(kClient* pk_Client, uint16_t u16_Request, eWLANStatus* pe_Status, uint64_t u64_Token = 0)
+{
+    BeginClient(pk_Client, u16_Request < EXPORT_VERSION ? u16_Request : EXPORT_VERSION);
+    StartClient(u16_Request, u64_Token);
+    return RunTransfer(pe_Status, pk_Client) - gu32_FirstByte;
+}
+
+static void TestBinary(void)
+{
+    CreateCards();
+
+    // The ASCII export of an old client
+    eWLANStatus e_Status;
+    StartClient();
+    uint32_t u32_AsciiTicks = RunTransfer(&e_Status) - gu32_FirstByte;
+    uint32_t u32_AsciiBytes = gu32_Received;
+    CHECK(e_Status == WLAN_DONE && ParseAscii() == TEST_CARDS);
+
+    // The binary export
+    kClient k_Client;
+    uint32_t u32_Ticks = RunBinary(&k_Client, 1, &e_Status);
+    CHECK(e_Status == WLAN_DONE && k_Client.b_Complete && k_Client.u32_Pos == gu32_Received);
+    CHECK(k_Client.u32_Count == TEST_CARDS && k_Client.u32_Records == TEST_CARDS && CheckCounts(&k_Client) == TEST_CARDS);
+    CHECK(gu32_Received == EXPORT_HEADER_SIZE + (k_Client.u16_Batch * EXPORT_BATCH_HEADER) + TEST_CARDS * EXPORT_RECORD_SIZE + 8);
+    printf("ASCII export : %4u cards, %6u bytes, %3u ticks\n", TEST_CARDS, (unsigned)u32_AsciiBytes, (unsigned)u32_AsciiTicks);
+    printf("binary export: %4u cards, %6u bytes, %3u ticks, %u batches\n", TEST_CARDS, (unsigned)gu32_Received,
+           (unsigned)u32_Ticks, (unsigned)k_Client.u16_Batch);
+    CHECK(gu32_Received < u32_AsciiBytes && u32_Ticks <= u32_AsciiTicks);
+
+    // The client detects a truncated transfer: the connection is lost before the trailer
+    BeginClient(&k_Client, 1);
+    StartClient(1);
+    while (WLAN::PollTransfer() == WLAN_BUSY && gu32_Received < 2000)
+    {
+        FakeClock::Advance(1);
+        Receive(0);
+    }
+    FakeWiFi::Drop();
+    RunTransfer(&e_Status);
+    CHECK(e_Status == WLAN_FAILED && ParseBinary(&k_Client) && !k_Client.b_Complete);
+
+    // A corrupt byte fails the CRC32
+    RunBinary(&k_Client, 1, &e_Status);
+    CHECK(e_Status == WLAN_DONE && k_Client.b_Complete);
+    gu8_Received[EXPORT_HEADER_SIZE + 100] ^= 0x01;
+    BeginClient(&k_Client, 1);
+    CHECK(!ParseBinary(&k_Client) || !k_Client.b_Complete);
+
+    // A request without the magic gets the ASCII export
+    StartClient();
+    FakeWiFi::Send((const byte*)"HELLO!", 6);
+    RunTransfer(&e_Status);
+    CHECK(e_Status == WLAN_DONE && ParseAscii() == TEST_CARDS);
+}
+
+// The client keeps the counts of the earlier syncs and the token of the last one.
+// returns the bytes of the transfer
+static uint32_t Sync(kClient* pk_Client, uint32_t* pu32_Records)
+{
+    static uint32_t u32_Counts[TEST_CARDS];
+    memcpy(u32_Counts, pk_Client->u32_Counts, sizeof(u32_Counts));
+    uint64_t u64_Token = pk_Client->u64_Token;
+
+    eWLANStatus e_Status;
+    RunBinary(pk_Client, EXPORT_VERSION_SYNC, &e_Status, u64_Token);
+    CHECK(e_Status == WLAN_DONE && pk_Client->b_Complete && pk_Client->u32_Count == gi_CounterDB.GetDirtyCount());
+    CHECK(pk_Client->u64_Token == gi_CounterDB.GetSyncToken());
+    CHECK(pk_Client->u64_Token != u64_Token || pk_Client->u32_Records == 0);
+    for (uint32_t C=0; C<TEST_CARDS; C++)
+        if (pk_Client->u32_Counts[C] == 0) pk_Client->u32_Counts[C] = u32_Counts[C];
+    CheckCounts(pk_Client);
+    *pu32_Records = pk_Client->u32_Records;
+    return gu32_Received;
+}
+
+static void TestSync(void)
+{
+    CreateCards();
+
+    // The first sync sends all cards
+    kClient k_Client;
+    uint32_t u32_Records;
+    BeginClient(&k_Client, EXPORT_VERSION_SYNC);
+    uint32_t u32_Full = Sync(&k_Client, &u32_Records);
+    CHECK(u32_Records == TEST_CARDS);
+    printf("sync 0: %4u cards changed, %4u records, %6u bytes\n", TEST_CARDS, (unsigned)u32_Records, (unsigned)u32_Full);
+
+    // Then only the cards tapped since the last sync
+    const uint32_t u32_Changed[] = { 200, 40, 3, 0 };
+    for (int i=0; i<4; i++)
+    {
+        for (uint32_t T=0; T<u32_Changed[i]; T++)
+        {
+            uint32_t u32_Count;
+            CHECK(CounterCache::Increment(CardID((T * 37 + i) % TEST_CARDS), &u32_Count));
+        }
+        uint32_t u32_Bytes = Sync(&k_Client, &u32_Records);
+        printf("sync %d: %4u cards changed, %4u records, %6u bytes\n", i + 1, (unsigned)u32_Changed[i],
+               (unsigned)u32_Records, (unsigned)u32_Bytes);
+        CHECK(u32_Records == u32_Changed[i]);
+        CHECK(u32_Bytes == EXPORT_HEADER_SIZE + (u32_Records + EXPORT_BATCH_RECORDS - 1) / EXPORT_BATCH_RECORDS * EXPORT_BATCH_HEADER +
+                           EXPORT_BATCH_HEADER + u32_Records * EXPORT_RECORD_SIZE + 16);
+    }
+
+    // The token of another database file gets all cards
+    uint64_t u64_Other = k_Client.u64_Token ^ 0x0000000100000000ull;
+    eWLANStatus e_Status;
+    RunBinary(&k_Client, EXPORT_VERSION_SYNC, &e_Status, u64_Other);
+    CHECK(e_Status == WLAN_DONE && k_Client.b_Complete && k_Client.u32_Records == TEST_CARDS);
+
+    // Version 1 has the short trailer, its CRC32 covers only the batches
+    RunBinary(&k_Client, 1, &e_Status);
+    CHECK(e_Status == WLAN_DONE && k_Client.b_Complete && k_Client.u64_Token == 0);
+    CHECK(Utils::ReadLE32(gu8_Received + gu32_Received - 4) == k_Client.u32_Crc);
+}
+
+// Starts a transfer with acknowledgements (or resumes it with the transfer ID of pk_Client)
+static void StartAck(kClient* pk_Client, bool b_Resume, uint64_t u64_Token = 0)
+{
+    if (b_Resume)
+        ResumeClient(pk_Client);
+    else
+        BeginClient(pk_Client, EXPORT_VERSION_ACK);
+    StartClient(EXPORT_VERSION_ACK, u64_Token, b_Resume ? pk_Client->u32_ID : 0);
+}
+
+static void TestAcks(void)
+{
+    CreateCards();
+
+    // Without acknowledgements the device sends EXPORT_ACK_WINDOW batches, then the transfer is interrupted
+    kClient k_Client;
+    eWLANStatus e_Status;
+    StartAck(&k_Client, false);
+    k_Client.b_HoldAcks = true;
+    uint32_t u32_Ticks = RunTransfer(&e_Status, &k_Client) - gu32_FirstByte;
+    CHECK(e_Status == WLAN_INTERRUPTED && WiFiExport::CanResume());
+    CHECK(k_Client.u16_First == 0 && k_Client.u16_Batch == EXPORT_ACK_WINDOW && !k_Client.b_Error);
+    CHECK(u32_Ticks >= EXPORT_ACK_TIMEOUT && u32_Ticks <= EXPORT_ACK_TIMEOUT + 2);
+
+    // Each acknowledgement opens the window for one more batch, repeated and old ones are ignored
+    StartAck(&k_Client, true);
+    k_Client.b_HoldAcks = true;
+    uint32_t u32_Start = millis();
+    while (WLAN::PollTransfer() == WLAN_BUSY && (!k_Client.b_Header || k_Client.u16_Batch < EXPORT_ACK_WINDOW) &&
+           millis() - u32_Start < 1000)
+    {
+        FakeClock::Advance(1);
+        Receive(0);
+        ParseBinary(&k_Client);
+    }
+    CHECK(k_Client.u16_First == 0 && k_Client.u16_Batch == EXPORT_ACK_WINDOW);
+    for (uint16_t A=0; A<3; A++)
+    {
+        SendAck(A);
+        SendAck(A);
+        SendAck(0);
+        for (int T=0; T<10; T++)
+        {
+            CHECK(WLAN::PollTransfer() == WLAN_BUSY);
+            FakeClock::Advance(1);
+            Receive(0);
+            ParseBinary(&k_Client);
+        }
+        CHECK(k_Client.u16_Batch == EXPORT_ACK_WINDOW + A + 1);
+    }
+
+    // The transfer is only complete when the client has acknowledged the last batch after the trailer
+    SendAck(k_Client.u16_Batch - 1);
+    k_Client.b_HoldAcks = false;
+    k_Client.b_HoldLast = true;
+    while (!k_Client.b_Complete && millis() - u32_Start < 2000)
+    {
+        CHECK(WLAN::PollTransfer() == WLAN_BUSY);
+        FakeClock::Advance(1);
+        Receive(0);
+        ParseBinary(&k_Client);
+    }
+    CHECK(k_Client.b_Complete && CheckCounts(&k_Client) == TEST_CARDS);
+    for (int T=0; T<100; T++)
+        CHECK(WLAN::PollTransfer() == WLAN_BUSY);
+    SendAck(k_Client.u16_Batch - 1);
+    CHECK(WLAN::PollTransfer() == WLAN_DONE && !WiFiExport::CanResume());
+}
+// Starts a new transfer with acknowledgements and drops the connection when the client has received u16_Batches
+static void Interrupt(kClient* pk_Client, uint16_t u16_Batches, uint64_t u64_Token)
+{
+    eWLANStatus e_Status;
+    StartAck(pk_Client, false, u64_Token);
+    while ((e_Status = WLAN::PollTransfer()) == WLAN_BUSY && (!pk_Client->b_Header || pk_Client->u16_Batch < u16_Batches))
+    {
+        FakeClock::Advance(1);
+        Receive(0);
+        ParseBinary(pk_Client);
+    }
+    FakeWiFi::Drop();
+    RunTransfer(&e_Status);
+    CHECK(e_Status == WLAN_INTERRUPTED && WiFiExport::CanResume());
+}
+
+// Resumes the transfer, returns the first batch that the device has sent again
+static uint16_t Resume(kClient* pk_Client, uint32_t u32_Resume, uint64_t u64_Token)
+{
+    eWLANStatus e_Status;
+    ResumeClient(pk_Client);
+    StartClient(EXPORT_VERSION_ACK, u64_Token, u32_Resume);
+    RunTransfer(&e_Status, pk_Client);
+    CHECK(e_Status == WLAN_DONE && pk_Client->b_Complete && !WiFiExport::CanResume());
+    CHECK(pk_Client->u32_Records == TEST_CARDS && CheckCounts(pk_Client) == TEST_CARDS);
+    return pk_Client->u16_First;
+}
+
+static uint32_t NextDrop(uint32_t* pu32_Seed)
+{
+    *pu32_Seed = *pu32_Seed * 1103515245 + 12345;
+    return 1 + (*pu32_Seed >> 8) % DROP_BYTES;
+}
+
+// Exports all cards to a client that loses the connection up to *pu32_Drops times at random points and connects
+// again after RECONNECT_DELAY. Version 2 starts the transfer again, version 3 resumes it.
+// returns the ticks until the transfer is complete, the bytes received and the connections lost
+static uint32_t RunWithDrops(kClient* pk_Client, uint16_t u16_Version, uint32_t* pu32_Drops, uint32_t* pu32_Bytes)
+{
+    uint32_t u32_Drops  = *pu32_Drops;
+    uint32_t u32_Seed   = 12345;
+    uint32_t u32_DropAt = NextDrop(&u32_Seed);
+    uint32_t u32_Ticks  = 0;
+    *pu32_Bytes = 0;
+    BeginClient(pk_Client, u16_Version);
+    StartClient(u16_Version);
+    while (u32_Ticks < 10 * CONNECTION_TIMEOUT)
+    {
+        eWLANStatus e_Status = WLAN::PollTransfer();
+        Receive(0);
+        ParseBinary(pk_Client);
+        if (e_Status == WLAN_DONE)
+            break;
+
+        if (e_Status != WLAN_BUSY)
+        {
+            *pu32_Bytes += gu32_Received;
+            FakeClock::Advance(RECONNECT_DELAY);
+            u32_Ticks += RECONNECT_DELAY;
+            if (e_Status == WLAN_INTERRUPTED)
+            {
+                ResumeClient(pk_Client);
+                StartClient(u16_Version, 0, pk_Client->u32_ID);
+            }
+            else
+            {
+                BeginClient(pk_Client, u16_Version);
+                StartClient(u16_Version);
+            }
+            continue;
+        }
+
+        if (u32_Drops > 0 && gu32_Received >= u32_DropAt)
+        {
+            FakeWiFi::Drop();
+            u32_Drops --;
+            u32_DropAt = NextDrop(&u32_Seed);
+        }
+        FakeClock::Advance(1);
+        u32_Ticks ++;
+    }
+    *pu32_Bytes += gu32_Received;
+    *pu32_Drops -= u32_Drops;
+    CHECK(pk_Client->b_Complete && CheckCounts(pk_Client) == TEST_CARDS);
+    return u32_Ticks;
+}
+
+static void TestResume(void)
+{
+    CreateCards();
+
+    // The same transfer ID and token: the device continues behind the last acknowledged batch
+    kClient k_Client;
+    Interrupt(&k_Client, 10, 0);
+    uint32_t u32_ID = k_Client.u32_ID;
+    uint16_t u16_First = Resume(&k_Client, u32_ID, 0);
+    CHECK(u16_First > 0 && u16_First <= 10 && k_Client.u32_ID == u32_ID);
+
+    // A stale transfer ID or another token starts a new transfer
+    Interrupt(&k_Client, 10, 0);
+    CHECK(k_Client.u32_ID != u32_ID);
+    u32_ID = k_Client.u32_ID;
+    CHECK(Resume(&k_Client, u32_ID + 1, 0) == 0 && k_Client.u32_ID != u32_ID);
+
+    Interrupt(&k_Client, 10, 0);
+    u32_ID = k_Client.u32_ID;
+    CHECK(Resume(&k_Client, u32_ID, 1) == 0 && k_Client.u32_ID != u32_ID);
+
+    // A counter has changed since the interruption: a new transfer with the new count
+    Interrupt(&k_Client, 10, 0);
+    u32_ID = k_Client.u32_ID;
+    uint32_t u32_Count;
+    CHECK(CounterCache::Increment(CardID(0), &u32_Count) && u32_Count == CardCount(0) + 1);
+    CHECK(Resume(&k_Client, u32_ID, 0) == 0 && k_Client.u32_ID != u32_ID && k_Client.u32_Counts[0] == u32_Count);
+
+    // The client does not come back within the resume timeout (RESUME_CONNECTION_TIMEOUT in Utils.cpp)
+    Interrupt(&k_Client, 10, 0);
+    u32_ID = k_Client.u32_ID;
+    WLAN::BeginWait(true);
+    uint32_t u32_Start = millis();
+    eWLANStatus e_Status;
+    while ((e_Status = WLAN::PollClient()) == WLAN_BUSY)
+        FakeClock::Advance(1);
+    CHECK(e_Status == WLAN_FAILED && millis() - u32_Start == 30000 && !WiFiExport::CanResume());
+    CHECK(Resume(&k_Client, u32_ID, 0) == 0 && k_Client.u32_ID != u32_ID);
+
+    // The connection is lost at random points
+    uint32_t u32_Bytes, u32_Drops = 0;
+    uint32_t u32_Ticks = RunWithDrops(&k_Client, EXPORT_VERSION_ACK, &u32_Drops, &u32_Bytes);
+    printf("no drops          : %6u ticks, %6u bytes\n", (unsigned)u32_Ticks, (unsigned)u32_Bytes);
+    const char* s8_Names[] = { "version 2 restarts", "version 3 resumes " };
+    for (int i=0; i<2; i++)
+    {
+        u32_Drops = 20;
+        u32_Ticks = RunWithDrops(&k_Client, i ? EXPORT_VERSION_ACK : EXPORT_VERSION_SYNC, &u32_Drops, &u32_Bytes);
+        printf("%s: %6u ticks, %6u bytes, %2u connections lost\n", s8_Names[i], (unsigned)u32_Ticks,
+               (unsigned)u32_Bytes, (unsigned)u32_Drops);
+        if (i == 1) CHECK(u32_Drops < 20 && u32_Ticks < 10 * RECONNECT_DELAY);
+    }
+}
+
+int main(void)
+{
+    FakeSD::Format();
+    CHECK(SDCard::Begin(0));
+    TestAccept();
+    TestThroughput();
+    TestBinary();
+    TestSync();
+    TestAcks();
+    TestResume();
+    return TestResult("TestWLAN");
+}
@@ -0,0 +1,61 @@
+// Host stub of the Arduino core for the tests in test/. Only what the sketch uses.
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+typedef uint8_t byte;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+#define FALLING       2
+#define CHANGE        3
+#define LSBFIRST      0
+#define MSBFIRST      1
+#define D1            5
+#define D2            4
+#define PROGMEM
+#define ICACHE_RAM_ATTR
+
+unsigned long millis(void);
+unsigned long micros(void);
+void     delay(unsigned long u32_Milli);
+void     delayMicroseconds(unsigned int u32_Micro);
+void     pinMode(uint8_t u8_Pin, uint8_t u8_Mode);
+void     digitalWrite(uint8_t u8_Pin, uint8_t u8_Status);
+int      digitalRead(uint8_t u8_Pin);
+void     yield(void);
+int      digitalPinToInterrupt(int s32_Pin);
+void     attachInterrupt(uint8_t u8_Interrupt, void (*pf_Handler)(void), int s32_Mode);
+void     detachInterrupt(uint8_t u8_Interrupt);
+uint32_t pgm_read_dword(const void* p_Address);
+uint16_t pgm_read_word(const void* p_Address);
+
+#include "WString.h"
+#include "Stream.h"
+
+class HardwareSerial : public Stream
+{
+public:
+    void   begin(unsigned long u32_Baud);
+    int    available(void);
+    int    read(void);
+    int    peek(void);
+    void   flush(void);
+    size_t write(uint8_t u8_Data);
+    using Print::write;
+};
+extern HardwareSerial Serial;
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+#endif
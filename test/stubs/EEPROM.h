@@ -0,0 +1,17 @@
+// Host stub of the ESP8266 EEPROM library for the tests in test/
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include <Arduino.h>
+
+class EEPROMClass
+{
+public:
+    void    begin(size_t u32_Size);
+    uint8_t read(int s32_Address);
+    void    write(int s32_Address, uint8_t u8_Data);
+    bool    commit(void);
+};
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,20 @@
+// Host stub of the ESP8266 WiFi library for the tests in test/
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include <Arduino.h>
+#include "WiFiClient.h"
+#include "WiFiServer.h"
+
+enum { WIFI_OFF, WIFI_AP };
+
+class ESP8266WiFiClass
+{
+public:
+    bool disconnect(bool b_WiFiOff);
+    bool mode(int s32_Mode);
+    bool softAP(const char* s8_SSID, const char* s8_Password);
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif
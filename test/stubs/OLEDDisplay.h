@@ -0,0 +1,29 @@
+// Host stub of the OLED display library for the tests in test/ (nothing is drawn)
+#ifndef OLEDDISPLAY_H
+#define OLEDDISPLAY_H
+
+#include <Arduino.h>
+
+enum { TEXT_ALIGN_CENTER };
+enum OLEDDISPLAY_COLOR { BLACK, WHITE };
+
+extern const char ArialMT_Plain_10[];
+extern const char ArialMT_Plain_24[];
+
+class OLEDDisplay
+{
+public:
+    bool init(void);
+    void clear(void);
+    void display(void);
+    void setTextAlignment(int s32_Alignment);
+    void setColor(OLEDDISPLAY_COLOR e_Color);
+    void setFont(const char* s8_Font);
+    void drawXbm(int x, int y, int s32_Width, int s32_Height, const char* u8_Image);
+    void fillRect(int x, int y, int s32_Width, int s32_Height);
+    void drawProgressBar(int x, int y, int s32_Width, int s32_Height, int s32_Percent);
+    void drawString(int x, int y, String i_Text);
+    void drawString(int x, int y, const char* s8_Text);
+};
+
+#endif
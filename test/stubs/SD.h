@@ -0,0 +1,49 @@
+// Host stub of the SD library for the tests in test/.
+// The files are kept in RAM. FakeSD (see HostStubs.h) injects faults.
+#ifndef SD_H
+#define SD_H
+
+#include <Arduino.h>
+
+#define FILE_READ   0
+#define FILE_WRITE  1
+
+class File : public Stream
+{
+public:
+    File(void);
+    size_t   write(uint8_t u8_Data);
+    size_t   write(const uint8_t* u8_Data, size_t u32_Length);
+    using Print::write;
+    int      read(void);
+    int      read(void* p_Buffer, uint16_t u16_Length);
+    int      peek(void);
+    int      available(void);
+    void     flush(void);
+    bool     seek(uint32_t u32_Position);
+    uint32_t position(void);
+    uint32_t size(void);
+    void     close(void);
+    char*    name(void);
+    bool     isDirectory(void);
+    File     openNextFile(uint8_t u8_Mode = FILE_READ);
+    void     rewindDirectory(void);
+    operator bool(void);
+
+    void*    mp_Handle;
+};
+
+class SDClass
+{
+public:
+    bool begin(uint8_t u8_ChipSelect);
+    File open(const char* s8_Path, uint8_t u8_Mode = FILE_READ);
+    bool exists(const char* s8_Path);
+    bool mkdir(const char* s8_Path);
+    bool remove(const char* s8_Path);
+    bool rmdir(const char* s8_Path);
+    bool rename(const char* s8_Source, const char* s8_Dest);
+};
+extern SDClass SD;
+
+#endif
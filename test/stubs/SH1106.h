@@ -0,0 +1,13 @@
+// Host stub of the SH1106 display for the tests in test/
+#ifndef SH1106_H
+#define SH1106_H
+
+#include "OLEDDisplay.h"
+
+class SH1106 : public OLEDDisplay
+{
+public:
+    SH1106(uint8_t u8_Address, uint8_t u8_SDA, uint8_t u8_SCL);
+};
+
+#endif
@@ -0,0 +1,26 @@
+// Host stub of the SPI library for the tests in test/
+#ifndef SPI_H
+#define SPI_H
+
+#include <Arduino.h>
+
+#define SPI_MODE0  0
+
+class SPISettings
+{
+public:
+    SPISettings(uint32_t u32_Clock, uint8_t u8_BitOrder, uint8_t u8_Mode);
+};
+
+class SPIClass
+{
+public:
+    void    begin(void);
+    void    beginTransaction(SPISettings i_Settings);
+    uint8_t transfer(uint8_t u8_Data);
+    void    transferBytes(const uint8_t* u8_Out, uint8_t* u8_In, uint32_t u32_Length);
+    void    writeBytes(uint8_t* u8_Data, uint32_t u32_Length);
+};
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,13 @@
+// Host stub of the SSD1306 display for the tests in test/
+#ifndef SSD1306_H
+#define SSD1306_H
+
+#include "OLEDDisplay.h"
+
+class SSD1306 : public OLEDDisplay
+{
+public:
+    SSD1306(uint8_t u8_Address, uint8_t u8_SDA, uint8_t u8_SCL);
+};
+
+#endif
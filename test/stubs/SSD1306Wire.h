@@ -0,0 +1 @@
+// Host stub for the tests in test/ (empty)
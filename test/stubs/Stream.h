@@ -0,0 +1,31 @@
+// Host stub of the Arduino Print and Stream classes for the tests in test/
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t u8_Data) = 0;
+    virtual size_t write(const uint8_t* u8_Data, size_t u32_Length);
+    size_t print(const char* s8_Text);
+    size_t println(const char* s8_Text);
+    size_t println(void);
+};
+
+class Stream : public Print
+{
+public:
+    virtual int  available(void) = 0;
+    virtual int  read(void) = 0;
+    virtual int  peek(void) = 0;
+    virtual void flush(void) = 0;
+    void   setTimeout(unsigned long u32_Timeout);
+    size_t readBytes(char* s8_Buffer, size_t u32_Length);
+    size_t readBytes(uint8_t* u8_Buffer, size_t u32_Length);
+};
+
+#endif
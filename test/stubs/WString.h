@@ -0,0 +1,15 @@
+// Host stub of the Arduino String class for the tests in test/ (the content is not stored)
+#ifndef WSTRING_H
+#define WSTRING_H
+
+class String
+{
+public:
+    String(const char* s8_Text = "");
+    String(int s32_Value);
+    String(unsigned char u8_Value);
+    String& operator+=(const String& i_Text);
+    String& operator+=(char s8_Char);
+};
+
+#endif
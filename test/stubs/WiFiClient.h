@@ -0,0 +1,31 @@
+// Host stub of the ESP8266 WiFiClient for the tests in test/ (the loopback connection of FakeWiFi, see HostStubs.h)
+#ifndef WIFICLIENT_H
+#define WIFICLIENT_H
+
+#include <Arduino.h>
+
+class WiFiClient : public Stream
+{
+public:
+    explicit WiFiClient(uint32_t u32_Connection = 0);
+    size_t  write(uint8_t u8_Data);
+    size_t  write(const uint8_t* u8_Data, size_t u32_Length);
+    using Print::write;
+    int     read(void);
+    int     read(uint8_t* u8_Buffer, size_t u32_Length);
+    int     peek(void);
+    int     available(void);
+    void    flush(void);
+    void    stop(void);
+    uint8_t connected(void);
+    size_t  availableForWrite(void);
+    void    setNoDelay(bool b_NoDelay);
+    operator bool(void);
+
+private:
+    bool    IsCurrent(void);
+
+    uint32_t mu32_Connection; // the connection of FakeWiFi, 0 = none
+};
+
+#endif
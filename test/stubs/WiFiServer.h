@@ -0,0 +1,17 @@
+// Host stub of the ESP8266 WiFiServer for the tests in test/ (the client connects with FakeWiFi::Connect())
+#ifndef WIFISERVER_H
+#define WIFISERVER_H
+
+#include "WiFiClient.h"
+
+class WiFiServer
+{
+public:
+    WiFiServer(uint16_t u16_Port);
+    void       begin(void);
+    void       setNoDelay(bool b_NoDelay);
+    bool       hasClient(void);
+    WiFiClient available(void);
+};
+
+#endif